@@ -27,17 +27,25 @@ $LLVM_DIR/bin/clang -O1 -emit-llvm -c "../inputs/$1" -S -o "test.ll"
 # Step 2: Apply the first LLVM pass
 $LLVM_DIR/bin/opt --passes=loop-simplify "test.ll" -S -o "test2.ll"
 
-# Step 3: Apply the second LLVM pass
-$LLVM_DIR/bin/opt --passes=lowerswitch "test2.ll" -S -o "test3.ll"
+# Step 3: Apply the second LLVM pass, then check that nothing depends on a
+# secret any more (ct-verify fails the build otherwise)
+$LLVM_DIR/bin/opt -load-pass-plugin ./lib/libSecret.so --passes="require<secret-summary>,ct-masked-clones,function(ct-linearize,ct-opt<O2>),ct-verify" "test2.ll" -S -o "output.ll"
 
-# Step 4: Apply the third LLVM pass
-$LLVM_DIR/bin/opt -load-pass-plugin ./lib/libSecret.so --passes="print<inputsVector>" "test3.ll" -S -o "output.ll"
+# Step 4: Check that the hardened functions compute what the original ones
+# do, on random inputs. The integers are kept below the default buffer size,
+# so that a length argument stays within the buffer passed with it and a
+# loop bounded by an argument stays short
+./bin/ct-diff -inputs=100000 -int-range=256 -transformed="output.ll" "test2.ll"
 
-# Step 5: Generate object file
-$LLVM_DIR/bin/llc -O0 -filetype=obj "output.ll" -o "output.o" -relocation-model=pic
+# Flags keeping llc from turning selects back into branches
+llc_ct_flags="-O2 -disable-cgp-select2branch"
 
-# Step 6: Generate asm in arm cortex x64
-$LLVM_DIR/bin/llc -O0 -mtriple=armv7m-none-eabi -filetype=asm "output.ll" -o "output.s"
+# Step 5: Generate object file, checking the machine code
+./bin/ct-llc $llc_ct_flags -x86-cmov-converter=false -filetype=obj "output.ll" -o "output.o" -relocation-model=pic
+
+# Step 6: Generate asm in arm cortex x64, with the selects lowered for ARM
+$LLVM_DIR/bin/opt -load-pass-plugin ./lib/libSecret.so -mtriple=armv7m-none-eabi --passes="require<secret-summary>,ct-masked-clones,function(ct-linearize,ct-opt<O2>),ct-verify" "test2.ll" -S -o "output_armv7m.ll"
+./bin/ct-llc $llc_ct_flags -mtriple=armv7m-none-eabi -filetype=asm "output_armv7m.ll" -o "output.s"
 
 # Step 7: Compile to an executable
 gcc -O0 -o "${filename_without_extension}" "output.o" -pie
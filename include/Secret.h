@@ -1,25 +1,102 @@
-
 #ifndef LLVM_TUTOR_SECRET_H
 #define LLVM_TUTOR_SECRET_H
 
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/Analysis/MemoryLocation.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/IR/Value.h"
 #include "llvm/Pass.h"
+#include "llvm/Passes/PassPlugin.h"
 #include "llvm/Support/raw_ostream.h"
 #include <vector>
 
+namespace llvm {
+class AAResults;
+class CallBase;
+class DominatorTree;
+class LoopInfo;
+class MemorySSA;
+class PostDominatorTree;
+} // namespace llvm
+
+class ResultSecretSummary;
+
 //------------------------------------------------------------------------------
 // New PM interface
 //------------------------------------------------------------------------------
-using ResultSecret = std::vector<llvm::Value*>;
 
+// The set of values that depend on a secret. Membership is a hash lookup and
+// iteration follows the order in which the values were tainted, so that the
+// transformations built on top of it stay deterministic.
+class ResultSecret {
+  using SetTy = llvm::SetVector<llvm::Value *, std::vector<llvm::Value *>,
+                                llvm::DenseSet<llvm::Value *>>;
+
+public:
+  using iterator = SetTy::const_iterator;
+
+  bool isSecret(const llvm::Value *V) const {
+    return Values.count(const_cast<llvm::Value *>(V));
+  }
+  // Returns true if V was not tainted before.
+  bool insert(llvm::Value *V) { return Values.insert(V); }
+
+  // The arguments of a call to a summarized function that are secret, or
+  // point to memory holding a secret. Null for other calls.
+  const llvm::BitVector *getSecretCallArgs(const llvm::CallBase *Call) const {
+    auto It = CallArgs.find(Call);
+    return It == CallArgs.end() ? nullptr : &It->second;
+  }
+  void setSecretCallArgs(const llvm::CallBase *Call, llvm::BitVector Args) {
+    CallArgs[Call] = std::move(Args);
+  }
+
+  iterator begin() const { return Values.begin(); }
+  iterator end() const { return Values.end(); }
+  size_t size() const { return Values.size(); }
+  bool empty() const { return Values.empty(); }
+
+private:
+  SetTy Values;
+  llvm::DenseMap<const llvm::CallBase *, llvm::BitVector> CallArgs;
+};
 
 struct Secret : public llvm::AnalysisInfoMixin<Secret> {
   using Result = ResultSecret;
   Result run(llvm::Function &F, llvm::FunctionAnalysisManager &);
 
-  Secret::Result generateInputVector(llvm::Function &F);
+  // Computes the taint of F from its secret sources and, when available, the
+  // arguments that are secret in its callers and the summaries of its callees.
+  Secret::Result
+  generateInputVector(llvm::Function &F, llvm::MemorySSA &MSSA,
+                      llvm::AAResults &AA, llvm::DominatorTree &DT,
+                      llvm::PostDominatorTree &PDT, llvm::LoopInfo &LI,
+                      const ResultSecretSummary *Summaries = nullptr);
+
+  // Collects the sources annotated in F or selected on the command line:
+  // secret arguments, and the memory that is secret: whole objects, of
+  // unknown size, and struct fields, sized.
+  static void collectSecretSources(llvm::Function &F,
+                                   std::vector<llvm::Argument *> &Args,
+                                   std::vector<llvm::MemoryLocation> &Regions);
+
+  // Propagates taint inside F from the given secret arguments and memory
+  // regions. For pointer arguments only the pointee is secret. The PHIs that
+  // merge the sides of a secret branch are secret too, since which value
+  // they take tells the side that ran.
+  static Result propagateTaint(llvm::Function &F,
+                               llvm::ArrayRef<llvm::Argument *> Args,
+                               llvm::ArrayRef<llvm::MemoryLocation> Regions,
+                               llvm::MemorySSA &MSSA, llvm::AAResults &AA,
+                               llvm::DominatorTree &DT,
+                               llvm::PostDominatorTree &PDT, llvm::LoopInfo &LI,
+                               const ResultSecretSummary *Summaries);
+
   static bool isRequired() { return true; }
 
 private:
@@ -27,7 +104,7 @@ private:
   friend struct llvm::AnalysisInfoMixin<Secret>;
 };
 
-
+// Prints the values that depend on a secret. Does not modify the function.
 class InputsVectorPrinter : public llvm::PassInfoMixin<InputsVectorPrinter> {
 public:
   explicit InputsVectorPrinter(llvm::raw_ostream &OutS) : OS(OutS) {}
@@ -39,4 +116,31 @@ public:
 private:
   llvm::raw_ostream &OS;
 };
+
+// Removes the secret-dependent control flow of a function: branches are
+// serialized, PHIs become selects and loops indexed by a secret run for a
+// fixed number of iterations. Expects loops in simplified form.
+class CTLinearize : public llvm::PassInfoMixin<CTLinearize> {
+public:
+  llvm::PreservedAnalyses run(llvm::Function &Func,
+                              llvm::FunctionAnalysisManager &FAM);
+
+  static bool isRequired() { return true; }
+};
+
+// Creates the masked clones ct-linearize calls instead of the functions
+// called on a secret path: those called from the blocks that depend on a
+// secret branch, and from the clones themselves. Only adds functions, so
+// must run before the function pipeline running ct-linearize.
+class CTMaskedClones : public llvm::PassInfoMixin<CTMaskedClones> {
+public:
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+
+  static bool isRequired() { return true; }
+};
+
+// The passes and analyses of the plugin, for the tools that run them
+// in-process instead of loading libSecret.so.
+llvm::PassPluginLibraryInfo getInputVectorPluginInfo();
 #endif
@@ -0,0 +1,55 @@
+//==============================================================================
+// FILE:
+//    SecretAnnotations.h
+//
+// DESCRIPTION:
+//    Helpers to read the source annotations used by the Secret passes, i.e.
+//    __attribute__((annotate("..."))) on globals, functions, struct fields,
+//    local variables and parameters.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_ANNOTATIONS_H
+#define LLVM_TUTOR_SECRET_ANNOTATIONS_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Analysis/MemoryLocation.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+
+#include <utility>
+
+namespace llvm {
+class IntrinsicInst;
+} // namespace llvm
+
+// Appends to Out the globals and functions annotated through
+// llvm.global.annotations, together with their annotation string.
+void getAnnotatedGlobals(
+    const llvm::Module &M,
+    llvm::SmallVectorImpl<std::pair<llvm::GlobalValue *, llvm::StringRef>> &Out);
+
+// Appends to Out the pointers annotated inside F through llvm.var.annotation
+// (locals and parameters) and llvm.ptr.annotation (struct fields). For the
+// latter the annotated pointer is the call itself.
+void getAnnotatedPointers(
+    llvm::Function &F,
+    llvm::SmallVectorImpl<std::pair<llvm::Value *, llvm::StringRef>> &Out);
+
+// Returns the memory of the struct field annotated by Annotation, a call to
+// llvm.ptr.annotation: its address, the operand of the call, and the size of
+// its type, or of the largest type it is indexed or accessed with. A field of
+// unknown size covers everything from its address.
+llvm::MemoryLocation getAnnotatedField(const llvm::IntrinsicInst &Annotation);
+
+// Returns N for a "ct_bound:N" annotation, the number of elements of the
+// annotated array or of the array the annotated pointer points to, and 0 for
+// any other annotation.
+unsigned getBoundAnnotation(llvm::StringRef Str);
+
+// Returns N for a "ct_trip:N" annotation, the largest number of iterations of
+// the loops of the annotated function, and 0 for any other annotation.
+unsigned getTripAnnotation(llvm::StringRef Str);
+
+#endif
@@ -0,0 +1,62 @@
+//==============================================================================
+// FILE:
+//    SecretCalls.h
+//
+// DESCRIPTION:
+//    Predication of the calls and stores ct-linearize executes whether or
+//    not the serialized branches would have reached them.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_CALLS_H
+#define LLVM_TUTOR_SECRET_CALLS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Instructions.h"
+
+// Returns true if a masked clone of F can predicate all of its writes: it
+// has no volatile or atomic stores, atomic read-modify-writes or volatile
+// memory intrinsics, whose effects cannot be blended with the old contents.
+bool hasMaskableWrites(const llvm::Function &F);
+
+// Creates the masked clone of F: a copy of F named <F>.ct_masked with an
+// extra i1 parameter, whose side effects only take place when the parameter
+// is true once ct-linearize has run on it. Run from the ct-masked-clones
+// module pass, so that the function passes that follow run on the clone.
+llvm::Function *createMaskedClone(llvm::Function &F);
+
+// Returns the masked clone of F created by createMaskedClone, null if there
+// is none.
+llvm::Function *getMaskedClone(const llvm::Function &F);
+
+// Returns the predicate parameter of a masked clone, null for any other
+// function.
+llvm::Argument *getMaskPredicate(llvm::Function &F);
+
+// Returns true if the effects of I must be predicated: a call that may
+// write memory, throw or not return, or a store in a masked clone.
+bool hasMaskedEffects(const llvm::Instruction &I);
+
+// Makes I, for which hasMaskedEffects holds, only take effect when Pred is
+// true, without adding a branch:
+//  * a call to a function with a masked clone calls the clone instead;
+//  * a store writes either its value or the old contents, loaded first.
+// The memory intrinsics, and the calls that cannot be masked (declarations,
+// indirect calls, varargs) when -ct-external-calls allows them, are added to
+// Deferred for predicateCalls; by default the latter are a fatal error.
+// Returns true if I has been replaced.
+bool maskSideEffect(llvm::Instruction &I, llvm::Value *Pred,
+                    llvm::SmallVectorImpl<std::pair<llvm::CallInst *,
+                                                    llvm::Value *>> &Deferred);
+
+// Rewrites each memory intrinsic as a loop storing, byte by byte, either the
+// new value or the old one depending on its predicate. With
+// -ct-external-calls=guard, moves each other call into a block only entered
+// when its predicate holds: that branch is on a secret and ct-llc reports
+// it. Returns true if the CFG has changed.
+bool predicateCalls(
+    llvm::ArrayRef<std::pair<llvm::CallInst *, llvm::Value *>> Calls);
+
+#endif
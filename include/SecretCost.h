@@ -0,0 +1,55 @@
+//==============================================================================
+// FILE:
+//    SecretCost.h
+//
+// DESCRIPTION:
+//    Static estimate of what ct-linearize costs a function, reported as
+//    optimization remarks and checked against a slowdown budget.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_COST_H
+#define LLVM_TUTOR_SECRET_COST_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
+
+// Cost of one call of a function, in TTI reciprocal throughput units.
+struct LinearizationCost {
+  double Before = 0;
+  double After = 0;
+
+  double getSlowdown() const { return Before > 0 ? After / Before : 1; }
+};
+
+// Estimates the cost of F before and after ct-linearize: the cost of each
+// instruction weighted by the frequency of its block relative to the entry.
+// The loops in ConstantTrips run for the given number of iterations, before
+// and after. After linearization, both sides of the conditional branches
+// IsSerialized accepts run as often as the branch, their PHIs become
+// selects, the loops in PaddedTrips run for the given number of iterations,
+// and each instruction costs RewriteCost when that is not 0.
+LinearizationCost estimateLinearizationCost(
+    llvm::Function &F,
+    llvm::function_ref<bool(const llvm::BranchInst *)> IsSerialized,
+    const llvm::DenseMap<const llvm::Loop *, unsigned> &ConstantTrips,
+    const llvm::DenseMap<const llvm::Loop *, unsigned> &PaddedTrips,
+    llvm::function_ref<double(llvm::Instruction &)> RewriteCost,
+    llvm::BlockFrequencyInfo &BFI, llvm::LoopInfo &LI,
+    llvm::PostDominatorTree &PDT, const llvm::TargetTransformInfo &TTI);
+
+// Returns true if the estimate is reported or checked against a budget.
+bool isLinearizationCostNeeded(llvm::OptimizationRemarkEmitter &ORE);
+
+// Emits the estimate as a remark of ct-linearize and checks it against
+// -ct-max-slowdown. Returns false if F must be left as it is.
+bool checkLinearizationCost(llvm::Function &F, const LinearizationCost &Cost,
+                            llvm::OptimizationRemarkEmitter &ORE);
+
+#endif
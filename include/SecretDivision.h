@@ -0,0 +1,42 @@
+//==============================================================================
+// FILE:
+//    SecretDivision.h
+//
+// DESCRIPTION:
+//    Rewriting of the integer divisions with a secret operand for
+//    ct-linearize.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_DIVISION_H
+#define LLVM_TUTOR_SECRET_DIVISION_H
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+
+class ResultSecret;
+
+// Replaces every udiv, sdiv, urem and srem with a secret operand, whose
+// latency depends on the operands on most cores, by a sequence that takes the
+// same time whatever they are: a multiplication by the reciprocal for a
+// constant divisor, a shift and subtract loop with one iteration per bit
+// otherwise, or whenever it is the cheaper of the two for the target (always
+// for the 32 and 64-bit divisions on Cortex-M3, whose long multiplies stop
+// early). A division of vectors is left as it is, with a warning, and so is
+// a multiplication wider than 32 bits with a secret operand on Cortex-M3.
+// Returns true if a division has been replaced.
+bool lowerSecretDivisions(llvm::Function &F, const ResultSecret &Secrets,
+                          const llvm::TargetTransformInfo &TTI);
+
+// Returns true if the multiplications of F with a result wider than 32 bits
+// take a time that depends on their operands: the UMULL and SMULL of
+// Cortex-M3 (ARMv7-M without the DSP extension) stop early.
+bool hasEarlyExitLongMultiply(const llvm::Function &F);
+
+// Returns the number of instructions the sequence replacing I executes, 0
+// if lowerSecretDivisions leaves I as it is.
+uint64_t getSecretDivisionCost(const llvm::Instruction &I,
+                               const ResultSecret &Secrets,
+                               const llvm::TargetTransformInfo &TTI);
+
+#endif
@@ -0,0 +1,33 @@
+//==============================================================================
+// FILE:
+//    SecretLookup.h
+//
+// DESCRIPTION:
+//    Rewriting of the table lookups at a secret index for ct-linearize.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_LOOKUP_H
+#define LLVM_TUTOR_SECRET_LOOKUP_H
+
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Function.h"
+
+class ResultSecret;
+
+// Replaces every load from an array at a secret index (an S-box in a global,
+// a table in a struct field) by a scan of the whole array that keeps the
+// element whose index matches, so that the addresses accessed do not depend
+// on the secret. The scan compares and blends a vector register worth of
+// elements at a time when the target has vector registers and it is cheaper,
+// one element at a time otherwise. Returns true if a load has been replaced.
+bool lowerSecretLookups(llvm::Function &F, const ResultSecret &Secrets,
+                        const llvm::TargetTransformInfo &TTI);
+
+// Returns the number of instructions the scan replacing I executes, 0 if
+// lowerSecretLookups leaves I as it is.
+uint64_t getSecretLookupCost(llvm::Instruction &I,
+                             const ResultSecret &Secrets,
+                             const llvm::TargetTransformInfo &TTI);
+
+#endif
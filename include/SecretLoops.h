@@ -0,0 +1,50 @@
+//==============================================================================
+// FILE:
+//    SecretLoops.h
+//
+// DESCRIPTION:
+//    Loops with a fixed trip count for ct-linearize, which cannot serialize a
+//    branch leaving a loop.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_LOOPS_H
+#define LLVM_TUTOR_SECRET_LOOPS_H
+
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Dominators.h"
+
+// Returns the largest number of iterations of L: the smallest of the maximum
+// ScalarEvolution proves and of the ct_trip:N annotation of the function, 0
+// if neither is known or it is above -ct-max-trip-count. An annotation below
+// the actual trip count cuts the loop short: this is only a fatal error when
+// ScalarEvolution knows the trip count exactly.
+unsigned getMaxTripCount(llvm::Loop &L, llvm::ScalarEvolution &SE);
+
+// Rewrites L, in simplified form, into a loop with a single exit at its
+// latch that always runs Trips iterations. A live flag, cleared on the edges
+// that used to leave the loop, skips the body of the iterations after the
+// first exit taken, while the induction variables ScalarEvolution finds keep
+// advancing; the exit taken and the values used after the loop are carried
+// to the new exit, which branches to the old exit blocks. The loop is marked
+// with its trip count. Neither DT, LI nor SE are kept up to date. Returns
+// true if L has been rewritten.
+bool boundLoop(llvm::Loop &L, unsigned Trips, llvm::DominatorTree &DT,
+               llvm::LoopInfo &LI, llvm::ScalarEvolution &SE);
+
+// Returns the trip count boundLoop gave to L, 0 if it has not rewritten L.
+unsigned getBoundedTripCount(const llvm::Loop &L);
+
+// Fully unrolls L, in simplified form and not bounded, if it runs a constant
+// number of iterations and the unrolled loop stays under -ct-unroll-threshold
+// instructions. DT, LI and SE are kept up to date. Returns true if the IR
+// changed: L has been unrolled, and deleted, or only put in LCSSA form.
+bool unrollSmallLoop(llvm::Loop &L, llvm::DominatorTree &DT,
+                     llvm::LoopInfo &LI, llvm::ScalarEvolution &SE,
+                     llvm::AssumptionCache &AC,
+                     const llvm::TargetTransformInfo &TTI);
+
+#endif
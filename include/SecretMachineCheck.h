@@ -0,0 +1,48 @@
+//==============================================================================
+// FILE:
+//    SecretMachineCheck.h
+//
+// DESCRIPTION:
+//    Checks the machine code generated for a module for branches and memory
+//    addresses that depend on a secret. Used by the ct-llc tool.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_MACHINE_CHECK_H
+#define LLVM_TUTOR_SECRET_MACHINE_CHECK_H
+
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+// The machine code does not keep track of IR values, so the secrets are made
+// visible to it in the IR: every value where a secret enters a register (a
+// secret argument, load or call result) is passed through an empty inline asm
+// that returns it unchanged. The machine code checker starts from the
+// registers these inline asm define. Returns the number of values marked.
+unsigned markSecretRoots(llvm::Module &M, llvm::FunctionAnalysisManager &FAM);
+
+// Propagates the secrets from the inline asm of markSecretRoots through the
+// registers and spill slots of each machine function, and reports the
+// conditional branches on a secret and the memory accesses whose address
+// depends on one. Runs on the final machine code, right before the asm
+// printer.
+class SecretMachineCheck : public llvm::MachineFunctionPass {
+public:
+  static char ID;
+  explicit SecretMachineCheck(llvm::raw_ostream &OS, unsigned &NumFindings)
+      : llvm::MachineFunctionPass(ID), OS(OS), NumFindings(NumFindings) {}
+
+  bool runOnMachineFunction(llvm::MachineFunction &MF) override;
+  void getAnalysisUsage(llvm::AnalysisUsage &AU) const override;
+  llvm::StringRef getPassName() const override {
+    return "Constant-time machine code checker";
+  }
+
+private:
+  llvm::raw_ostream &OS;
+  unsigned &NumFindings;
+};
+
+#endif
@@ -0,0 +1,33 @@
+//==============================================================================
+// FILE:
+//    SecretOpt.h
+//
+// DESCRIPTION:
+//    Declares the ct-opt<level> pass: the optimizations that are safe to run
+//    after ct-linearize, followed by a check of what they produced.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_OPT_H
+#define LLVM_TUTOR_SECRET_OPT_H
+
+#include "llvm/IR/PassManager.h"
+#include "llvm/Passes/OptimizationLevel.h"
+
+// Runs a subset of the usual pipeline that never turns a select back into a
+// branch (SROA, EarlyCSE, InstCombine, GVN, LICM and dead code elimination,
+// no SimplifyCFG) and ct-select, then fails if the function ends up with a
+// branch on a secret it did not have.
+class CTOpt : public llvm::PassInfoMixin<CTOpt> {
+public:
+  explicit CTOpt(llvm::OptimizationLevel Level);
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &FAM);
+
+  static bool isRequired() { return true; }
+
+private:
+  llvm::FunctionPassManager FPM;
+};
+
+#endif
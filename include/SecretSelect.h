@@ -0,0 +1,55 @@
+//==============================================================================
+// FILE:
+//    SecretSelect.h
+//
+// DESCRIPTION:
+//    Lowering of the selects on a secret, and the ct-select pass running it.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_SELECT_H
+#define LLVM_TUTOR_SECRET_SELECT_H
+
+#include "llvm/ADT/Triple.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/PassManager.h"
+
+class ResultSecret;
+
+// How a select on a secret is written in the IR.
+enum class SelectLowering {
+  // The one of the table of ct-select-bench for the target.
+  Auto,
+  // A select, left to the backend.
+  Native,
+  // b ^ ((a ^ b) & -c), with integer operations only.
+  Mask,
+  // An inline asm conditional move, opaque to the optimizers.
+  Asm
+};
+
+// The lowering given with -ct-select.
+SelectLowering getSelectLowering();
+
+// Auto resolved for the target T: the fastest lowering that stays
+// branch-free once compiled with the llc flags of compile.sh. The others are
+// returned unchanged.
+SelectLowering resolveSelectLowering(SelectLowering How, const llvm::Triple &T);
+
+// Rewrites every select of F whose condition is a secret with How. Asm falls
+// back to Mask for the types and targets without a conditional move. Returns
+// true if a select has been rewritten.
+bool lowerSecretSelects(llvm::Function &F, const ResultSecret &Secrets,
+                        SelectLowering How);
+
+// Lowers the selects on a secret with -ct-select. Runs at the end of ct-opt,
+// since InstCombine folds a mask back into a select.
+class CTSelect : public llvm::PassInfoMixin<CTSelect> {
+public:
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::FunctionAnalysisManager &FAM);
+
+  static bool isRequired() { return true; }
+};
+
+#endif
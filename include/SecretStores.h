@@ -0,0 +1,50 @@
+//==============================================================================
+// FILE:
+//    SecretStores.h
+//
+// DESCRIPTION:
+//    Lowering of the stores ct-linearize predicates in loops whose bounds
+//    depend on a secret.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_STORES_H
+#define LLVM_TUTOR_SECRET_STORES_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/IR/Instructions.h"
+
+// A store that must only take effect when Pred holds.
+struct PredicatedStore {
+  llvm::StoreInst *Store;
+  llvm::Value *Pred;
+};
+
+// Rewrites the predicated stores of loop L so that they are executed
+// unconditionally, cheapest strategy first:
+//  * a location that does not change across the loop is kept in a register,
+//    loaded in the preheader and written back once in the exit blocks;
+//  * stores next to each other sharing a predicate become one wide
+//    llvm.masked.store if the target supports it, a wide load, select and
+//    store otherwise;
+//  * any other store becomes a load, a select and a store of the location.
+// Returns true if a store has been rewritten.
+bool lowerPredicatedStores(llvm::ArrayRef<PredicatedStore> Stores,
+                           llvm::Loop &L,
+                           const llvm::TargetTransformInfo &TTI);
+
+// Rewrites Sel, a select between the result of a binary operation on X and
+// X itself, into the operation of X and of a select between its other
+// operand and its identity, in place: the form of a conditional reduction
+// LoopVectorize recognizes, with no select on the loop-carried value. The
+// operation then yields X when the condition does not hold, which only
+// matters to the iterations it disables, so Sel must be the only user of
+// the operation: with MaskPHIUsers, its PHI users may take the masked value
+// too, as the caller then replaces the operation with Sel in them. Returns
+// the value replacing Sel, Sel itself if it does not have that form.
+llvm::Value *foldPredicatedUpdate(llvm::SelectInst *Sel,
+                                  bool MaskPHIUsers = false);
+
+#endif
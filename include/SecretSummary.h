@@ -0,0 +1,114 @@
+//==============================================================================
+// FILE:
+//    SecretSummary.h
+//
+// DESCRIPTION:
+//    Declares the SecretSummary analysis, the interprocedural side of the
+//    Secret analysis:
+//      * module analysis computing a summary per function
+//      * printer pass for the new pass manager
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_SUMMARY_H
+#define LLVM_TUTOR_SECRET_SUMMARY_H
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <utility>
+
+// What a function does with secrets, as seen from its call sites. Bit I of
+// each vector refers to argument I.
+struct FunctionSummary {
+  // A secret argument I makes the return value secret.
+  llvm::BitVector ArgToReturn;
+  // A secret argument I is written to memory visible to the caller.
+  llvm::BitVector ArgToMemory;
+  // The return value or the memory written is secret whatever the arguments,
+  // e.g. the function reads an annotated global.
+  bool AlwaysSecret = false;
+  // Arguments that are annotated, or secret in at least one caller.
+  llvm::BitVector SecretArgs;
+
+  FunctionSummary() = default;
+  explicit FunctionSummary(unsigned NumArgs)
+      : ArgToReturn(NumArgs), ArgToMemory(NumArgs), SecretArgs(NumArgs) {}
+
+  // Returns true if a call whose secret arguments are Args returns or writes
+  // a secret.
+  bool taintsCall(const llvm::BitVector &Args) const {
+    return AlwaysSecret || ArgToReturn.anyCommon(Args) ||
+           ArgToMemory.anyCommon(Args);
+  }
+};
+
+class ResultSecretSummary {
+public:
+  // Returns null for declarations and functions that are not in the module.
+  const FunctionSummary *lookup(const llvm::Function *F) const {
+    auto It = Summaries.find(F);
+    return It == Summaries.end() ? nullptr : &It->second;
+  }
+
+  bool invalidate(llvm::Module &M, const llvm::PreservedAnalyses &PA,
+                  llvm::ModuleAnalysisManager::Invalidator &);
+
+private:
+  llvm::DenseMap<const llvm::Function *, FunctionSummary> Summaries;
+  friend struct SecretSummary;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface
+//------------------------------------------------------------------------------
+// Summaries are computed bottom-up over the SCCs of the call graph, and the
+// secret arguments top-down from the callers. The analysis keeps them across
+// invalidations and only recomputes the SCCs whose functions, or callees'
+// summaries, changed.
+struct SecretSummary : public llvm::AnalysisInfoMixin<SecretSummary> {
+  using Result = ResultSecretSummary;
+  Result run(llvm::Module &M, llvm::ModuleAnalysisManager &MAM);
+
+  static bool isRequired() { return true; }
+
+private:
+  struct CacheEntry {
+    llvm::hash_code Hash = 0;
+    FunctionSummary Summary;
+    // Secret arguments the calls below were computed with.
+    llvm::BitVector Context;
+    bool HasCallArgs = false;
+    llvm::SmallVector<std::pair<const llvm::Function *, llvm::BitVector>, 4>
+        CallArgs;
+  };
+
+  llvm::DenseMap<const llvm::Function *, CacheEntry> Cache;
+  llvm::hash_code ModuleHash = 0;
+
+  static llvm::AnalysisKey Key;
+  friend struct llvm::AnalysisInfoMixin<SecretSummary>;
+};
+
+//------------------------------------------------------------------------------
+// New PM interface for the printer pass
+//------------------------------------------------------------------------------
+class SecretSummaryPrinter : public llvm::PassInfoMixin<SecretSummaryPrinter> {
+public:
+  explicit SecretSummaryPrinter(llvm::raw_ostream &OutS) : OS(OutS) {}
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+
+  static bool isRequired() { return true; }
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+#endif
@@ -0,0 +1,29 @@
+//==============================================================================
+// FILE:
+//    SecretSwitch.h
+//
+// DESCRIPTION:
+//    Lowering of switch instructions for ct-linearize, which only knows how to
+//    serialize two-way branches.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_SWITCH_H
+#define LLVM_TUTOR_SECRET_SWITCH_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/IR/Instructions.h"
+
+// Rewrites each of Switches without data-dependent control flow where
+// possible:
+//  * a switch that only selects the incoming values of PHIs in a join block
+//    becomes straight-line code, either a balanced tree of compares and
+//    selects or a masked selection (a constant-time table lookup over the
+//    cases), whichever the cost model finds cheaper;
+//  * any other switch becomes a chain of two-way branches, one per distinct
+//    successor, on predicates all computed in the switch block.
+// The caller picks the switches: those on a secret or in a serialized region,
+// the others keep their jump tables. Returns true if a switch was lowered.
+bool lowerSwitches(llvm::ArrayRef<llvm::SwitchInst *> Switches);
+
+#endif
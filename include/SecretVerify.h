@@ -0,0 +1,46 @@
+//==============================================================================
+// FILE:
+//    SecretVerify.h
+//
+// DESCRIPTION:
+//    Declares the ct-verify pass: a check of the IR for the instructions whose
+//    timing depends on a secret.
+//
+// License: MIT
+//==============================================================================
+#ifndef LLVM_TUTOR_SECRET_VERIFY_H
+#define LLVM_TUTOR_SECRET_VERIFY_H
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+class ResultSecret;
+
+// Reports to OS the instructions of F whose timing depends on a secret of
+// Secrets: conditional branches, switches and indirect branches on a secret,
+// indirect calls to a secret callee, memory accesses at an address derived
+// from a secret, and the instructions whose latency depends on their
+// operands (integer and floating-point divisions, remainders and square
+// roots, long multiplications on Cortex-M3). Returns the number of
+// instructions reported.
+unsigned verifyConstantTime(llvm::Function &F, const ResultSecret &Secrets,
+                            llvm::raw_ostream &OS);
+
+// Runs verifyConstantTime on every function of the module with the taint of
+// the Secret analysis, and fails if one of them reports an instruction. Does
+// not modify the module.
+class CTVerify : public llvm::PassInfoMixin<CTVerify> {
+public:
+  explicit CTVerify(llvm::raw_ostream &OutS) : OS(OutS) {}
+  llvm::PreservedAnalyses run(llvm::Module &M,
+                              llvm::ModuleAnalysisManager &MAM);
+
+  static bool isRequired() { return true; }
+
+private:
+  llvm::raw_ostream &OS;
+};
+
+#endif
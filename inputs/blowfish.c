@@ -78,9 +78,11 @@ See blowfish.c for more information about this file.
 
 #include <inttypes.h>
 
+#include "secret.h"
+
 typedef struct {
-  uint32_t P[16 + 2];
-  uint32_t S[4][256];
+  SECRET uint32_t P[16 + 2];
+  SECRET uint32_t S[4][256];
 } BLOWFISH_CTX;
 
 void Blowfish_Init(BLOWFISH_CTX *ctx, uint8_t *key, int32_t keyLen);
@@ -380,7 +382,7 @@ static uint32_t F(BLOWFISH_CTX *ctx, uint32_t x) {
 }
 
 
-void Blowfish_Encrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
+void Blowfish_Encrypt(BLOWFISH_CTX *ctx, SECRET uint32_t *xl, SECRET uint32_t *xr){
   uint32_t  Xl;
   uint32_t  Xr;
   uint32_t  temp;
@@ -410,7 +412,7 @@ void Blowfish_Encrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
 }
 
 
-void Blowfish_Decrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
+void Blowfish_Decrypt(BLOWFISH_CTX *ctx, SECRET uint32_t *xl, SECRET uint32_t *xr){
   uint32_t  Xl;
   uint32_t  Xr;
   uint32_t  temp;
@@ -442,7 +444,7 @@ void Blowfish_Decrypt(BLOWFISH_CTX *ctx, uint32_t *xl, uint32_t *xr){
 }
 
 
-void Blowfish_Init(BLOWFISH_CTX *ctx, uint8_t *key, int32_t keyLen) {
+void Blowfish_Init(BLOWFISH_CTX *ctx, SECRET uint8_t *key, int32_t keyLen) {
   int32_t i, j, k;
   uint32_t data, datal, datar;
 
@@ -9,7 +9,9 @@
 //=============================================================================
 #include <stdio.h>
 
-int foo(int a) {
+#include "secret.h"
+
+CT_TRIP(32) int foo(SECRET int a) {
 
 	int res = 2;
 	
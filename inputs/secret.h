@@ -0,0 +1,20 @@
+//=============================================================================
+// FILE:
+//      secret.h
+//
+// DESCRIPTION:
+//      Annotations shared by the sample inputs of the Secret pass.
+//
+// License: MIT
+//=============================================================================
+#ifndef SECRET_INPUTS_H
+#define SECRET_INPUTS_H
+
+// Marks a value as secret for the Secret pass.
+#define SECRET __attribute__((annotate("secret")))
+
+// Largest number of iterations of the loops of a function, for the loops
+// whose exit depends on a secret.
+#define CT_TRIP(n) __attribute__((annotate("ct_trip:" #n)))
+
+#endif // SECRET_INPUTS_H
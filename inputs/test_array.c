@@ -9,7 +9,9 @@
 //=============================================================================
 #include <stdio.h>
 
-int foo(int a) {
+#include "secret.h"
+
+int foo(SECRET int a) {
 
 	int array[8];
 	int res = 0;
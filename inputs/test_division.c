@@ -0,0 +1,95 @@
+//=============================================================================
+// FILE:
+//      test_division.c
+//
+// DESCRIPTION:
+//      Divisions on secrets, and a benchmark of their latency on small and
+//      large operands. A division instruction is faster on small operands,
+//      the rewritten divisions take the same time on both: run
+//      utils/bench_division.sh to compare the -ct-division strategies.
+//
+// License: MIT
+//=============================================================================
+#include <stdint.h>
+#include <stdio.h>
+
+#include "secret.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT "cycles"
+static uint64_t now(void) { return __rdtsc(); }
+#else
+#include <time.h>
+#define UNIT "ns"
+static uint64_t now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+__attribute__((noinline)) uint32_t div_const(SECRET uint32_t x) {
+	return x / 10;
+}
+
+__attribute__((noinline)) int32_t rem_const(SECRET int32_t x) {
+	return x % 7;
+}
+
+__attribute__((noinline)) uint32_t div_secret(SECRET uint32_t x, SECRET uint32_t d) {
+	return x / d;
+}
+
+__attribute__((noinline)) int64_t rem_secret(SECRET int64_t x, SECRET int64_t d) {
+	return x % d;
+}
+
+#define N 1024
+#define ROUNDS 2000
+
+static uint64_t xs[2][N];
+static uint64_t ds[2][N];
+static volatile uint64_t sink;
+
+// Average time of a call on the small (0) or large (1) operands.
+static double bench(int kind, int large) {
+	uint64_t best = UINT64_MAX;
+	for(int r = 0; r < ROUNDS; r++) {
+		uint64_t acc = 0;
+		uint64_t start = now();
+		for(int i = 0; i < N; i++) {
+			uint64_t x = xs[large][i], d = ds[large][i];
+			switch(kind) {
+				case 0: acc += div_const((uint32_t)x); break;
+				case 1: acc += rem_const((int32_t)x); break;
+				case 2: acc += div_secret((uint32_t)x, (uint32_t)d); break;
+				default: acc += rem_secret((int64_t)x, (int64_t)d); break;
+			}
+		}
+		uint64_t time = now() - start;
+		sink += acc;
+		if(time < best) best = time;
+	}
+	return (double)best / N;
+}
+
+int main(void) {
+
+	// Small dividends and divisors, then full-width ones.
+	uint64_t seed = 88172645463325252u;
+	for(int i = 0; i < N; i++) {
+		seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+		xs[0][i] = seed % 16;
+		ds[0][i] = 1 + seed % 3;
+		xs[1][i] = seed >> 1;
+		ds[1][i] = 1 + (seed >> 40);
+	}
+
+	const char *names[] = { "x / 10 (u32)", "x % 7 (i32)", "x / d (u32)", "x % d (i64)" };
+	printf("%-14s %10s %10s  (" UNIT " per call)\n", "", "small", "large");
+	for(int kind = 0; kind < 4; kind++)
+		printf("%-14s %10.2f %10.2f\n", names[kind], bench(kind, 0), bench(kind, 1));
+
+	return div_const(1234) == 123 && rem_const(-20) == -6 && div_secret(100, 7) == 14 && rem_secret(-100, 7) == -2 ? 0 : 1;
+}
@@ -8,7 +8,10 @@
 // License: MIT
 //=============================================================================
 #include <stdio.h>
-int foo(int a) {
+
+#include "secret.h"
+
+int foo(SECRET int a) {
  int res=0;
  if(a>10) {
  	printf("ciao");
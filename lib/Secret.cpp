@@ -1,4 +1,16 @@
 #include "Secret.h"
+#include "SecretAnnotations.h"
+#include "SecretCalls.h"
+#include "SecretCost.h"
+#include "SecretDivision.h"
+#include "SecretOpt.h"
+#include "SecretSelect.h"
+#include "SecretSummary.h"
+#include "SecretLookup.h"
+#include "SecretLoops.h"
+#include "SecretStores.h"
+#include "SecretSwitch.h"
+#include "SecretVerify.h"
 
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Passes/PassBuilder.h"
@@ -9,52 +21,743 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Dominators.h"
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/ADT/PostOrderIterator.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/RegionInfo.h"
+#include "llvm/Analysis/RegionIterator.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ADT/Statistic.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/PassTimingInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/Timer.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
 #include <map>
+#include <optional>
 
 #include <string>
 
 using namespace llvm;
 
+#define DEBUG_TYPE "secret"
+
+STATISTIC(NumSerializedBranches, "Number of branches serialized by ct-linearize");
+STATISTIC(NumSelects, "Number of selects merging the values of serialized branches");
+STATISTIC(NumPredicatedStores, "Number of stores predicated by ct-linearize");
+
+// Times a phase of the Secret passes, under the secret group of -time-passes
+// and as a scope of -ftime-trace (-time-trace in opt).
+struct PhaseTimer {
+	llvm::TimeTraceScope trace;
+	llvm::NamedRegionTimer timer;
+
+	PhaseTimer(llvm::StringRef name, llvm::StringRef desc, const llvm::Function& Func)
+		: trace(desc, Func.getName()), timer(name, desc, "secret", "Secret plugin phases", llvm::TimePassesIsEnabled) {}
+};
+
 struct  newBranch {
 	llvm::Value* cond;
 	llvm::BasicBlock* then;
 	llvm::BasicBlock* els;
 };
 
-static void printInputsVectorResult(raw_ostream &OutS, const ResultSecret &InputVector, Function &Func);
+// The serialized control flow: the new branch of each block, and for each
+// block the blocks whose new branch jumps to it, in the order they were set.
+struct SerializedCFG {
+	llvm::DenseMap<llvm::BasicBlock*, newBranch> branches;
+	llvm::DenseMap<llvm::BasicBlock*, llvm::SmallVector<llvm::BasicBlock*, 2>> preds;
+
+	bool count(llvm::BasicBlock* bb) const { return branches.count(bb); }
+	const newBranch& get(llvm::BasicBlock* bb) const { return branches.find(bb)->second; }
+
+	template<typename Predicate>
+	llvm::BasicBlock* firstJumpTo(llvm::BasicBlock* bb, Predicate pred) const {
+		auto it = preds.find(bb);
+		if(it == preds.end()) return NULL;
+		auto found = std::find_if(it->second.begin(), it->second.end(), pred);
+		return found == it->second.end() ? NULL : *found;
+	}
+
+	void set(llvm::BasicBlock* bb, newBranch br) {
+		auto old = branches.find(bb);
+		if(old != branches.end()) {
+			for(auto target : {old->second.then, old->second.els}) {
+				auto& oldPreds = preds[target];
+				oldPreds.erase(std::remove(oldPreds.begin(), oldPreds.end(), bb), oldPreds.end());
+			}
+		}
+		branches[bb] = br;
+		preds[br.then].push_back(bb);
+		if(br.els != NULL && br.els != br.then) preds[br.els].push_back(bb);
+	}
+};
+
+// The conditional branches serialized by ct-linearize: those of the SESE
+// regions holding a branch on a secret condition among their own blocks, and
+// of all the regions nested in those, loop latches aside. The other branches
+// are kept, with both their sides. Each block of a serialized region is owned
+// by the entry of the outermost serialized region holding it.
+struct SecretRegions {
+	llvm::DenseMap<llvm::BasicBlock*, llvm::BasicBlock*> owners;
+	llvm::SmallPtrSet<llvm::BasicBlock*, 16> serialized;
+	// The serialized regions, each one before the regions nested in it.
+	llvm::SmallVector<llvm::Region*, 8> regions;
+
+	bool isSerialized(const llvm::BasicBlock* bb) const { return serialized.count(bb); }
+
+	llvm::BasicBlock* getOwner(llvm::BasicBlock* bb) const {
+		auto it = owners.find(bb);
+		return it == owners.end() ? NULL : it->second;
+	}
+};
+
+static void getSecretRegions(Function &Func, const ResultSecret &inputsVector, const std::vector<llvm::Loop*>& allLoopsVector, llvm::RegionInfo& RI, SecretRegions& regions);
+static void getSecretSwitches(Function &Func, const ResultSecret &inputsVector, llvm::RegionInfo& RI, llvm::LoopInfo& LI, std::vector<llvm::SwitchInst*>& switches);
+static PreservedAnalyses linearize(Function &Func, const ResultSecret &InputVector, llvm::DominatorTree& DT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, const llvm::TargetTransformInfo& TTI);
+static bool checkCost(Function &Func, const ResultSecret &inputsVector, llvm::PostDominatorTree& PDT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, const llvm::TargetTransformInfo& TTI, FunctionAnalysisManager &FAM);
+static bool boundSecretLoops(Function &Func, const ResultSecret &inputsVector, llvm::DominatorTree& DT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, llvm::ScalarEvolution& SE, llvm::OptimizationRemarkEmitter& ORE);
+static bool unrollSecretLoops(Function &Func, const ResultSecret &inputsVector, llvm::DominatorTree& DT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, llvm::ScalarEvolution& SE, llvm::AssumptionCache& AC, const llvm::TargetTransformInfo& TTI);
 
 llvm::AnalysisKey Secret::Key;
 
-static void getAllUsers(llvm::Value* Inst, std::vector<llvm::Value*>& UsersVector);
+static llvm::cl::list<std::string> SecretArgs("secret-args",
+	llvm::cl::desc("Arguments to treat as secret, as <function>:arg<N>"),
+	llvm::cl::value_desc("function:argN"), llvm::cl::CommaSeparated);
 
-Secret::Result Secret::generateInputVector(llvm::Function &Func) {
+static llvm::cl::opt<bool> SecretAllArgs("secret-all-args",
+	llvm::cl::desc("Treat every function argument as secret"), llvm::cl::init(false));
 
+static llvm::cl::opt<bool> LinearizePublic("ct-linearize-public",
+	llvm::cl::desc("Serialize the branches on a public condition outside the secret regions too"), llvm::cl::init(false));
+
+using UsersSet = llvm::SetVector<llvm::Value*>;
+
+static void getAllUsers(llvm::Value* Inst, UsersSet& UsersVector);
+
+// Returns true if Loc may read memory that holds a secret on entry to the
+// function: the pointee of a secret pointer argument, a secret object, or
+// the bytes of a secret struct field, which leave its sibling fields public.
+static bool overlapsSecretRegion(const llvm::MemoryLocation& Loc, llvm::ArrayRef<llvm::MemoryLocation> regions, llvm::AAResults& AA) {
+
+	const llvm::Value* obj = llvm::getUnderlyingObject(Loc.Ptr);
+	for(auto& region : regions) {
+		if(!region.Size.hasValue() && region.Ptr == obj) return true;
+	}
+
+	// Constant tables and fresh stack slots cannot hold a secret on entry.
+	if(llvm::AllocaInst::classof(obj)) return false;
+	if(llvm::GlobalVariable::classof(obj) && cast<GlobalVariable>(obj)->isConstant()) return false;
+
+	for(auto& region : regions) {
+		if(!AA.isNoAlias(region, Loc)) return true;
+	}
+	return false;
+}
+
+// Walks the MemorySSA def chain above Start looking for a write that may
+// store a secret into Loc. Only accesses that may alias Loc are visited, so
+// writes to other struct fields or array regions do not taint the read.
+static bool isMemoryTainted(llvm::MemoryAccess* Start, const llvm::MemoryLocation& Loc, const ResultSecret& inputsVector,
+							llvm::ArrayRef<llvm::MemoryLocation> regions, llvm::MemorySSA& MSSA, llvm::AAResults& AA) {
+
+	llvm::MemorySSAWalker* walker = MSSA.getWalker();
+	llvm::SmallPtrSet<llvm::MemoryAccess*, 16> visited;
+	llvm::SmallVector<llvm::MemoryAccess*, 8> worklist = {Start};
+
+	while(!worklist.empty()) {
+		llvm::MemoryAccess* access = walker->getClobberingMemoryAccess(worklist.pop_back_val(), Loc);
+		if(!visited.insert(access).second) continue;
+
+		if(MSSA.isLiveOnEntryDef(access)) {
+			if(overlapsSecretRegion(Loc, regions, AA)) return true;
+			continue;
+		}
+
+		if(llvm::MemoryPhi::classof(access)) {
+			for(auto& incoming : cast<MemoryPhi>(access)->incoming_values())
+				worklist.push_back(cast<MemoryAccess>(incoming.get()));
+			continue;
+		}
+
+		llvm::MemoryDef* def = cast<MemoryDef>(access);
+		llvm::Instruction* inst = def->getMemoryInst();
+
+		// Stores through a secret pointer and calls that read secret memory
+		// are already in the set.
+		if(inputsVector.isSecret(inst)) return true;
+
+		// A public store that fully overwrites Loc hides anything above it.
+		if(llvm::StoreInst::classof(inst) && AA.alias(llvm::MemoryLocation::get(cast<StoreInst>(inst)), Loc) == llvm::AliasResult::MustAlias) continue;
+
+		worklist.push_back(def->getDefiningAccess());
+	}
+
+	return false;
+}
+
+// Returns true if -secret-args lists argument ArgNo of Func.
+static bool isSecretArgOption(llvm::Function &Func, unsigned ArgNo) {
+
+	for(auto& spec : SecretArgs) {
+		llvm::StringRef name, arg;
+		std::tie(name, arg) = llvm::StringRef(spec).rsplit(':');
+
+		unsigned index;
+		if(!arg.consume_front("arg") || arg.getAsInteger(10, index))
+			llvm::report_fatal_error(llvm::Twine("secret-args: expected <function>:arg<N>, got '") + spec + "'");
+
+		if(name == Func.getName() && index == ArgNo) return true;
+	}
+	return false;
+}
+
+// Collects the secret sources of Func: the arguments selected through
+// annotate("secret") or -secret-args, and the memory annotated as secret
+// (globals, struct fields, locals).
+void Secret::collectSecretSources(llvm::Function &Func, std::vector<llvm::Argument*>& args, std::vector<llvm::MemoryLocation>& regions) {
+
+	// A masked clone is only called from serialized regions: its predicate
+	// is secret, and so may be any of its arguments.
+	bool allArgs = SecretAllArgs || getMaskPredicate(Func);
+
+	llvm::SmallVector<std::pair<llvm::GlobalValue*, llvm::StringRef>, 8> globals;
+	getAnnotatedGlobals(*Func.getParent(), globals);
+	for(auto& pair : globals) {
+		if(pair.second != "secret") continue;
+		if(pair.first == &Func) allArgs = true;
+		else if(llvm::GlobalVariable::classof(pair.first)) regions.push_back(llvm::MemoryLocation::getBeforeOrAfter(pair.first));
+	}
 
-	std::vector<llvm::Value*> inputsVector;
 	for(auto arg = Func.arg_begin(); arg != Func.arg_end(); ++arg) {
-		getAllUsers(cast<Value>(arg), inputsVector);
+		if(allArgs || isSecretArgOption(Func, arg->getArgNo())) args.push_back(&*arg);
 	}
-  
+
+	// An annotated parameter shows up as an annotated stack slot the
+	// parameter is spilled to: both the slot and the parameter are secret. An
+	// annotated struct field is secret alone, not the struct holding it.
+	llvm::SmallVector<std::pair<llvm::Value*, llvm::StringRef>, 8> pointers;
+	getAnnotatedPointers(Func, pointers);
+	for(auto& pair : pointers) {
+		if(pair.second != "secret") continue;
+
+		if(llvm::IntrinsicInst::classof(pair.first)) {
+			llvm::MemoryLocation field = getAnnotatedField(*cast<IntrinsicInst>(pair.first));
+			if(std::find(regions.begin(), regions.end(), field) == regions.end()) regions.push_back(field);
+			continue;
+		}
+
+		llvm::Value* obj = llvm::getUnderlyingObject(pair.first);
+		regions.push_back(llvm::MemoryLocation::getBeforeOrAfter(obj));
+
+		for(auto user : obj->users()) {
+			if(llvm::StoreInst::classof(user) && llvm::Argument::classof(cast<StoreInst>(user)->getValueOperand()))
+				args.push_back(cast<Argument>(cast<StoreInst>(user)->getValueOperand()));
+		}
+	}
+}
+
+// Returns the summary of the function called by Inst, if Inst is a direct
+// call to a function of the module.
+static const FunctionSummary* getCallSummary(llvm::Value* Inst, const ResultSecretSummary* Summaries) {
+
+	if(!Summaries || !llvm::CallBase::classof(Inst)) return NULL;
+
+	llvm::Function* callee = cast<CallBase>(Inst)->getCalledFunction();
+	return callee ? Summaries->lookup(callee) : NULL;
+}
+
+// Arguments of Call that are secret values or point to memory holding a
+// secret right before the call.
+static llvm::BitVector getSecretArgs(llvm::CallBase* Call, unsigned NumArgs, const ResultSecret& inputsVector,
+									 llvm::ArrayRef<llvm::MemoryLocation> regions, llvm::MemorySSA& MSSA, llvm::AAResults& AA) {
+
+	llvm::BitVector args(NumArgs);
+	llvm::MemoryUseOrDef* access = MSSA.getMemoryAccess(Call);
+
+	for(unsigned i = 0; i < NumArgs && i < Call->arg_size(); i++) {
+		llvm::Value* arg = Call->getArgOperand(i);
+
+		if(inputsVector.isSecret(arg)) args.set(i);
+		else if(access && arg->getType()->isPointerTy() && !Call->onlyWritesMemory(i)
+				&& isMemoryTainted(access->getDefiningAccess(), llvm::MemoryLocation::getBeforeOrAfter(arg), inputsVector, regions, MSSA, AA))
+			args.set(i);
+	}
+	return args;
+}
+
+Secret::Result Secret::generateInputVector(llvm::Function &Func, llvm::MemorySSA& MSSA, llvm::AAResults& AA, llvm::DominatorTree& DT,
+										   llvm::PostDominatorTree& PDT, llvm::LoopInfo& LI, const ResultSecretSummary* Summaries) {
+
+	std::vector<llvm::Argument*> args;
+	std::vector<llvm::MemoryLocation> regions;
+	collectSecretSources(Func, args, regions);
+
+	// Arguments that are secret in one of the callers.
+	if(const FunctionSummary* summary = Summaries ? Summaries->lookup(&Func) : NULL) {
+		for(unsigned i : summary->SecretArgs.set_bits()) args.push_back(Func.getArg(i));
+	}
+
+	return propagateTaint(Func, args, regions, MSSA, AA, DT, PDT, LI, Summaries);
+}
+
+// Instructions whose taint depends on the memory they read: loads, memory
+// transfers and calls. Calls to summarized functions are readers too, even
+// when they do not touch memory: their summary decides which arguments
+// reach the result.
+static bool isMemoryReader(const llvm::Instruction* Inst) {
+	if(llvm::LoadInst::classof(Inst) || llvm::MemTransferInst::classof(Inst)) return true;
+	return llvm::CallBase::classof(Inst) && !llvm::IntrinsicInst::classof(Inst);
+}
+
+// Collects the readers below Def in MemorySSA, i.e. those the write may
+// reach, so that they are checked again once Def stores a secret. walked
+// holds the accesses whose readers are already collected and still waiting
+// for their check: a store below another secret one stops at once, so a
+// batch of secret stores walks each access once.
+static void collectReachedReaders(llvm::MemoryDef* Def, llvm::SmallPtrSetImpl<llvm::MemoryAccess*>& walked, llvm::SmallVectorImpl<llvm::Instruction*>& Readers) {
+
+	if(!walked.insert(Def).second) return;
+	llvm::SmallVector<llvm::MemoryAccess*, 16> worklist = {Def};
+
+	while(!worklist.empty()) {
+		for(auto user : worklist.pop_back_val()->users()) {
+			llvm::MemoryAccess* access = cast<MemoryAccess>(user);
+			if(!walked.insert(access).second) continue;
+
+			if(llvm::MemoryUseOrDef::classof(access) && isMemoryReader(cast<MemoryUseOrDef>(access)->getMemoryInst()))
+				Readers.push_back(cast<MemoryUseOrDef>(access)->getMemoryInst());
+			if(!llvm::MemoryUse::classof(access)) worklist.push_back(access);
+		}
+	}
+}
+
+// Finds the PHIs whose value tells which successor of a secret branch was
+// taken. Each successor gives its label to the blocks it reaches, walked in
+// reverse post-order up to the immediate post-dominator of the branch; a
+// block reached with two labels is a join, whose PHIs may tell them apart,
+// and passes on a label of its own, so that a merge below it is left to the
+// branch that decides it. The walk stops when a single block is left, all
+// the sides having met there or died, and crosses the region of a nested
+// branch that dominates its own post-dominator in one step, since no other
+// label can enter it: a branch walks the blocks of its own region, not
+// those of the branches nested in it. The order is computed once per
+// function.
+class JoinFinder {
+	llvm::DominatorTree& DT;
+	llvm::PostDominatorTree& PDT;
+	llvm::LoopInfo& LI;
+	llvm::DenseMap<const llvm::BasicBlock*, unsigned> order;
+
+public:
+	JoinFinder(llvm::Function& Func, llvm::DominatorTree& DT, llvm::PostDominatorTree& PDT, llvm::LoopInfo& LI)
+		: DT(DT), PDT(PDT), LI(LI) {
+		unsigned index = 0;
+		for(auto bb : llvm::ReversePostOrderTraversal<llvm::Function*>(&Func)) order[bb] = index++;
+	}
+
+	// Collects the PHIs of the joins of Term, and those of its immediate
+	// post-dominator, unless the edges from Term's side all carry the same
+	// value. A value leaving a loop that Term exits is kept too, as the
+	// iteration it comes from is secret.
+	void collect(llvm::Instruction* Term, llvm::SmallVectorImpl<llvm::PHINode*>& PHIs) {
+
+		llvm::BasicBlock* head = Term->getParent();
+		if(!order.count(head)) return;
+		llvm::DomTreeNode* node = PDT.getNode(head);
+		llvm::BasicBlock* join = node && node->getIDom() ? node->getIDom()->getBlock() : NULL;
+		llvm::Loop* loop = LI.getLoopFor(head);
+
+		llvm::DenseMap<llvm::BasicBlock*, llvm::BasicBlock*> labels;
+		llvm::SmallSetVector<llvm::BasicBlock*, 8> joins;
+		llvm::SmallVector<llvm::BasicBlock*, 4> exits;
+		// The nested branches crossed in one step, by the post-dominator they
+		// lead to.
+		llvm::DenseMap<llvm::BasicBlock*, llvm::SmallVector<llvm::BasicBlock*, 2>> crossed;
+		std::map<unsigned, llvm::BasicBlock*> pending;
+		bool backEdge = false;
+
+		// A block above, reached back from a side, is not walked again: it is a
+		// join if two labels come back to it.
+		auto reach = [&](llvm::BasicBlock* from, llvm::BasicBlock* bb, llvm::BasicBlock* label) {
+			bool back = bb == head || order.lookup(bb) <= order.lookup(from);
+			backEdge |= back;
+			if(bb == head) return;
+
+			auto it = labels.find(bb);
+			if(it == labels.end()) {
+				labels[bb] = label;
+				if(!back) pending[order.lookup(bb)] = bb;
+			}
+			else if(it->second != label) {
+				joins.insert(bb);
+				it->second = bb;
+			}
+		};
+
+		for(auto succ : llvm::successors(head)) reach(head, succ, succ);
+
+		while(!pending.empty()) {
+			llvm::BasicBlock* bb = pending.begin()->second;
+			pending.erase(pending.begin());
+			if(bb == join) continue;
+			if(loop && !loop->contains(bb)) exits.push_back(bb);
+
+			// In a loop the walk goes on to the exits, whose values depend on
+			// the iteration if a side went back to the header.
+			if(pending.empty() && !loop) break;
+
+			llvm::BasicBlock* label = labels.lookup(bb);
+			if(!loop && bb->getTerminator()->getNumSuccessors() > 1) {
+				llvm::DomTreeNode* inner = PDT.getNode(bb);
+				llvm::BasicBlock* end = inner && inner->getIDom() ? inner->getIDom()->getBlock() : NULL;
+				if(end && DT.dominates(bb, end)) {
+					crossed[end].push_back(bb);
+					reach(bb, end, label);
+					continue;
+				}
+			}
+			for(auto next : llvm::successors(bb)) reach(bb, next, label);
+		}
+
+		// Only the edges from Term's side count: the others were taken
+		// whatever the secret.
+		auto onSide = [&](llvm::BasicBlock* pred, llvm::BasicBlock* bb) {
+			if(pred == head || labels.count(pred)) return true;
+			for(auto branch : crossed.lookup(bb)) {
+				if(DT.dominates(branch, pred)) return true;
+			}
+			return false;
+		};
+
+		auto collectPHIs = [&](llvm::BasicBlock* bb, bool exitsOnly) {
+			for(auto& phi : bb->phis()) {
+				llvm::SmallPtrSet<llvm::Value*, 4> values;
+				bool exitValue = false;
+				for(unsigned i = 0; i < phi.getNumIncomingValues(); i++) {
+					if(!onSide(phi.getIncomingBlock(i), bb)) continue;
+
+					llvm::Value* value = phi.getIncomingValue(i);
+					values.insert(value);
+					if(loop && llvm::Instruction::classof(value) && loop->contains(cast<Instruction>(value)) && !loop->contains(bb))
+						exitValue = true;
+				}
+				if((!exitsOnly && values.size() > 1) || exitValue) PHIs.push_back(&phi);
+			}
+		};
+
+		for(auto bb : joins) collectPHIs(bb, false);
+		if(join && labels.count(join) && !joins.count(join)) collectPHIs(join, false);
+		if(backEdge) {
+			for(auto bb : exits) {
+				if(!joins.count(bb) && bb != join) collectPHIs(bb, true);
+			}
+		}
+	}
+};
+
+Secret::Result Secret::propagateTaint(llvm::Function &Func, llvm::ArrayRef<llvm::Argument*> Args, llvm::ArrayRef<llvm::MemoryLocation> Regions,
+									  llvm::MemorySSA& MSSA, llvm::AAResults& AA, llvm::DominatorTree& DT, llvm::PostDominatorTree& PDT,
+									  llvm::LoopInfo& LI, const ResultSecretSummary* Summaries) {
+
+	// Worklist propagation over the def-use graph: every value is pushed at
+	// most once, so the data flow is linear in the number of uses. A secret
+	// branch also walks its own region, once, for the PHIs that merge it.
+	ResultSecret inputsVector;
+	llvm::SmallVector<llvm::Value*, 32> worklist;
+
+	std::vector<llvm::MemoryLocation> regions(Regions.begin(), Regions.end());
+
+	// Scalar arguments are secret values. For pointer arguments the address
+	// itself is public and the memory it points to is secret.
+	for(auto arg : Args) {
+		if(arg->getType()->isPointerTy()) regions.push_back(llvm::MemoryLocation::getBeforeOrAfter(arg));
+		else if(inputsVector.insert(arg)) worklist.push_back(arg);
+	}
+
+	// Readers become secret when one of the writes reaching them (through
+	// MemorySSA) stores a secret. Each is checked once up front, then again
+	// only when a write above it, or an argument of the summarized function
+	// it calls, becomes secret.
+	std::vector<llvm::Instruction*> readers;
+	for(auto& bb : Func) {
+		for(auto& inst : bb) {
+			if(isMemoryReader(&inst)) readers.push_back(&inst);
+		}
+	}
+
+	llvm::SmallVector<llvm::Instruction*, 32> pending(readers.rbegin(), readers.rend());
+	llvm::SmallPtrSet<llvm::Instruction*, 32> queued(readers.begin(), readers.end());
+	llvm::SmallVector<llvm::Instruction*, 16> reached;
+	llvm::SmallPtrSet<llvm::MemoryAccess*, 32> walked;
+	llvm::SmallVector<llvm::PHINode*, 8> joins;
+	std::optional<JoinFinder> joinFinder;
+
+	auto recheck = [&](llvm::Instruction* inst) {
+		if(!inputsVector.isSecret(inst) && queued.insert(inst).second) pending.push_back(inst);
+	};
+
+	while(!worklist.empty() || !pending.empty()) {
+		while(!worklist.empty()) {
+			llvm::Value* val = worklist.pop_back_val();
+			for(auto user : val->users()) {
+				if(getCallSummary(user, Summaries)) recheck(cast<Instruction>(user));
+				else if(inputsVector.insert(user)) worklist.push_back(user);
+			}
+
+			// A branch on a secret: the PHIs merging its sides. They may feed
+			// other branches, so this runs until no new branch is secret.
+			if((llvm::BranchInst::classof(val) && cast<BranchInst>(val)->isConditional()) || llvm::SwitchInst::classof(val)) {
+				joins.clear();
+				if(!joinFinder) joinFinder.emplace(Func, DT, PDT, LI);
+				joinFinder->collect(cast<Instruction>(val), joins);
+				for(auto phi : joins) {
+					if(inputsVector.insert(phi)) worklist.push_back(phi);
+				}
+			}
+
+			// A write that stores a secret: the readers it may reach.
+			llvm::Instruction* inst = dyn_cast<Instruction>(val);
+			llvm::MemoryUseOrDef* access = inst ? MSSA.getMemoryAccess(inst) : NULL;
+			if(access && llvm::MemoryDef::classof(access)) {
+				reached.clear();
+				collectReachedReaders(cast<MemoryDef>(access), walked, reached);
+				for(auto reader : reached) recheck(reader);
+			}
+		}
+
+		if(pending.empty()) break;
+
+		// The readers waiting for their check are checked as one batch, so
+		// that the secret stores they reveal are walked together.
+		llvm::SmallVector<llvm::Instruction*, 32> batch;
+		batch.swap(pending);
+		bool foundPublic = false;
+		for(auto inst : llvm::reverse(batch)) {
+			queued.erase(inst);
+			if(inputsVector.isSecret(inst)) continue;
+
+			bool tainted = false;
+			if(const FunctionSummary* summary = getCallSummary(inst, Summaries)) {
+				// The taint set does not tell a call result from the memory the
+				// call writes, so either makes the call secret.
+				tainted = summary->taintsCall(getSecretArgs(cast<CallBase>(inst), summary->SecretArgs.size(), inputsVector, regions, MSSA, AA));
+			}
+			else {
+				llvm::MemoryUseOrDef* access = MSSA.getMemoryAccess(inst);
+				if(!access) continue;
+
+				if(llvm::LoadInst::classof(inst)) {
+					tainted = isMemoryTainted(access->getDefiningAccess(), llvm::MemoryLocation::get(inst), inputsVector, regions, MSSA, AA);
+				}
+				else {
+					llvm::CallBase* call = cast<CallBase>(inst);
+					for(unsigned i = 0; i < call->arg_size() && !tainted; i++) {
+						if(!call->getArgOperand(i)->getType()->isPointerTy() || call->onlyWritesMemory(i)) continue;
+						tainted = isMemoryTainted(access->getDefiningAccess(), llvm::MemoryLocation::getBeforeOrAfter(call->getArgOperand(i)),
+												inputsVector, regions, MSSA, AA);
+					}
+				}
+			}
+
+			if(tainted && inputsVector.insert(inst)) worklist.push_back(inst);
+			foundPublic |= !tainted;
+		}
+
+		// A reader found public must be checked again for the next secret
+		// store above it, which therefore walks the accesses again.
+		if(foundPublic) walked.clear();
+	}
+
+	// What reaches each summarized call, for the callees' secret arguments.
+	for(auto inst : readers) {
+		if(const FunctionSummary* summary = getCallSummary(inst, Summaries))
+			inputsVector.setSecretCallArgs(cast<CallBase>(inst), getSecretArgs(cast<CallBase>(inst), summary->SecretArgs.size(), inputsVector, regions, MSSA, AA));
+	}
+
  	return inputsVector;
 }
 
-Secret::Result Secret::run(llvm::Function &Func, llvm::FunctionAnalysisManager &) {
-  return generateInputVector(Func);
+Secret::Result Secret::run(llvm::Function &Func, llvm::FunctionAnalysisManager &FAM) {
+	auto& MSSA = FAM.getResult<MemorySSAAnalysis>(Func).getMSSA();
+	auto& AA = FAM.getResult<AAManager>(Func);
+	auto& DT = FAM.getResult<DominatorTreeAnalysis>(Func);
+	auto& PDT = FAM.getResult<PostDominatorTreeAnalysis>(Func);
+	auto& LI = FAM.getResult<LoopAnalysis>(Func);
+
+	// The summaries are only used when already computed, e.g. through
+	// require<secret-summary>: a function analysis cannot run a module one.
+	auto& MAMProxy = FAM.getResult<ModuleAnalysisManagerFunctionProxy>(Func);
+	auto* Summaries = MAMProxy.getCachedResult<SecretSummary>(*Func.getParent());
+	if(Summaries) MAMProxy.registerOuterAnalysisInvalidation<SecretSummary, Secret>();
+
+	PhaseTimer timer("taint", "Propagate the secrets", Func);
+	return generateInputVector(Func, MSSA, AA, DT, PDT, LI, Summaries);
 }  
 
 PreservedAnalyses InputsVectorPrinter::run(Function &Func, FunctionAnalysisManager &FAM) {
   
 	auto &inputsVector = FAM.getResult<Secret>(Func);
-	
-	printInputsVectorResult(OS, inputsVector, Func);
+
+	OS << "Secret values in function '" << Func.getName() << "':\n";
+	for(auto val : inputsVector) {
+		if(llvm::Argument::classof(val)) OS << "  " << *val << "\n";
+		else OS << *val << "\n";
+	}
 	return PreservedAnalyses::all();
 }
 
+// Collects the blocks whose execution may depend on a secret: those reached
+// from a branch or switch on a secret (on any condition with
+// -ct-linearize-public) before its immediate post-dominator. The regions
+// ct-linearize serializes are made of these blocks.
+static void getSecretControlledBlocks(Function &Func, const ResultSecret& inputsVector, llvm::PostDominatorTree& PDT, llvm::SmallPtrSetImpl<llvm::BasicBlock*>& blocks) {
+
+	for(auto& bb : Func) {
+		llvm::Instruction* term = bb.getTerminator();
+		if(term->getNumSuccessors() < 2 || (!LinearizePublic && !inputsVector.isSecret(term))) continue;
+
+		llvm::DomTreeNode* node = PDT.getNode(&bb);
+		llvm::BasicBlock* join = node && node->getIDom() ? node->getIDom()->getBlock() : NULL;
+
+		llvm::SmallPtrSet<llvm::BasicBlock*, 16> visited;
+		llvm::SmallVector<llvm::BasicBlock*, 16> worklist(llvm::successors(&bb));
+		while(!worklist.empty()) {
+			llvm::BasicBlock* cur = worklist.pop_back_val();
+			if(cur == join || !visited.insert(cur).second) continue;
+
+			blocks.insert(cur);
+			for(auto next : llvm::successors(cur)) worklist.push_back(next);
+		}
+	}
+}
+
+PreservedAnalyses CTMaskedClones::run(Module &M, ModuleAnalysisManager &MAM) {
+
+	auto& FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+	// The clones are visited too: the calls in a clone all run on a secret.
+	llvm::SmallVector<llvm::Function*, 16> worklist;
+	for(auto& func : M) {
+		if(!func.isDeclaration()) worklist.push_back(&func);
+	}
+
+	bool changed = false;
+	while(!worklist.empty()) {
+		llvm::Function* func = worklist.pop_back_val();
+		bool masked = getMaskPredicate(*func) != NULL;
+
+		llvm::SmallPtrSet<llvm::BasicBlock*, 16> blocks;
+		if(!masked) getSecretControlledBlocks(*func, FAM.getResult<Secret>(*func), FAM.getResult<PostDominatorTreeAnalysis>(*func), blocks);
+
+		for(auto& bb : *func) {
+			if(!masked && !blocks.count(&bb)) continue;
+
+			for(auto& inst : bb) {
+				llvm::CallInst* call = dyn_cast<CallInst>(&inst);
+				llvm::Function* callee = call ? call->getCalledFunction() : NULL;
+				if(!callee || callee->isDeclaration() || callee->isVarArg() || call->isMustTailCall() || !hasMaskedEffects(*call)) continue;
+				if(getMaskedClone(*callee) || !hasMaskableWrites(*callee)) continue;
+
+				worklist.push_back(createMaskedClone(*callee));
+				changed = true;
+			}
+		}
+	}
+
+	if(!changed) return PreservedAnalyses::all();
+
+	// Adding functions changes none of the existing ones, nor their taint.
+	PreservedAnalyses PA;
+	PA.preserveSet<AllAnalysesOn<Function>>();
+	PA.preserve<FunctionAnalysisManagerModuleProxy>();
+	PA.preserve<SecretSummary>();
+	return PA;
+}
+
+PreservedAnalyses CTLinearize::run(Function &Func, FunctionAnalysisManager &FAM) {
+
+	// The serialization only handles two-way branches: lower the switches on
+	// a secret or in a serialized region first, and recompute everything on
+	// the new CFG. The lowered switches may make other regions serialized.
+	bool switchesLowered = false;
+	{
+		PhaseTimer timer("switches", "Lower the switches", Func);
+		std::vector<llvm::SwitchInst*> switches;
+		getSecretSwitches(Func, FAM.getResult<Secret>(Func), FAM.getResult<RegionInfoAnalysis>(Func), FAM.getResult<LoopAnalysis>(Func), switches);
+		while(lowerSwitches(switches)) {
+			switchesLowered = true;
+			FAM.invalidate(Func, PreservedAnalyses::none());
+			switches.clear();
+			getSecretSwitches(Func, FAM.getResult<Secret>(Func), FAM.getResult<RegionInfoAnalysis>(Func), FAM.getResult<LoopAnalysis>(Func), switches);
+		}
+	}
+
+	auto& inputsVector = FAM.getResult<Secret>(Func);
+	auto& DT = FAM.getResult<DominatorTreeAnalysis>(Func);
+	auto& PDT = FAM.getResult<PostDominatorTreeAnalysis>(Func);
+	auto& RI = FAM.getResult<RegionInfoAnalysis>(Func);
+	auto& LI = FAM.getResult<LoopAnalysis>(Func);
+	auto& TTI = FAM.getResult<TargetIRAnalysis>(Func);
+
+	if(!checkCost(Func, inputsVector, PDT, RI, LI, TTI, FAM))
+		return switchesLowered ? PreservedAnalyses::none() : PreservedAnalyses::all();
+
+	// The loops leaving on a secret get a fixed trip count, and everything is
+	// recomputed on the new loops as for the switches.
+	bool loopsBounded = boundSecretLoops(Func, inputsVector, DT, RI, LI, FAM.getResult<ScalarEvolutionAnalysis>(Func), FAM.getResult<OptimizationRemarkEmitterAnalysis>(Func));
+	if(loopsBounded)
+		FAM.invalidate(Func, PreservedAnalyses::none());
+
+	// The small loops with a constant trip count of the serialized regions
+	// become straight-line code, serialized with the rest of the region.
+	bool loopsUnrolled = unrollSecretLoops(Func, FAM.getResult<Secret>(Func), FAM.getResult<DominatorTreeAnalysis>(Func), FAM.getResult<RegionInfoAnalysis>(Func),
+										   FAM.getResult<LoopAnalysis>(Func), FAM.getResult<ScalarEvolutionAnalysis>(Func), FAM.getResult<AssumptionAnalysis>(Func), FAM.getResult<TargetIRAnalysis>(Func));
+	if(loopsUnrolled)
+		FAM.invalidate(Func, PreservedAnalyses::none());
+
+	PreservedAnalyses PA = linearize(Func, FAM.getResult<Secret>(Func), FAM.getResult<DominatorTreeAnalysis>(Func), FAM.getResult<RegionInfoAnalysis>(Func),
+									 FAM.getResult<LoopAnalysis>(Func), FAM.getResult<TargetIRAnalysis>(Func));
+
+	// The divisions and the table lookups on a secret are rewritten on the
+	// linearized code, with the secrets recomputed on it.
+	FAM.invalidate(Func, PA);
+	auto& linearSecrets = FAM.getResult<Secret>(Func);
+	bool divisionsLowered;
+	{
+		PhaseTimer timer("divisions", "Lower the divisions on a secret", Func);
+		divisionsLowered = lowerSecretDivisions(Func, linearSecrets, FAM.getResult<TargetIRAnalysis>(Func));
+	}
+	if(divisionsLowered)
+		FAM.invalidate(Func, PreservedAnalyses::none());
+	auto& loweredSecrets = FAM.getResult<Secret>(Func);
+	bool lookupsLowered;
+	{
+		PhaseTimer timer("lookups", "Lower the table lookups at a secret index", Func);
+		lookupsLowered = lowerSecretLookups(Func, loweredSecrets, FAM.getResult<TargetIRAnalysis>(Func));
+	}
+	return (switchesLowered || loopsBounded || loopsUnrolled || divisionsLowered || lookupsLowered) ? PreservedAnalyses::none() : PA;
+}
+
 //-----------------------------------------------------------------------------
 // New PM Registration
 //-----------------------------------------------------------------------------
+static llvm::OptimizationLevel parseCTOptLevel(llvm::StringRef Name) {
+  if (Name == "O0") return llvm::OptimizationLevel::O0;
+  if (Name == "O1") return llvm::OptimizationLevel::O1;
+  if (Name == "O2") return llvm::OptimizationLevel::O2;
+  if (Name == "O3") return llvm::OptimizationLevel::O3;
+  if (Name == "Os") return llvm::OptimizationLevel::Os;
+  if (Name == "Oz") return llvm::OptimizationLevel::Oz;
+  llvm::report_fatal_error(llvm::Twine("ct-opt: invalid optimization level '") + Name + "', expecting one of O0, O1, O2, O3, Os, Oz");
+}
+
 llvm::PassPluginLibraryInfo getInputVectorPluginInfo() {
   return {
     LLVM_PLUGIN_API_VERSION, "InputVector", LLVM_VERSION_STRING,
@@ -67,28 +770,61 @@ llvm::PassPluginLibraryInfo getInputVectorPluginInfo() {
                   FPM.addPass(InputsVectorPrinter(llvm::errs()));
                   return true;
                 }
+                if (Name == "ct-linearize") {
+                  FPM.addPass(CTLinearize());
+                  return true;
+                }
+                if (Name == "ct-select") {
+                  FPM.addPass(CTSelect());
+                  return true;
+                }
+                if (Name.consume_front("ct-opt<") && Name.consume_back(">")) {
+                  FPM.addPass(CTOpt(parseCTOptLevel(Name)));
+                  return true;
+                }
                 return false;
               });
 
-          PB.registerVectorizerStartEPCallback(
-              [](llvm::FunctionPassManager &PM,
-                 llvm::OptimizationLevel Level) {
-                PM.addPass(InputsVectorPrinter(llvm::errs()));
+          PB.registerPipelineParsingCallback(
+              [&](StringRef Name, ModulePassManager &MPM,
+                  ArrayRef<PassBuilder::PipelineElement>) {
+                if (Name == "require<secret-summary>") {
+                  MPM.addPass(RequireAnalysisPass<SecretSummary, Module>());
+                  return true;
+                }
+                if (Name == "invalidate<secret-summary>") {
+                  MPM.addPass(InvalidateAnalysisPass<SecretSummary>());
+                  return true;
+                }
+                if (Name == "print<secret-summary>") {
+                  MPM.addPass(SecretSummaryPrinter(llvm::errs()));
+                  return true;
+                }
+                if (Name == "ct-verify") {
+                  MPM.addPass(CTVerify(llvm::errs()));
+                  return true;
+                }
+                if (Name == "ct-masked-clones") {
+                  MPM.addPass(CTMaskedClones());
+                  return true;
+                }
+                return false;
               });
 
+
           PB.registerAnalysisRegistrationCallback(
               [](FunctionAnalysisManager &FAM) {
                 FAM.registerPass([&] { return Secret(); });
               });
+
+          PB.registerAnalysisRegistrationCallback(
+              [](ModuleAnalysisManager &MAM) {
+                MAM.registerPass([&] { return SecretSummary(); });
+              });
           }
         };
 }
 
-extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
-llvmGetPassPluginInfo() {
-  return getInputVectorPluginInfo();
-}
-
 
 static void getAllInnerLoops(llvm::Loop* CurrentLoop, std::vector<llvm::Loop*>& InnerLoops) {
     InnerLoops.push_back(CurrentLoop);
@@ -98,42 +834,150 @@ static void getAllInnerLoops(llvm::Loop* CurrentLoop, std::vector<llvm::Loop*>&
     }
 }
 
-static void getAllUsers(llvm::Value* Inst, std::vector<llvm::Value*>& UsersVector) {
-	UsersVector.push_back(Inst);
+static void getAllUsers(llvm::Value* Inst, UsersSet& UsersVector) {
+	llvm::SmallVector<llvm::Value*, 16> worklist;
+	if(UsersVector.insert(Inst)) worklist.push_back(Inst);
 
-	for(auto temp : Inst->users()) {
-		if(std::find(UsersVector.begin(), UsersVector.end(), &*temp) == UsersVector.end()) getAllUsers(&*temp, UsersVector);
+	while(!worklist.empty()) {
+		llvm::Value* cur = worklist.pop_back_val();
+		for(auto temp : cur->users()) {
+			if(UsersVector.insert(&*temp)) worklist.push_back(&*temp);
+		}
 	}
 }
 
-static llvm::PHINode* getPhiIndex(std::vector<llvm::Value*>& Rest, llvm::Loop* loop, std::vector<llvm::Value*> inputsVector) {
+static llvm::PHINode* getPhiIndex(const std::vector<llvm::Value*>& Uses, llvm::Loop* loop, const ResultSecret& inputsVector) {
 
-	if(Rest.empty()) return NULL;
-	llvm::Value* Inst = Rest.front();
+	llvm::SmallVector<llvm::Value*, 16> worklist(Uses.begin(), Uses.end());
+	llvm::SmallPtrSet<llvm::Value*, 16> visited;
 
-	if(llvm::PHINode::classof(Inst)) 
-	{ 
-		llvm::PHINode* phi = cast<PHINode>(Inst);
-		for(unsigned j = 0; j < phi->getNumIncomingValues(); j++) {
-			if(phi->getIncomingBlock(j) == loop->getLoopPreheader()) {
-				if(std::find(inputsVector.begin(), inputsVector.end(), phi->getIncomingValue(j)) 
-					!= inputsVector.end()) return phi;
+	// Breadth-first, as the values are examined in the order they are found.
+	for(unsigned i = 0; i < worklist.size(); i++) {
+		llvm::Value* Inst = worklist[i];
+		if(!visited.insert(Inst).second) continue;
+
+		if(llvm::PHINode::classof(Inst)) 
+		{ 
+			llvm::PHINode* phi = cast<PHINode>(Inst);
+			for(unsigned j = 0; j < phi->getNumIncomingValues(); j++) {
+				if(phi->getIncomingBlock(j) == loop->getLoopPreheader()) {
+					if(inputsVector.isSecret(phi->getIncomingValue(j))) return phi;
+				}
+			}
+		}
+		else {
+			for(auto uses = Inst->use_begin(); uses != Inst->use_end(); ++uses) {
+				if(!visited.count((*uses).get())) worklist.push_back((*uses).get());
 			}
 		}
 	}
-	else {
-		for(auto uses = Inst->use_begin(); uses != Inst->use_end(); ++uses) {
-			if(std::find(Rest.begin(), Rest.end(), (*uses).get()) == Rest.end()) 						
-				Rest.push_back((*uses).get());
+
+	return NULL;
+}
+
+using BoundsMap = llvm::DenseMap<const llvm::Value*, unsigned>;
+
+// Objects and pointers annotated with ct_bound:N. As for secrets, an
+// annotated parameter shows up as an annotated stack slot it is spilled to.
+static void getAnnotatedBounds(llvm::Function& Func, BoundsMap& bounds) {
+
+	llvm::SmallVector<std::pair<llvm::GlobalValue*, llvm::StringRef>, 8> globals;
+	getAnnotatedGlobals(*Func.getParent(), globals);
+	for(auto& pair : globals) {
+		if(unsigned bound = getBoundAnnotation(pair.second)) bounds[pair.first] = bound;
+	}
+
+	llvm::SmallVector<std::pair<llvm::Value*, llvm::StringRef>, 8> pointers;
+	getAnnotatedPointers(Func, pointers);
+	for(auto& pair : pointers) {
+		unsigned bound = getBoundAnnotation(pair.second);
+		if(!bound) continue;
+
+		// A struct field: only the pointer returned by the annotation.
+		bounds[pair.first] = bound;
+		if(llvm::IntrinsicInst::classof(pair.first)) continue;
+
+		llvm::Value* obj = llvm::getUnderlyingObject(pair.first);
+		bounds[obj] = bound;
+		for(auto user : obj->users()) {
+			if(llvm::StoreInst::classof(user) && llvm::Argument::classof(cast<StoreInst>(user)->getValueOperand()))
+				bounds[cast<StoreInst>(user)->getValueOperand()] = bound;
 		}
 	}
+}
+
+// Returns the operand number of the outermost index of ptr that is not a
+// constant, the one the bound of getArrayBound applies to; 0 if there is
+// none.
+static unsigned getOutermostIndex(llvm::GetElementPtrInst* ptr) {
+
+	for(auto index = ptr->idx_begin(); index != ptr->idx_end(); ++index) {
+		if(!isa<Constant>(index->get())) return index->getOperandNo();
+	}
+	return 0;
+}
+
+// Returns the size in bytes of the object ptr points into when ptr is the
+// object itself: a local or global variable, or a pointer parameter with a
+// dereferenceable attribute. 0 if unknown.
+static uint64_t getObjectSize(llvm::Value* ptr, const llvm::DataLayout& DL) {
+
+	if(llvm::AllocaInst::classof(ptr)) {
+		llvm::AllocaInst* alloca = cast<AllocaInst>(ptr);
+		llvm::ConstantInt* count = dyn_cast<ConstantInt>(alloca->getArraySize());
+		return count ? count->getZExtValue() * DL.getTypeAllocSize(alloca->getAllocatedType()) : 0;
+	}
+
+	if(llvm::GlobalVariable::classof(ptr))
+		return DL.getTypeAllocSize(cast<GlobalVariable>(ptr)->getValueType());
+
+	if(llvm::Argument::classof(ptr)) {
+		llvm::Argument* arg = cast<Argument>(ptr);
+		uint64_t bytes = arg->getDereferenceableBytes();
+		return bytes ? bytes : arg->getDereferenceableOrNullBytes();
+	}
+
+	return 0;
+}
+
+// Returns the number of values the outermost variable index of ptr can
+// take, 0 if unknown. The bound comes from a ct_bound annotation, or from
+// the size of the object ptr indexes, a local or global variable or a
+// pointer parameter with a dereferenceable attribute: the first index steps
+// over whole objects of the source element type, the next ones select in
+// the arrays and structs of that type.
+static unsigned getArrayBound(llvm::GetElementPtrInst* ptr, const BoundsMap& annotated) {
+
+	llvm::Value* base = ptr->getPointerOperand()->stripPointerCasts();
+
+	llvm::SmallVector<const llvm::Value*, 4> candidates = {base, llvm::getUnderlyingObject(base)};
+	if(llvm::LoadInst::classof(base)) {
+		llvm::Value* slot = cast<LoadInst>(base)->getPointerOperand()->stripPointerCasts();
+		candidates.push_back(slot);
+		candidates.push_back(llvm::getUnderlyingObject(slot));
+	}
+	for(auto candidate : candidates) {
+		auto it = annotated.find(candidate);
+		if(it != annotated.end()) return it->second;
+	}
+
+	unsigned outer = getOutermostIndex(ptr);
+	if(!outer) return 0;
 
-	Rest.erase(Rest.begin());
+	llvm::Type* type = ptr->getSourceElementType();
+	if(outer == 1) {
+		const llvm::DataLayout& DL = ptr->getModule()->getDataLayout();
+		uint64_t bytes = getObjectSize(base, DL);
+		uint64_t size = DL.getTypeAllocSize(type);
+		return bytes && size ? bytes / size : 0;
+	}
 
-	return getPhiIndex(Rest, loop, inputsVector);
+	// The constant indices before it lead to the array it selects in.
+	for(unsigned i = 2; i < outer && type; i++) type = llvm::GetElementPtrInst::getTypeAtIndex(type, ptr->getOperand(i));
+	return type && type->isArrayTy() ? type->getArrayNumElements() : 0;
 }
 
-static void findArrays(llvm::Loop* Loop, std::vector<llvm::GetElementPtrInst*>& arraysLoop) {
+static void findArrays(llvm::Loop* Loop, const BoundsMap& annotated, std::vector<std::pair<llvm::GetElementPtrInst*, unsigned>>& arraysLoop) {
 
 	for(auto bb : Loop->blocks()) {
 		for(auto inst = (*bb).begin(); inst != (*bb).end(); ++inst) {
@@ -142,21 +986,19 @@ static void findArrays(llvm::Loop* Loop, std::vector<llvm::GetElementPtrInst*>&
 			{
   					llvm::GetElementPtrInst* ptr = cast<GetElementPtrInst>(&*inst);
   					
-					if(llvm::AllocaInst::classof(ptr->getPointerOperand()) && cast<AllocaInst>(ptr->getPointerOperand())->getAllocatedType()->isArrayTy())
-						arraysLoop.push_back(ptr);
+					if(unsigned bound = getArrayBound(ptr, annotated))
+						arraysLoop.push_back(std::make_pair(ptr, bound));
 			}
 		}
 	}
 }
 
-static unsigned minSizeArrays(std::vector<llvm::GetElementPtrInst*> arraysLoop) {
+static unsigned minSizeArrays(const std::vector<std::pair<llvm::GetElementPtrInst*, unsigned>>& arraysLoop) {
 	
-	llvm::GetElementPtrInst* ptr = arraysLoop.front();
-	unsigned temp = cast<AllocaInst>(ptr->getPointerOperand())->getAllocatedType()->getArrayNumElements();
+	unsigned temp = arraysLoop.front().second;
 
-	for(auto array : arraysLoop) {
-		unsigned cur = cast<AllocaInst>(array->getPointerOperand())->getAllocatedType()->getArrayNumElements();
-		if(temp > cur) temp = cur; 
+	for(auto& array : arraysLoop) {
+		if(temp > array.second) temp = array.second; 
 	}
 
 	return temp;
@@ -177,43 +1019,261 @@ static llvm::Value* fixLoopCmp(llvm::BasicBlock* header, llvm::Value* oldValue)
 	return oldValue;
 }
 
-static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func, std::vector<llvm::Loop*> allLoopsVector) {
+// The conditional branches of a loop on a secret condition that do not only
+// leave the loop.
+static void getSecretBranches(llvm::Loop* loop, const ResultSecret &inputsVector, std::vector<llvm::BranchInst*>& InputBrs) {
 
+	llvm::SmallVector<llvm::BasicBlock*, 8> exitBlocks;
+	loop->getExitBlocks(exitBlocks);
 
-	llvm::DominatorTree DT (Func);
-	llvm::LoopInfo LI (DT);
+	for(auto bb : loop->blocks()) {
 
-	std::vector<llvm::Value*> inputsVector;
-	for(auto arg = Func.arg_begin(); arg != Func.arg_end(); ++arg) {
-		getAllUsers(cast<Value>(arg), inputsVector);
+		if(llvm::BranchInst::classof(bb->getTerminator())) {
+			
+			llvm::BranchInst* br = cast<BranchInst>(bb->getTerminator());
+			if(br->isConditional() && inputsVector.isSecret(br->getCondition())
+				&& (std::find(exitBlocks.begin(), exitBlocks.end(), br->getSuccessor(0)) == exitBlocks.end()
+					||  std::find(exitBlocks.begin(), exitBlocks.end(), br->getSuccessor(1)) == exitBlocks.end()))
+					{
+						InputBrs.push_back(br);
+					}
+		}
 	}
+}
+
+// The loops modifyNumCyclesLoops pads, with the number of iterations it pads
+// them to, for the cost model.
+static void getPaddedLoops(const ResultSecret &inputsVector, Function &Func, const std::vector<llvm::Loop*>& allLoopsVector, llvm::DenseMap<const llvm::Loop*, unsigned>& paddedTrips) {
+
+	BoundsMap annotatedBounds;
+	getAnnotatedBounds(Func, annotatedBounds);
+
+	for(auto loop : allLoopsVector) {
+
+		if(getBoundedTripCount(*loop)) continue;
+
+		std::vector<llvm::BranchInst*> InputBrs;
+		getSecretBranches(loop, inputsVector, InputBrs);
+		if(InputBrs.empty()) continue;
+
+		std::vector<std::pair<llvm::GetElementPtrInst*, unsigned>> arraysLoop;
+		findArrays(loop, annotatedBounds, arraysLoop);
+		if(!arraysLoop.empty()) paddedTrips[loop] = minSizeArrays(arraysLoop);
+	}
+}
+
+// Puts the loops modifyNumCyclesLoops pads in the form it expects, which is
+// also the one LoopVectorize widens once they are padded: the latch goes on
+// looping when its condition is true, and the values used after the loop go
+// through LCSSA PHIs, so that they get the predicated values rather than the
+// ones of the last padded iteration. Returns true if a loop has changed.
+static bool canonicalizePaddedLoops(const ResultSecret &inputsVector, Function &Func, const std::vector<llvm::Loop*>& allLoopsVector, llvm::DominatorTree& DT, llvm::LoopInfo& LI) {
+
+	PhaseTimer timer("loops", "Rewrite the loops with a secret bound", Func);
+
+	llvm::DenseMap<const llvm::Loop*, unsigned> paddedTrips;
+	getPaddedLoops(inputsVector, Func, allLoopsVector, paddedTrips);
+
+	bool changed = false;
+	for(auto loop : allLoopsVector) {
+
+		if(!paddedTrips.count(loop)) continue;
+
+		llvm::BranchInst* br = dyn_cast<BranchInst>(loop->getLoopLatch()->getTerminator());
+		llvm::ICmpInst* cmp = br && br->isConditional() ? dyn_cast<ICmpInst>(br->getCondition()) : NULL;
+		if(cmp && cmp->hasOneUse() && br->getSuccessor(1) == loop->getHeader() && inputsVector.isSecret(cmp)) {
+			cmp->setPredicate(cmp->getInversePredicate());
+			br->swapSuccessors();
+			changed = true;
+		}
+
+		changed |= llvm::formLCSSA(*loop, DT, &LI, NULL);
+	}
+
+	return changed;
+}
+
+// The loops boundSecretLoops gives a fixed trip count, by header, with that
+// count: those leaving on a secret condition, and those leaving a serialized
+// region elsewhere than at their latch. A loop that only leaves at its latch
+// and that modifyNumCyclesLoops pads to the size of its arrays keeps its
+// padding, a loop without a known maximum trip count stays as it is and is
+// added to unbounded, if given.
+static void getBoundedLoops(const ResultSecret &inputsVector, Function &Func, const std::vector<llvm::Loop*>& allLoopsVector, const SecretRegions& regions, llvm::ScalarEvolution& SE,
+							std::vector<std::pair<llvm::BasicBlock*, unsigned>>& boundedLoops, std::vector<llvm::Loop*>* unbounded = NULL) {
+
+	llvm::DenseMap<const llvm::Loop*, unsigned> paddedTrips;
+	getPaddedLoops(inputsVector, Func, allLoopsVector, paddedTrips);
+
+	for(auto loop : allLoopsVector) {
+
+		llvm::SmallVector<llvm::BasicBlock*, 4> exiting;
+		loop->getExitingBlocks(exiting);
+
+		bool secretExit = false;
+		bool earlyExit = false;
+		for(auto bb : exiting) {
+			llvm::BranchInst* br = dyn_cast<BranchInst>(bb->getTerminator());
+			if(br && br->isConditional() && inputsVector.isSecret(br->getCondition())) secretExit = true;
+			if(bb != loop->getLoopLatch()) earlyExit = true;
+		}
+
+		if(!secretExit && !(earlyExit && regions.getOwner(loop->getHeader()))) continue;
+		if(!earlyExit && paddedTrips.count(loop)) continue;
+
+		if(unsigned trips = getMaxTripCount(*loop, SE))
+			boundedLoops.push_back(std::make_pair(loop->getHeader(), trips));
+		else if(unbounded)
+			unbounded->push_back(loop);
+	}
+}
+
+// Gives the loops of getBoundedLoops a fixed trip count, inner loops first,
+// recomputing the dominator tree and the loops after each of them. The loops
+// that keep their secret exit for lack of a maximum trip count are reported
+// as missed remarks. Returns true if a loop has been rewritten.
+static bool boundSecretLoops(Function &Func, const ResultSecret &inputsVector, llvm::DominatorTree& DT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, llvm::ScalarEvolution& SE, llvm::OptimizationRemarkEmitter& ORE) {
+
+	PhaseTimer timer("bound-loops", "Bound the loops leaving on a secret", Func);
+
+	std::vector<llvm::Loop*> allLoopsVector;
+	for(auto loop = LI.begin(); loop != LI.end(); ++loop)  getAllInnerLoops(*loop, allLoopsVector);
+
+	SecretRegions regions;
+	getSecretRegions(Func, inputsVector, allLoopsVector, RI, regions);
+
+	std::vector<std::pair<llvm::BasicBlock*, unsigned>> boundedLoops;
+	std::vector<llvm::Loop*> unbounded;
+	getBoundedLoops(inputsVector, Func, allLoopsVector, regions, SE, boundedLoops, &unbounded);
+
+	for(auto loop : unbounded) {
+		ORE.emit([&]() {
+			return llvm::OptimizationRemarkMissed("ct-linearize", "UnboundedLoop", loop->getStartLoc(), loop->getHeader())
+				<< "the loop at '" << loop->getHeader()->getName() << "' keeps its secret exit: no maximum trip count is known, annotate '"
+				<< Func.getName() << "' with ct_trip:N or raise -ct-max-trip-count";
+		});
+	}
+
+	bool changed = false;
+	for(auto bounded = boundedLoops.rbegin(); bounded != boundedLoops.rend(); ++bounded) {
+
+		llvm::Loop* loop = LI.getLoopFor(bounded->first);
+		if(!loop || loop->getHeader() != bounded->first || !boundLoop(*loop, bounded->second, DT, LI, SE)) continue;
+
+		DT.recalculate(Func);
+		LI.releaseMemory();
+		LI.analyze(DT);
+		SE.forgetAllLoops();
+		changed = true;
+	}
+
+	return changed;
+}
+
+// The loops unrollSecretLoops tries to unroll: those in a serialized region
+// or holding a serialized branch, outer loops first.
+static void getUnrollCandidates(const std::vector<llvm::Loop*>& allLoopsVector, const SecretRegions& regions, std::vector<llvm::Loop*>& candidates) {
+
+	for(auto loop : allLoopsVector) {
+		bool serialized = regions.getOwner(loop->getHeader()) != NULL;
+		for(auto bb : loop->blocks()) serialized |= regions.isSerialized(bb);
+		if(serialized) candidates.push_back(loop);
+	}
+}
+
+// Fully unrolls the small loops with a constant trip count that are in a
+// serialized region or hold a serialized branch, inner loops first, so that
+// an outer loop is measured with its inner loops unrolled. Returns true if
+// the IR changed, the LCSSA PHIs of a loop left rolled included: the taint
+// must be computed again.
+static bool unrollSecretLoops(Function &Func, const ResultSecret &inputsVector, llvm::DominatorTree& DT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, llvm::ScalarEvolution& SE, llvm::AssumptionCache& AC, const llvm::TargetTransformInfo& TTI) {
+
+	PhaseTimer timer("unroll-loops", "Unroll the small loops of the secret regions", Func);
+
+	std::vector<llvm::Loop*> allLoopsVector;
+	for(auto loop = LI.begin(); loop != LI.end(); ++loop)  getAllInnerLoops(*loop, allLoopsVector);
+
+	SecretRegions regions;
+	getSecretRegions(Func, inputsVector, allLoopsVector, RI, regions);
+
+	std::vector<llvm::Loop*> candidates;
+	getUnrollCandidates(allLoopsVector, regions, candidates);
+
+	// allLoopsVector has the outer loops first.
+	bool changed = false;
+	for(auto loop = candidates.rbegin(); loop != candidates.rend(); ++loop) changed |= unrollSmallLoop(**loop, DT, LI, SE, AC, TTI);
+	return changed;
+}
+
+// Estimates what the linearization costs Func, reports it, and returns false
+// if Func is above the slowdown budget and must be left as it is.
+static bool checkCost(Function &Func, const ResultSecret &inputsVector, llvm::PostDominatorTree& PDT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, const llvm::TargetTransformInfo& TTI, FunctionAnalysisManager &FAM) {
+
+	PhaseTimer timer("cost", "Estimate the linearization cost", Func);
+
+	auto& ORE = FAM.getResult<OptimizationRemarkEmitterAnalysis>(Func);
+	if(!isLinearizationCostNeeded(ORE)) return true;
+
+	std::vector<llvm::Loop*> allLoopsVector;
+	for(auto loop = LI.begin(); loop != LI.end(); ++loop)  getAllInnerLoops(*loop, allLoopsVector);
+
+	SecretRegions regions;
+	getSecretRegions(Func, inputsVector, allLoopsVector, RI, regions);
+
+	llvm::DenseMap<const llvm::Loop*, unsigned> paddedTrips;
+	getPaddedLoops(inputsVector, Func, allLoopsVector, paddedTrips);
+
+	auto& SE = FAM.getResult<ScalarEvolutionAnalysis>(Func);
+	std::vector<std::pair<llvm::BasicBlock*, unsigned>> boundedLoops;
+	getBoundedLoops(inputsVector, Func, allLoopsVector, regions, SE, boundedLoops);
+	for(auto& bounded : boundedLoops) paddedTrips[LI.getLoopFor(bounded.first)] = bounded.second;
+
+	// The cost is estimated before the loops are bounded and unrolled: the
+	// loops unrolled later run their constant trip count.
+	std::vector<llvm::Loop*> candidates;
+	getUnrollCandidates(allLoopsVector, regions, candidates);
+	llvm::DenseMap<const llvm::Loop*, unsigned> constantTrips;
+	for(auto loop : candidates) {
+		if(unsigned trips = SE.getSmallConstantTripCount(loop)) constantTrips[loop] = trips;
+	}
+
+	// The lookups and divisions are rewritten after linearization, on a
+	// taint that may differ: this one is close enough for an estimate.
+	auto rewriteCost = [&](llvm::Instruction& inst) -> double {
+		if(uint64_t lookup = getSecretLookupCost(inst, inputsVector, TTI)) return lookup;
+		return getSecretDivisionCost(inst, inputsVector, TTI);
+	};
+
+	LinearizationCost cost = estimateLinearizationCost(Func, [&](const llvm::BranchInst* br) { return regions.isSerialized(br->getParent()); },
+		constantTrips, paddedTrips, rewriteCost, FAM.getResult<BlockFrequencyAnalysis>(Func), LI, PDT, TTI);
+	return checkLinearizationCost(Func, cost, ORE);
+}
+
+// Returns true if a loop has been modified.
+static bool modifyNumCyclesLoops(const ResultSecret &inputsVector, Function &Func, std::vector<llvm::Loop*> allLoopsVector, const llvm::TargetTransformInfo& TTI) {
+
+	PhaseTimer timer("loops", "Rewrite the loops with a secret bound", Func);
+
+	bool changed = false;
+
+	BoundsMap annotatedBounds;
+	getAnnotatedBounds(Func, annotatedBounds);
 
   	for(auto loop : allLoopsVector) {
   
-  		std::vector<llvm::BranchInst*> InputBrs;
+		// A bounded loop already runs a fixed number of iterations.
+		if(getBoundedTripCount(*loop)) continue;
 
-  		llvm::SmallVector<llvm::BasicBlock*, 8> exitBlocks;
-  		loop->getExitBlocks(exitBlocks);
-  	
-		for(auto inst : inputsVector) {
-			
-			if(llvm::Instruction::classof(&*inst) && loop->contains(cast<Instruction>(&*inst)) && llvm::BranchInst::classof(&*inst)) {
-				
-				llvm::BranchInst* br = cast<BranchInst>(&*inst);
-				if(br->isConditional() 
-					&& (std::find(exitBlocks.begin(), exitBlocks.end(), br->getSuccessor(0)) == exitBlocks.end()
-						||  std::find(exitBlocks.begin(), exitBlocks.end(), br->getSuccessor(1)) == exitBlocks.end()))
-						{
-							InputBrs.push_back(br);
-						}
-			}
-		}
+  		// The terminators have been rebuilt by the serialization, so look for
+		// branches on a secret condition rather than for the old instructions.
+  		std::vector<llvm::BranchInst*> InputBrs;
+		getSecretBranches(loop, inputsVector, InputBrs);
   	
   		if(!InputBrs.empty()) {
 
-			std::vector<llvm::GetElementPtrInst*> arraysLoop;
+			std::vector<std::pair<llvm::GetElementPtrInst*, unsigned>> arraysLoop;
 
-			findArrays(loop, arraysLoop);
+			findArrays(loop, annotatedBounds, arraysLoop);
 
 			if(!arraysLoop.empty()) {
 				unsigned maxSize = minSizeArrays(arraysLoop);
@@ -225,13 +1285,25 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 				std::map<llvm::BasicBlock*,llvm::Value*> applyBranchInit;
 				std::map<llvm::BasicBlock*,llvm::Value*> applyBranchEnd;
 
-				for(auto array : arraysLoop) {
+				// A store may guard several branches: only its first predicate
+				// counts, as when the stores were rewritten one branch at a time.
+				llvm::MapVector<llvm::StoreInst*, llvm::Value*> predicatedStores;
+
+				for(auto& arrayBound : arraysLoop) {
+
+					llvm::GetElementPtrInst* array = arrayBound.first;
 
 					for(auto index = array->idx_begin(); index != array->idx_end(); ++index) {
 
-						if(isa<Constant>((*index).get())) continue;
-						std::vector<llvm::Value*> UsersVector;
-						getAllUsers((*index).get(), UsersVector);
+						// The bound only holds for the outermost variable index.
+						if(index->getOperandNo() != getOutermostIndex(array)) continue;
+
+						// Look through the extension of a narrower induction variable.
+						llvm::Value* indexValue = (*index).get();
+						while(llvm::CastInst::classof(indexValue)) indexValue = cast<CastInst>(indexValue)->getOperand(0);
+
+						UsersSet UsersVector;
+						getAllUsers(indexValue, UsersVector);
 
 						std::vector<llvm::Value*> tempApplyBranchLS;
 
@@ -239,7 +1311,7 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 
 							tempApplyBranchLS.clear();
 
-							if(std::find(UsersVector.begin(), UsersVector.end(), (*brB)->getCondition()) != UsersVector.end())  {
+							if(UsersVector.count((*brB)->getCondition()))  {
 							
 								//-----------------------------------------------------------------------------
 
@@ -262,8 +1334,7 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 								
 								for(unsigned  j = 0; j < cmp->getNumOperands(); j++) {
 							
-									if(std::find(UsersVector.begin(), UsersVector.end(), cmp->getOperand(j)) == UsersVector.end() 
-										&& std::find(inputsVector.begin(), inputsVector.end(), cmp->getOperand(j)) != inputsVector.end()) {
+									if(!UsersVector.count(cmp->getOperand(j)) && inputsVector.isSecret(cmp->getOperand(j))) {
 										
 										//--------------------------
 
@@ -273,30 +1344,31 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 											
 										if(llvm::ICmpInst::isGT(cast<ICmpInst>((*brB)->getCondition())->getPredicate())) {
 										
-											llvm::Value* vsize = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Func.getContext()), -1);
+											llvm::Value* vsize = llvm::ConstantInt::get(cmp->getOperand(j)->getType(), -1);
 											cmp->setOperand(j, vsize);
 										}
 										else if(llvm::ICmpInst::isGE(cast<ICmpInst>((*brB)->getCondition())->getPredicate())) {
 										
-											llvm::Value* vsize = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Func.getContext()), 0);
+											llvm::Value* vsize = llvm::ConstantInt::get(cmp->getOperand(j)->getType(), 0);
 											cmp->setOperand(j, vsize);
 										}
 										else if(llvm::ICmpInst::isLT(cast<ICmpInst>((*brB)->getCondition())->getPredicate())) {
 											
-											llvm::Value* vsize = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Func.getContext()), maxSize - 1);
+											llvm::Value* vsize = llvm::ConstantInt::get(cmp->getOperand(j)->getType(), maxSize - 1);
 											cmp->setOperand(j, vsize);
 										}
 										else {
 											
-											llvm::Value* vsize = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Func.getContext()), maxSize);
+											llvm::Value* vsize = llvm::ConstantInt::get(cmp->getOperand(j)->getType(), maxSize);
 											cmp->setOperand(j, vsize);
 										}
+										changed = true;
 									}
 								}
 								
 								std::vector<llvm::Value*> UsesVector;
 								
-								for(auto uses = (*index).get()->use_begin(); uses != (*index).get()->use_end(); ++uses)
+								for(auto uses = indexValue->use_begin(); uses != indexValue->use_end(); ++uses)
 										UsesVector.push_back((*uses).get());
 
 								llvm::PHINode* phi = getPhiIndex(UsesVector, loop, inputsVector);
@@ -304,8 +1376,7 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 								if(phi != NULL) {
 									for(unsigned j = 0; j < phi->getNumIncomingValues(); j++) {
 										if(phi->getIncomingBlock(j) == loop->getLoopPreheader()) {
-											if(std::find(inputsVector.begin(), inputsVector.end(), phi->getIncomingValue(j)) 
-												!= inputsVector.end()) {
+											if(inputsVector.isSecret(phi->getIncomingValue(j))) {
 												
 												
 												//--------------------------------------------------------
@@ -319,13 +1390,14 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 												if(llvm::ICmpInst::isGT(cast<ICmpInst>((*brB)->getCondition())->getPredicate()) 
 													|| llvm::ICmpInst::isGE(cast<ICmpInst>((*brB)->getCondition())->getPredicate())) {
 												
-													llvm::Value* vsize = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Func.getContext()), maxSize - 1);
+													llvm::Value* vsize = llvm::ConstantInt::get(phi->getType(), maxSize - 1);
 													phi->setIncomingValue(j, vsize);
 												}
 												else {
-													llvm::Value* vsize = llvm::ConstantInt::get(llvm::Type::getInt64Ty(Func.getContext()), 0);
+													llvm::Value* vsize = llvm::ConstantInt::get(phi->getType(), 0);
 													phi->setIncomingValue(j, vsize);
 												}
+												changed = true;
 											}
 										}
 									}
@@ -339,6 +1411,8 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 
 				for(auto pair = applyBranchLS.begin(); pair != applyBranchLS.end(); ++pair) {
 
+					changed = true;
+
 					llvm::BranchInst* br = cast<BranchInst>(pair->first->getTerminator());
 					llvm::Instruction* condbr = cast<Instruction>(br->getCondition());
 
@@ -389,15 +1463,10 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 
 					for(auto inst : pair->second) {
 						if(llvm::StoreInst::classof(inst)) {
-							llvm::StoreInst* store = cast<StoreInst>(inst); 
-							builder.SetInsertPoint(store);
-							llvm::LoadInst* load = builder.CreateAlignedLoad(store->getValueOperand()->getType(), store->getPointerOperand(), store->getAlign(), store->isVolatile());
-							llvm::Value* sel = builder.CreateSelect(finalCmp, store->getValueOperand(), load);
-							builder.CreateAlignedStore(sel, store->getPointerOperand(), store->getAlign(), store->isVolatile());
-							store->eraseFromParent();
+							predicatedStores.insert(std::make_pair(cast<StoreInst>(inst), finalCmp));
 						}
 						else {
-							std::vector<llvm::Value*> loadUsers;
+							UsersSet loadUsers;
 							getAllUsers(inst, loadUsers);
 
 							builder.SetInsertPoint(condbr);
@@ -408,9 +1477,13 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 								if(llvm::PHINode::classof(temp) && (*loop).contains(cast<Instruction>(temp))) {
 									llvm::PHINode* phi = cast<PHINode>(temp);
 									for(unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
-										if(std::find(loadUsers.begin(), loadUsers.end(), phi->getIncomingValue(i)) != loadUsers.end()) {
+										if(loadUsers.count(phi->getIncomingValue(i))) {
+											// A reduction keeps its operation on the PHI, with the
+											// operand selected instead.
 											llvm::Value* sel = builder.CreateSelect(finalCmp, phi->getIncomingValue(i), phi);
-											phiToModify.insert(std::make_pair(phi->getIncomingValue(i), sel));
+											++NumSelects;
+											if(llvm::SelectInst::classof(sel)) sel = foldPredicatedUpdate(cast<SelectInst>(sel), /*MaskPHIUsers=*/true);
+											if(sel != phi->getIncomingValue(i)) phiToModify.insert(std::make_pair(phi->getIncomingValue(i), sel));
 											break;
 										}
 									}
@@ -418,7 +1491,7 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 							}
 
 							for(auto tofix = phiToModify.begin(); tofix != phiToModify.end(); ++tofix) {
-								std::vector<llvm::Value*> tofixUsers;
+								UsersSet tofixUsers;
 								getAllUsers(tofix->first, tofixUsers);
 								for(auto t : tofixUsers) {
 									if(llvm::PHINode::classof(t) && t != tofix->second) {
@@ -440,289 +1513,568 @@ static void modifyNumCyclesLoops(const ResultSecret &InputVector, Function &Func
 						}
 					}
 				}
+
+				std::vector<PredicatedStore> stores;
+				for(auto& entry : predicatedStores)
+					if(entry.second) stores.push_back(PredicatedStore{entry.first, entry.second});
+				NumPredicatedStores += stores.size();
+				lowerPredicatedStores(stores, *loop, TTI);
 			}
 		}
   	}
+
+	return changed;
 }
 
-static void recursiveSerialization(llvm::BasicBlock* bb, std::map<llvm::BasicBlock*, newBranch>& serializedCode, std::vector<llvm::BranchInst*>& condBranch, std::vector<llvm::Loop*>& allLoopsVector, llvm::PostDominatorTree& PDT)
-{
-	llvm::Instruction* bbTerminator = bb->getTerminator();
-	if(serializedCode.find(bb) != serializedCode.end() || llvm::ReturnInst::classof(bbTerminator))
-	{
-		if(!condBranch.empty())
-		{
-			do {
-				llvm::BranchInst* lastBranch = condBranch.back();
-				llvm::DomTreeNodeBase<llvm::BasicBlock>* node = PDT.getNode(lastBranch->getParent());
-
-				if (node) {
-					llvm::DomTreeNodeBase<llvm::BasicBlock>* IPDNode = node->getIDom();
-					
-					if (IPDNode) {
+// The serialized regions: walks the region tree top-down, and serializes a
+// region if it holds a branch on a secret among its own blocks, or if the
+// region around it is serialized. The regions without a secret condition
+// outside of those are skipped as a whole.
+static void getSecretRegions(Function &Func, const ResultSecret &inputsVector, const std::vector<llvm::Loop*>& allLoopsVector, llvm::RegionInfo& RI, SecretRegions& regions) {
+
+	llvm::SmallPtrSet<llvm::BasicBlock*, 8> latches;
+	for(auto loop : allLoopsVector) latches.insert(loop->getLoopLatch());
+
+	llvm::SmallPtrSet<llvm::Region*, 8> secretRegions;
+	for(auto& bb : Func) {
+		llvm::BranchInst* br = dyn_cast<BranchInst>(bb.getTerminator());
+		if(!br || !br->isConditional() || latches.count(&bb)) continue;
+		if(!LinearizePublic && !inputsVector.isSecret(br->getCondition())) continue;
+		if(llvm::Region* region = RI.getRegionFor(&bb)) secretRegions.insert(region);
+	}
+	if(secretRegions.empty()) return;
+
+	llvm::SmallPtrSet<llvm::Region*, 8> serializedRegions;
+	llvm::SmallVector<llvm::Region*, 16> worklist(1, RI.getTopLevelRegion());
+	while(!worklist.empty()) {
+		llvm::Region* region = worklist.pop_back_val();
+		for(auto& child : *region) worklist.push_back(child.get());
+
+		bool nested = region->getParent() && serializedRegions.count(region->getParent());
+		if(!nested && !secretRegions.count(region)) continue;
+		serializedRegions.insert(region);
+		regions.regions.push_back(region);
+		if(nested) continue;
+
+		for(auto bb : region->blocks()) {
+			regions.owners[bb] = region->getEntry();
+			llvm::BranchInst* br = dyn_cast<BranchInst>(bb->getTerminator());
+			if(br && br->isConditional() && !latches.count(bb)) regions.serialized.insert(bb);
+		}
+	}
+}
 
-						llvm::BasicBlock* postDom = IPDNode->getBlock();
-						if(serializedCode.find(postDom) != serializedCode.end() || llvm::ReturnInst::classof(postDom->getTerminator())) {
+// The switches ct-linearize lowers: those on a secret, and those in a
+// serialized region. The others, e.g. a dispatch on a public mode, keep their
+// jump tables.
+static void getSecretSwitches(Function &Func, const ResultSecret &inputsVector, llvm::RegionInfo& RI, llvm::LoopInfo& LI, std::vector<llvm::SwitchInst*>& switches) {
 
-							if(lastBranch->getSuccessor(0) != postDom) {
-								for(auto pair = serializedCode.begin(); pair != serializedCode.end(); ++pair) {
-									if(pair->second.then == postDom)
-									{
-										newBranch newbr;
-											newbr.cond = NULL ;
-											newbr.then = lastBranch->getSuccessor(0);
-											newbr.els = NULL;
-										pair->second = newbr;
-										break;
-									}
-								}
+	std::vector<llvm::Loop*> allLoopsVector;
+	for(auto loop = LI.begin(); loop != LI.end(); ++loop)  getAllInnerLoops(*loop, allLoopsVector);
 
-								condBranch.pop_back();
-								recursiveSerialization(lastBranch->getSuccessor(0), serializedCode, condBranch, allLoopsVector, PDT);
-								break;
-							}
-							else condBranch.pop_back();
-						}
-						else if(serializedCode.find(postDom) == serializedCode.end()) {
-							bool find = false;
-
-							auto cur = serializedCode.find(lastBranch->getParent());
-							do {
-								for(auto p = serializedCode.begin(); p != serializedCode.end(); ++p) {
-									if(p->first != cur->first && p->second.then == cur->second.then) {
-										find = true;
-										break;
-									}
-								}
+	SecretRegions regions;
+	getSecretRegions(Func, inputsVector, allLoopsVector, RI, regions);
 
-								if(!find) cur = serializedCode.find(cur->second.then);
-								
-							} while(!find);
+	for(auto& bb : Func) {
+		llvm::SwitchInst* sw = dyn_cast<SwitchInst>(bb.getTerminator());
+		if(!sw) continue;
+		if(LinearizePublic || inputsVector.isSecret(sw->getCondition()) || regions.getOwner(&bb)) switches.push_back(sw);
+	}
+}
 
-							if(find) {
-								newBranch newbr;
-									newbr.cond =  lastBranch->getCondition();
-									newbr.then = lastBranch->getSuccessor(0);
-									newbr.els = cur->second.then;
-							
-								cur->second = newbr;
+// Returns true if all the blocks of loop are in region. A loop whose header is
+// in the region and which is not inside it leaves through its exit.
+static bool regionContainsLoop(llvm::Region* region, llvm::Loop* loop) {
+	return region->contains(loop->getHeader()) && !(region->getExit() && loop->contains(region->getExit()));
+}
 
-								condBranch.pop_back();
-								recursiveSerialization(lastBranch->getSuccessor(0), serializedCode, condBranch, allLoopsVector, PDT);
-								break;
-							}
-							else condBranch.pop_back();
-						}
-					}
-				}
-			} while(!condBranch.empty());
+// A node of the plan of a serialized region or loop: one of its own blocks,
+// or a region or a loop nested in it, planned before and run as a whole.
+struct PlanNode {
+	llvm::BasicBlock* entry;
+	llvm::Region* region;
+	llvm::Loop* loop;
+};
+
+// An element of a region: one of its own blocks, or a region nested in it.
+using RegionElement = std::pair<llvm::BasicBlock*, llvm::Region*>;
+
+// Plans the new branch of every block of the serialized regions, bottom-up
+// over the region tree. The nodes of a region are put in a topological order
+// and each one jumps to the next, the last one to the exit of the region:
+// the region becomes a single path, which its parent plans as one of its
+// nodes. A loop at the level of a region is one node too, planned the same
+// way from its header to its latch, which keeps its branch. The blocks of
+// each planned region and loop whose new branch leaves it are kept, so that
+// its parent only redirects those.
+struct RegionSerializer {
+	llvm::RegionInfo& RI;
+	llvm::LoopInfo& LI;
+	SerializedCFG& serializedCode;
+	llvm::DenseMap<llvm::BasicBlock*, llvm::Loop*> latches;
+	llvm::DenseMap<llvm::Region*, llvm::SmallVector<llvm::BasicBlock*, 2>> regionExits;
+	llvm::DenseMap<llvm::Loop*, llvm::SmallVector<llvm::BasicBlock*, 2>> loopExits;
+
+	RegionSerializer(llvm::RegionInfo& RI, llvm::LoopInfo& LI, SerializedCFG& serializedCode, const std::vector<llvm::Loop*>& allLoopsVector)
+		: RI(RI), LI(LI), serializedCode(serializedCode) {
+		for(auto loop : allLoopsVector) latches.insert(std::make_pair(loop->getLoopLatch(), loop));
+	}
+
+	// The node holding bb among those of region, or of loop if it is not
+	// NULL. A region and a loop nested in region hold one another or do not
+	// overlap: the outer one is the node.
+	PlanNode getNode(llvm::BasicBlock* bb, llvm::Region* region, llvm::Loop* loop) {
+
+		llvm::Loop* inner = NULL;
+		for(llvm::Loop* item = LI.getLoopFor(bb); item && item != loop && regionContainsLoop(region, item); item = item->getParentLoop()) inner = item;
+
+		llvm::Region* child = RI.getRegionFor(bb);
+		while(child && child != region && child->getParent() != region) child = child->getParent();
+		if(child == region) child = NULL;
+
+		if(child && (!inner || regionContainsLoop(child, inner))) return PlanNode{child->getEntry(), child, NULL};
+		if(inner) return PlanNode{inner->getHeader(), NULL, inner};
+		return PlanNode{bb, NULL, NULL};
+	}
+
+	// Makes the new branch of bb jump to next where it left node.
+	void redirect(llvm::BasicBlock* bb, const PlanNode& node, llvm::BasicBlock* next) {
+		newBranch br = serializedCode.get(bb);
+		auto leaves = [&](llvm::BasicBlock* target) {
+			return target != NULL && (node.region ? target == node.region->getExit() : !node.loop->contains(target));
+		};
+		if(leaves(br.then)) br.then = next;
+		if(leaves(br.els)) br.els = next;
+		serializedCode.set(bb, br);
+	}
+
+	void serialize(llvm::Region* region, llvm::Loop* loop, llvm::ArrayRef<RegionElement> elements);
+};
+
+// Plans region, or loop inside region if it is not NULL, from the elements of
+// region it holds.
+void RegionSerializer::serialize(llvm::Region* region, llvm::Loop* loop, llvm::ArrayRef<RegionElement> elements) {
+
+	llvm::BasicBlock* entry = loop ? loop->getHeader() : region->getEntry();
+	llvm::BasicBlock* exit = loop ? NULL : region->getExit();
+	auto contains = [&](llvm::BasicBlock* bb) { return loop ? loop->contains(bb) : region->contains(bb); };
+
+	// The nodes and the edges between them, back edges aside. A node ending
+	// with a latch is followed by the node holding the exit of its loop: the
+	// PHIs there stay, with the latch as incoming block.
+	llvm::MapVector<llvm::BasicBlock*, PlanNode> nodes;
+	llvm::DenseMap<llvm::BasicBlock*, llvm::SmallSetVector<llvm::BasicBlock*, 2>> succs;
+	llvm::DenseMap<llvm::BasicBlock*, unsigned> numPreds;
+	llvm::DenseMap<llvm::BasicBlock*, llvm::BasicBlock*> follow;
+	llvm::DenseMap<llvm::Loop*, llvm::SmallVector<RegionElement, 4>> loopElements;
+
+	for(auto& element : elements) {
+		PlanNode node = getNode(element.first, region, loop);
+		nodes.insert(std::make_pair(node.entry, node));
+		if(node.loop) loopElements[node.loop].push_back(element);
+
+		llvm::SmallVector<llvm::BasicBlock*, 2> targets;
+		bool latch = false;
+		if(element.second) {
+			if(element.second->getExit()) targets.push_back(element.second->getExit());
+			for(auto bb : regionExits[element.second]) latch |= latches.count(bb) != 0;
+		}
+		else {
+			targets.append(llvm::succ_begin(element.first), llvm::succ_end(element.first));
+			latch = latches.count(element.first);
+		}
+
+		for(auto succ : targets) {
+			if(loop && !contains(succ) && element.first != loop->getLoopLatch())
+				llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot serialize the loop of '") + entry->getName() + "', it leaves at '" + element.first->getName() + "' instead of its latch");
+			if(!contains(succ) || (loop && succ == entry)) continue;
+			llvm::BasicBlock* target = getNode(succ, region, loop).entry;
+			if(target == node.entry) continue;
+			if(succs[node.entry].insert(target)) numPreds[target]++;
+			if(latch) follow[node.entry] = target;
 		}
 	}
-	else 
-	{
-		if(llvm::BranchInst::classof(bbTerminator))
-		{
-			llvm::BranchInst* brTerminator = llvm::cast<BranchInst>(bbTerminator);
-			if(brTerminator->isConditional())
-			{
-				llvm::Loop* bbLoop = NULL;
-				for(auto loop : allLoopsVector)
-				{
-					llvm::BasicBlock* latchBlock = loop->getLoopLatch();
-
-					if (latchBlock == bb) {
-						bbLoop = loop;
-						break;
-					}
-				}
 
-				if(bbLoop != NULL)
-				{
-					newBranch newbr;
-						newbr.cond =  brTerminator->getCondition();
-						newbr.then = brTerminator->getSuccessor(0);
-						newbr.els = brTerminator->getSuccessor(1);
-					serializedCode.insert(std::make_pair(bb, newbr));
-					if(brTerminator->getSuccessor(0) == bbLoop->getHeader()) recursiveSerialization(brTerminator->getSuccessor(1), serializedCode, condBranch, allLoopsVector, PDT);
-					else recursiveSerialization(brTerminator->getSuccessor(0), serializedCode, condBranch, allLoopsVector, PDT);
-				}
-				else
-				{
-					condBranch.push_back(brTerminator);
-					newBranch newbr;
-						newbr.cond = NULL;
-						newbr.then = brTerminator->getSuccessor(1);
-						newbr.els = NULL;
-					serializedCode.insert(std::make_pair(bb, newbr));
-					recursiveSerialization(brTerminator->getSuccessor(1), serializedCode, condBranch, allLoopsVector, PDT);
-				}
+	// Each node is taken once all the nodes jumping to it are, the last one
+	// ready first: the else side of a branch runs before its then side.
+	llvm::SmallVector<llvm::BasicBlock*, 16> order;
+	llvm::SmallVector<llvm::BasicBlock*, 16> ready(1, entry);
+	while(!ready.empty()) {
+		llvm::BasicBlock* item = ready.pop_back_val();
+		order.push_back(item);
+		llvm::BasicBlock* after = follow.lookup(item);
+		for(auto succ : succs[item]) {
+			if(succ != after && --numPreds[succ] == 0) ready.push_back(succ);
+		}
+		if(after && --numPreds[after] == 0) ready.push_back(after);
+	}
+	if(order.size() != nodes.size())
+		llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot order the blocks of the region of '") + entry->getName() + "', expecting a reducible CFG");
+
+	// Nothing jumps from the latch to another node of its loop: it can go last.
+	if(loop) {
+		auto latch = std::find(order.begin(), order.end(), loop->getLoopLatch());
+		if(latch == order.end())
+			llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot serialize the loop of '") + entry->getName() + "', its latch is in a nested region");
+		std::rotate(latch, latch + 1, order.end());
+	}
 
-			}
-			else
-			{
-				newBranch newbr;
-						newbr.cond = NULL;
-						newbr.then = brTerminator->getSuccessor(0);
-						newbr.els = NULL;
-				serializedCode.insert(std::make_pair(bb, newbr));
-				recursiveSerialization(brTerminator->getSuccessor(0), serializedCode, condBranch, allLoopsVector, PDT);
-			}
+	llvm::SmallVector<llvm::BasicBlock*, 2> exits;
+	for(unsigned i = 0; i < order.size(); i++) {
+		const PlanNode& node = nodes.find(order[i])->second;
+		llvm::BasicBlock* next = i + 1 < order.size() ? order[i + 1] : exit;
+		bool last = i + 1 == order.size();
+
+		llvm::BasicBlock* after = follow.lookup(order[i]);
+		if(after && after != next)
+			llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot serialize the region of '") + entry->getName() + "', the exit of the loop ending at '" + order[i]->getName() + "' does not come next");
+
+		if(node.region || node.loop) {
+			if(node.loop) serialize(region, node.loop, loopElements[node.loop]);
+			auto& nodeExits = node.region ? regionExits[node.region] : loopExits[node.loop];
+			for(auto bb : nodeExits) redirect(bb, node, next);
+			if(last) exits.append(nodeExits.begin(), nodeExits.end());
+			continue;
+		}
+
+		llvm::BranchInst* br = dyn_cast<BranchInst>(node.entry->getTerminator());
+		if(loop && last) {
+			// The latch: the region around the loop plans its exit.
+			serializedCode.set(node.entry, br->isConditional() ? newBranch{br->getCondition(), br->getSuccessor(0), br->getSuccessor(1)} : newBranch{NULL, br->getSuccessor(0), NULL});
+			exits.push_back(node.entry);
+		}
+		else if(br && next != NULL && !(br->isConditional() && latches.count(node.entry))) {
+			serializedCode.set(node.entry, newBranch{NULL, next, NULL});
+			if(last) exits.push_back(node.entry);
 		}
+		else if(br || next != NULL)
+			llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot serialize '") + node.entry->getName() + "' in the region of '" + entry->getName() + "', expecting a single exit block: use mergereturn!");
 	}
+
+	if(loop) loopExits[loop] = exits;
+	else regionExits[region] = exits;
 }
 
-static void generateSelect(std::map<std::vector<llvm::BasicBlock*>, llvm::BasicBlock*>& commonDomMap, std::vector<llvm::SelectInst*>& selects, std::map<std::vector<llvm::BasicBlock*>, std::vector<llvm::Value*>>& pairsValue, llvm::DominatorTree& DT) {
+// Plans the new branch of every block of the serialized regions, the nested
+// ones first. Each block and each region is visited as an element of the
+// region directly holding it, once more for each loop around it there.
+static void serializeRegions(SerializedCFG& serializedCode, const SecretRegions& regions, const std::vector<llvm::Loop*>& allLoopsVector, llvm::RegionInfo& RI, llvm::LoopInfo& LI) {
 
-	std::map<llvm::BasicBlock*, llvm::SelectInst*> selectBasicBlock;
+	RegionSerializer serializer(RI, LI, serializedCode, allLoopsVector);
+	for(auto region = regions.regions.rbegin(); region != regions.regions.rend(); ++region) {
 
-	
-	while(!commonDomMap.empty())
-	{
-		auto temp = commonDomMap.begin();
+		llvm::SmallVector<RegionElement, 16> elements;
+		for(auto element : (*region)->elements()) {
+			if(element->isSubRegion()) elements.push_back(std::make_pair(element->getEntry(), element->getNodeAs<llvm::Region>()));
+			else elements.push_back(std::make_pair(element->getEntry(), (llvm::Region*)NULL));
+		}
+		serializer.serialize(*region, NULL, elements);
+	}
+}
 
-		for(auto pair = commonDomMap.begin(); pair != commonDomMap.end(); ++pair) {
-			llvm::DomTreeNodeBase<llvm::BasicBlock>* node1 = DT.getNode(temp->second);
-			llvm::DomTreeNodeBase<llvm::BasicBlock>* node2 = DT.getNode(pair->second);
+// Dominance queries through the DFS numbering of the dominator tree, and
+// nearest common dominators remembered across queries. Computed once per
+// function and shared by all its PHIs.
+struct DominanceCache {
+	llvm::DominatorTree& DT;
+	llvm::DenseMap<std::pair<llvm::BasicBlock*, llvm::BasicBlock*>, llvm::BasicBlock*> commonDominators;
 
-			if(node1 && node2){
-				if(DT.dominates(node1, node2)) temp = pair;
-			}
-		}
+	explicit DominanceCache(llvm::DominatorTree& DT) : DT(DT) { DT.updateDFSNumbers(); }
 
-		llvm::BranchInst* br = cast<BranchInst>(temp->second->getTerminator());
-		auto values = pairsValue.find(temp->first);
-		
-		llvm::SelectInst* sel;
-		if(selectBasicBlock.find(temp->first[0]) == selectBasicBlock.end())
-		{
-			if(selectBasicBlock.find(temp->first[1]) == selectBasicBlock.end())
-			{
+	bool isReachable(llvm::BasicBlock* bb) const { return DT.getNode(bb) != NULL; }
+	unsigned order(llvm::BasicBlock* bb) const { return DT.getNode(bb)->getDFSNumIn(); }
 
-				sel = llvm::SelectInst::Create(br->getCondition(), values->second[0], values->second[1]);
-				selects.push_back(sel);
-			}
-			else
-			{
-				auto v1 = selectBasicBlock.find(temp->first[1]);
-				sel = llvm::SelectInst::Create(br->getCondition(), values->second[0], v1->second);
-				selects.push_back(sel);
-				selectBasicBlock.erase(temp->first[1]);
-			}
-			selectBasicBlock.insert(std::make_pair(temp->first[0], sel));
-			selectBasicBlock.insert(std::make_pair(temp->first[1], sel));
-		
-		}
-		else
-		{
-			if(selectBasicBlock.find(temp->first[1]) == selectBasicBlock.end())
-			{
-				auto v0 = selectBasicBlock.find(temp->first[0]);
-				sel = llvm::SelectInst::Create(br->getCondition(), v0->second, values->second[1]);
-				selects.push_back(sel);
-				selectBasicBlock.erase(temp->first[0]);
-			
-			}
-			else
-			{
-				auto v0 = selectBasicBlock.find(temp->first[0]);
-				auto v1 = selectBasicBlock.find(temp->first[1]);
-				sel = llvm::SelectInst::Create(br->getCondition(), v0->second, v1->second);
-				selects.push_back(sel);
-				selectBasicBlock.erase(temp->first[0]);
-				selectBasicBlock.erase(temp->first[1]);
-			}
-			selectBasicBlock.insert(std::make_pair(temp->first[0], sel));
-			selectBasicBlock.insert(std::make_pair(temp->first[1], sel));
+	bool dominates(llvm::BasicBlock* a, llvm::BasicBlock* b) const {
+		auto nodeA = DT.getNode(a);
+		auto nodeB = DT.getNode(b);
+		return nodeA->getDFSNumIn() <= nodeB->getDFSNumIn() && nodeB->getDFSNumOut() <= nodeA->getDFSNumOut();
+	}
+
+	llvm::BasicBlock* commonDominator(llvm::BasicBlock* a, llvm::BasicBlock* b) {
+		if(b < a) std::swap(a, b);
+		auto it = commonDominators.find(std::make_pair(a, b));
+		if(it != commonDominators.end()) return it->second;
+		return commonDominators[std::make_pair(a, b)] = DT.findNearestCommonDominator(a, b);
+	}
+};
+
+// Returns 0 if the value coming from item flows into the PHI block when the
+// branch of node is taken, 1 if it flows there when the branch is not taken,
+// -1 if the CFG does not tell.
+static int getBranchSide(llvm::BasicBlock* item, llvm::BasicBlock* node, llvm::BranchInst* br, llvm::BasicBlock* phiBlock, DominanceCache& DC) {
+
+	for(unsigned side = 0; side < 2; side++) {
+		llvm::BasicBlock* succ = br->getSuccessor(side);
+		if(succ == br->getSuccessor(1 - side)) return -1;
+
+		// The incoming block is the branch itself, through the edge to the PHI.
+		if(item == node && succ == phiBlock) return side;
+		if(item != node && succ != phiBlock && DC.dominates(succ, item)) return side;
+	}
+	return -1;
+}
+
+using IncomingValues = llvm::SmallVector<std::pair<llvm::BasicBlock*, llvm::Value*>, 4>;
+
+// Merges the incoming values of phi from the given blocks with a tree of
+// selects, one for each branch deciding which of them reaches it. The
+// incoming blocks and their nearest common dominators form a virtual
+// dominator tree, built from the blocks sorted in DFS order and the common
+// dominators of neighbours only. Each node of the tree merges the values of
+// its children with the condition of its branch.
+static llvm::Value* buildSelectTree(llvm::PHINode* phi, const IncomingValues& values, DominanceCache& DC, ResultSecret& inputsVector, IRBuilder<>& builder) {
+
+	llvm::SmallVector<llvm::BasicBlock*, 8> nodes;
+	llvm::SmallDenseMap<llvm::BasicBlock*, llvm::Value*, 8> incoming;
+
+	for(auto& value : values) {
+		if(DC.isReachable(value.first) && incoming.insert(value).second) nodes.push_back(value.first);
+	}
+	if(nodes.empty()) return llvm::UndefValue::get(phi->getType());
+
+	auto byOrder = [&](llvm::BasicBlock* a, llvm::BasicBlock* b) { return DC.order(a) < DC.order(b); };
+	std::sort(nodes.begin(), nodes.end(), byOrder);
+
+	unsigned numBlocks = nodes.size();
+	for(unsigned i = 0; i + 1 < numBlocks; i++) nodes.push_back(DC.commonDominator(nodes[i], nodes[i + 1]));
+	std::sort(nodes.begin(), nodes.end(), byOrder);
+	nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+
+	// In DFS order the parent of a node is the closest node on the stack
+	// that dominates it.
+	llvm::SmallDenseMap<llvm::BasicBlock*, llvm::SmallVector<llvm::BasicBlock*, 2>, 8> children;
+	llvm::SmallVector<llvm::BasicBlock*, 8> stack;
+	for(auto node : nodes) {
+		while(!stack.empty() && !DC.dominates(stack.back(), node)) stack.pop_back();
+		if(!stack.empty()) children[stack.back()].push_back(node);
+		stack.push_back(node);
+	}
+
+	// Children come after their parent in DFS order: merge bottom-up.
+	llvm::SmallDenseMap<llvm::BasicBlock*, llvm::Value*, 8> merged;
+	for(auto node = nodes.rbegin(); node != nodes.rend(); ++node) {
+
+		llvm::SmallVector<std::pair<llvm::BasicBlock*, llvm::Value*>, 4> items;
+		auto value = incoming.find(*node);
+		if(value != incoming.end()) items.push_back(*value);
+		for(auto child : children[*node]) items.push_back(std::make_pair(child, merged[child]));
+
+		if(items.size() == 1) {
+			merged[*node] = items.front().second;
+			continue;
 		}
 
-		std::vector<std::vector<llvm::BasicBlock*>> pairToErase;
-		for(auto pair = commonDomMap.begin(); pair != commonDomMap.end(); ++pair) {
-			if(temp->second == pair->second) pairToErase.push_back(pair->first);
+		llvm::BranchInst* br = dyn_cast<BranchInst>((*node)->getTerminator());
+		if(!br || !br->isConditional())
+			llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot merge the values of a PHI at '") + (*node)->getName() + "', expecting a conditional branch: use lowerswitch!");
+
+		llvm::Value* values[2] = {NULL, NULL};
+		bool ambiguous = false;
+		for(auto& item : items) {
+			int side = getBranchSide(item.first, *node, br, phi->getParent(), DC);
+			if(side < 0 || values[side] != NULL) ambiguous = true;
+			else values[side] = item.second;
 		}
 
-		for(auto first : pairToErase)
-			commonDomMap.erase(first);
+		// Selecting on the condition of the branch is only right when each
+		// value comes from its own side of it.
+		if(ambiguous || !values[0] || !values[1])
+			llvm::report_fatal_error(llvm::Twine("ct-linearize: cannot merge the values of a PHI at '") + (*node)->getName() + "', reached from both sides of its branch");
+
+		llvm::Value* sel = builder.CreateSelect(br->getCondition(), values[0], values[1]);
+		NumSelects++;
+
+		if(llvm::SelectInst::classof(sel) && (inputsVector.isSecret(phi) || inputsVector.isSecret(br->getCondition()))) inputsVector.insert(sel);
+		merged[*node] = sel;
 	}
+
+	return merged[nodes.front()];
 }
 
-static void modifyPhis(std::vector<llvm::PHINode*> phis, Function &Func, llvm::DominatorTree& DT) {
+// Replaces the PHIs merging values from serialized regions. A PHI only
+// reached from one region becomes a tree of selects. A PHI also reached by
+// public paths stays: the values from each region are merged with selects
+// at the end of the region, which becomes their incoming block. Returns true
+// if a PHI has been modified.
+static bool modifyPhis(std::vector<llvm::PHINode*> phis, Function &Func, llvm::DominatorTree& DT, ResultSecret& inputsVector, const SecretRegions& regions, const SerializedCFG& serializedCode) {
 
 	IRBuilder<> builder (Func.getContext());
+	DominanceCache DC(DT);
+	bool changed = false;
 
-	std::map<std::vector<llvm::BasicBlock*>, llvm::BasicBlock*> commonDomMap;
-	std::map<std::vector<llvm::BasicBlock*>, std::vector<llvm::Value*>> pairsValue;
-	std::vector<llvm::SelectInst*> selects;
 	for(auto phi : phis) {
 
-		commonDomMap.clear();
-		selects.clear();
-		pairsValue.clear();
-		unsigned numBlocks = phi->getNumIncomingValues();
-		for(unsigned i = 0; i < numBlocks - 1; i ++) {
-			for(unsigned j = i + 1; j < numBlocks; j++) {
-
-				llvm::BasicBlock* commonDominatorNode = DT.findNearestCommonDominator(phi->getIncomingBlock(i), phi->getIncomingBlock(j));
-				
-				if (commonDominatorNode) {
-					std::vector<llvm::BasicBlock*> temp;
-					temp.push_back(phi->getIncomingBlock(i));
-					temp.push_back(phi->getIncomingBlock(j));
-					std::vector<llvm::Value*> values;
-					values.push_back(phi->getIncomingValue(i));
-					values.push_back(phi->getIncomingValue(j));
-					commonDomMap.insert(std::make_pair(temp, commonDominatorNode));
-					pairsValue.insert(std::make_pair(temp, values));
-				}
-			}
+		llvm::MapVector<llvm::BasicBlock*, IncomingValues> groups;
+		bool publicPaths = false;
+		for(unsigned i = 0; i < phi->getNumIncomingValues(); i++) {
+			llvm::BasicBlock* owner = regions.getOwner(phi->getIncomingBlock(i));
+			if(owner) groups[owner].push_back(std::make_pair(phi->getIncomingBlock(i), phi->getIncomingValue(i)));
+			else publicPaths = true;
 		}
+		if(groups.empty()) continue;
+		changed = true;
 
-		generateSelect(commonDomMap, selects,pairsValue, DT);
+		if(!publicPaths && groups.size() == 1) {
+			// After the other PHIs of the block, which are replaced later.
+			builder.SetInsertPoint(phi->getParent()->getFirstNonPHI());
 
-		builder.SetInsertPoint(phi);
-		for(auto sel : selects)
-			builder.Insert(sel);
-		
-		phi->replaceAllUsesWith(selects.back());
-		phi->eraseFromParent();
+			phi->replaceAllUsesWith(buildSelectTree(phi, groups.front().second, DC, inputsVector, builder));
+			phi->eraseFromParent();
+			continue;
+		}
+
+		for(auto& group : groups) {
+			llvm::BasicBlock* owner = group.first;
+			llvm::BasicBlock* end = serializedCode.firstJumpTo(phi->getParent(), [&](llvm::BasicBlock* item) { return regions.getOwner(item) == owner; });
+			if(!end)
+				llvm::report_fatal_error(llvm::Twine("ct-linearize: no path from the region of '") + owner->getName() + "' to '" + phi->getParent()->getName() + "'");
+
+			builder.SetInsertPoint(end->getTerminator());
+			llvm::Value* merged = buildSelectTree(phi, group.second, DC, inputsVector, builder);
+
+			for(auto& item : group.second) {
+				int index = phi->getBasicBlockIndex(item.first);
+				if(index >= 0) phi->removeIncomingValue(index, false);
+			}
+			phi->addIncoming(merged, end);
+		}
 	}
 
+	return changed;
 }
 
-static void printInputsVectorResult(raw_ostream &OutS,
-                                     const ResultSecret &InputVector, Function &Func) {
+// The condition under which each block ran before the serialization, NULL
+// standing for true: the predicate of the function in a masked clone, and
+// inside a serialized region the conditions of the paths from its entry
+// (or from the preheader for a loop header). The exit of a region nested in
+// it takes the predicate of the entry of that region, so that the predicates
+// are composed region by region instead of path by path. Computed on demand
+// at the top of the blocks, from the branches before they are rewritten.
+struct BlockPredicates {
+	const SecretRegions& regions;
+	llvm::RegionInfo& RI;
+	llvm::LoopInfo& LI;
+	llvm::DominatorTree& DT;
+	llvm::Value* mask;
+	llvm::DenseMap<llvm::BasicBlock*, llvm::Value*> predicates;
+	IRBuilder<> builder;
+
+	BlockPredicates(Function &Func, const SecretRegions& regions, llvm::RegionInfo& RI, llvm::LoopInfo& LI, llvm::DominatorTree& DT)
+		: regions(regions), RI(RI), LI(LI), DT(DT), mask(getMaskPredicate(Func)), builder(Func.getContext()) {}
+
+	llvm::Value* andPreds(llvm::Value* a, llvm::Value* b) { return !a ? b : !b ? a : builder.CreateAnd(a, b); }
+	llvm::Value* orPreds(llvm::Value* a, llvm::Value* b) { return !a || !b ? NULL : builder.CreateOr(a, b); }
+
+	llvm::Value* getEdge(llvm::BasicBlock* from, llvm::BasicBlock* to) {
+		llvm::BranchInst* br = dyn_cast<BranchInst>(from->getTerminator());
+		if(!br || !br->isConditional() || br->getSuccessor(0) == br->getSuccessor(1)) return NULL;
+		return br->getSuccessor(0) == to ? br->getCondition() : builder.CreateNot(br->getCondition());
+	}
 
+	// The entry of a region of owner that ends at bb and holds all the given
+	// predecessors of bb, NULL if there is none.
+	llvm::BasicBlock* getRegionEntry(llvm::BasicBlock* bb, llvm::ArrayRef<llvm::BasicBlock*> froms, llvm::BasicBlock* owner) {
+		if(froms.empty()) return NULL;
+		for(llvm::Region* region = RI.getRegionFor(froms.front()); region; region = region->getParent()) {
+			if(region->getExit() != bb) continue;
+			if(regions.getOwner(region->getEntry()) != owner) return NULL;
+			if(llvm::all_of(froms, [&](llvm::BasicBlock* from) { return region->contains(from); })) return region->getEntry();
+		}
+		return NULL;
+	}
 
-	errs() << Func.getName() << "\n =============================================== \n";
+	llvm::Value* get(llvm::BasicBlock* bb) {
+		auto known = predicates.find(bb);
+		if(known != predicates.end()) return known->second;
 
-	int i = 0;
-	for(auto bb = Func.begin(); bb != Func.end(); ++bb) {
-		std::string name = std::to_string(i);
-		(*bb).setName(name);
+		// Also ends the walk on a cycle of an irreducible region.
+		predicates[bb] = mask;
+		llvm::BasicBlock* owner = regions.getOwner(bb);
+		if(!owner || owner == bb) return mask;
+
+		llvm::Loop* loop = LI.isLoopHeader(bb) ? LI.getLoopFor(bb) : NULL;
+		llvm::SmallVector<llvm::BasicBlock*, 4> froms;
+		for(auto from : llvm::predecessors(bb)) {
+			if(!(loop && loop->contains(from)) && DT.isReachableFromEntry(from)) froms.push_back(from);
+		}
+
+		if(llvm::BasicBlock* entry = getRegionEntry(bb, froms, owner)) return predicates[bb] = get(entry);
+
+		llvm::Instruction* top = &*bb->getFirstInsertionPt();
+		llvm::Value* pred = mask;
+		bool first = true;
+		for(auto from : froms) {
+			llvm::Value* fromPred = get(from);
+			builder.SetInsertPoint(top);
+			llvm::Value* edge = andPreds(fromPred, getEdge(from, bb));
+			pred = first ? edge : orPreds(pred, edge);
+			first = false;
+		}
+		return predicates[bb] = pred;
+	}
+};
+
+// Predicates the calls (and the stores of a masked clone or of a bounded
+// loop) that run whatever the serialized branches decide. Returns true if the
+// function has changed.
+static bool predicateSideEffects(Function &Func, const SecretRegions& regions, llvm::RegionInfo& RI, llvm::LoopInfo& LI, llvm::DominatorTree& DT, llvm::SmallVectorImpl<std::pair<llvm::CallInst*, llvm::Value*>>& deferredCalls) {
+
+	bool masked = getMaskPredicate(Func) != NULL;
+
+	std::vector<llvm::Instruction*> effects;
+	for(auto& bb : Func) {
+		llvm::BasicBlock* owner = regions.getOwner(&bb);
+		if((!masked && (!owner || owner == &bb)) || !DT.isReachableFromEntry(&bb)) continue;
+
+		// The stores of a bounded loop would also run in the iterations after
+		// the exit.
+		bool bounded = false;
+		for(llvm::Loop* loop = LI.getLoopFor(&bb); loop && !bounded; loop = loop->getParentLoop()) bounded = getBoundedTripCount(*loop);
+
+		for(auto& inst : bb) {
+			if(hasMaskedEffects(inst) || (bounded && llvm::StoreInst::classof(&inst) && cast<StoreInst>(&inst)->isSimple())) effects.push_back(&inst);
+		}
 	}
 
-	llvm::DominatorTree DT (Func);
-	llvm::LoopInfo LI (DT);
-	llvm::PostDominatorTree PDT (Func);
+	BlockPredicates predicates(Func, regions, RI, LI, DT);
+	bool changed = false;
+	for(auto inst : effects) {
+		llvm::Value* pred = predicates.get(inst->getParent());
+		if(!pred) continue;
+		if(llvm::StoreInst::classof(inst)) ++NumPredicatedStores;
+		maskSideEffect(*inst, pred, deferredCalls);
+		changed = true;
+	}
+	return changed;
+}
 
-	PDT.print(OutS);
+static PreservedAnalyses linearize(Function &Func, const ResultSecret &InputVector, llvm::DominatorTree& DT, llvm::RegionInfo& RI, llvm::LoopInfo& LI, const llvm::TargetTransformInfo& TTI) {
 
-	std::vector<llvm::BranchInst*> condBranch;
 	std::vector<llvm::Loop*> allLoopsVector;
-	std::map<llvm::BasicBlock*, newBranch> serializedCode;
+	SerializedCFG serializedCode;
 	
 	for(auto loop = LI.begin(); loop != LI.end(); ++loop)  getAllInnerLoops(*loop, allLoopsVector);
 
 	for(auto loop : allLoopsVector) assert(loop->isLoopSimplifyForm() && "expecting loop in sinplify form: use loop-simplify!");
 
-	recursiveSerialization(&(Func.getEntryBlock()), serializedCode, condBranch, allLoopsVector, PDT);
+	bool changed = canonicalizePaddedLoops(InputVector, Func, allLoopsVector, DT, LI);
 
-  	/*for(auto pair = serializedCode.begin(); pair != serializedCode.end(); ++pair) {
-		errs() << "\n-------------------------------------------------------\n";
-		errs() << (pair->first)->getName() << " -> ";
-		if(pair->second.cond != NULL) errs() << "Branch: cond: (" << *(pair->second.cond) << ") \n";
-		if(pair->second.then != NULL) errs() << "Branch: then: (" << pair->second.then->getName() << ")\n";
-		if(pair->second.els != NULL) errs() << "Branch: else: (" << pair->second.els->getName() << ")\n";
-	}*/
+	SecretRegions regions;
+	{
+		PhaseTimer timer("serialization", "Serialize the secret regions", Func);
+		getSecretRegions(Func, InputVector, allLoopsVector, RI, regions);
+		serializeRegions(serializedCode, regions, allLoopsVector, RI, LI);
+	}
+	NumSerializedBranches += regions.serialized.size();
+
+	LLVM_DEBUG({
+		dbgs() << "ct-linearize: " << regions.serialized.size() << " serialized branches in '" << Func.getName() << "'\n";
+		for(auto pair = serializedCode.branches.begin(); pair != serializedCode.branches.end(); ++pair) {
+			dbgs() << "  " << pair->first->getName() << " -> ";
+			if(pair->second.cond != NULL) dbgs() << "br " << pair->second.cond->getName() << ", " << pair->second.then->getName() << ", " << pair->second.els->getName() << "\n";
+			else dbgs() << "br " << pair->second.then->getName() << "\n";
+		}
+	});
 
 	std::vector<llvm::PHINode*> phis;
 
@@ -749,12 +2101,31 @@ static void printInputsVectorResult(raw_ostream &OutS,
 	}
 
 
-	if(!phis.empty()) modifyPhis(phis, Func, DT);
+	// Keep the taint up to date with the selects that replace the PHIs.
+	ResultSecret inputsVector = InputVector;
+
+	{
+		PhaseTimer timer("phis", "Replace the PHIs with selects", Func);
+		changed |= modifyPhis(phis, Func, DT, inputsVector, regions, serializedCode);
+	}
+	bool changedCFG = false;
+
+	llvm::SmallVector<std::pair<llvm::CallInst*, llvm::Value*>, 4> deferredCalls;
+	{
+		PhaseTimer timer("side-effects", "Predicate the side effects", Func);
+		changed |= predicateSideEffects(Func, regions, RI, LI, DT, deferredCalls);
+	}
 
 	IRBuilder<> builder (Func.getContext());
 
-  	for(auto pair = serializedCode.begin(); pair != serializedCode.end(); ++pair) {
+  	for(auto pair = serializedCode.branches.begin(); pair != serializedCode.branches.end(); ++pair) {
+
+		llvm::BranchInst* old = dyn_cast<BranchInst>(pair->first->getTerminator());
+		if(old && (old->isConditional() ? old->getCondition() == pair->second.cond && old->getSuccessor(0) == pair->second.then && old->getSuccessor(1) == pair->second.els
+										: pair->second.cond == NULL && old->getSuccessor(0) == pair->second.then))
+			continue;
 
+		changed = changedCFG = true;
 		pair->first->getTerminator()->eraseFromParent();
 
 		builder.SetInsertPoint(pair->first);
@@ -765,5 +2136,28 @@ static void printInputsVectorResult(raw_ostream &OutS,
 			builder.CreateBr(pair->second.then);
 	}
 
-	modifyNumCyclesLoops(InputVector, Func, allLoopsVector); 
+	// The loops padded below, and the locations their stores promote, must
+	// be found in the serialized CFG, not in the one LoopInfo was built on.
+	if(changedCFG) {
+		DT.recalculate(Func);
+		LI.releaseMemory();
+		LI.analyze(DT);
+		allLoopsVector.clear();
+		for(auto loop = LI.begin(); loop != LI.end(); ++loop) getAllInnerLoops(*loop, allLoopsVector);
+	}
+
+	changed |= modifyNumCyclesLoops(inputsVector, Func, allLoopsVector, TTI);
+
+	// The memory intrinsics become loops, and the calls that cannot be masked
+	// are guarded, once the loops are done with LoopInfo.
+	if(predicateCalls(deferredCalls)) changed = changedCFG = true;
+
+	if(!changed) return PreservedAnalyses::all();
+
+	// The taint refers to the PHIs that have been replaced, and the callers
+	// must see the new bodies the next time the summaries are computed.
+	PreservedAnalyses PA;
+	if(!changedCFG) PA.preserveSet<CFGAnalyses>();
+	PA.abandon<SecretSummary>();
+	return PA;
 }
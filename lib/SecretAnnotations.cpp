@@ -0,0 +1,126 @@
+//==============================================================================
+// FILE:
+//    SecretAnnotations.cpp
+//
+// DESCRIPTION:
+//    Clang lowers __attribute__((annotate("str"))) in three ways:
+//      * globals and functions: an entry {value, "str", file, line, args} in
+//        the @llvm.global.annotations array
+//      * locals and parameters: a call to llvm.var.annotation on their stack
+//        slot
+//      * struct fields: a call to llvm.ptr.annotation on every access to the
+//        field, returning the annotated pointer
+//    This file hides those details from the passes.
+//
+// License: MIT
+//==============================================================================
+#include "SecretAnnotations.h"
+
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/ErrorHandling.h"
+
+using namespace llvm;
+
+void getAnnotatedGlobals(
+    const Module &M, SmallVectorImpl<std::pair<GlobalValue *, StringRef>> &Out) {
+  const GlobalVariable *Annotations =
+      M.getNamedGlobal("llvm.global.annotations");
+  if (!Annotations || !Annotations->hasInitializer())
+    return;
+
+  auto *Entries = dyn_cast<ConstantArray>(Annotations->getInitializer());
+  if (!Entries)
+    return;
+
+  for (const Use &Entry : Entries->operands()) {
+    auto *Fields = dyn_cast<ConstantStruct>(Entry.get());
+    if (!Fields || Fields->getNumOperands() < 2)
+      continue;
+
+    auto *Annotated =
+        dyn_cast<GlobalValue>(Fields->getOperand(0)->stripPointerCasts());
+    StringRef Str;
+    if (Annotated && getConstantStringInfo(Fields->getOperand(1), Str))
+      Out.push_back({Annotated, Str});
+  }
+}
+
+void getAnnotatedPointers(Function &F,
+                          SmallVectorImpl<std::pair<Value *, StringRef>> &Out) {
+  for (Instruction &Inst : instructions(F)) {
+    auto *II = dyn_cast<IntrinsicInst>(&Inst);
+    if (!II)
+      continue;
+
+    StringRef Str;
+    switch (II->getIntrinsicID()) {
+    case Intrinsic::var_annotation:
+      if (getConstantStringInfo(II->getArgOperand(1), Str))
+        Out.push_back({II->getArgOperand(0)->stripPointerCasts(), Str});
+      break;
+    case Intrinsic::ptr_annotation:
+      if (getConstantStringInfo(II->getArgOperand(1), Str))
+        Out.push_back({II, Str});
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+MemoryLocation getAnnotatedField(const IntrinsicInst &Annotation) {
+  assert(Annotation.getIntrinsicID() == Intrinsic::ptr_annotation &&
+         "not a field annotation");
+  const Value *Field = Annotation.getArgOperand(0);
+  const DataLayout &DL = Annotation.getModule()->getDataLayout();
+
+  // The field of a struct GEP, otherwise (the first field, addressed by the
+  // struct pointer) the types the accesses through the annotation use.
+  SmallVector<Type *, 8> Types;
+  if (auto *GEP = dyn_cast<GEPOperator>(Field))
+    Types.push_back(GEP->getResultElementType());
+  for (const User *U : Annotation.users()) {
+    if (auto *GEP = dyn_cast<GEPOperator>(U))
+      Types.push_back(GEP->getSourceElementType());
+    else if (auto *LI = dyn_cast<LoadInst>(U))
+      Types.push_back(LI->getType());
+    else if (auto *SI = dyn_cast<StoreInst>(U);
+             SI && SI->getPointerOperand() == &Annotation)
+      Types.push_back(SI->getValueOperand()->getType());
+  }
+
+  uint64_t Size = 0;
+  for (Type *Ty : Types)
+    if (Ty->isSized())
+      Size = std::max<uint64_t>(Size, DL.getTypeStoreSize(Ty));
+  if (!Size)
+    return MemoryLocation::getBeforeOrAfter(Field);
+  return MemoryLocation(Field, LocationSize::precise(Size));
+}
+
+unsigned getBoundAnnotation(StringRef Str) {
+  if (!Str.consume_front("ct_bound:"))
+    return 0;
+
+  unsigned Bound;
+  if (Str.trim().getAsInteger(10, Bound) || Bound == 0)
+    report_fatal_error(Twine("invalid annotation 'ct_bound:") + Str +
+                       "', expecting a positive number of elements");
+  return Bound;
+}
+
+unsigned getTripAnnotation(StringRef Str) {
+  if (!Str.consume_front("ct_trip:"))
+    return 0;
+
+  unsigned Trips;
+  if (Str.trim().getAsInteger(10, Trips) || Trips == 0)
+    report_fatal_error(Twine("invalid annotation 'ct_trip:") + Str +
+                       "', expecting a positive number of iterations");
+  return Trips;
+}
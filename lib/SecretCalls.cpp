@@ -0,0 +1,322 @@
+//==============================================================================
+// FILE:
+//    SecretCalls.cpp
+//
+// DESCRIPTION:
+//    Calls in the serialized regions of ct-linearize. Once the branches are
+//    serialized, a call in one side of a branch on a secret runs whichever
+//    side was taken: its side effects must be predicated on the condition
+//    under which the block used to run.
+//
+//    A call to a function of the module calls the masked clone of the callee
+//    instead: a copy with an extra i1 parameter, the predicate, on which
+//    ct-linearize predicates the stores and calls of the clone in turn. Each
+//    callee is cloned once, <callee>.ct_masked, by the ct-masked-clones
+//    module pass, and the clone is shared by all the calls in serialized
+//    regions.
+//
+//    memset, memcpy and memmove become a loop that stores, byte by byte,
+//    the new value or the old one. A call that cannot be masked (a
+//    declaration such as printf, an indirect call, varargs) is an error:
+//    -ct-external-calls=guard puts it behind a branch on its predicate,
+//    which ct-llc reports, and -ct-external-calls=keep runs it
+//    unconditionally.
+//
+// License: MIT
+//==============================================================================
+#include "SecretCalls.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+
+using namespace llvm;
+
+namespace {
+enum class ExternalCalls { Error, Guard, Keep };
+} // namespace
+
+static cl::opt<ExternalCalls> ExternalCallsOpt(
+    "ct-external-calls",
+    cl::desc("What ct-linearize does with the calls it cannot mask in a "
+             "serialized region"),
+    cl::init(ExternalCalls::Error),
+    cl::values(clEnumValN(ExternalCalls::Error, "error",
+                          "Stop with an error"),
+               clEnumValN(ExternalCalls::Guard, "guard",
+                          "Branch over them on their predicate"),
+               clEnumValN(ExternalCalls::Keep, "keep",
+                          "Run them unconditionally")));
+
+static const char *const MaskedSuffix = ".ct_masked";
+static const char *const MaskedAttr = "ct-masked";
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+static bool canMaskCall(const CallInst &Call) {
+  const Function *Callee = Call.getCalledFunction();
+  return Callee && !Callee->isDeclaration() && !Callee->isVarArg() &&
+         !Call.isMustTailCall();
+}
+
+// The memory intrinsics predicateCalls turns into a masked loop.
+static bool isMaskedLoop(const CallInst &Call) {
+  auto *MI = dyn_cast<MemIntrinsic>(&Call);
+  return MI && !MI->isVolatile();
+}
+
+// Why Call, which has no masked clone, cannot be masked.
+static const char *getUnmaskableReason(const CallInst &Call) {
+  const Function *Callee = Call.getCalledFunction();
+  if (!Callee)
+    return "the callee is indirect";
+  if (isa<AnyMemIntrinsic>(Call))
+    return "it is volatile or atomic";
+  if (Callee->isDeclaration())
+    return "the callee is external";
+  if (Callee->isVarArg())
+    return "the callee is variadic";
+  if (Call.isMustTailCall())
+    return "it is a musttail call";
+  if (!hasMaskableWrites(*Callee))
+    return "the callee has volatile or atomic writes";
+  return "the callee has no masked clone, run ct-masked-clones first";
+}
+
+static void maskCall(CallInst &Call, Function *Clone, Value *Pred) {
+  SmallVector<Value *, 8> Args(Call.args());
+  Args.push_back(Pred);
+  SmallVector<OperandBundleDef, 1> Bundles;
+  Call.getOperandBundlesAsDefs(Bundles);
+
+  CallInst *Masked = CallInst::Create(Clone, Args, Bundles, "", &Call);
+  Masked->takeName(&Call);
+  Masked->setCallingConv(Call.getCallingConv());
+  Masked->setAttributes(Call.getAttributes());
+  Masked->setTailCallKind(Call.getTailCallKind());
+  Masked->setDebugLoc(Call.getDebugLoc());
+
+  Call.replaceAllUsesWith(Masked);
+  Call.eraseFromParent();
+}
+
+static void maskStore(StoreInst &Store, Value *Pred) {
+  IRBuilder<> Builder(&Store);
+  Value *Ptr = Store.getPointerOperand();
+  Value *Val = Store.getValueOperand();
+
+  LoadInst *Old = Builder.CreateAlignedLoad(Val->getType(), Ptr,
+                                            Store.getAlign(), "ct.old");
+  Store.setOperand(0, Builder.CreateSelect(Pred, Val, Old, "ct.masked"));
+}
+
+// Replaces MI with a loop over its bytes that stores either the new byte or
+// the old one, loaded first, depending on Pred. memmove copies backwards when
+// the destination is above the source, whatever the predicate.
+static void maskMemIntrinsic(MemIntrinsic &MI, Value *Pred) {
+  BasicBlock *Head = MI.getParent();
+  Function &F = *Head->getParent();
+  BasicBlock *Tail = SplitBlock(Head, &MI);
+  Tail->setName(Head->getName() + ".ct.cont");
+  BasicBlock *Header = BasicBlock::Create(F.getContext(),
+                                          Head->getName() + ".ct.mem", &F, Tail);
+  BasicBlock *Body = BasicBlock::Create(
+      F.getContext(), Head->getName() + ".ct.mem.body", &F, Tail);
+  Head->getTerminator()->setSuccessor(0, Header);
+
+  Value *Len = MI.getLength();
+  Type *LenTy = Len->getType();
+  IRBuilder<> Builder(Head->getTerminator());
+  Value *Backward = nullptr;
+  if (auto *Move = dyn_cast<MemMoveInst>(&MI))
+    Backward = Builder.CreateICmpUGT(Move->getRawDest(), Move->getRawSource(),
+                                     "ct.backward");
+
+  Builder.SetInsertPoint(Header);
+  PHINode *Index = Builder.CreatePHI(LenTy, 2, "ct.i");
+  Builder.CreateCondBr(Builder.CreateICmpULT(Index, Len, "ct.more"), Body,
+                       Tail);
+
+  Builder.SetInsertPoint(Body);
+  Value *Offset = Index;
+  if (Backward) {
+    Value *Last = Builder.CreateSub(Len, ConstantInt::get(LenTy, 1));
+    Offset = Builder.CreateSelect(Backward, Builder.CreateSub(Last, Index),
+                                  Index, "ct.offset");
+  }
+
+  Type *ByteTy = Builder.getInt8Ty();
+  Value *Dst = Builder.CreateGEP(ByteTy, MI.getRawDest(), Offset, "ct.dst");
+  Value *New;
+  if (auto *Set = dyn_cast<MemSetInst>(&MI)) {
+    New = Set->getValue();
+  } else {
+    Value *Src = Builder.CreateGEP(
+        ByteTy, cast<MemTransferInst>(MI).getRawSource(), Offset, "ct.src");
+    New = Builder.CreateAlignedLoad(ByteTy, Src, Align(1), "ct.new");
+  }
+  LoadInst *Old = Builder.CreateAlignedLoad(ByteTy, Dst, Align(1), "ct.old");
+  Builder.CreateAlignedStore(Builder.CreateSelect(Pred, New, Old, "ct.masked"),
+                             Dst, Align(1));
+  Value *Next = Builder.CreateNUWAdd(Index, ConstantInt::get(LenTy, 1),
+                                     "ct.i.next");
+  Builder.CreateBr(Header);
+
+  Index->addIncoming(ConstantInt::get(LenTy, 0), Head);
+  Index->addIncoming(Next, Body);
+  MI.eraseFromParent();
+}
+
+static void guardCall(CallInst &Call, Value *Pred) {
+  BasicBlock *Head = Call.getParent();
+  Instruction *ThenTerm =
+      SplitBlockAndInsertIfThen(Pred, &Call, /*Unreachable=*/false);
+  BasicBlock *Tail = ThenTerm->getSuccessor(0);
+  ThenTerm->getParent()->setName(Head->getName() + ".ct.call");
+  Tail->setName(Head->getName() + ".ct.cont");
+  Call.moveBefore(ThenTerm);
+
+  if (Call.use_empty() || Call.getType()->isVoidTy())
+    return;
+
+  // The result is zero when the call does not run, rather than poison,
+  // which would reach the predicates and branches computed from it.
+  PHINode *Result = PHINode::Create(Call.getType(), 2, Call.getName() + ".ct",
+                                    &Tail->front());
+  Call.replaceAllUsesWith(Result);
+  Result->addIncoming(&Call, ThenTerm->getParent());
+  Result->addIncoming(Constant::getNullValue(Call.getType()), Head);
+}
+
+//------------------------------------------------------------------------------
+// Masked clones
+//------------------------------------------------------------------------------
+bool hasMaskableWrites(const Function &F) {
+  for (const Instruction &I : instructions(F)) {
+    if (auto *Store = dyn_cast<StoreInst>(&I)) {
+      if (!Store->isSimple())
+        return false;
+    } else if (isa<AtomicRMWInst>(I) || isa<AtomicCmpXchgInst>(I)) {
+      return false;
+    } else if (auto *MI = dyn_cast<AnyMemIntrinsic>(&I)) {
+      if (!isa<MemIntrinsic>(MI) || cast<MemIntrinsic>(MI)->isVolatile())
+        return false;
+    }
+  }
+  return true;
+}
+
+Function *getMaskedClone(const Function &F) {
+  Function *Clone = F.getParent()->getFunction(
+      (F.getName() + MaskedSuffix).str());
+  return Clone && Clone->hasFnAttribute(MaskedAttr) ? Clone : nullptr;
+}
+
+Function *createMaskedClone(Function &F) {
+  assert(!getMaskedClone(F) && "the masked clone already exists");
+  Module &M = *F.getParent();
+  std::string Name = (F.getName() + MaskedSuffix).str();
+
+  SmallVector<Type *, 8> Params(F.getFunctionType()->param_begin(),
+                                F.getFunctionType()->param_end());
+  Params.push_back(Type::getInt1Ty(F.getContext()));
+  FunctionType *Ty = FunctionType::get(F.getReturnType(), Params, false);
+  Function *Clone = Function::Create(Ty, GlobalValue::InternalLinkage,
+                                     F.getAddressSpace(), Name, &M);
+
+  ValueToValueMapTy VMap;
+  Function::arg_iterator NewArg = Clone->arg_begin();
+  for (Argument &Arg : F.args()) {
+    NewArg->setName(Arg.getName());
+    VMap[&Arg] = &*NewArg++;
+  }
+  NewArg->setName("ct.pred");
+
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(Clone, &F, VMap, CloneFunctionChangeType::LocalChangesOnly,
+                    Returns);
+
+  // CloneFunctionInto copies the comdat and visibility of F along with its
+  // attributes: the clone is private to the module.
+  Clone->setLinkage(GlobalValue::InternalLinkage);
+  Clone->setVisibility(GlobalValue::DefaultVisibility);
+  Clone->setDLLStorageClass(GlobalValue::DefaultStorageClass);
+  Clone->setComdat(nullptr);
+  Clone->addFnAttr(MaskedAttr);
+  return Clone;
+}
+
+Argument *getMaskPredicate(Function &F) {
+  if (!F.hasFnAttribute(MaskedAttr) || F.arg_empty())
+    return nullptr;
+  return F.getArg(F.arg_size() - 1);
+}
+
+bool hasMaskedEffects(const Instruction &I) {
+  if (auto *Store = dyn_cast<StoreInst>(&I))
+    return Store->isSimple() &&
+           I.getFunction()->hasFnAttribute(MaskedAttr);
+
+  auto *Call = dyn_cast<CallInst>(&I);
+  if (!Call || !Call->mayHaveSideEffects())
+    return false;
+
+  // Among the intrinsics, only the memory ones write to memory the program
+  // can see, the others are markers (lifetime, assume, debug info).
+  return !isa<IntrinsicInst>(Call) || isa<AnyMemIntrinsic>(Call);
+}
+
+bool maskSideEffect(Instruction &I, Value *Pred,
+                    SmallVectorImpl<std::pair<CallInst *, Value *>> &Deferred) {
+  if (auto *Store = dyn_cast<StoreInst>(&I)) {
+    maskStore(*Store, Pred);
+    return true;
+  }
+
+  auto &Call = cast<CallInst>(I);
+  if (isMaskedLoop(Call)) {
+    Deferred.push_back(std::make_pair(&Call, Pred));
+    return false;
+  }
+
+  Function *Clone = !isa<IntrinsicInst>(Call) && canMaskCall(Call)
+                        ? getMaskedClone(*Call.getCalledFunction())
+                        : nullptr;
+  if (Clone) {
+    maskCall(Call, Clone, Pred);
+    return true;
+  }
+
+  // Running the call anyway, or only when its predicate holds, both tell
+  // the secret: only on request.
+  if (ExternalCallsOpt == ExternalCalls::Error) {
+    const Function *Callee = Call.getCalledFunction();
+    report_fatal_error(
+        Twine("ct-linearize: cannot mask the call to '") +
+        (Callee ? Callee->getName() : "<indirect>") + "' in '" +
+        Call.getFunction()->getName() + "' on a secret, " +
+        getUnmaskableReason(Call) +
+        "; -ct-external-calls=guard branches over it, "
+        "-ct-external-calls=keep runs it anyway");
+  }
+  Deferred.push_back(std::make_pair(&Call, Pred));
+  return false;
+}
+
+bool predicateCalls(ArrayRef<std::pair<CallInst *, Value *>> Calls) {
+  bool Changed = false;
+  for (auto &Deferred : Calls) {
+    if (isMaskedLoop(*Deferred.first)) {
+      maskMemIntrinsic(cast<MemIntrinsic>(*Deferred.first), Deferred.second);
+      Changed = true;
+    } else if (ExternalCallsOpt == ExternalCalls::Guard) {
+      guardCall(*Deferred.first, Deferred.second);
+      Changed = true;
+    }
+  }
+  return Changed;
+}
@@ -0,0 +1,301 @@
+//==============================================================================
+// FILE:
+//    SecretCost.cpp
+//
+// DESCRIPTION:
+//    Cost model of ct-linearize. The cost of a block is the sum of the TTI
+//    reciprocal throughputs of its instructions, and the cost of a function
+//    the sum of the costs of its blocks weighted by their frequency relative
+//    to the entry block (BFI). After linearization:
+//      * the blocks between a serialized branch and its post-dominator run
+//        whenever the branch does, whichever side it would have taken;
+//      * the loops nested there run as often per entry as before;
+//      * the padded loops run for their padded number of iterations instead
+//        of the number BFI expects;
+//      * the PHIs become chains of selects;
+//      * the table lookups and divisions on a secret become the scans and
+//        the division sequences of SecretLookup.cpp and SecretDivision.cpp.
+//    The loops ct-linearize unrolls run their constant trip count, before
+//    and after, rather than the number BFI expects: their unrolled copies
+//    are serialized with the rest of the region.
+//
+//    The estimate is reported as a remark of ct-linearize:
+//      opt -passes=ct-linearize -pass-remarks=ct-linearize
+//      opt -passes=ct-linearize -pass-remarks-output=remarks.yaml
+//    and -ct-max-slowdown sets the largest slowdown allowed for a function,
+//    -ct-over-budget what happens to the functions above it.
+//
+// License: MIT
+//==============================================================================
+#include "SecretCost.h"
+
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FormatVariadic.h"
+
+using namespace llvm;
+
+namespace {
+enum class OverBudget { Warn, Skip, Error };
+} // namespace
+
+static const char *const PassName = "ct-linearize";
+
+static cl::opt<double> MaxSlowdown(
+    "ct-max-slowdown",
+    cl::desc("Largest slowdown of a function ct-linearize may cause, as "
+             "estimated by its cost model (0 for no limit)"),
+    cl::init(0));
+
+static cl::opt<OverBudget> OverBudgetAction(
+    "ct-over-budget",
+    cl::desc("What ct-linearize does with a function above -ct-max-slowdown"),
+    cl::init(OverBudget::Warn),
+    cl::values(clEnumValN(OverBudget::Warn, "warn",
+                          "Warn and linearize it anyway"),
+               clEnumValN(OverBudget::Skip, "skip",
+                          "Warn and leave it as it is"),
+               clEnumValN(OverBudget::Error, "error", "Stop with an error")));
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+static double getBlockCost(const BasicBlock &BB,
+                           const TargetTransformInfo &TTI) {
+  double Cost = 0;
+  for (const Instruction &I : BB) {
+    InstructionCost C =
+        TTI.getInstructionCost(&I, TargetTransformInfo::TCK_RecipThroughput);
+    if (C.isValid())
+      Cost += *C.getValue();
+  }
+  return Cost;
+}
+
+static bool isLatchOfAnyLoop(const BasicBlock *BB, const LoopInfo &LI) {
+  for (const Loop *L = LI.getLoopFor(BB); L; L = L->getParentLoop())
+    if (L->isLoopLatch(BB))
+      return true;
+  return false;
+}
+
+namespace {
+// Frequencies of the blocks per call, before and after linearization.
+class FrequencyModel {
+public:
+  FrequencyModel(BlockFrequencyInfo &BFI, LoopInfo &LI,
+                 const DenseMap<const Loop *, unsigned> &PaddedTrips)
+      : BFI(BFI), LI(LI), PaddedTrips(PaddedTrips),
+        EntryFreq(BFI.getEntryFreq()) {}
+
+  double getFreq(const BasicBlock *BB) const {
+    return EntryFreq ? double(BFI.getBlockFreq(BB).getFrequency()) / EntryFreq
+                     : 1;
+  }
+
+  // Makes the blocks between Br and its post-dominator PostDom (null if
+  // there is none) run as often as Br. The innermost branch wins.
+  void serialize(const BranchInst *Br, const BasicBlock *PostDom);
+
+  // The factor that turns the number of iterations BFI expects of the
+  // loops around BB into the one Trips gives them.
+  double getTripScale(const BasicBlock *BB,
+                      const DenseMap<const Loop *, unsigned> &Trips) const {
+    double Scale = 1;
+    for (const Loop *L = LI.getLoopFor(BB); L; L = L->getParentLoop()) {
+      auto It = Trips.find(L);
+      const BasicBlock *Preheader = L->getLoopPreheader();
+      if (It == Trips.end() || !Preheader || getFreq(Preheader) == 0)
+        continue;
+      double Expected = getFreq(L->getHeader()) / getFreq(Preheader);
+      if (Expected > 0)
+        Scale *= It->second / Expected;
+    }
+    return Scale;
+  }
+
+  double getLinearizedFreq(const BasicBlock *BB) {
+    return getUnpaddedFreq(BB) * getTripScale(BB, PaddedTrips);
+  }
+
+private:
+  double getUnpaddedFreq(const BasicBlock *BB);
+
+  BlockFrequencyInfo &BFI;
+  LoopInfo &LI;
+  const DenseMap<const Loop *, unsigned> &PaddedTrips;
+  uint64_t EntryFreq;
+
+  // The serialized branch each block runs with, and the size of its region.
+  DenseMap<const BasicBlock *, std::pair<const BasicBlock *, unsigned>> Owner;
+  DenseMap<const BasicBlock *, double> Linearized;
+};
+} // namespace
+
+void FrequencyModel::serialize(const BranchInst *Br,
+                               const BasicBlock *PostDom) {
+  const BasicBlock *Head = Br->getParent();
+  const Loop *HeadLoop = LI.getLoopFor(Head);
+
+  // The region stops at the post-dominator and at the back edges of the
+  // loops around the branch, which keep their own latches.
+  SmallPtrSet<const BasicBlock *, 16> Region;
+  SmallVector<const BasicBlock *, 16> Worklist(successors(Head));
+  while (!Worklist.empty()) {
+    const BasicBlock *BB = Worklist.pop_back_val();
+    if (BB == PostDom || BB == Head || !Region.insert(BB).second)
+      continue;
+    for (const BasicBlock *Succ : successors(BB)) {
+      const Loop *SuccLoop = LI.getLoopFor(Succ);
+      if (SuccLoop && SuccLoop->getHeader() == Succ && HeadLoop &&
+          SuccLoop->contains(HeadLoop))
+        continue;
+      Worklist.push_back(Succ);
+    }
+  }
+
+  for (const BasicBlock *BB : Region) {
+    auto It = Owner.find(BB);
+    if (It == Owner.end() || Region.size() < It->second.second)
+      Owner[BB] = std::make_pair(Head, Region.size());
+  }
+}
+
+double FrequencyModel::getUnpaddedFreq(const BasicBlock *BB) {
+  auto Known = Linearized.find(BB);
+  if (Known != Linearized.end())
+    return Known->second;
+
+  // Until the branches are followed, a block runs as often as before, which
+  // also ends the walk on an irreducible region.
+  Linearized[BB] = getFreq(BB);
+
+  double Freq = getFreq(BB);
+  auto It = Owner.find(BB);
+  if (It != Owner.end()) {
+    const BasicBlock *Head = It->second.first;
+
+    // A loop nested in the region runs as many iterations per entry as
+    // before, and is entered as often as its preheader runs.
+    const Loop *Outer = nullptr;
+    for (const Loop *L = LI.getLoopFor(BB); L && !L->contains(Head);
+         L = L->getParentLoop())
+      Outer = L;
+
+    const BasicBlock *Preheader = Outer ? Outer->getLoopPreheader() : nullptr;
+    if (Preheader && getFreq(Preheader) > 0)
+      Freq = getFreq(BB) / getFreq(Preheader) * getUnpaddedFreq(Preheader);
+    else
+      Freq = getUnpaddedFreq(Head);
+  }
+
+  return Linearized[BB] = Freq;
+}
+
+//------------------------------------------------------------------------------
+// Cost model
+//------------------------------------------------------------------------------
+LinearizationCost estimateLinearizationCost(
+    Function &F, function_ref<bool(const BranchInst *)> IsSerialized,
+    const DenseMap<const Loop *, unsigned> &ConstantTrips,
+    const DenseMap<const Loop *, unsigned> &PaddedTrips,
+    function_ref<double(Instruction &)> RewriteCost, BlockFrequencyInfo &BFI,
+    LoopInfo &LI, PostDominatorTree &PDT, const TargetTransformInfo &TTI) {
+  // After linearization, the padding wins over the constant trip count.
+  DenseMap<const Loop *, unsigned> LinearizedTrips = ConstantTrips;
+  for (auto &Padded : PaddedTrips)
+    LinearizedTrips[Padded.first] = Padded.second;
+  FrequencyModel Model(BFI, LI, LinearizedTrips);
+
+  for (BasicBlock &BB : F) {
+    auto *Br = dyn_cast<BranchInst>(BB.getTerminator());
+    if (!Br || !Br->isConditional() || !IsSerialized(Br))
+      continue;
+    DomTreeNode *Node = PDT.getNode(&BB);
+    DomTreeNode *IPDom = Node ? Node->getIDom() : nullptr;
+    Model.serialize(Br, IPDom ? IPDom->getBlock() : nullptr);
+  }
+
+  LinearizationCost Cost;
+  ReversePostOrderTraversal<Function *> RPOT(&F);
+  for (BasicBlock *BB : RPOT) {
+    double BlockCost = getBlockCost(*BB, TTI);
+    double LinearizedFreq = Model.getLinearizedFreq(BB);
+    Cost.Before +=
+        BlockCost * Model.getFreq(BB) * Model.getTripScale(BB, ConstantTrips);
+    Cost.After += BlockCost * LinearizedFreq;
+
+    // The table lookups and divisions rewritten after linearization: the
+    // sequence replacing an instruction runs instead of it.
+    for (Instruction &I : *BB) {
+      double Rewritten = RewriteCost(I);
+      if (Rewritten == 0)
+        continue;
+      InstructionCost C =
+          TTI.getInstructionCost(&I, TargetTransformInfo::TCK_RecipThroughput);
+      Cost.After += (Rewritten - (C.isValid() ? *C.getValue() : 0)) *
+                    LinearizedFreq;
+    }
+
+    // The PHIs that do not merge a loop back edge become selects, one per
+    // incoming value but the first.
+    for (PHINode &Phi : BB->phis()) {
+      if (any_of(Phi.blocks(), [&](const BasicBlock *Pred) {
+            return isLatchOfAnyLoop(Pred, LI);
+          }))
+        continue;
+      InstructionCost Select = TTI.getCmpSelInstrCost(
+          Instruction::Select, Phi.getType(),
+          Type::getInt1Ty(F.getContext()), CmpInst::BAD_ICMP_PREDICATE,
+          TargetTransformInfo::TCK_RecipThroughput);
+      if (Select.isValid())
+        Cost.After += *Select.getValue() * (Phi.getNumIncomingValues() - 1) *
+                      LinearizedFreq;
+    }
+  }
+
+  return Cost;
+}
+
+bool isLinearizationCostNeeded(OptimizationRemarkEmitter &ORE) {
+  return MaxSlowdown > 0 || ORE.allowExtraAnalysis(PassName);
+}
+
+bool checkLinearizationCost(Function &F, const LinearizationCost &Cost,
+                            OptimizationRemarkEmitter &ORE) {
+  std::string Before = formatv("{0:F2}", Cost.Before).str();
+  std::string After = formatv("{0:F2}", Cost.After).str();
+  std::string Slowdown = formatv("{0:F2}", Cost.getSlowdown()).str();
+
+  ORE.emit([&]() {
+    return OptimizationRemark(PassName, "LinearizationCost", &F)
+           << "estimated cost " << ore::NV("CostBefore", Before)
+           << " before linearization, " << ore::NV("CostAfter", After)
+           << " after (slowdown " << ore::NV("Slowdown", Slowdown) << "x)";
+  });
+
+  if (MaxSlowdown <= 0 || Cost.getSlowdown() <= MaxSlowdown)
+    return true;
+
+  std::string Budget = formatv("{0:F2}", double(MaxSlowdown)).str();
+  if (OverBudgetAction == OverBudget::Error)
+    report_fatal_error(Twine("ct-linearize: '") + F.getName() +
+                       "' would be " + Slowdown +
+                       "x slower, more than the budget of " + Budget +
+                       "x (-ct-max-slowdown)");
+
+  bool Skip = OverBudgetAction == OverBudget::Skip;
+  ORE.emit([&]() {
+    return OptimizationRemarkMissed(PassName, "OverBudget", &F)
+           << "slowdown " << ore::NV("Slowdown", Slowdown)
+           << "x exceeds the budget of " << ore::NV("Budget", Budget) << "x"
+           << (Skip ? ", not linearized" : "");
+  });
+  F.getContext().diagnose(DiagnosticInfoOptimizationFailure(
+      F, DiagnosticLocation(F.getSubprogram()),
+      Twine("ct-linearize: '") + F.getName() + "' would be " + Slowdown +
+          "x slower, more than the budget of " + Budget + "x" +
+          (Skip ? ", left as it is" : "")));
+  return !Skip;
+}
@@ -0,0 +1,324 @@
+//==============================================================================
+// FILE:
+//    SecretDivision.cpp
+//
+// DESCRIPTION:
+//    Constant-time divisions for ct-linearize. The division instructions of
+//    most cores stop as soon as the quotient is known (x86-64 DIV and IDIV,
+//    Cortex-M3/M4 UDIV and SDIV), so their latency leaks a secret operand.
+//    Each udiv, sdiv, urem and srem with a secret operand is replaced with:
+//      * for a constant divisor, the multiplication by its reciprocal of
+//        Hacker's Delight (chapter 10): the high half of the double width
+//        product of the dividend and a magic number, the one of
+//        DivisionByConstantInfo, then shifts and adds.
+//        The backend does the same when the division is expensive, but not
+//        when optimizing for size nor on every target;
+//      * otherwise, a restoring division: a loop running one iteration per
+//        bit of the operands, each one shifting the next bit of the dividend
+//        into the remainder and subtracting the divisor under a mask when it
+//        fits. The signed divisions run it on the absolute values.
+//    A remainder is the dividend minus the quotient times the divisor.
+//
+//    The double width product is a library call on the targets without a
+//    wide multiplication (64-bit divisions on ARMv7-M): the cost model (TTI)
+//    keeps the loop when it is cheaper. On Cortex-M3, the long multiplies
+//    (UMULL, SMULL) stop early too, so a product wider than 32 bits is never
+//    used there and the 32 and 64-bit divisions always take the loop.
+//    -ct-division forces one of them, or keeps the division instructions,
+//    for a target whose division takes a fixed time.
+//
+//    The divisions of vectors with a secret operand are left as they are,
+//    with a warning, and so are the multiplications wider than 32 bits with
+//    a secret operand on Cortex-M3.
+//
+// License: MIT
+//==============================================================================
+#include "SecretDivision.h"
+#include "Secret.h"
+
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DivisionByConstantInfo.h"
+
+using namespace llvm;
+
+namespace {
+enum class DivisionStrategy { Auto, Reciprocal, Loop, None };
+} // namespace
+
+static cl::opt<DivisionStrategy> DivisionStrategyOpt(
+    "ct-division",
+    cl::desc("How ct-linearize rewrites the integer divisions with a secret "
+             "operand"),
+    cl::init(DivisionStrategy::Auto),
+    cl::values(clEnumValN(DivisionStrategy::Auto, "auto",
+                          "Use the cost model"),
+               clEnumValN(DivisionStrategy::Reciprocal, "reciprocal",
+                          "Multiply by the reciprocal of a constant divisor, "
+                          "a loop otherwise"),
+               clEnumValN(DivisionStrategy::Loop, "loop",
+                          "Shift and subtract, one bit per iteration"),
+               clEnumValN(DivisionStrategy::None, "none",
+                          "Keep the division instructions")));
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+// Instructions executed by the loop division: the body runs once per bit.
+static uint64_t getLoopCost(unsigned Bits) { return 12 * Bits; }
+
+// The double width multiplication, plus the shifts and adds around it.
+static uint64_t getReciprocalCost(IntegerType *Ty,
+                                  const TargetTransformInfo &TTI) {
+  Type *WideTy = IntegerType::get(Ty->getContext(), 2 * Ty->getBitWidth());
+  InstructionCost Mul = TTI.getArithmeticInstrCost(Instruction::Mul, WideTy);
+  if (!Mul.isValid())
+    return getLoopCost(Ty->getBitWidth());
+  return *Mul.getValue() + 6;
+}
+
+// The high half of the product of X and Magic, as wide as X.
+static Value *emitMulHigh(IRBuilder<> &B, Value *X, const APInt &Magic,
+                          bool Signed) {
+  auto *Ty = cast<IntegerType>(X->getType());
+  unsigned Bits = Ty->getBitWidth();
+  Type *WideTy = B.getIntNTy(2 * Bits);
+  Value *Wide = Signed ? B.CreateSExt(X, WideTy) : B.CreateZExt(X, WideTy);
+  APInt WideMagic = Signed ? Magic.sext(2 * Bits) : Magic.zext(2 * Bits);
+  Value *Prod = B.CreateMul(Wide, ConstantInt::get(WideTy, WideMagic));
+  return B.CreateTrunc(B.CreateLShr(Prod, Bits), Ty, "div.mulh");
+}
+
+static Value *emitConstantQuotient(IRBuilder<> &B, Value *X, const APInt &D,
+                                   bool Signed) {
+  unsigned Bits = D.getBitWidth();
+  Type *Ty = X->getType();
+  if (D.isOne())
+    return X;
+
+  if (!Signed) {
+    // The quotient is 0 or 1.
+    if (D.isNegative())
+      return B.CreateZExt(B.CreateICmpUGE(X, ConstantInt::get(Ty, D)), Ty,
+                          "div.q");
+
+    // An even divisor whose magic number does not fit is shifted first.
+    auto R = UnsignedDivisionByConstantInfo::get(D);
+    Value *Shifted = R.PreShift ? B.CreateLShr(X, R.PreShift) : X;
+    Value *Q = emitMulHigh(B, Shifted, R.Magic, false);
+    if (R.IsAdd) {
+      // The magic number does not fit: X is added back, halved so that the
+      // sum does not overflow, which the post-shift accounts for.
+      Value *NPQ = B.CreateLShr(B.CreateSub(X, Q), 1);
+      Q = B.CreateAdd(NPQ, Q);
+    }
+    return R.PostShift ? B.CreateLShr(Q, R.PostShift, "div.q") : Q;
+  }
+
+  // Dividing INT_MIN by -1 is undefined, the others fit.
+  if (D.isAllOnes())
+    return B.CreateNeg(X, "div.q");
+  if (D.isMinSignedValue())
+    return B.CreateZExt(B.CreateICmpEQ(X, ConstantInt::get(Ty, D)), Ty,
+                        "div.q");
+
+  auto R = SignedDivisionByConstantInfo::get(D);
+  Value *Q = emitMulHigh(B, X, R.Magic, true);
+  if (D.isStrictlyPositive() && R.Magic.isNegative())
+    Q = B.CreateAdd(Q, X);
+  else if (D.isNegative() && R.Magic.isStrictlyPositive())
+    Q = B.CreateSub(Q, X);
+  if (R.ShiftAmount)
+    Q = B.CreateAShr(Q, R.ShiftAmount);
+  // Rounds towards zero: adds one to a negative quotient.
+  return B.CreateAdd(Q, B.CreateLShr(Q, Bits - 1), "div.q");
+}
+
+// Divides X by D, both unsigned, in a loop inserted before At, which is
+// moved to the block after the loop. Returns the quotient and the remainder.
+static std::pair<Value *, Value *> emitLoopDivision(Instruction *At, Value *X,
+                                                    Value *D) {
+  auto *Ty = cast<IntegerType>(X->getType());
+  unsigned Bits = Ty->getBitWidth();
+  BasicBlock *Head = At->getParent();
+  BasicBlock *Exit = Head->splitBasicBlock(At, "div.end");
+  BasicBlock *Body =
+      BasicBlock::Create(Head->getContext(), "div", Head->getParent(), Exit);
+  Head->getTerminator()->setSuccessor(0, Body);
+
+  IRBuilder<> LB(Body);
+  Type *CountTy = LB.getInt32Ty();
+  PHINode *I = LB.CreatePHI(CountTy, 2, "div.i");
+  PHINode *Rest = LB.CreatePHI(Ty, 2, "div.x");
+  PHINode *Rem = LB.CreatePHI(Ty, 2, "div.r");
+  PHINode *Quo = LB.CreatePHI(Ty, 2, "div.q");
+
+  // The remainder is below D, so the shift can only carry out a bit when D
+  // does not fit in Bits - 1 bits, and then the divisor fits.
+  Value *Carry = LB.CreateTrunc(LB.CreateLShr(Rem, Bits - 1), LB.getInt1Ty());
+  Value *Shifted = LB.CreateOr(LB.CreateShl(Rem, 1),
+                               LB.CreateLShr(Rest, Bits - 1), "div.r.shl");
+  Value *Fits =
+      LB.CreateOr(Carry, LB.CreateICmpUGE(Shifted, D), "div.fits");
+  Value *Mask = LB.CreateSExt(Fits, Ty, "div.mask");
+  Value *RemNext =
+      LB.CreateSub(Shifted, LB.CreateAnd(D, Mask), "div.r.next");
+  Value *QuoNext = LB.CreateOr(LB.CreateShl(Quo, 1), LB.CreateZExt(Fits, Ty),
+                               "div.q.next");
+  Value *RestNext = LB.CreateShl(Rest, 1, "div.x.next");
+  Value *INext = LB.CreateAdd(I, ConstantInt::get(CountTy, 1), "div.i.next",
+                              /*HasNUW=*/true, /*HasNSW=*/true);
+  LB.CreateCondBr(LB.CreateICmpULT(INext, ConstantInt::get(CountTy, Bits)),
+                  Body, Exit);
+
+  Value *Zero = Constant::getNullValue(Ty);
+  I->addIncoming(ConstantInt::get(CountTy, 0), Head);
+  I->addIncoming(INext, Body);
+  Rest->addIncoming(X, Head);
+  Rest->addIncoming(RestNext, Body);
+  Rem->addIncoming(Zero, Head);
+  Rem->addIncoming(RemNext, Body);
+  Quo->addIncoming(Zero, Head);
+  Quo->addIncoming(QuoNext, Body);
+  return std::make_pair(QuoNext, RemNext);
+}
+
+// (V ^ S) - S: V when S is 0, -V when S is all ones.
+static Value *emitConditionalNeg(IRBuilder<> &B, Value *V, Value *S) {
+  return B.CreateSub(B.CreateXor(V, S), S);
+}
+
+bool hasEarlyExitLongMultiply(const Function &F) {
+  StringRef CPU = F.getFnAttribute("target-cpu").getValueAsString();
+  if (!CPU.empty())
+    return CPU == "cortex-m3" || CPU == "sc300";
+  Triple TT(F.getParent()->getTargetTriple());
+  return (TT.isARM() || TT.isThumb()) &&
+         TT.getSubArch() == Triple::ARMSubArch_v7m;
+}
+
+// Returns true if Div, by a constant, becomes a multiplication by the
+// reciprocal rather than a loop.
+static bool useReciprocal(const BinaryOperator *Div,
+                          const TargetTransformInfo &TTI) {
+  auto *C = dyn_cast<ConstantInt>(Div->getOperand(1));
+  auto *Ty = cast<IntegerType>(Div->getType());
+  if (2 * Ty->getBitWidth() > 32 &&
+      hasEarlyExitLongMultiply(*Div->getFunction()))
+    return false;
+  return C && !C->isZero() &&
+         (DivisionStrategyOpt == DivisionStrategy::Reciprocal ||
+          (DivisionStrategyOpt == DivisionStrategy::Auto &&
+           getReciprocalCost(Ty, TTI) < getLoopCost(Ty->getBitWidth())));
+}
+
+// Returns true if Div is a division lowerSecretDivisions rewrites.
+static bool isSecretDivision(const Instruction &I, const ResultSecret &Secrets) {
+  auto *Div = dyn_cast<BinaryOperator>(&I);
+  return Div && Div->isIntDivRem() && Div->getType()->isIntegerTy() &&
+         (Secrets.isSecret(Div->getOperand(0)) ||
+          Secrets.isSecret(Div->getOperand(1)));
+}
+
+static Value *emitDivision(BinaryOperator *Div,
+                           const TargetTransformInfo &TTI) {
+  unsigned Opcode = Div->getOpcode();
+  bool Signed = Opcode == Instruction::SDiv || Opcode == Instruction::SRem;
+  bool IsRem = Opcode == Instruction::URem || Opcode == Instruction::SRem;
+  auto *Ty = cast<IntegerType>(Div->getType());
+  unsigned Bits = Ty->getBitWidth();
+  Value *X = Div->getOperand(0);
+  Value *D = Div->getOperand(1);
+  IRBuilder<> B(Div);
+
+  if (useReciprocal(Div, TTI)) {
+    auto *C = cast<ConstantInt>(D);
+    Value *Q = emitConstantQuotient(B, X, C->getValue(), Signed);
+    return IsRem ? B.CreateSub(X, B.CreateMul(Q, C), "div.rem") : Q;
+  }
+
+  if (!Signed) {
+    auto QR = emitLoopDivision(Div, X, D);
+    return IsRem ? QR.second : QR.first;
+  }
+
+  Value *SignX = B.CreateAShr(X, Bits - 1, "div.sx");
+  Value *SignD = B.CreateAShr(D, Bits - 1, "div.sd");
+  auto QR = emitLoopDivision(Div, emitConditionalNeg(B, X, SignX),
+                             emitConditionalNeg(B, D, SignD));
+  // The remainder has the sign of the dividend, the quotient is negative
+  // when the signs differ.
+  B.SetInsertPoint(Div);
+  if (IsRem)
+    return emitConditionalNeg(B, QR.second, SignX);
+  return emitConditionalNeg(B, QR.first, B.CreateXor(SignX, SignD));
+}
+
+//------------------------------------------------------------------------------
+// Main function
+//------------------------------------------------------------------------------
+bool lowerSecretDivisions(Function &F, const ResultSecret &Secrets,
+                          const TargetTransformInfo &TTI) {
+  // Collect first: the loops split the blocks.
+  SmallVector<BinaryOperator *, 8> Divisions;
+  unsigned NumVectorDivisions = 0, NumLongMultiplies = 0;
+  bool EarlyExitLongMultiply = hasEarlyExitLongMultiply(F);
+  for (Instruction &I : instructions(F)) {
+    bool SecretOperand =
+        I.isBinaryOp() && (Secrets.isSecret(I.getOperand(0)) ||
+                           Secrets.isSecret(I.getOperand(1)));
+    if (isSecretDivision(I, Secrets))
+      Divisions.push_back(cast<BinaryOperator>(&I));
+    else if (I.isIntDivRem() && I.getType()->isVectorTy() && SecretOperand)
+      ++NumVectorDivisions;
+    else if (EarlyExitLongMultiply && I.getOpcode() == Instruction::Mul &&
+             I.getType()->getScalarSizeInBits() > 32 && SecretOperand)
+      ++NumLongMultiplies;
+  }
+
+  // The long multiplies are only reported: the user code keeps them.
+  if (NumLongMultiplies)
+    F.getContext().diagnose(DiagnosticInfoOptimizationFailure(
+        F, DiagnosticLocation(F.getSubprogram()),
+        Twine("ct-linearize: ") + Twine(NumLongMultiplies) +
+            " multiplication(s) wider than 32 bits with a secret operand in '" +
+            F.getName() + "' take a variable time on Cortex-M3"));
+
+  if (DivisionStrategyOpt == DivisionStrategy::None)
+    return false;
+
+  if (NumVectorDivisions)
+    F.getContext().diagnose(DiagnosticInfoOptimizationFailure(
+        F, DiagnosticLocation(F.getSubprogram()),
+        Twine("ct-linearize: ") + Twine(NumVectorDivisions) +
+            " vector division(s) with a secret operand in '" + F.getName() +
+            "' left as they are"));
+
+  for (BinaryOperator *Div : Divisions) {
+    Value *Result = emitDivision(Div, TTI);
+    if (Result != Div->getOperand(0))
+      Result->takeName(Div);
+    Div->replaceAllUsesWith(Result);
+    Div->eraseFromParent();
+  }
+  return !Divisions.empty();
+}
+
+uint64_t getSecretDivisionCost(const Instruction &I,
+                               const ResultSecret &Secrets,
+                               const TargetTransformInfo &TTI) {
+  if (DivisionStrategyOpt == DivisionStrategy::None ||
+      !isSecretDivision(I, Secrets))
+    return 0;
+  auto *Div = cast<BinaryOperator>(&I);
+  auto *Ty = cast<IntegerType>(Div->getType());
+  if (useReciprocal(Div, TTI))
+    return getReciprocalCost(Ty, TTI);
+  // The signed divisions also take the absolute values and fix the sign.
+  bool Signed = Div->getOpcode() == Instruction::SDiv ||
+                Div->getOpcode() == Instruction::SRem;
+  return getLoopCost(Ty->getBitWidth()) + (Signed ? 8 : 0);
+}
@@ -0,0 +1,295 @@
+//==============================================================================
+// FILE:
+//    SecretLookup.cpp
+//
+// DESCRIPTION:
+//    Constant-time table lookups for ct-linearize. A load such as sbox[x] or
+//    ctx->S[0][x >> 24] with a secret x leaks x through the cache lines it
+//    touches. It is replaced with a loop over the whole table that loads
+//    every element and keeps the one at index x:
+//      * scalar scan: Acc |= T[j] & sext(j == x), one element per iteration;
+//      * vector scan: Acc = select(<j, .., j+VF-1> == x, T[j..j+VF-1], Acc),
+//        one vector register per iteration, then an OR reduction of Acc.
+//    The cost model counts the instructions of both, the vector scan is only
+//    available when the target has vector registers (TTI) and they divide
+//    the table. -ct-table-lookup forces one of them.
+//
+//    With -ct-align-tables, the global tables are also aligned on a cache
+//    line, so that a scan touches as few lines as possible and the vector
+//    loads are aligned.
+//
+// License: MIT
+//==============================================================================
+#include "SecretLookup.h"
+#include "Secret.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+
+using namespace llvm;
+
+namespace {
+enum class LookupStrategy { Auto, Scalar, Vector, None };
+
+// A load from Table at a secret Index: &Table[Index] followed by constant
+// indices into the element, the table being at Ptr + Prefix.
+struct TableLookup {
+  LoadInst *Load;
+  ArrayType *Table;
+  Type *SourceTy;
+  Value *Ptr;
+  SmallVector<Value *, 2> Prefix;
+  Value *Index;
+  SmallVector<Value *, 2> Suffix;
+};
+} // namespace
+
+static cl::opt<LookupStrategy> LookupStrategyOpt(
+    "ct-table-lookup",
+    cl::desc("How ct-linearize rewrites the loads from a table at a secret "
+             "index"),
+    cl::init(LookupStrategy::Auto),
+    cl::values(clEnumValN(LookupStrategy::Auto, "auto", "Use the cost model"),
+               clEnumValN(LookupStrategy::Scalar, "scalar",
+                          "Masked scan, one element at a time"),
+               clEnumValN(LookupStrategy::Vector, "vector",
+                          "Compare and blend scan, one vector at a time"),
+               clEnumValN(LookupStrategy::None, "none",
+                          "Keep the loads as they are")));
+
+static cl::opt<bool>
+    AlignTables("ct-align-tables",
+                cl::desc("Align the global tables scanned by ct-linearize on "
+                         "a cache line"),
+                cl::init(false));
+
+static const unsigned CacheLineSize = 64;
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+static bool getTableLookup(LoadInst *Load, const ResultSecret &Secrets,
+                           TableLookup &TL) {
+  auto *GEP = dyn_cast<GetElementPtrInst>(Load->getPointerOperand());
+  if (!GEP || !Load->isSimple() || !Load->getType()->isIntegerTy() ||
+      Secrets.isSecret(GEP->getPointerOperand()))
+    return false;
+
+  SmallVector<Value *, 4> Indices(GEP->indices());
+  auto *It = llvm::find_if(Indices,
+                           [&](Value *V) { return Secrets.isSecret(V); });
+  if (It == Indices.end())
+    return false;
+  unsigned K = It - Indices.begin();
+
+  // The indices after the secret one select a field of the element.
+  Type *ElementTy = nullptr;
+  TL.SourceTy = GEP->getSourceElementType();
+  TL.Ptr = GEP->getPointerOperand();
+  if (K == 0) {
+    // Pointer arithmetic over a global array, as in *(sbox + x).
+    auto *GV = dyn_cast<GlobalVariable>(TL.Ptr);
+    TL.Table = GV ? dyn_cast<ArrayType>(GV->getValueType()) : nullptr;
+    if (!TL.Table || TL.Table->getElementType() != TL.SourceTy)
+      return false;
+    TL.SourceTy = TL.Table;
+    TL.Prefix.push_back(ConstantInt::get(Indices[0]->getType(), 0));
+  } else {
+    TL.Table = dyn_cast_or_null<ArrayType>(GetElementPtrInst::getIndexedType(
+        TL.SourceTy, ArrayRef<Value *>(Indices).take_front(K)));
+    if (!TL.Table)
+      return false;
+    TL.Prefix.append(Indices.begin(), Indices.begin() + K);
+  }
+
+  ElementTy = TL.Table->getElementType();
+  for (Value *Idx : ArrayRef<Value *>(Indices).drop_front(K + 1)) {
+    if (!isa<ConstantInt>(Idx))
+      return false;
+    ElementTy = GetElementPtrInst::getTypeAtIndex(ElementTy, Idx);
+    TL.Suffix.push_back(Idx);
+  }
+
+  TL.Load = Load;
+  TL.Index = Indices[K];
+  return ElementTy == Load->getType() && TL.Table->getNumElements() > 0;
+}
+
+// Number of elements per vector scan step, 1 if there is none.
+static unsigned getVectorWidth(const TableLookup &TL, const DataLayout &DL,
+                               const TargetTransformInfo &TTI) {
+  Type *Ty = TL.Load->getType();
+  unsigned Bits = Ty->getIntegerBitWidth();
+  if (!TL.Suffix.empty() || DL.getTypeAllocSizeInBits(Ty) != Bits)
+    return 1;
+
+  unsigned RegBits =
+      TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector)
+          .getKnownMinValue();
+  unsigned Width = RegBits / Bits;
+  uint64_t N = TL.Table->getNumElements();
+  while (Width >= 2 && N % Width)
+    Width /= 2;
+  return Width >= 2 ? Width : 1;
+}
+
+// Instructions executed by a scan of N elements, Width at a time, including
+// the induction variable, the compare and branch of the loop and, for the
+// vector scan, the splat of the index and the reduction.
+static uint64_t getScanCost(uint64_t N, unsigned Width) {
+  if (Width == 1)
+    return 7 * N;
+  return 6 * (N / Width) + Log2_32(Width) + 2;
+}
+
+// The width lowerSecretLookups scans TL with.
+static unsigned chooseWidth(const TableLookup &TL, const DataLayout &DL,
+                            const TargetTransformInfo &TTI) {
+  uint64_t N = TL.Table->getNumElements();
+  unsigned Width = getVectorWidth(TL, DL, TTI);
+  if (LookupStrategyOpt == LookupStrategy::Scalar ||
+      (LookupStrategyOpt == LookupStrategy::Auto &&
+       getScanCost(N, Width) >= getScanCost(N, 1)))
+    return 1;
+  return Width;
+}
+
+static Value *emitScan(const TableLookup &TL, unsigned Width,
+                       const DataLayout &DL) {
+  LoadInst *Load = TL.Load;
+  Type *EltTy = Load->getType();
+  uint64_t N = TL.Table->getNumElements();
+  IRBuilder<> B(Load);
+
+  Value *Base = TL.Ptr;
+  auto *Zero = dyn_cast<Constant>(TL.Prefix[0]);
+  if (TL.Prefix.size() != 1 || !Zero || !Zero->isNullValue())
+    Base = B.CreateInBoundsGEP(TL.SourceTy, TL.Ptr, TL.Prefix, "scan.base");
+
+  auto *GV = dyn_cast<GlobalVariable>(Base);
+  if (AlignTables && GV && !GV->isDeclaration() &&
+      GV->getPointerAlignment(DL) < CacheLineSize)
+    GV->setAlignment(Align(CacheLineSize));
+
+  // Same semantics as the GEP index: sign-extended or truncated.
+  Type *IdxTy = DL.getIndexType(Base->getType());
+  Value *Index = B.CreateSExtOrTrunc(TL.Index, IdxTy, "scan.idx");
+
+  uint64_t EltSize = DL.getTypeAllocSize(TL.Table->getElementType());
+  Align EltAlign = commonAlignment(Load->getAlign(), EltSize);
+  Type *AccTy = EltTy;
+  Value *Lanes = nullptr, *IndexLanes = nullptr;
+  Align VecAlign;
+  if (Width > 1) {
+    // Compare the indices in lanes as wide as the elements if they fit.
+    Type *LaneTy = EltTy;
+    if (N - 1 > maxUIntN(EltTy->getIntegerBitWidth()))
+      LaneTy = IdxTy;
+    AccTy = FixedVectorType::get(EltTy, Width);
+    SmallVector<Constant *, 32> Offsets;
+    for (unsigned I = 0; I < Width; I++)
+      Offsets.push_back(ConstantInt::get(LaneTy, I));
+    Lanes = ConstantVector::get(Offsets);
+    IndexLanes = B.CreateVectorSplat(
+        Width, B.CreateTrunc(Index, LaneTy, "scan.lane"), "scan.splat");
+    Align BaseAlign = GV ? GV->getPointerAlignment(DL) : EltAlign;
+    VecAlign = commonAlignment(BaseAlign, Width * EltSize);
+  }
+
+  // Adds the elements from J to J + Width - 1 to Acc.
+  auto emitStep = [&](IRBuilder<> &B, Value *J, Value *Acc) -> Value * {
+    SmallVector<Value *, 4> Indices{ConstantInt::get(IdxTy, 0), J};
+    Indices.append(TL.Suffix.begin(), TL.Suffix.end());
+    Value *Ptr = B.CreateInBoundsGEP(TL.Table, Base, Indices, "scan.ptr");
+
+    if (Width == 1) {
+      Value *Elt = B.CreateAlignedLoad(EltTy, Ptr, EltAlign, "scan.elt");
+      Value *Mask = B.CreateSExt(B.CreateICmpEQ(J, Index), EltTy, "scan.mask");
+      return B.CreateOr(Acc, B.CreateAnd(Elt, Mask), "scan.acc.next");
+    }
+    Value *Elts = B.CreateAlignedLoad(AccTy, Ptr, VecAlign, "scan.elts");
+    Value *JLanes = B.CreateVectorSplat(
+        Width, B.CreateTrunc(J, Lanes->getType()->getScalarType()));
+    Value *Hit = B.CreateICmpEQ(B.CreateAdd(JLanes, Lanes), IndexLanes,
+                                "scan.hit");
+    return B.CreateSelect(Hit, Elts, Acc, "scan.acc.next");
+  };
+
+  Value *Acc = Constant::getNullValue(AccTy);
+  if (N == Width) {
+    Acc = emitStep(B, ConstantInt::get(IdxTy, 0), Acc);
+  } else {
+    BasicBlock *Head = Load->getParent();
+    BasicBlock *Exit =
+        Head->splitBasicBlock(Load, "scan.end");
+    BasicBlock *Body = BasicBlock::Create(Head->getContext(),
+                                          "scan",
+                                          Head->getParent(), Exit);
+    Head->getTerminator()->setSuccessor(0, Body);
+
+    IRBuilder<> LB(Body);
+    PHINode *J = LB.CreatePHI(IdxTy, 2, "scan.j");
+    PHINode *AccPhi = LB.CreatePHI(AccTy, 2, "scan.acc");
+    Value *Next = emitStep(LB, J, AccPhi);
+    Value *JNext = LB.CreateAdd(J, ConstantInt::get(IdxTy, Width), "scan.j.next",
+                                /*HasNUW=*/true, /*HasNSW=*/true);
+    LB.CreateCondBr(LB.CreateICmpULT(JNext, ConstantInt::get(IdxTy, N)), Body,
+                    Exit);
+    J->addIncoming(ConstantInt::get(IdxTy, 0), Head);
+    J->addIncoming(JNext, Body);
+    AccPhi->addIncoming(Acc, Head);
+    AccPhi->addIncoming(Next, Body);
+
+    Acc = Next;
+    B.SetInsertPoint(Load);
+  }
+
+  if (Width > 1)
+    Acc = B.CreateOrReduce(Acc);
+  return Acc;
+}
+
+//------------------------------------------------------------------------------
+// Main function
+//------------------------------------------------------------------------------
+bool lowerSecretLookups(Function &F, const ResultSecret &Secrets,
+                        const TargetTransformInfo &TTI) {
+  if (LookupStrategyOpt == LookupStrategy::None)
+    return false;
+
+  // Collect first: the scans split the blocks.
+  SmallVector<TableLookup, 8> Lookups;
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      TableLookup TL;
+      if (auto *Load = dyn_cast<LoadInst>(&I))
+        if (getTableLookup(Load, Secrets, TL))
+          Lookups.push_back(std::move(TL));
+    }
+
+  const DataLayout &DL = F.getParent()->getDataLayout();
+  for (TableLookup &TL : Lookups) {
+    unsigned Width = chooseWidth(TL, DL, TTI);
+    auto *GEP = cast<GetElementPtrInst>(TL.Load->getPointerOperand());
+    Value *Result = emitScan(TL, Width, DL);
+    Result->takeName(TL.Load);
+    TL.Load->replaceAllUsesWith(Result);
+    TL.Load->eraseFromParent();
+    if (GEP->use_empty())
+      GEP->eraseFromParent();
+  }
+  return !Lookups.empty();
+}
+
+uint64_t getSecretLookupCost(Instruction &I, const ResultSecret &Secrets,
+                             const TargetTransformInfo &TTI) {
+  auto *Load = dyn_cast<LoadInst>(&I);
+  TableLookup TL;
+  if (LookupStrategyOpt == LookupStrategy::None || !Load ||
+      !getTableLookup(Load, Secrets, TL))
+    return 0;
+  const DataLayout &DL = I.getModule()->getDataLayout();
+  return getScanCost(TL.Table->getNumElements(), chooseWidth(TL, DL, TTI));
+}
@@ -0,0 +1,452 @@
+//==============================================================================
+// FILE:
+//    SecretLoops.cpp
+//
+// DESCRIPTION:
+//    Loops with a fixed trip count for ct-linearize. A loop whose exit
+//    depends on a secret (`while (res > 0) res--;`, a `break` on a secret)
+//    runs a secret number of iterations, and serializing its exit branches
+//    would run the code after the loop in the middle of it. Such a loop is
+//    rewritten into one that always runs its maximum number of iterations:
+//
+//      header:                        ; the old PHIs, plus
+//        %ct.trip = phi i32 [ 0, %preheader ], [ %ct.trip.next, %ct.latch ]
+//        %ct.live = phi i1 [ true, %preheader ], [ %ct.live.next, %ct.latch ]
+//        br i1 %ct.live, label %header.ct.body, label %header.ct.latch
+//      header.ct.body:                ; the old body, whose exits jump to
+//        ...                          ; blocks clearing the live flag
+//      header.ct.latch:
+//        %ct.trip.next = add nuw i32 %ct.trip, 1
+//        %ct.trip.more = icmp ult i32 %ct.trip.next, <trips>
+//        br i1 %ct.trip.more, label %header, label %header.ct.done
+//
+//    The exit taken and the values used after the loop (its LCSSA PHIs) are
+//    carried across the iterations to header.ct.done, which branches to the
+//    old exit block. The branches on the live flag and on the old exit
+//    conditions are secret: ct-linearize serializes them as the others, and
+//    the loop latch now only depends on the public iteration count, so that
+//    the loop can be unrolled.
+//
+//    The induction variables of the loop still advance in the iterations
+//    after the exit, so that the addresses computed from them go through
+//    the same sequence whichever iteration the loop left at: only the other
+//    values are held by the live flag.
+//
+//    The maximum trip count is the smallest of the maximum ScalarEvolution
+//    proves and of the ct_trip:N annotation of the function, up to
+//    -ct-max-trip-count. The annotation is trusted: a loop that would run
+//    more iterations is cut after N of them, and leaves through its first
+//    exit block. It is only checked against a trip count ScalarEvolution
+//    knows exactly.
+//
+//    The small loops with a constant trip count of the serialized regions
+//    (`for (i = 0; i < 7; i++)`, the rounds of a block cipher) are fully
+//    unrolled before the serialization instead, up to -ct-unroll-threshold
+//    instructions: their blocks are serialized as straight-line code, without
+//    the header and latch of each iteration nor the predicates recomputed in
+//    each of them.
+//
+// License: MIT
+//==============================================================================
+#include "SecretLoops.h"
+#include "SecretAnnotations.h"
+
+#include "llvm/ADT/Statistic.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/UnrollLoop.h"
+
+using namespace llvm;
+
+#define DEBUG_TYPE "secret"
+
+STATISTIC(NumBoundedLoops, "Number of loops given a fixed trip count");
+STATISTIC(NumUnrolledLoops, "Number of loops fully unrolled by ct-linearize");
+
+static cl::opt<unsigned> MaxTripCount(
+    "ct-max-trip-count",
+    cl::desc("Largest number of iterations ct-linearize gives a loop whose "
+             "exit depends on a secret"),
+    cl::init(4096));
+
+static cl::opt<unsigned> UnrollThreshold(
+    "ct-unroll-threshold",
+    cl::desc("Largest number of instructions ct-linearize fully unrolls a "
+             "loop with a constant trip count into, 0 to keep the loops"),
+    cl::init(300));
+
+static const char *const BoundedLoopMD = "llvm.loop.ct.bounded";
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+static unsigned getAnnotatedTripCount(const Function &F) {
+  SmallVector<std::pair<GlobalValue *, StringRef>, 8> Annotated;
+  getAnnotatedGlobals(*F.getParent(), Annotated);
+
+  unsigned Trips = 0;
+  for (auto &Pair : Annotated) {
+    unsigned N = Pair.first == &F ? getTripAnnotation(Pair.second) : 0;
+    if (N && (!Trips || N < Trips))
+      Trips = N;
+  }
+  return Trips;
+}
+
+// Returns the ID of the bounded loop, keeping the properties of the old one
+// (OldID, may be null) but the self reference.
+static MDNode *getBoundedLoopID(LLVMContext &Ctx, MDNode *OldID,
+                                unsigned Trips) {
+  SmallVector<Metadata *, 4> MDs(1);
+  if (OldID)
+    MDs.append(OldID->op_begin() + 1, OldID->op_end());
+  MDs.push_back(MDNode::get(
+      Ctx, {MDString::get(Ctx, BoundedLoopMD),
+            ConstantAsMetadata::get(
+                ConstantInt::get(Type::getInt32Ty(Ctx), Trips))}));
+
+  MDNode *ID = MDNode::getDistinct(Ctx, MDs);
+  ID->replaceOperandWith(0, ID);
+  return ID;
+}
+
+// Returns the step of Phi, a PHI of the header of L, if it is an affine
+// induction variable of L with a constant or loop-invariant step, null
+// otherwise.
+static Value *getInductionStep(PHINode &Phi, Loop &L, ScalarEvolution &SE) {
+  if (!SE.isSCEVable(Phi.getType()))
+    return nullptr;
+  auto *AR = dyn_cast<SCEVAddRecExpr>(SE.getSCEV(&Phi));
+  if (!AR || AR->getLoop() != &L || !AR->isAffine())
+    return nullptr;
+
+  const SCEV *Step = AR->getStepRecurrence(SE);
+  if (auto *C = dyn_cast<SCEVConstant>(Step))
+    return C->getValue();
+  if (auto *U = dyn_cast<SCEVUnknown>(Step))
+    return L.isLoopInvariant(U->getValue()) ? U->getValue() : nullptr;
+  return nullptr;
+}
+
+namespace {
+// A value carried from the exits of the loop to its new exit: an LCSSA PHI
+// of an exit block, the value it has in the current iteration and in the
+// next one.
+struct CarriedValue {
+  PHINode *ExitPhi;
+  PHINode *Cur;
+  PHINode *Next;
+};
+} // namespace
+
+//------------------------------------------------------------------------------
+// Bounded loops
+//------------------------------------------------------------------------------
+unsigned getMaxTripCount(Loop &L, ScalarEvolution &SE) {
+  uint64_t Trips = 0;
+  const SCEV *MaxBTC = SE.getConstantMaxBackedgeTakenCount(&L);
+  if (auto *C = dyn_cast<SCEVConstant>(MaxBTC))
+    if (C->getAPInt().ult(MaxTripCount))
+      Trips = C->getAPInt().getZExtValue() + 1;
+
+  // The annotation is trusted: a loop running more iterations than it says
+  // leaves through the first exit block after the last one. Only a trip
+  // count known exactly tells that it is wrong.
+  Function &F = *L.getHeader()->getParent();
+  unsigned Annotated = getAnnotatedTripCount(F);
+  if (Annotated && (!Trips || Annotated < Trips)) {
+    unsigned Exact = SE.getSmallConstantTripCount(&L);
+    if (Exact > Annotated)
+      report_fatal_error(Twine("ct-linearize: the ct_trip:") +
+                         Twine(Annotated) + " annotation of '" + F.getName() +
+                         "' cuts the loop at '" + L.getHeader()->getName() +
+                         "', which runs " + Twine(Exact) + " iterations");
+    Trips = Annotated;
+  }
+
+  return Trips <= MaxTripCount ? Trips : 0;
+}
+
+bool boundLoop(Loop &L, unsigned Trips, DominatorTree &DT, LoopInfo &LI,
+               ScalarEvolution &SE) {
+  BasicBlock *Preheader = L.getLoopPreheader();
+  BasicBlock *Header = L.getHeader();
+  BasicBlock *OldLatch = L.getLoopLatch();
+  if (!Trips || !Preheader || !OldLatch || !L.hasDedicatedExits())
+    return false;
+
+  SmallVector<BasicBlock *, 4> Exiting;
+  L.getExitingBlocks(Exiting);
+  if (Exiting.empty() || any_of(Exiting, [](BasicBlock *BB) {
+        return !isa<BranchInst>(BB->getTerminator());
+      }))
+    return false;
+
+  // The values used after the loop all go through the PHIs of the exit
+  // blocks, which are carried to the new exit.
+  formLCSSARecursively(L, DT, &LI, nullptr);
+
+  SmallVector<BasicBlock *, 4> Exits;
+  L.getUniqueExitBlocks(Exits);
+  for (BasicBlock *Exit : Exits)
+    for (PHINode &Phi : Exit->phis())
+      if (Phi.getType()->isTokenTy())
+        return false;
+
+  LLVMContext &Ctx = Header->getContext();
+  Function &F = *Header->getParent();
+  Type *I1 = Type::getInt1Ty(Ctx);
+  Type *I32 = Type::getInt32Ty(Ctx);
+
+  BranchInst *OldBackEdge = cast<BranchInst>(OldLatch->getTerminator());
+  MDNode *OldID = OldBackEdge->getMetadata(LLVMContext::MD_loop);
+  OldBackEdge->setMetadata(LLVMContext::MD_loop, nullptr);
+
+  SmallVector<PHINode *, 8> HeaderPhis;
+  SmallVector<std::pair<PHINode *, Value *>, 4> Inductions;
+  for (PHINode &Phi : Header->phis()) {
+    if (Value *Step = getInductionStep(Phi, L, SE))
+      Inductions.push_back(std::make_pair(&Phi, Step));
+    else
+      HeaderPhis.push_back(&Phi);
+  }
+
+  // The header only keeps its PHIs and the branch on the live flag.
+  BasicBlock *Body = SplitBlock(Header, Header->getFirstNonPHI(), &DT, &LI,
+                                nullptr, Header->getName() + ".ct.body");
+  if (OldLatch == Header)
+    OldLatch = Body;
+
+  SmallVector<Loop::Edge, 4> ExitEdges;
+  L.getExitEdges(ExitEdges);
+  ExitEdges.erase(std::unique(ExitEdges.begin(), ExitEdges.end()),
+                  ExitEdges.end());
+
+  BasicBlock *Latch = BasicBlock::Create(Ctx, Header->getName() + ".ct.latch",
+                                         &F, Exits.front());
+  BasicBlock *Done = BasicBlock::Create(Ctx, Header->getName() + ".ct.done",
+                                        &F, Exits.front());
+
+  IRBuilder<> Builder(Header, Header->begin());
+  PHINode *Trip = Builder.CreatePHI(I32, 2, "ct.trip");
+  PHINode *Live = Builder.CreatePHI(I1, 2, "ct.live");
+  PHINode *ExitId =
+      Exits.size() > 1 ? Builder.CreatePHI(I32, 2, "ct.exit.id") : nullptr;
+
+  Builder.SetInsertPoint(Latch);
+  PHINode *LiveNext = Builder.CreatePHI(I1, 4, "ct.live.next");
+  PHINode *ExitIdNext =
+      ExitId ? Builder.CreatePHI(I32, 4, "ct.exit.id.next") : nullptr;
+
+  SmallVector<std::pair<PHINode *, PHINode *>, 8> HeaderNexts;
+  for (PHINode *Phi : HeaderPhis)
+    HeaderNexts.push_back(std::make_pair(
+        Phi, Builder.CreatePHI(Phi->getType(), 4, Phi->getName() + ".ct.next")));
+
+  SmallVector<CarriedValue, 8> Carried;
+  for (BasicBlock *Exit : Exits) {
+    for (PHINode &Phi : Exit->phis()) {
+      PHINode *Cur = PHINode::Create(Phi.getType(), 2, Phi.getName() + ".ct",
+                                     Header->getFirstNonPHI());
+      PHINode *Next = Builder.CreatePHI(Phi.getType(), 4,
+                                        Phi.getName() + ".ct.next");
+      Carried.push_back(CarriedValue{&Phi, Cur, Next});
+    }
+  }
+
+  // Adds the incoming values of the latch PHIs for an edge: an iteration
+  // that goes on, that is skipped or that leaves keeps everything but the
+  // values it sets.
+  auto AddEdge = [&](BasicBlock *From, Value *LiveValue, Value *ExitIdValue,
+                     const Loop::Edge *ExitEdge, bool Continues) {
+    LiveNext->addIncoming(LiveValue, From);
+    if (ExitIdNext)
+      ExitIdNext->addIncoming(ExitIdValue, From);
+    for (auto &Pair : HeaderNexts)
+      Pair.second->addIncoming(
+          Continues ? Pair.first->getIncomingValueForBlock(OldLatch)
+                    : Pair.first,
+          From);
+    for (CarriedValue &Value : Carried)
+      Value.Next->addIncoming(
+          ExitEdge && Value.ExitPhi->getParent() == ExitEdge->second
+              ? Value.ExitPhi->getIncomingValueForBlock(ExitEdge->first)
+              : Value.Cur,
+          From);
+  };
+
+  // The skipped iterations.
+  Header->getTerminator()->eraseFromParent();
+  BranchInst::Create(Body, Latch, Live, Header);
+  AddEdge(Header, Live, ExitId, nullptr, false);
+
+  // The iterations going on, on a live flag that is true.
+  for (unsigned I = 0; I < OldBackEdge->getNumSuccessors(); ++I) {
+    if (OldBackEdge->getSuccessor(I) != Header)
+      continue;
+    OldBackEdge->setSuccessor(I, Latch);
+    AddEdge(OldLatch, Live, ExitId, nullptr, true);
+  }
+
+  // The iterations leaving, through a block clearing the live flag.
+  for (auto &Edge : ExitEdges) {
+    BasicBlock *Exiting = Edge.first;
+    BasicBlock *Exit = Edge.second;
+    auto *Br = cast<BranchInst>(Exiting->getTerminator());
+
+    BasicBlock *Stop = BasicBlock::Create(Ctx, Exiting->getName() + ".ct.exit",
+                                          &F, Latch);
+    for (unsigned I = 0; I < Br->getNumSuccessors(); ++I)
+      if (Br->getSuccessor(I) == Exit)
+        Br->setSuccessor(I, Stop);
+
+    // The flags are computed from the condition, true on this edge, rather
+    // than being constants: the Secret analysis only follows the data flow.
+    Builder.SetInsertPoint(Stop);
+    Value *Cond = nullptr;
+    bool ExitsOnTrue = true;
+    if (Br->isConditional() && Br->getSuccessor(0) != Br->getSuccessor(1)) {
+      Cond = Br->getCondition();
+      ExitsOnTrue = Br->getSuccessor(0) == Stop;
+    }
+
+    Value *LiveValue = ConstantInt::getFalse(Ctx);
+    if (Cond)
+      LiveValue = ExitsOnTrue ? Builder.CreateNot(Cond, "ct.live.exit") : Cond;
+
+    Value *ExitIdValue = nullptr;
+    if (ExitId) {
+      Value *Index = ConstantInt::get(I32, find(Exits, Exit) - Exits.begin());
+      ExitIdValue = !Cond ? Index
+                    : ExitsOnTrue
+                        ? Builder.CreateSelect(Cond, Index, ExitId, "ct.exit.sel")
+                        : Builder.CreateSelect(Cond, ExitId, Index, "ct.exit.sel");
+    }
+    Builder.CreateBr(Latch);
+    AddEdge(Stop, LiveValue, ExitIdValue, &Edge, false);
+  }
+
+  // The new latch, where the induction variables advance whatever the live
+  // flag.
+  Builder.SetInsertPoint(Latch);
+  for (auto &Pair : Inductions) {
+    PHINode *Phi = Pair.first;
+    Value *Next =
+        Phi->getType()->isPointerTy()
+            ? Builder.CreateGEP(Builder.getInt8Ty(), Phi, Pair.second,
+                                Phi->getName() + ".ct.next")
+            : Builder.CreateAdd(Phi, Pair.second, Phi->getName() + ".ct.next");
+    while (Phi->getBasicBlockIndex(OldLatch) >= 0)
+      Phi->removeIncomingValue(OldLatch, /*DeletePHIIfEmpty=*/false);
+    Phi->addIncoming(Next, Latch);
+  }
+  Value *TripNext = Builder.CreateAdd(Trip, ConstantInt::get(I32, 1),
+                                      "ct.trip.next", /*HasNUW=*/true);
+  Value *More = Builder.CreateICmpULT(TripNext, ConstantInt::get(I32, Trips),
+                                      "ct.trip.more");
+  Builder.CreateCondBr(More, Header, Done)
+      ->setMetadata(LLVMContext::MD_loop, getBoundedLoopID(Ctx, OldID, Trips));
+
+  Trip->addIncoming(ConstantInt::get(I32, 0), Preheader);
+  Trip->addIncoming(TripNext, Latch);
+  Live->addIncoming(ConstantInt::getTrue(Ctx), Preheader);
+  Live->addIncoming(LiveNext, Latch);
+  if (ExitId) {
+    ExitId->addIncoming(ConstantInt::get(I32, 0), Preheader);
+    ExitId->addIncoming(ExitIdNext, Latch);
+  }
+  for (auto &Pair : HeaderNexts) {
+    while (Pair.first->getBasicBlockIndex(OldLatch) >= 0)
+      Pair.first->removeIncomingValue(OldLatch, /*DeletePHIIfEmpty=*/false);
+    Pair.first->addIncoming(Pair.second, Latch);
+  }
+  for (CarriedValue &Value : Carried) {
+    Value.Cur->addIncoming(Constant::getNullValue(Value.Cur->getType()),
+                           Preheader);
+    Value.Cur->addIncoming(Value.Next, Latch);
+  }
+
+  // The new exit resumes at the old exit block that was taken.
+  BasicBlock *Dispatch = Done;
+  Builder.SetInsertPoint(Dispatch);
+  for (unsigned I = 0; I + 1 < Exits.size(); ++I) {
+    BasicBlock *Next = I + 2 < Exits.size()
+                           ? BasicBlock::Create(Ctx, Done->getName(), &F,
+                                                Exits.front())
+                           : Exits[I + 1];
+    Builder.CreateCondBr(Builder.CreateICmpEQ(ExitIdNext,
+                                              ConstantInt::get(I32, I),
+                                              "ct.exit.is"),
+                         Exits[I], Next);
+    Builder.SetInsertPoint(Next);
+  }
+  if (Exits.size() == 1)
+    Builder.CreateBr(Exits.front());
+
+  for (CarriedValue &Value : Carried) {
+    Value.ExitPhi->replaceAllUsesWith(Value.Next);
+    Value.ExitPhi->eraseFromParent();
+  }
+  ++NumBoundedLoops;
+  LLVM_DEBUG(dbgs() << "ct-linearize: bounded " << Header->getName() << " to "
+                    << Trips << " iterations\n");
+  return true;
+}
+
+unsigned getBoundedTripCount(const Loop &L) {
+  MDNode *ID = L.getLoopID();
+  MDNode *Bounded = ID ? findOptionMDForLoopID(ID, BoundedLoopMD) : nullptr;
+  if (!Bounded || Bounded->getNumOperands() < 2)
+    return 0;
+  return mdconst::extract<ConstantInt>(Bounded->getOperand(1))->getZExtValue();
+}
+
+//------------------------------------------------------------------------------
+// Unrolled loops
+//------------------------------------------------------------------------------
+bool unrollSmallLoop(Loop &L, DominatorTree &DT, LoopInfo &LI,
+                     ScalarEvolution &SE, AssumptionCache &AC,
+                     const TargetTransformInfo &TTI) {
+  // A bounded loop predicates its stores as a loop, and runs its maximum
+  // number of iterations anyway.
+  if (!UnrollThreshold || getBoundedTripCount(L) || !L.isLoopSimplifyForm())
+    return false;
+
+  unsigned Trips = SE.getSmallConstantTripCount(&L);
+  if (!Trips)
+    return false;
+
+  uint64_t Size = 0;
+  for (BasicBlock *BB : L.blocks())
+    Size += BB->sizeWithoutDebug();
+  if (Size * Trips > UnrollThreshold)
+    return false;
+
+  UnrollLoopOptions ULO;
+  ULO.Count = Trips;
+  ULO.Force = false;
+  ULO.Runtime = false;
+  ULO.AllowExpensiveTripCount = false;
+  ULO.UnrollRemainder = false;
+  ULO.ForgetAllSCEV = false;
+
+  // UnrollLoop only rewrites the uses after the loop that go through an LCSSA
+  // PHI: the others would keep the value of the first iteration. The new
+  // PHIs change the IR even if UnrollLoop gives up, and have no taint yet.
+  bool AddedLCSSA = formLCSSARecursively(L, DT, &LI, &SE);
+  BasicBlock *Header = L.getHeader();
+  OptimizationRemarkEmitter ORE(Header->getParent());
+  if (UnrollLoop(&L, ULO, &LI, &SE, &DT, &AC, &TTI, &ORE,
+                 /*PreserveLCSSA=*/true) != LoopUnrollResult::FullyUnrolled)
+    return AddedLCSSA;
+
+  ++NumUnrolledLoops;
+  LLVM_DEBUG(dbgs() << "ct-linearize: unrolled " << Header->getName() << ", "
+                    << Trips << " iterations of " << Size << " instructions\n");
+  return true;
+}
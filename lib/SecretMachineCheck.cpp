@@ -0,0 +1,448 @@
+//==============================================================================
+// FILE:
+//    SecretMachineCheck.cpp
+//
+// DESCRIPTION:
+//    Constant-time checker for the machine code of the ct-llc tool. Even when
+//    the IR has no branch on a secret, the backend may lower a select, a
+//    division or a table lookup with a conditional jump, or index memory with
+//    a secret.
+//
+//    The IR taint cannot be looked up from machine instructions, so it is
+//    carried over with markers: before code generation, each value where a
+//    secret enters a register goes through an inline asm that only prints a
+//    "ct-secret" comment and returns its operand. On the final machine code,
+//    the registers defined by these inline asm are secret, and the taint is
+//    propagated forward through the register units and the stack slots, until
+//    a fixed point over the CFG.
+//
+// License: MIT
+//==============================================================================
+#include "SecretMachineCheck.h"
+#include "Secret.h"
+
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/CodeGen/MachineFrameInfo.h"
+#include "llvm/CodeGen/MachineFunction.h"
+#include "llvm/CodeGen/PseudoSourceValue.h"
+#include "llvm/CodeGen/TargetInstrInfo.h"
+#include "llvm/CodeGen/TargetLowering.h"
+#include "llvm/CodeGen/TargetRegisterInfo.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/MathExtras.h"
+
+using namespace llvm;
+
+static const char *MarkerComment = "${:comment} ct-secret";
+
+//------------------------------------------------------------------------------
+// IR markers
+//------------------------------------------------------------------------------
+// The markers use the "r" constraint: integers and pointers, in general
+// purpose registers.
+static bool canMark(Type *Ty) {
+  return Ty->isPointerTy() || Ty->isIntegerTy();
+}
+
+static Value *createMarker(Value *V, IRBuilder<> &Builder) {
+  Type *Ty = V->getType();
+  FunctionType *FTy = FunctionType::get(Ty, {Ty}, /*isVarArg=*/false);
+  InlineAsm *Marker = InlineAsm::get(FTy, MarkerComment, "=r,0",
+                                     /*hasSideEffects=*/false);
+  return Builder.CreateCall(FTy, Marker, {V}, V->getName() + ".ct");
+}
+
+// An integer narrower than a byte is marked as a byte, and one wider than a
+// register (i64 on ARMv7-M) as one marker per register it takes.
+static void markValue(Value *V, Instruction *InsertBefore,
+                      const DataLayout &DL) {
+  SmallVector<Use *, 8> Uses(make_pointer_range(V->uses()));
+  IRBuilder<> Builder(InsertBefore);
+  Type *Ty = V->getType();
+  unsigned Bits = Ty->isIntegerTy() ? Ty->getIntegerBitWidth() : 0;
+  unsigned RegBits = DL.getPointerSizeInBits();
+
+  Value *Marked = nullptr;
+  if (!Bits || (Bits >= 8 && Bits <= RegBits)) {
+    Marked = createMarker(V, Builder);
+  } else if (Bits < 8) {
+    Marked = Builder.CreateTrunc(
+        createMarker(Builder.CreateZExt(V, Builder.getInt8Ty()), Builder), Ty);
+  } else {
+    Type *WideTy = Builder.getIntNTy(alignTo(Bits, RegBits));
+    Value *Wide = Builder.CreateZExt(V, WideTy);
+    for (unsigned Shift = 0; Shift < Bits; Shift += RegBits) {
+      Value *Part = Shift ? Builder.CreateLShr(Wide, Shift) : Wide;
+      Part = createMarker(
+          Builder.CreateTrunc(Part, Builder.getIntNTy(RegBits)), Builder);
+      Part = Builder.CreateZExt(Part, WideTy);
+      if (Shift)
+        Part = Builder.CreateShl(Part, Shift);
+      Marked = Marked ? Builder.CreateOr(Marked, Part) : Part;
+    }
+    Marked = Builder.CreateTrunc(Marked, Ty);
+  }
+
+  for (Use *U : Uses)
+    U->set(Marked);
+}
+
+unsigned markSecretRoots(Module &M, FunctionAnalysisManager &FAM) {
+  const DataLayout &DL = M.getDataLayout();
+  unsigned NumMarked = 0;
+
+  for (Function &F : M) {
+    if (F.isDeclaration())
+      continue;
+    const ResultSecret &Secrets = FAM.getResult<Secret>(F);
+
+    // A secret enters a register through an argument, a load or a call.
+    // Anything else computed from public operands only is a secret as well.
+    SmallVector<std::pair<Value *, Instruction *>, 16> Roots;
+    for (Argument &Arg : F.args())
+      if (Secrets.isSecret(&Arg))
+        Roots.push_back({&Arg, &*F.getEntryBlock().getFirstInsertionPt()});
+
+    for (BasicBlock &BB : F)
+      for (Instruction &I : BB) {
+        if (!Secrets.isSecret(&I) || isa<PHINode>(I) || I.isTerminator() ||
+            I.getType()->isVoidTy())
+          continue;
+        bool Root = isa<LoadInst>(I) || isa<CallBase>(I);
+        if (!Root)
+          Root = llvm::none_of(I.operands(), [&](Use &U) {
+            return Secrets.isSecret(U.get());
+          });
+        if (Root)
+          Roots.push_back({&I, I.getNextNode()});
+      }
+
+    // Floating point and vector values stay in their own registers: the
+    // markers would move them to general purpose ones and back.
+    unsigned NumUnmarked = 0;
+    for (auto &Root : Roots) {
+      if (!canMark(Root.first->getType())) {
+        NumUnmarked++;
+        continue;
+      }
+      markValue(Root.first, Root.second, DL);
+      NumMarked++;
+    }
+    if (NumUnmarked)
+      F.getContext().diagnose(DiagnosticInfoOptimizationFailure(
+          F, DiagnosticLocation(F.getSubprogram()),
+          Twine("ct-llc: ") + Twine(NumUnmarked) +
+              " secret value(s) that are not integers or pointers in '" +
+              F.getName() + "' are not checked"));
+
+    if (NumUnmarked != Roots.size())
+      FAM.invalidate(F, PreservedAnalyses::none());
+  }
+  return NumMarked;
+}
+
+//------------------------------------------------------------------------------
+// Machine code taint
+//------------------------------------------------------------------------------
+namespace {
+// The secret register units and stack slots at a program point.
+struct TaintState {
+  BitVector Units;
+  BitVector Slots;
+
+  bool operator!=(const TaintState &Other) const {
+    return Units != Other.Units || Slots != Other.Slots;
+  }
+  TaintState &operator|=(const TaintState &Other) {
+    Units |= Other.Units;
+    Slots |= Other.Slots;
+    return *this;
+  }
+};
+
+class MachineTaint {
+public:
+  MachineTaint(MachineFunction &MF)
+      : MF(MF), MFI(MF.getFrameInfo()),
+        TRI(*MF.getSubtarget().getRegisterInfo()),
+        SP(MF.getSubtarget()
+               .getTargetLowering()
+               ->getStackPointerRegisterToSaveRestore()) {}
+
+  // Runs the propagation to a fixed point, then calls Report on every
+  // instruction with the taint right before it.
+  template <typename ReportFn> void run(ReportFn Report);
+
+  bool isSecret(const MachineOperand &MO, const TaintState &State) const {
+    if (!MO.isReg() || !MO.getReg().isPhysical())
+      return false;
+    for (MCRegUnitIterator U(MO.getReg(), &TRI); U.isValid(); ++U)
+      if (State.Units.test(*U))
+        return true;
+    return false;
+  }
+
+  // Returns true if MI reads a secret register or stack slot.
+  bool readsSecret(const MachineInstr &MI, const TaintState &State) const;
+
+private:
+  MachineFunction &MF;
+  const MachineFrameInfo &MFI;
+  const TargetRegisterInfo &TRI;
+  Register SP;
+
+  void transfer(const MachineInstr &MI, TaintState &State) const;
+  void transferList(const MachineInstr &MI,
+                    ArrayRef<const MachineOperand *> List,
+                    TaintState &State) const;
+  void setUnits(MCRegister Reg, bool Secret, TaintState &State) const {
+    for (MCRegUnitIterator U(Reg, &TRI); U.isValid(); ++U)
+      State.Units[*U] = Secret;
+  }
+  // Returns true and sets Slot if MMO accesses a stack object.
+  bool getSlot(const MachineMemOperand *MMO, int &Slot) const {
+    auto *FS =
+        dyn_cast_or_null<FixedStackPseudoSourceValue>(MMO->getPseudoValue());
+    if (!FS)
+      return false;
+    Slot = FS->getFrameIndex() - MFI.getObjectIndexBegin();
+    return true;
+  }
+};
+} // namespace
+
+static bool isSecretMarker(const MachineInstr &MI) {
+  return MI.isInlineAsm() &&
+         StringRef(MI.getOperand(InlineAsm::MIOp_AsmString).getSymbolName()) ==
+             MarkerComment;
+}
+
+static bool isPredicateOperand(const MachineInstr &MI, unsigned OpNo) {
+  const MCInstrDesc &Desc = MI.getDesc();
+  return OpNo < Desc.getNumOperands() &&
+         Desc.operands().begin()[OpNo].isPredicate();
+}
+
+// For a load or store multiple (the ARM ldm and stm the spills are merged
+// into), the registers of the list, in the order of the memory operands.
+static bool getRegisterList(const MachineInstr &MI,
+                            SmallVectorImpl<const MachineOperand *> &List) {
+  if (MI.getNumMemOperands() < 2 || MI.mayLoad() == MI.mayStore())
+    return false;
+
+  bool Load = MI.mayLoad(), Base = true;
+  for (unsigned I = 0, E = MI.getNumExplicitOperands(); I < E; I++) {
+    const MachineOperand &MO = MI.getOperand(I);
+    if (!MO.isReg() || !MO.getReg() || isPredicateOperand(MI, I))
+      continue;
+    if (Load && MO.isDef() && !MO.isTied())
+      List.push_back(&MO);
+    // The first register a store reads is the base address.
+    if (!Load && MO.isUse() && !std::exchange(Base, false))
+      List.push_back(&MO);
+  }
+  return List.size() == MI.getNumMemOperands();
+}
+
+bool MachineTaint::readsSecret(const MachineInstr &MI,
+                               const TaintState &State) const {
+  for (const MachineOperand &MO : MI.operands())
+    if (MO.isReg() && MO.isUse() && !MO.isUndef() && isSecret(MO, State))
+      return true;
+  int Slot;
+  for (const MachineMemOperand *MMO : MI.memoperands())
+    if (MMO->isLoad() && getSlot(MMO, Slot) && State.Slots.test(Slot))
+      return true;
+  return false;
+}
+
+void MachineTaint::transfer(const MachineInstr &MI, TaintState &State) const {
+  SmallVector<const MachineOperand *, 8> List;
+  if (getRegisterList(MI, List)) {
+    transferList(MI, List, State);
+    return;
+  }
+  bool Secret = isSecretMarker(MI) || readsSecret(MI, State);
+
+  // A public store over the whole slot makes it public again: the slots of
+  // the spills are reused.
+  int Slot;
+  if (MI.mayStore())
+    for (const MachineMemOperand *MMO : MI.memoperands())
+      if (MMO->isStore() && getSlot(MMO, Slot) &&
+          (Secret || MMO->getSize() >=
+                         MFI.getObjectSize(Slot + MFI.getObjectIndexBegin())))
+        State.Slots[Slot] = Secret;
+
+  for (const MachineOperand &MO : MI.operands()) {
+    if (MO.isRegMask()) {
+      // By root register: a call preserves X22 on RISC-V but not the X22_PD
+      // pair that shares its unit.
+      for (unsigned U = 0, E = TRI.getNumRegUnits(); U != E; U++)
+        for (MCRegUnitRootIterator Root(U, &TRI); Root.isValid(); ++Root)
+          if (MO.clobbersPhysReg(*Root)) {
+            State.Units.reset(U);
+            break;
+          }
+    } else if (MO.isReg() && MO.isDef() && MO.getReg().isPhysical()) {
+      // Pushing a secret updates the stack pointer, which stays public.
+      setUnits(MO.getReg().asMCReg(), Secret && MO.getReg() != SP, State);
+    }
+  }
+}
+
+void MachineTaint::transferList(const MachineInstr &MI,
+                                ArrayRef<const MachineOperand *> List,
+                                TaintState &State) const {
+  bool BaseSecret = false;
+  for (const MachineOperand &MO : MI.operands())
+    if (MO.isReg() && MO.isUse() && !llvm::is_contained(List, &MO))
+      BaseSecret |= isSecret(MO, State);
+
+  int Slot;
+  for (auto Op : llvm::enumerate(List)) {
+    const MachineMemOperand *MMO = MI.memoperands()[Op.index()];
+    if (MI.mayStore()) {
+      if (getSlot(MMO, Slot))
+        State.Slots[Slot] = BaseSecret || isSecret(*Op.value(), State);
+    } else {
+      bool Secret =
+          BaseSecret || (getSlot(MMO, Slot) && State.Slots.test(Slot));
+      setUnits(Op.value()->getReg().asMCReg(), Secret, State);
+    }
+  }
+
+  for (const MachineOperand &MO : MI.operands())
+    if (MO.isReg() && MO.isDef() && MO.getReg().isPhysical() &&
+        !llvm::is_contained(List, &MO))
+      setUnits(MO.getReg().asMCReg(), BaseSecret && MO.getReg() != SP, State);
+}
+
+template <typename ReportFn> void MachineTaint::run(ReportFn Report) {
+  DenseMap<const MachineBasicBlock *, TaintState> Out;
+  ReversePostOrderTraversal<MachineFunction *> RPOT(&MF);
+
+  auto getIn = [&](const MachineBasicBlock *MBB) {
+    TaintState In{BitVector(TRI.getNumRegUnits()),
+                  BitVector(MFI.getObjectIndexEnd() -
+                            MFI.getObjectIndexBegin())};
+    for (const MachineBasicBlock *Pred : MBB->predecessors()) {
+      auto It = Out.find(Pred);
+      if (It != Out.end())
+        In |= It->second;
+    }
+    return In;
+  };
+
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    for (MachineBasicBlock *MBB : RPOT) {
+      TaintState State = getIn(MBB);
+      for (const MachineInstr &MI : *MBB)
+        transfer(MI, State);
+
+      auto It = Out.find(MBB);
+      if (It == Out.end() || It->second != State) {
+        Out[MBB] = std::move(State);
+        Changed = true;
+      }
+    }
+  }
+
+  for (MachineBasicBlock *MBB : RPOT) {
+    TaintState State = getIn(MBB);
+    for (const MachineInstr &MI : *MBB) {
+      Report(MI, State);
+      transfer(MI, State);
+    }
+  }
+}
+
+//------------------------------------------------------------------------------
+// Checks
+//------------------------------------------------------------------------------
+// The register operands MI computes a memory address from.
+static void getAddressOperands(const MachineInstr &MI,
+                               const TargetInstrInfo &TII,
+                               const TargetRegisterInfo &TRI,
+                               SmallVectorImpl<const MachineOperand *> &Ops) {
+  int64_t Offset;
+  bool OffsetIsScalable;
+  unsigned Width;
+  if (TII.getMemOperandsWithOffsetWidth(MI, Ops, Offset, OffsetIsScalable,
+                                        Width, &TRI))
+    return;
+  Ops.clear();
+
+  // Without the help of the target, the registers a load reads are its
+  // address, except the ones tied to a result (x86 folds loads into
+  // arithmetic) and the predicate.
+  if (!MI.mayLoad() || MI.mayStore() || MI.isCall())
+    return;
+  for (const MachineOperand &MO : MI.explicit_uses())
+    if (MO.isReg() && MO.isUse() && !MO.isTied() &&
+        !isPredicateOperand(MI, MI.getOperandNo(&MO)))
+      Ops.push_back(&MO);
+}
+
+char SecretMachineCheck::ID = 0;
+
+void SecretMachineCheck::getAnalysisUsage(AnalysisUsage &AU) const {
+  AU.setPreservesAll();
+  MachineFunctionPass::getAnalysisUsage(AU);
+}
+
+bool SecretMachineCheck::runOnMachineFunction(MachineFunction &MF) {
+  const TargetInstrInfo &TII = *MF.getSubtarget().getInstrInfo();
+  const TargetRegisterInfo &TRI = *MF.getSubtarget().getRegisterInfo();
+  MachineTaint Taint(MF);
+
+  bool Branches = false, Addresses = false;
+  auto Report = [&](const MachineInstr &MI, const char *What) {
+    const MachineBasicBlock *MBB = MI.getParent();
+    OS << MF.getName() << ": " << What << " in bb." << MBB->getNumber();
+    if (MBB->getBasicBlock() && MBB->getBasicBlock()->hasName())
+      OS << "." << MBB->getBasicBlock()->getName();
+    OS << ":\n  ";
+    MI.print(OS, /*IsStandalone=*/true, /*SkipOpers=*/false,
+             /*SkipDebugLoc=*/true, /*AddNewLine=*/false, &TII);
+    OS << "\n";
+    NumFindings++;
+  };
+
+  Taint.run([&](const MachineInstr &MI, const TaintState &State) {
+    if ((MI.isConditionalBranch() || MI.isIndirectBranch()) &&
+        Taint.readsSecret(MI, State)) {
+      Report(MI, "branch on a secret");
+      Branches = true;
+    }
+
+    if (MI.mayLoadOrStore() && !isSecretMarker(MI)) {
+      SmallVector<const MachineOperand *, 4> Ops;
+      getAddressOperands(MI, TII, TRI, Ops);
+      if (llvm::any_of(Ops, [&](const MachineOperand *MO) {
+            return Taint.isSecret(*MO, State);
+          })) {
+        Report(MI, "memory access at an address derived from a secret");
+        Addresses = true;
+      }
+    }
+  });
+
+  if (Branches)
+    OS << MF.getName()
+       << ": note: keep the selects as conditional moves (cmov on x86, an IT "
+          "block on ARMv7-M, csel on AArch64), e.g. with "
+          "-disable-cgp-select2branch and -x86-cmov-converter=false\n";
+  if (Addresses)
+    OS << MF.getName()
+       << ": note: read secret-indexed tables with a scan of the whole table\n";
+  return false;
+}
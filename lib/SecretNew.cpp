@@ -7,6 +7,11 @@
 #include "llvm/Support/Casting.h"
 #include <algorithm>
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/IR/Dominators.h"
 
 using namespace llvm;
 
@@ -15,15 +20,24 @@ static void printInputsVectorResult(raw_ostream &OutS,
 
 llvm::AnalysisKey Secret::Key;
 
-Secret::Result Secret::generateInputVector(llvm::Function &Func) {
+Secret::Result Secret::generateInputVector(llvm::Function &Func,
+                                           llvm::MemorySSA &, llvm::AAResults &,
+                                           llvm::DominatorTree &,
+                                           llvm::PostDominatorTree &, llvm::LoopInfo &,
+                                           const ResultSecretSummary *) {
 
-  std::vector<llvm::Value*> inputsVector;
+  ResultSecret inputsVector;
 
   return inputsVector;
 }
 
-Secret::Result Secret::run(llvm::Function &Func, llvm::FunctionAnalysisManager &) {
-  return generateInputVector(Func);
+Secret::Result Secret::run(llvm::Function &Func, llvm::FunctionAnalysisManager &FAM) {
+  auto &MSSA = FAM.getResult<MemorySSAAnalysis>(Func).getMSSA();
+  auto &AA = FAM.getResult<AAManager>(Func);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(Func);
+  auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(Func);
+  auto &LI = FAM.getResult<LoopAnalysis>(Func);
+  return generateInputVector(Func, MSSA, AA, DT, PDT, LI);
 }  
 
 PreservedAnalyses InputsVectorPrinter::run(Function &Func, FunctionAnalysisManager &FAM) {
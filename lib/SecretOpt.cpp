@@ -0,0 +1,102 @@
+//==============================================================================
+// FILE:
+//    SecretOpt.cpp
+//
+// DESCRIPTION:
+//    The ct-opt<level> pass, meant to run right after ct-linearize so that
+//    the constant-time code can be compiled with llc -O2.
+//
+//    The standard pipelines are not safe there: SimplifyCFG speculates and
+//    folds blocks back into branches, and SROA may rewrite a select of
+//    pointers as control flow. ct-opt keeps to passes that do not create
+//    conditional branches, with SROA restricted to the existing CFG, and
+//    checks that every branch on a secret after them was there before. The selects on a
+//    secret are then lowered as -ct-select says (see SecretSelect.cpp).
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libSecret.so `\`
+//        -passes="function(ct-linearize,ct-opt<O2>)" <input-llvm-file>
+//
+// License: MIT
+//==============================================================================
+#include "SecretOpt.h"
+#include "Secret.h"
+#include "SecretSelect.h"
+
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/ValueHandle.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/ADCE.h"
+#include "llvm/Transforms/Scalar/DCE.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+
+using namespace llvm;
+
+// Collects the conditional branches and switches on a secret in F.
+static void getSecretBranches(Function &F, const ResultSecret &Secrets,
+                              SmallVectorImpl<Instruction *> &Branches) {
+  for (BasicBlock &BB : F) {
+    Instruction *Term = BB.getTerminator();
+    if (auto *Br = dyn_cast<BranchInst>(Term)) {
+      if (Br->isConditional() && Secrets.isSecret(Br->getCondition()))
+        Branches.push_back(Br);
+    } else if (auto *SI = dyn_cast<SwitchInst>(Term)) {
+      if (Secrets.isSecret(SI->getCondition()))
+        Branches.push_back(SI);
+    }
+  }
+}
+
+CTOpt::CTOpt(OptimizationLevel Level) {
+  if (Level != OptimizationLevel::O0) {
+    FPM.addPass(SROAPass(SROAOptions::PreserveCFG));
+    FPM.addPass(EarlyCSEPass(/*UseMemorySSA=*/true));
+    FPM.addPass(InstCombinePass());
+  }
+
+  if (Level.getSpeedupLevel() >= 2) {
+    FPM.addPass(createFunctionToLoopPassAdaptor(LICMPass(),
+                                                /*UseMemorySSA=*/true));
+    FPM.addPass(GVNPass());
+    FPM.addPass(InstCombinePass());
+    FPM.addPass(ADCEPass());
+  } else if (Level != OptimizationLevel::O0) {
+    FPM.addPass(DCEPass());
+  }
+
+  // Last, InstCombine would fold a mask back into a select.
+  FPM.addPass(CTSelect());
+}
+
+PreservedAnalyses CTOpt::run(Function &F, FunctionAnalysisManager &FAM) {
+  SmallVector<Instruction *, 8> Branches;
+  getSecretBranches(F, FAM.getResult<Secret>(F), Branches);
+
+  // Weak handles, so that a terminator the optimizations delete cannot be
+  // mistaken for a new one allocated at the same address.
+  SmallVector<WeakVH, 8> Before(Branches.begin(), Branches.end());
+
+  // The pass manager invalidates the analyses after each pass, so the taint
+  // below is computed on the optimized code.
+  PreservedAnalyses PA = FPM.run(F, FAM);
+
+  SmallPtrSet<Value *, 8> Known;
+  for (WeakVH &Branch : Before)
+    if (Branch)
+      Known.insert(Branch);
+
+  Branches.clear();
+  getSecretBranches(F, FAM.getResult<Secret>(F), Branches);
+  for (Instruction *Branch : Branches)
+    if (!Known.count(Branch))
+      report_fatal_error(Twine("ct-opt: the optimizations of '") +
+                         F.getName() + "' added a branch on a secret in '" +
+                         Branch->getParent()->getName() + "'");
+  return PA;
+}
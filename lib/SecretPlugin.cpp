@@ -0,0 +1,23 @@
+//==============================================================================
+// FILE:
+//    SecretPlugin.cpp
+//
+// DESCRIPTION:
+//    The entry point of libSecret.so. The passes themselves are in the
+//    SecretPasses library, which the tools running them in-process link as
+//    well.
+//
+// USAGE:
+//    opt -load-pass-plugin libSecret.so -passes="ct-linearize" `\`
+//      <input-llvm-file>
+//
+// License: MIT
+//==============================================================================
+#include "Secret.h"
+
+#include "llvm/Passes/PassPlugin.h"
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo
+llvmGetPassPluginInfo() {
+  return getInputVectorPluginInfo();
+}
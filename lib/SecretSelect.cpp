@@ -0,0 +1,282 @@
+//==============================================================================
+// FILE:
+//    SecretSelect.cpp
+//
+// DESCRIPTION:
+//    Lowering of the selects on a secret. ct-linearize turns the branches on
+//    a secret into selects, and nothing forces the backend to compile those
+//    to a conditional move: CodeGenPrepare and the x86 cmov converter bring
+//    some branches back, and the cores without a conditional move (Thumb-1,
+//    RISC-V) have no other way. -ct-select chooses how they are written:
+//      * native keeps the select, for the backends that compile it to a
+//        conditional move with the llc flags of compile.sh;
+//      * mask computes b ^ ((a ^ b) & -c) with integer operations, which any
+//        target has, at the cost of three or four instructions;
+//      * asm calls an inline asm conditional move (x86 test and cmov, ARM cmp
+//        and a conditional mov, AArch64 cmp and csel) that no optimization
+//        can look into, and falls back to mask on the other targets;
+//      * auto takes the fastest of these that stays branch-free on the
+//        target, from the results of tools/ct-select-bench.
+//    InstCombine folds a mask back into a select, so this runs last in ct-opt.
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libSecret.so -ct-select=mask `\`
+//        -passes="function(ct-linearize,ct-opt<O2>)" <input-llvm-file>
+//
+// License: MIT
+//==============================================================================
+#include "SecretSelect.h"
+#include "Secret.h"
+
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InlineAsm.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+
+using namespace llvm;
+
+static cl::opt<SelectLowering> SelectLoweringOpt(
+    "ct-select",
+    cl::desc("How ct-opt lowers the selects on a secret"),
+    cl::init(SelectLowering::Auto),
+    cl::values(clEnumValN(SelectLowering::Auto, "auto",
+                          "The fastest branch-free one on the target"),
+               clEnumValN(SelectLowering::Native, "native",
+                          "Keep the select instructions"),
+               clEnumValN(SelectLowering::Mask, "mask",
+                          "b ^ ((a ^ b) & -c)"),
+               clEnumValN(SelectLowering::Asm, "asm",
+                          "An inline asm conditional move")));
+
+//------------------------------------------------------------------------------
+// Arithmetic masking
+//------------------------------------------------------------------------------
+// The integer type with the bits of Ty, or NULL for an aggregate.
+static Type *getIntegerType(Type *Ty, const DataLayout &DL) {
+  if (Ty->isPtrOrPtrVectorTy())
+    return DL.getIntPtrType(Ty);
+  if (!Ty->isIntOrIntVectorTy() && !Ty->isFPOrFPVectorTy())
+    return nullptr;
+  Type *IntTy = IntegerType::get(Ty->getContext(), Ty->getScalarSizeInBits());
+  if (auto *VTy = dyn_cast<VectorType>(Ty))
+    return VectorType::get(IntTy, VTy->getElementCount());
+  return IntTy;
+}
+
+static Value *toInteger(IRBuilder<> &B, Value *V, Type *IntTy) {
+  if (V->getType() == IntTy)
+    return V;
+  if (V->getType()->isPtrOrPtrVectorTy())
+    return B.CreatePtrToInt(V, IntTy);
+  return B.CreateBitCast(V, IntTy);
+}
+
+static Value *fromInteger(IRBuilder<> &B, Value *V, Type *Ty) {
+  if (V->getType() == Ty)
+    return V;
+  if (Ty->isPtrOrPtrVectorTy())
+    return B.CreateIntToPtr(V, Ty);
+  return B.CreateBitCast(V, Ty);
+}
+
+// All ones if Cond is true, zero otherwise, as an integer of type MaskTy. A
+// scalar condition goes through an empty inline asm: once the backend knows
+// the mask is a sign-extended i1, it compiles the and as a select, which is a
+// branch on the cores without a conditional move.
+static Value *emitMask(IRBuilder<> &B, Value *Cond, Type *MaskTy) {
+  if (Cond->getType()->isVectorTy())
+    return B.CreateSExt(Cond, MaskTy, "sel.mask");
+
+  Type *I32 = B.getInt32Ty();
+  auto *Barrier = InlineAsm::get(FunctionType::get(I32, {I32}, false), "",
+                                 "=r,0", /*hasSideEffects=*/false);
+  Value *Bit = B.CreateCall(Barrier, {B.CreateZExt(Cond, I32)});
+  Value *Mask = B.CreateSExtOrTrunc(B.CreateNeg(Bit), MaskTy->getScalarType());
+  // A scalar condition selects whole vectors.
+  if (auto *VTy = dyn_cast<VectorType>(MaskTy))
+    Mask = B.CreateVectorSplat(VTy->getElementCount(), Mask);
+  Mask->setName("sel.mask");
+  return Mask;
+}
+
+// b ^ ((a ^ b) & -c) for Sel = select c, a, b. Returns NULL if the type of
+// Sel has no integer equivalent.
+static Value *emitMaskSelect(SelectInst *Sel) {
+  Type *Ty = Sel->getType();
+  Type *IntTy = getIntegerType(Ty, Sel->getModule()->getDataLayout());
+  if (!IntTy)
+    return nullptr;
+
+  IRBuilder<> B(Sel);
+  Value *A = toInteger(B, Sel->getTrueValue(), IntTy);
+  Value *Bv = toInteger(B, Sel->getFalseValue(), IntTy);
+  Value *Mask = emitMask(B, Sel->getCondition(), IntTy);
+  Value *Diff = B.CreateAnd(B.CreateXor(A, Bv), Mask, "sel.diff");
+  return fromInteger(B, B.CreateXor(Bv, Diff), Ty);
+}
+
+//------------------------------------------------------------------------------
+// Inline asm conditional moves
+//------------------------------------------------------------------------------
+// Whether an ARM triple in Thumb state has the IT instruction.
+static bool hasThumb2(const Triple &T) {
+  switch (T.getSubArch()) {
+  case Triple::NoSubArch:
+  case Triple::ARMSubArch_v4t:
+  case Triple::ARMSubArch_v5:
+  case Triple::ARMSubArch_v5te:
+  case Triple::ARMSubArch_v6:
+  case Triple::ARMSubArch_v6k:
+  case Triple::ARMSubArch_v6m:
+  case Triple::ARMSubArch_v8m_baseline:
+    return false;
+  default:
+    return true;
+  }
+}
+
+// Width of the largest integer a conditional move of T handles, 0 if it has
+// none.
+static unsigned getCondMoveBits(const Triple &T) {
+  switch (T.getArch()) {
+  case Triple::x86_64:
+  case Triple::aarch64:
+  case Triple::aarch64_be:
+  case Triple::aarch64_32:
+    return 64;
+  case Triple::x86:
+    // cmov came with the i686.
+    return T.getArchName() == "i386" || T.getArchName() == "i486" ||
+                   T.getArchName() == "i586"
+               ? 0
+               : 32;
+  case Triple::arm:
+  case Triple::armeb:
+    return 32;
+  case Triple::thumb:
+  case Triple::thumbeb:
+    return hasThumb2(T) ? 32 : 0;
+  default:
+    return 0;
+  }
+}
+
+// The conditional move of T on integers of type Ty: returns its second
+// operand if the first one is not zero, its third one otherwise.
+static InlineAsm *getCondMoveAsm(const Triple &T, IntegerType *Ty) {
+  Type *CondTy = Type::getInt32Ty(Ty->getContext());
+  auto *FTy = FunctionType::get(Ty, {CondTy, Ty, Ty}, false);
+
+  if (T.isX86())
+    return InlineAsm::get(FTy, "test $1, $1\n\tcmovne $2, $0",
+                          "=r,r,r,0,~{flags}", /*hasSideEffects=*/false);
+  if (T.isAArch64()) {
+    const char *Asm = Ty->getBitWidth() == 64
+                          ? "cmp ${1:w}, #0\n\tcsel ${0:x}, ${2:x}, ${3:x}, ne"
+                          : "cmp ${1:w}, #0\n\tcsel ${0:w}, ${2:w}, ${3:w}, ne";
+    return InlineAsm::get(FTy, Asm, "=r,r,r,r,~{cc}",
+                          /*hasSideEffects=*/false);
+  }
+  const char *Asm = T.isThumb() ? "cmp $1, #0\n\tit ne\n\tmovne $0, $2"
+                                : "cmp $1, #0\n\tmovne $0, $2";
+  return InlineAsm::get(FTy, Asm, "=r,r,r,0,~{cc}", /*hasSideEffects=*/false);
+}
+
+// Sel as a call to the conditional move of T, NULL if T has none for its
+// type. The operands narrower than 32 bits are extended: there is no 8-bit
+// cmov.
+static Value *emitAsmSelect(SelectInst *Sel, const Triple &T) {
+  Type *Ty = Sel->getType();
+  const DataLayout &DL = Sel->getModule()->getDataLayout();
+  unsigned MaxBits = getCondMoveBits(T);
+  // An i1 select is cheaper as and, xor.
+  if (!MaxBits || Ty->isVectorTy() || Ty->isIntegerTy(1))
+    return nullptr;
+  auto *IntTy = dyn_cast_or_null<IntegerType>(getIntegerType(Ty, DL));
+  if (!IntTy || IntTy->getBitWidth() > MaxBits)
+    return nullptr;
+
+  IRBuilder<> B(Sel);
+  auto *MoveTy = IntTy->getBitWidth() <= 32 ? B.getInt32Ty() : B.getInt64Ty();
+  auto Extend = [&](Value *V) {
+    return B.CreateZExt(toInteger(B, V, IntTy), MoveTy);
+  };
+  Value *Cond = B.CreateZExt(Sel->getCondition(), B.getInt32Ty());
+  Value *Move =
+      B.CreateCall(getCondMoveAsm(T, MoveTy),
+                   {Cond, Extend(Sel->getTrueValue()),
+                    Extend(Sel->getFalseValue())},
+                   "sel.move");
+  return fromInteger(B, B.CreateTrunc(Move, IntTy), Ty);
+}
+
+//------------------------------------------------------------------------------
+// Strategy
+//------------------------------------------------------------------------------
+SelectLowering getSelectLowering() { return SelectLoweringOpt; }
+
+SelectLowering resolveSelectLowering(SelectLowering How, const Triple &T) {
+  if (How != SelectLowering::Auto)
+    return How;
+
+  // ct-select-bench, compiling with -disable-cgp-select2branch and
+  // -x86-cmov-converter=false. x86 has no conditional move for SSE
+  // registers, and i686 none at all without -mcpu; Thumb-1 and RISC-V none.
+  switch (T.getArch()) {
+  case Triple::x86_64:
+  case Triple::x86:
+    return SelectLowering::Asm;
+  case Triple::aarch64:
+  case Triple::aarch64_be:
+  case Triple::aarch64_32:
+    return SelectLowering::Native;
+  case Triple::arm:
+  case Triple::armeb:
+  case Triple::thumb:
+  case Triple::thumbeb:
+    return getCondMoveBits(T) ? SelectLowering::Native : SelectLowering::Mask;
+  default:
+    return SelectLowering::Mask;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Main function
+//------------------------------------------------------------------------------
+bool lowerSecretSelects(Function &F, const ResultSecret &Secrets,
+                        SelectLowering How) {
+  Triple T(F.getParent()->getTargetTriple());
+  How = resolveSelectLowering(How, T);
+  if (How == SelectLowering::Native)
+    return false;
+
+  SmallVector<SelectInst *, 16> Selects;
+  for (Instruction &I : instructions(F))
+    if (auto *Sel = dyn_cast<SelectInst>(&I))
+      if (Secrets.isSecret(Sel->getCondition()))
+        Selects.push_back(Sel);
+
+  bool Changed = false;
+  for (SelectInst *Sel : Selects) {
+    Value *Result = How == SelectLowering::Asm ? emitAsmSelect(Sel, T) : nullptr;
+    if (!Result)
+      Result = emitMaskSelect(Sel);
+    if (!Result)
+      continue;
+    Result->takeName(Sel);
+    Sel->replaceAllUsesWith(Result);
+    Sel->eraseFromParent();
+    Changed = true;
+  }
+  return Changed;
+}
+
+PreservedAnalyses CTSelect::run(Function &F, FunctionAnalysisManager &FAM) {
+  if (!lowerSecretSelects(F, FAM.getResult<Secret>(F), getSelectLowering()))
+    return PreservedAnalyses::all();
+
+  PreservedAnalyses PA;
+  PA.preserveSet<CFGAnalyses>();
+  return PA;
+}
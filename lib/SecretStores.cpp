@@ -0,0 +1,438 @@
+//==============================================================================
+// FILE:
+//    SecretStores.cpp
+//
+// DESCRIPTION:
+//    Lowers the stores ct-linearize predicates in loops with secret bounds.
+//    The plain strategy turns each of them into a load, a select and a store,
+//    which doubles the memory operations of the loop. Cheaper ones, tried in
+//    this order:
+//      * promotion: a loop-invariant location only accessed through the same
+//        pointer is kept in a register across the loop, loaded once in the
+//        preheader and written back once in each exit block;
+//      * coalescing: stores sharing a predicate to consecutive elements of the
+//        same object, with no other memory access in between, become a single
+//        llvm.masked.store where the target supports it, or a single wide
+//        load, select (a blend of the vectors) and store;
+//      * the plain strategy for the rest.
+//    None of them adds a branch: the write-back and the wide accesses touch
+//    the same memory whatever the predicates. -ct-predicated-stores=select
+//    forces the plain strategy.
+//
+//    A promoted location updated with a binary operation (a sum, a count)
+//    becomes a conditional reduction, `x + (p ? y : 0)` rather than
+//    `p ? x + y : x`, the form LoopVectorize widens.
+//
+// License: MIT
+//==============================================================================
+#include "SecretStores.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+enum class StoreStrategy { Auto, Select };
+} // namespace
+
+static cl::opt<StoreStrategy> StoreStrategyOpt(
+    "ct-predicated-stores",
+    cl::desc("How ct-linearize lowers the stores it predicates"),
+    cl::init(StoreStrategy::Auto),
+    cl::values(clEnumValN(StoreStrategy::Auto, "auto",
+                          "Promote, coalesce or select, whichever applies"),
+               clEnumValN(StoreStrategy::Select, "select",
+                          "Load, select and store every location")));
+
+//------------------------------------------------------------------------------
+// Plain strategy
+//------------------------------------------------------------------------------
+// Returns the new store, and the load of the old value in Old if not null.
+static StoreInst *selectStore(StoreInst *Store, Value *Pred,
+                              LoadInst **Old = nullptr) {
+  IRBuilder<> Builder(Store);
+  Value *Ptr = Store->getPointerOperand();
+  Value *Val = Store->getValueOperand();
+
+  LoadInst *Load = Builder.CreateAlignedLoad(Val->getType(), Ptr,
+                                             Store->getAlign(),
+                                             Store->isVolatile());
+  Value *Sel = Builder.CreateSelect(Pred, Val, Load);
+  StoreInst *New = Builder.CreateAlignedStore(Sel, Ptr, Store->getAlign(),
+                                              Store->isVolatile());
+  Store->eraseFromParent();
+  if (Old)
+    *Old = Load;
+  return New;
+}
+
+//------------------------------------------------------------------------------
+// Promotion
+//------------------------------------------------------------------------------
+namespace {
+// Writes the promoted value back in every exit block, as LICM does.
+class LocationPromoter : public LoadAndStorePromoter {
+  Value *Ptr;
+  ArrayRef<BasicBlock *> Exits;
+  Align Alignment;
+  SSAUpdater &SSA;
+
+public:
+  LocationPromoter(ArrayRef<const Instruction *> Insts, SSAUpdater &SSA,
+                   Value *Ptr, ArrayRef<BasicBlock *> Exits, Align Alignment)
+      : LoadAndStorePromoter(Insts, SSA, Ptr->getName()), Ptr(Ptr),
+        Exits(Exits), Alignment(Alignment), SSA(SSA) {}
+
+  void doExtraRewritesBeforeFinalDeletion() override {
+    for (BasicBlock *Exit : Exits)
+      new StoreInst(SSA.GetValueInMiddleOfBlock(Exit), Ptr,
+                    /*isVolatile=*/false, Alignment,
+                    &*Exit->getFirstInsertionPt());
+  }
+};
+} // namespace
+
+// Collects in Accesses the loads and stores of Ptr in L. Returns false if
+// another instruction of L may access the same memory, or Ptr is accessed
+// with different types or volatile operations.
+static bool getPromotableAccesses(Value *Ptr, Type *Ty, Loop &L,
+                                  SmallVectorImpl<Instruction *> &Accesses) {
+  const Value *Obj = getUnderlyingObject(Ptr);
+  if (!isIdentifiedObject(Obj))
+    return false;
+
+  for (BasicBlock *BB : L.blocks())
+    for (Instruction &I : *BB) {
+      if (!I.mayReadOrWriteMemory())
+        continue;
+
+      Value *Other = getLoadStorePointerOperand(&I);
+      if (!Other)
+        return false;
+      if (Other == Ptr) {
+        if (!isa<LoadInst>(I) && !isa<StoreInst>(I))
+          return false;
+        if (getLoadStoreType(&I) != Ty ||
+            (isa<LoadInst>(I) ? !cast<LoadInst>(I).isSimple()
+                              : !cast<StoreInst>(I).isSimple()))
+          return false;
+        Accesses.push_back(&I);
+        continue;
+      }
+
+      // Distinct identified objects do not alias.
+      const Value *OtherObj = getUnderlyingObject(Other);
+      if (OtherObj == Obj || !isIdentifiedObject(OtherObj))
+        return false;
+    }
+  return true;
+}
+
+static bool promoteLocation(Value *Ptr, ArrayRef<PredicatedStore> Stores,
+                            Loop &L) {
+  BasicBlock *Preheader = L.getLoopPreheader();
+  if (!Preheader || !L.hasDedicatedExits())
+    return false;
+  SmallVector<BasicBlock *, 4> Exits;
+  L.getUniqueExitBlocks(Exits);
+  if (Exits.empty())
+    return false;
+
+  Type *Ty = Stores.front().Store->getValueOperand()->getType();
+  SmallVector<Instruction *, 8> Accesses;
+  if (!getPromotableAccesses(Ptr, Ty, L, Accesses))
+    return false;
+
+  // Make the stores unconditional first: the loads of the selects then read
+  // the promoted value like any other load of the location.
+  Align Alignment = Stores.front().Store->getAlign();
+  SmallVector<SelectInst *, 4> Updates;
+  for (const PredicatedStore &PS : Stores) {
+    Alignment = std::min(Alignment, PS.Store->getAlign());
+    auto It = std::find(Accesses.begin(), Accesses.end(), PS.Store);
+    LoadInst *Old;
+    *It = selectStore(PS.Store, PS.Pred, &Old);
+    Accesses.push_back(Old);
+    if (auto *Sel = dyn_cast<SelectInst>(cast<StoreInst>(*It)->getValueOperand()))
+      Updates.push_back(Sel);
+  }
+  for (Instruction *I : Accesses)
+    if (auto *Load = dyn_cast<LoadInst>(I))
+      Alignment = std::min(Alignment, Load->getAlign());
+
+  SmallVector<const Instruction *, 8> ConstAccesses(Accesses.begin(),
+                                                    Accesses.end());
+  SmallVector<PHINode *, 8> NewPHIs;
+  SSAUpdater SSA(&NewPHIs);
+  LocationPromoter Promoter(ConstAccesses, SSA, Ptr, Exits, Alignment);
+
+  LoadInst *Init =
+      new LoadInst(Ty, Ptr, Ptr->getName() + ".promoted", /*isVolatile=*/false,
+                   Alignment, Preheader->getTerminator());
+  SSA.AddAvailableValue(Preheader, Init);
+  Promoter.run(Accesses);
+
+  // Both sides of the selects now read the same promoted value.
+  for (SelectInst *Sel : Updates)
+    foldPredicatedUpdate(Sel);
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Coalescing
+//------------------------------------------------------------------------------
+namespace {
+struct Lane {
+  StoreInst *Store;
+  int64_t Index;
+};
+} // namespace
+
+// Rewrites the stores of Lanes, with consecutive indexes from the one of the
+// first lane and at most NumElts of them, as a single wide access.
+static void coalesceStores(ArrayRef<Lane> Lanes, unsigned NumElts, Value *Pred,
+                           const TargetTransformInfo &TTI) {
+  StoreInst *First = Lanes.front().Store;
+  Type *EltTy = First->getValueOperand()->getType();
+  auto *VecTy = FixedVectorType::get(EltTy, NumElts);
+  Value *Ptr = First->getPointerOperand();
+  Align Alignment = First->getAlign();
+
+  // All the values are defined before the last store.
+  StoreInst *Last = Lanes.front().Store;
+  for (const Lane &L : Lanes)
+    if (Last->comesBefore(L.Store))
+      Last = L.Store;
+  IRBuilder<> Builder(Last);
+
+  Value *Vec = PoisonValue::get(VecTy);
+  SmallVector<bool, 16> Stored(NumElts, false);
+  for (const Lane &L : Lanes) {
+    unsigned Idx = L.Index - Lanes.front().Index;
+    Vec = Builder.CreateInsertElement(Vec, L.Store->getValueOperand(), Idx);
+    Stored[Idx] = true;
+  }
+
+  if (TTI.isLegalMaskedStore(VecTy, Alignment)) {
+    Value *Mask = Builder.CreateVectorSplat(NumElts, Pred);
+    if (is_contained(Stored, false)) {
+      SmallVector<Constant *, 16> Bits;
+      for (bool S : Stored)
+        Bits.push_back(Builder.getInt1(S));
+      Mask = Builder.CreateAnd(Mask, ConstantVector::get(Bits));
+    }
+    Builder.CreateMaskedStore(Vec, Ptr, Alignment, Mask);
+  } else {
+    LoadInst *Old = Builder.CreateAlignedLoad(VecTy, Ptr, Alignment);
+    for (unsigned I = 0; I < NumElts; I++)
+      if (!Stored[I])
+        Vec = Builder.CreateInsertElement(
+            Vec, Builder.CreateExtractElement(Old, I), I);
+    Builder.CreateAlignedStore(Builder.CreateSelect(Pred, Vec, Old), Ptr,
+                               Alignment);
+  }
+
+  for (const Lane &L : Lanes)
+    L.Store->eraseFromParent();
+}
+
+// Splits Run, stores to the same object sorted by index, into chunks of a
+// power of two elements that fit in a vector register and lie between its
+// first and last index, so that the wide accesses stay inside the object.
+// Stores left alone go to Rest.
+static bool coalesceRun(SmallVectorImpl<Lane> &Run, Value *Pred,
+                        unsigned MaxElts, const TargetTransformInfo &TTI,
+                        SmallVectorImpl<StoreInst *> &Rest) {
+  llvm::sort(Run, [](const Lane &A, const Lane &B) { return A.Index < B.Index; });
+  int64_t End = Run.back().Index + 1;
+
+  bool Changed = false;
+  for (unsigned I = 0; I < Run.size();) {
+    uint64_t Span = std::min<uint64_t>(MaxElts, End - Run[I].Index);
+    unsigned NumElts = Span ? PowerOf2Floor(Span) : 0;
+    unsigned J = I;
+    while (J < Run.size() && Run[J].Index < Run[I].Index + NumElts)
+      J++;
+
+    if (J - I >= 2) {
+      coalesceStores(ArrayRef<Lane>(Run).slice(I, J - I), NumElts, Pred, TTI);
+      Changed = true;
+    } else {
+      Rest.push_back(Run[I].Store);
+      J = I + 1;
+    }
+    I = J;
+  }
+  return Changed;
+}
+
+// Groups the stores of each block that share a predicate, element type and
+// object, and are not separated by other memory accesses.
+static bool coalesceBlock(BasicBlock &BB,
+                          const DenseMap<StoreInst *, Value *> &Preds,
+                          const TargetTransformInfo &TTI,
+                          SmallVectorImpl<StoreInst *> &Rest) {
+  const DataLayout &DL = BB.getModule()->getDataLayout();
+  unsigned RegBits =
+      TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector)
+          .getKnownMinValue();
+
+  bool Changed = false;
+  SmallVector<Lane, 16> Run;
+  Value *RunPred = nullptr, *RunBase = nullptr;
+  Type *RunTy = nullptr;
+  SmallPtrSet<const Value *, 16> RunPtrs;
+
+  auto Flush = [&]() {
+    if (Run.empty())
+      return;
+    unsigned MaxElts = RegBits / DL.getTypeStoreSizeInBits(RunTy);
+    if (MaxElts >= 2)
+      Changed |= coalesceRun(Run, RunPred, MaxElts, TTI, Rest);
+    else
+      for (const Lane &L : Run)
+        Rest.push_back(L.Store);
+    Run.clear();
+    RunPtrs.clear();
+  };
+
+  SmallVector<Instruction *, 32> Insts;
+  for (Instruction &I : BB)
+    Insts.push_back(&I);
+
+  for (Instruction *I : Insts) {
+    if (!I->mayReadOrWriteMemory())
+      continue;
+
+    auto *Store = dyn_cast<StoreInst>(I);
+    auto It = Store ? Preds.find(Store) : Preds.end();
+    if (It == Preds.end()) {
+      Flush();
+      continue;
+    }
+
+    Type *Ty = Store->getValueOperand()->getType();
+    Value *Ptr = Store->getPointerOperand();
+    APInt Offset(DL.getIndexTypeSizeInBits(Ptr->getType()), 0);
+    Value *Base = Ptr->stripAndAccumulateConstantOffsets(
+        DL, Offset, /*AllowNonInbounds=*/true);
+    uint64_t Size = DL.getTypeStoreSize(Ty);
+
+    bool Fits = Store->isSimple() && DL.typeSizeEqualsStoreSize(Ty) &&
+                VectorType::isValidElementType(Ty) && !Ty->isPointerTy() &&
+                Offset.getSExtValue() % Size == 0;
+    if (!Fits) {
+      Flush();
+      Rest.push_back(Store);
+      continue;
+    }
+
+    int64_t Index = Offset.getSExtValue() / Size;
+    bool SameRun = !Run.empty() && It->second == RunPred && Base == RunBase &&
+                   Ty == RunTy;
+    if (SameRun)
+      for (const Lane &L : Run)
+        SameRun &= L.Index != Index;
+    if (!SameRun) {
+      Flush();
+      RunPred = It->second;
+      RunBase = Base;
+      RunTy = Ty;
+    }
+    Run.push_back({Store, Index});
+  }
+  Flush();
+  return Changed;
+}
+
+//------------------------------------------------------------------------------
+// Entry points
+//------------------------------------------------------------------------------
+Value *foldPredicatedUpdate(SelectInst *Sel, bool MaskPHIUsers) {
+  Value *X = Sel->getFalseValue();
+  auto *Op = dyn_cast<BinaryOperator>(Sel->getTrueValue());
+  bool Swapped = !Op || !is_contained(Op->operands(), X);
+  if (Swapped) {
+    X = Sel->getTrueValue();
+    Op = dyn_cast<BinaryOperator>(Sel->getFalseValue());
+    if (!Op || !is_contained(Op->operands(), X))
+      return Sel;
+  }
+
+  // The other users of the operation would see the masked value too.
+  if (any_of(Op->users(), [&](const User *U) {
+        return U != Sel && !(MaskPHIUsers && isa<PHINode>(U));
+      }))
+    return Sel;
+
+  unsigned OtherIdx = Op->getOperand(0) == X ? 1 : 0;
+  if (OtherIdx == 0 && !Op->isCommutative())
+    return Sel;
+  Constant *Identity = ConstantExpr::getBinOpIdentity(
+      Op->getOpcode(), Op->getType(), /*AllowRHSConstant=*/true);
+  if (!Identity)
+    return Sel;
+
+  // The condition must be available at the operation.
+  Value *Pred = Sel->getCondition();
+  auto *PredInst = dyn_cast<Instruction>(Pred);
+  if (Op->getParent() != Sel->getParent() ||
+      (PredInst && PredInst->getParent() == Op->getParent() &&
+       !PredInst->comesBefore(Op)))
+    return Sel;
+
+  IRBuilder<> Builder(Op);
+  Value *Y = Op->getOperand(OtherIdx);
+  Op->setOperand(OtherIdx, Swapped ? Builder.CreateSelect(Pred, Identity, Y)
+                                   : Builder.CreateSelect(Pred, Y, Identity));
+  Sel->replaceAllUsesWith(Op);
+  Sel->eraseFromParent();
+  return Op;
+}
+
+bool lowerPredicatedStores(ArrayRef<PredicatedStore> Stores, Loop &L,
+                           const TargetTransformInfo &TTI) {
+  if (Stores.empty())
+    return false;
+
+  SmallVector<StoreInst *, 16> Rest;
+  DenseMap<StoreInst *, Value *> Preds;
+  for (const PredicatedStore &PS : Stores)
+    Preds.insert({PS.Store, PS.Pred});
+
+  if (StoreStrategyOpt == StoreStrategy::Select) {
+    for (const PredicatedStore &PS : Stores)
+      Rest.push_back(PS.Store);
+  } else {
+    // Promote the locations the loop does not move.
+    MapVector<Value *, SmallVector<PredicatedStore, 4>> Invariant;
+    for (const PredicatedStore &PS : Stores)
+      if (PS.Store->isSimple() && L.isLoopInvariant(PS.Store->getPointerOperand()))
+        Invariant[PS.Store->getPointerOperand()].push_back(PS);
+    for (auto &Loc : Invariant)
+      if (promoteLocation(Loc.first, Loc.second, L))
+        for (const PredicatedStore &PS : Loc.second)
+          Preds.erase(PS.Store);
+
+    // Coalesce what is left, block by block.
+    SmallPtrSet<BasicBlock *, 8> Blocks;
+    for (auto &Entry : Preds)
+      Blocks.insert(Entry.first->getParent());
+    for (BasicBlock *BB : L.blocks())
+      if (Blocks.count(BB))
+        coalesceBlock(*BB, Preds, TTI, Rest);
+  }
+
+  for (StoreInst *Store : Rest)
+    selectStore(Store, Preds.lookup(Store));
+  return true;
+}
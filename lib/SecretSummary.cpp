@@ -0,0 +1,363 @@
+//==============================================================================
+// FILE:
+//    SecretSummary.cpp
+//
+// DESCRIPTION:
+//    Interprocedural summaries for the Secret analysis. For every function of
+//    the module it records which arguments reach the return value and the
+//    memory visible to the callers, and which arguments are secret in at
+//    least one caller. The Secret analysis uses the former at call sites and
+//    the latter as extra sources, so that e.g. the state passed by Cipher to
+//    SubBytes is secret inside SubBytes too.
+//
+//    Summaries are computed bottom-up over the SCCs of the call graph (the
+//    functions of an SCC are iterated to a fixed point), then the secret
+//    arguments are pushed top-down from the callers. Both steps are cached
+//    in the analysis, keyed by a fingerprint of each function, so that after
+//    an invalidation only the SCCs that changed are analysed again.
+//
+// USAGE:
+//    opt -load-pass-plugin libSecret.so `\`
+//      -passes="print<secret-summary>" -disable-output <input-llvm-file>
+//
+//    opt -load-pass-plugin libSecret.so `\`
+//      -passes="require<secret-summary>,ct-masked-clones,function(ct-linearize)" `\`
+//      <input-llvm-file>
+//
+// License: MIT
+//==============================================================================
+#include "SecretSummary.h"
+#include "Secret.h"
+
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+
+using namespace llvm;
+
+AnalysisKey SecretSummary::Key;
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+// A fingerprint of the body of F. Instructions and operands are hashed by
+// identity, so any edit (new instruction, new operand, new predicate)
+// changes it, while a function nobody touched keeps the same one.
+static hash_code hashFunction(const Function &F) {
+  hash_code Hash = hash_combine(F.getName(), F.getFunctionType());
+  for (const Instruction &I : instructions(F)) {
+    Hash = hash_combine(Hash, &I, I.getOpcode(), I.getType());
+    if (auto *Cmp = dyn_cast<CmpInst>(&I))
+      Hash = hash_combine(Hash, Cmp->getPredicate());
+    for (const Value *Op : I.operands())
+      Hash = hash_combine(Hash, Op);
+  }
+  return Hash;
+}
+
+// The globals annotated as secret affect the summaries of every function.
+static hash_code hashSecretSources(const Module &M) {
+  hash_code Hash = hash_value(M.getModuleIdentifier());
+  if (const GlobalVariable *Annotations =
+          M.getGlobalVariable("llvm.global.annotations"))
+    Hash = hash_combine(Hash, Annotations->getInitializer());
+  return Hash;
+}
+
+// Functions of the module called directly by F.
+static void getCallees(const Function &F,
+                       SmallVectorImpl<const Function *> &Callees) {
+  for (const Instruction &I : instructions(F)) {
+    auto *Call = dyn_cast<CallBase>(&I);
+    if (!Call || !Call->getCalledFunction() ||
+        Call->getCalledFunction()->isDeclaration())
+      continue;
+    Callees.push_back(Call->getCalledFunction());
+  }
+}
+
+// Returns true if a store or a call in the taint set writes memory that
+// outlives F. Writes to the stack of F are not visible to the callers.
+static bool writesSecretMemory(Function &F, const ResultSecret &Taint,
+                               const ResultSecretSummary &Summaries) {
+  for (Instruction &I : instructions(F)) {
+    if (!Taint.isSecret(&I))
+      continue;
+
+    const Value *Ptr = nullptr;
+    if (auto *Store = dyn_cast<StoreInst>(&I))
+      Ptr = Store->getPointerOperand();
+    else if (auto *Mem = dyn_cast<MemIntrinsic>(&I))
+      Ptr = Mem->getDest();
+    else if (auto *Call = dyn_cast<CallBase>(&I)) {
+      // A summarized call may be secret only because of its result.
+      const BitVector *Args = Taint.getSecretCallArgs(Call);
+      if (!Args) {
+        if (!Call->onlyReadsMemory())
+          return true;
+        continue;
+      }
+      const FunctionSummary *Summary =
+          Summaries.lookup(Call->getCalledFunction());
+      if (Summary->AlwaysSecret || Summary->ArgToMemory.anyCommon(*Args))
+        return true;
+      continue;
+    } else
+      continue;
+
+    if (!isa<AllocaInst>(getUnderlyingObject(Ptr)))
+      return true;
+  }
+  return false;
+}
+
+static bool returnsSecret(Function &F, const ResultSecret &Taint) {
+  for (Instruction &I : instructions(F)) {
+    auto *Ret = dyn_cast<ReturnInst>(&I);
+    if (Ret && Ret->getReturnValue() && Taint.isSecret(Ret->getReturnValue()))
+      return true;
+  }
+  return false;
+}
+
+// Computes the argument -> return/memory part of the summary of F, using the
+// summaries in Summaries for the calls inside F. The taint is propagated once
+// from the sources annotated in F (and the callees that always return a
+// secret), then once from each argument for what is not secret already.
+static FunctionSummary computeSummary(Function &F,
+                                      FunctionAnalysisManager &FAM,
+                                      const ResultSecretSummary &Summaries) {
+  auto &MSSA = FAM.getResult<MemorySSAAnalysis>(F).getMSSA();
+  auto &AA = FAM.getResult<AAManager>(F);
+  auto &DT = FAM.getResult<DominatorTreeAnalysis>(F);
+  auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(F);
+  auto &LI = FAM.getResult<LoopAnalysis>(F);
+
+  FunctionSummary Summary(F.arg_size());
+
+  std::vector<Argument *> Args;
+  std::vector<MemoryLocation> Regions;
+  Secret::collectSecretSources(F, Args, Regions);
+  ResultSecret Taint =
+      Secret::propagateTaint(F, Args, Regions, MSSA, AA, DT, PDT, LI,
+                             &Summaries);
+  bool AlwaysReturn = returnsSecret(F, Taint);
+  bool AlwaysMemory = writesSecretMemory(F, Taint, Summaries);
+  Summary.AlwaysSecret = AlwaysReturn || AlwaysMemory;
+
+  for (Argument &Arg : F.args()) {
+    ResultSecret Taint = Secret::propagateTaint(F, {&Arg}, {}, MSSA, AA, DT,
+                                                PDT, LI, &Summaries);
+    if (!AlwaysReturn && returnsSecret(F, Taint))
+      Summary.ArgToReturn.set(Arg.getArgNo());
+    if (!AlwaysMemory && writesSecretMemory(F, Taint, Summaries))
+      Summary.ArgToMemory.set(Arg.getArgNo());
+  }
+
+  return Summary;
+}
+
+static bool sameSummary(const FunctionSummary &A, const FunctionSummary &B) {
+  return A.ArgToReturn == B.ArgToReturn && A.ArgToMemory == B.ArgToMemory &&
+         A.AlwaysSecret == B.AlwaysSecret;
+}
+
+//------------------------------------------------------------------------------
+// SecretSummary Implementation
+//------------------------------------------------------------------------------
+SecretSummary::Result SecretSummary::run(Module &M,
+                                         ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+  CallGraph &CG = MAM.getResult<CallGraphAnalysis>(M);
+
+  hash_code Sources = hashSecretSources(M);
+  if (Sources != ModuleHash) {
+    Cache.clear();
+    ModuleHash = Sources;
+  }
+
+  // scc_iterator visits the SCCs bottom-up, callees first.
+  std::vector<std::pair<SmallVector<Function *, 4>, bool>> SCCs;
+  DenseSet<const Function *> Defined;
+  for (auto It = scc_begin(&CG); !It.isAtEnd(); ++It) {
+    SmallVector<Function *, 4> SCC;
+    for (CallGraphNode *Node : *It) {
+      Function *F = Node->getFunction();
+      if (F && !F->isDeclaration())
+        SCC.push_back(F);
+    }
+    Defined.insert(SCC.begin(), SCC.end());
+    if (!SCC.empty())
+      SCCs.push_back({std::move(SCC), It.hasCycle()});
+  }
+
+  // Forget the functions that have been deleted since the last run.
+  SmallVector<const Function *, 8> Deleted;
+  for (auto &Pair : Cache)
+    if (!Defined.count(Pair.first))
+      Deleted.push_back(Pair.first);
+  for (const Function *F : Deleted)
+    Cache.erase(F);
+
+  Result Res;
+  // Functions whose body changed since the cached summary, and functions
+  // whose summary changed: their callers must be looked at again.
+  DenseSet<const Function *> Edited, Changed;
+
+  for (auto &Pair : SCCs) {
+    auto &SCC = Pair.first;
+    bool Dirty = false;
+    for (Function *F : SCC) {
+      hash_code Hash = hashFunction(*F);
+      auto Entry = Cache.find(F);
+      if (Entry == Cache.end() || Entry->second.Hash != Hash) {
+        Edited.insert(F);
+        Dirty = true;
+      }
+
+      SmallVector<const Function *, 8> Callees;
+      getCallees(*F, Callees);
+      for (const Function *Callee : Callees)
+        Dirty |= Changed.count(Callee) != 0;
+    }
+
+    if (!Dirty) {
+      for (Function *F : SCC)
+        Res.Summaries[F] = Cache[F].Summary;
+      continue;
+    }
+
+    // Summaries only grow, so a recursive SCC converges from empty ones.
+    for (Function *F : SCC)
+      Res.Summaries[F] = FunctionSummary(F->arg_size());
+
+    bool Again = true;
+    while (Again) {
+      Again = false;
+      for (Function *F : SCC) {
+        FunctionSummary Summary = computeSummary(*F, FAM, Res);
+        if (!sameSummary(Summary, Res.Summaries[F])) {
+          Res.Summaries[F] = std::move(Summary);
+          Again = Pair.second;
+        }
+      }
+    }
+
+    for (Function *F : SCC) {
+      CacheEntry &Entry = Cache[F];
+      if (!sameSummary(Entry.Summary, Res.Summaries[F]))
+        Changed.insert(F);
+      Entry.Hash = hashFunction(*F);
+      Entry.Summary = Res.Summaries[F];
+    }
+  }
+
+  // Top-down: the secret arguments of a function are its own sources plus
+  // what reaches it from its callers, which are all processed before it
+  // except the ones in the same SCC.
+  for (auto &Pair : llvm::reverse(SCCs)) {
+    auto &SCC = Pair.first;
+    for (Function *F : SCC) {
+      std::vector<Argument *> Args;
+      std::vector<MemoryLocation> Regions;
+      Secret::collectSecretSources(*F, Args, Regions);
+      for (Argument *Arg : Args)
+        Res.Summaries[F].SecretArgs.set(Arg->getArgNo());
+    }
+
+    bool Again = true;
+    while (Again) {
+      Again = false;
+      for (Function *F : SCC) {
+        CacheEntry &Entry = Cache[F];
+        const BitVector &Context = Res.Summaries[F].SecretArgs;
+
+        bool Stale = !Entry.HasCallArgs || Entry.Context != Context ||
+                     Edited.count(F);
+        SmallVector<const Function *, 8> Callees;
+        getCallees(*F, Callees);
+        for (const Function *Callee : Callees)
+          Stale |= Changed.count(Callee) != 0;
+
+        if (Stale) {
+          auto &MSSA = FAM.getResult<MemorySSAAnalysis>(*F).getMSSA();
+          auto &AA = FAM.getResult<AAManager>(*F);
+          auto &DT = FAM.getResult<DominatorTreeAnalysis>(*F);
+          auto &PDT = FAM.getResult<PostDominatorTreeAnalysis>(*F);
+          auto &LI = FAM.getResult<LoopAnalysis>(*F);
+          ResultSecret Taint =
+              Secret().generateInputVector(*F, MSSA, AA, DT, PDT, LI, &Res);
+
+          Entry.CallArgs.clear();
+          for (Instruction &I : instructions(*F)) {
+            auto *Call = dyn_cast<CallBase>(&I);
+            if (const BitVector *Args =
+                    Call ? Taint.getSecretCallArgs(Call) : nullptr)
+              Entry.CallArgs.push_back({Call->getCalledFunction(), *Args});
+          }
+          Entry.Context = Context;
+          Entry.HasCallArgs = true;
+        }
+
+        for (auto &CallArgs : Entry.CallArgs) {
+          BitVector &CalleeArgs = Res.Summaries[CallArgs.first].SecretArgs;
+          BitVector Old = CalleeArgs;
+          CalleeArgs |= CallArgs.second;
+          if (CalleeArgs != Old && is_contained(SCC, CallArgs.first))
+            Again = true;
+        }
+      }
+    }
+  }
+
+  return Res;
+}
+
+bool ResultSecretSummary::invalidate(Module &M, const PreservedAnalyses &PA,
+                                     ModuleAnalysisManager::Invalidator &) {
+  // The summaries go away with any module-level change that does not
+  // preserve them, including a function pipeline run through an adaptor.
+  // Inside that pipeline they stay cached: the Secret analysis reads them
+  // as an outer analysis and is invalidated along with them.
+  return !PA.getChecker<SecretSummary>().preservedWhenStateless();
+}
+
+PreservedAnalyses SecretSummaryPrinter::run(Module &M,
+                                            ModuleAnalysisManager &MAM) {
+  auto &Summaries = MAM.getResult<SecretSummary>(M);
+
+  auto PrintArgs = [&](const BitVector &Args) {
+    OS << "{";
+    ListSeparator LS(", ");
+    for (unsigned I : Args.set_bits())
+      OS << LS << I;
+    OS << "}";
+  };
+
+  OS << "Secret summaries for module '" << M.getName() << "':\n";
+  for (Function &F : M) {
+    const FunctionSummary *Summary = Summaries.lookup(&F);
+    if (!Summary)
+      continue;
+
+    OS << "  " << F.getName() << ": secret args ";
+    PrintArgs(Summary->SecretArgs);
+    OS << ", return <- ";
+    PrintArgs(Summary->ArgToReturn);
+    OS << ", memory <- ";
+    PrintArgs(Summary->ArgToMemory);
+    if (Summary->AlwaysSecret)
+      OS << ", always secret";
+    OS << "\n";
+  }
+
+  return PreservedAnalyses::all();
+}
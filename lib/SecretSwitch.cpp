@@ -0,0 +1,284 @@
+//==============================================================================
+// FILE:
+//    SecretSwitch.cpp
+//
+// DESCRIPTION:
+//    Lowers switch instructions for ct-linearize, replacing the lowerswitch
+//    pre-pass. lowerswitch builds a binary search over the case values out of
+//    leaf and pivot blocks, which ct-linearize then executes one after the
+//    other. Here:
+//      * a "value" switch, whose successors are empty blocks (or the join
+//        block itself) and that only decides the incoming values of the PHIs
+//        of the join block, becomes straight-line code;
+//      * any other switch becomes a chain of branches, one per distinct
+//        successor, whose predicates are all computed in the switch block.
+//
+//    A value switch is lowered either to a balanced tree of compares and
+//    selects, or to a masked selection: every case value is ANDed with the
+//    mask of its compare and the results are ORed, as in a constant-time
+//    table lookup. The cost model counts the instructions of both, charging
+//    extra for selects on types narrower than 32 bits, which backends often
+//    expand into branches. -ct-switch-lowering forces one of the two.
+//
+// License: MIT
+//==============================================================================
+#include "SecretSwitch.h"
+
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+namespace {
+enum class SwitchLowering { Auto, Tree, Table };
+} // namespace
+
+static cl::opt<SwitchLowering> SwitchLoweringOpt(
+    "ct-switch-lowering",
+    cl::desc("How ct-linearize lowers a switch selecting values"),
+    cl::init(SwitchLowering::Auto),
+    cl::values(clEnumValN(SwitchLowering::Auto, "auto", "Use the cost model"),
+               clEnumValN(SwitchLowering::Tree, "tree",
+                          "Balanced tree of compares and selects"),
+               clEnumValN(SwitchLowering::Table, "table",
+                          "Masked selection over all the cases")));
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+// Returns the block all the successors of SI lead to, if each successor is
+// either that block or an empty block branching to it.
+static BasicBlock *getValueSwitchJoin(SwitchInst *SI) {
+  BasicBlock *SwitchBB = SI->getParent();
+  BasicBlock *Join = nullptr;
+
+  for (BasicBlock *Succ : successors(SwitchBB)) {
+    BasicBlock *Target = Succ;
+    if (Succ->getSinglePredecessor() == SwitchBB ||
+        Succ->getUniquePredecessor() == SwitchBB) {
+      auto *Br = dyn_cast<BranchInst>(Succ->getFirstNonPHIOrDbg());
+      if (Br && Br->isUnconditional() && !isa<PHINode>(Succ->front()))
+        Target = Br->getSuccessor(0);
+    }
+
+    if (Join && Target != Join)
+      return nullptr;
+    Join = Target;
+  }
+
+  // The join must merge the values, not run the case bodies.
+  if (Join == SwitchBB || isa<SwitchInst>(Join->getTerminator()))
+    return nullptr;
+  for (BasicBlock *Succ : successors(SwitchBB))
+    if (Succ != Join && Succ->size() != 1)
+      return nullptr;
+  return Join;
+}
+
+// Incoming value of Phi when the switch jumps to Succ.
+static Value *getCaseValue(PHINode *Phi, BasicBlock *SwitchBB,
+                           BasicBlock *Succ, BasicBlock *Join) {
+  return Phi->getIncomingValueForBlock(Succ == Join ? SwitchBB : Succ);
+}
+
+static unsigned getSelectCost(Type *Ty) {
+  return Ty->isIntegerTy() && Ty->getIntegerBitWidth() < 32 ? 3 : 1;
+}
+
+using CaseList = SmallVector<std::pair<ConstantInt *, BasicBlock *>, 16>;
+
+// Balanced binary search over the sorted cases [Lo, Hi]: one unsigned
+// compare per inner node, one equality compare per leaf. Values holds the
+// result for every PHI.
+static void buildSelectTree(IRBuilder<> &Builder, Value *Cond,
+                            const CaseList &Cases, unsigned Lo, unsigned Hi,
+                            ArrayRef<PHINode *> Phis, BasicBlock *SwitchBB,
+                            BasicBlock *Join, ArrayRef<Value *> Defaults,
+                            SmallVectorImpl<Value *> &Values) {
+  if (Lo == Hi) {
+    Value *Eq = Builder.CreateICmpEQ(Cond, Cases[Lo].first);
+    for (unsigned I = 0; I < Phis.size(); I++)
+      Values.push_back(Builder.CreateSelect(
+          Eq, getCaseValue(Phis[I], SwitchBB, Cases[Lo].second, Join),
+          Defaults[I]));
+    return;
+  }
+
+  unsigned Mid = (Lo + Hi + 1) / 2;
+  SmallVector<Value *, 4> Left, Right;
+  buildSelectTree(Builder, Cond, Cases, Lo, Mid - 1, Phis, SwitchBB, Join,
+                  Defaults, Left);
+  buildSelectTree(Builder, Cond, Cases, Mid, Hi, Phis, SwitchBB, Join,
+                  Defaults, Right);
+
+  Value *Less = Builder.CreateICmpULT(Cond, Cases[Mid].first);
+  for (unsigned I = 0; I < Phis.size(); I++)
+    Values.push_back(Builder.CreateSelect(Less, Left[I], Right[I]));
+}
+
+// OR over the cases of (value & mask), where the mask is all ones for the
+// case that matches, plus the default under the mask of no match.
+static void buildMaskedTable(IRBuilder<> &Builder, Value *Cond,
+                             const CaseList &Cases, ArrayRef<PHINode *> Phis,
+                             BasicBlock *SwitchBB, BasicBlock *Join,
+                             ArrayRef<Value *> Defaults,
+                             SmallVectorImpl<Value *> &Values) {
+  SmallVector<Value *, 16> Matches;
+  Value *Any = nullptr;
+  for (auto &Case : Cases) {
+    Matches.push_back(Builder.CreateICmpEQ(Cond, Case.first));
+    Any = Any ? Builder.CreateOr(Any, Matches.back()) : Matches.back();
+  }
+  Value *None = Builder.CreateNot(Any);
+
+  for (unsigned I = 0; I < Phis.size(); I++) {
+    Type *Ty = Phis[I]->getType();
+    Value *Acc =
+        Builder.CreateAnd(Defaults[I], Builder.CreateSExt(None, Ty));
+    for (unsigned C = 0; C < Cases.size(); C++) {
+      Value *Mask = Builder.CreateSExt(Matches[C], Ty);
+      Value *Val = getCaseValue(Phis[I], SwitchBB, Cases[C].second, Join);
+      Acc = Builder.CreateOr(Acc, Builder.CreateAnd(Val, Mask));
+    }
+    Values.push_back(Acc);
+  }
+}
+
+static bool lowerValueSwitch(SwitchInst *SI, BasicBlock *Join) {
+  BasicBlock *SwitchBB = SI->getParent();
+  BasicBlock *Default = SI->getDefaultDest();
+
+  // Cases going to the default block produce the default values anyway.
+  CaseList Cases;
+  for (auto &Case : SI->cases())
+    if (Case.getCaseSuccessor() != Default)
+      Cases.push_back({Case.getCaseValue(), Case.getCaseSuccessor()});
+  llvm::sort(Cases, [](const auto &A, const auto &B) {
+    return A.first->getValue().ult(B.first->getValue());
+  });
+
+  SmallVector<PHINode *, 4> Phis;
+  SmallVector<Value *, 4> Defaults;
+  for (PHINode &Phi : Join->phis()) {
+    Phis.push_back(&Phi);
+    Defaults.push_back(getCaseValue(&Phi, SwitchBB, Default, Join));
+  }
+
+  IRBuilder<> Builder(SI);
+  SmallVector<Value *, 4> Values;
+  if (!Cases.empty() && !Phis.empty()) {
+    unsigned K = Cases.size();
+    unsigned TreeCost = 2 * K - 1, TableCost = 2 * K;
+    bool TableLegal = true;
+    for (PHINode *Phi : Phis) {
+      TreeCost += getSelectCost(Phi->getType()) * (2 * K - 1);
+      TableCost += 3 * K + 2;
+      TableLegal &= Phi->getType()->isIntegerTy();
+    }
+
+    bool UseTable = TableLegal && TableCost <= TreeCost;
+    if (SwitchLoweringOpt != SwitchLowering::Auto)
+      UseTable = TableLegal && SwitchLoweringOpt == SwitchLowering::Table;
+
+    if (UseTable)
+      buildMaskedTable(Builder, SI->getCondition(), Cases, Phis, SwitchBB,
+                       Join, Defaults, Values);
+    else
+      buildSelectTree(Builder, SI->getCondition(), Cases, 0, K - 1, Phis,
+                      SwitchBB, Join, Defaults, Values);
+  } else {
+    Values.append(Defaults.begin(), Defaults.end());
+  }
+
+  // The switch block now jumps straight to the join with the selected values.
+  SmallSetVector<BasicBlock *, 8> Dead;
+  for (BasicBlock *Succ : successors(SwitchBB))
+    if (Succ != Join)
+      Dead.insert(Succ);
+
+  for (unsigned I = 0; I < Phis.size(); I++) {
+    while (Phis[I]->getBasicBlockIndex(SwitchBB) >= 0)
+      Phis[I]->removeIncomingValue(SwitchBB, /*DeletePHIIfEmpty=*/false);
+    Phis[I]->addIncoming(Values[I], SwitchBB);
+  }
+  Builder.CreateBr(Join);
+  SI->eraseFromParent();
+
+  for (BasicBlock *BB : Dead)
+    DeleteDeadBlock(BB);
+  return true;
+}
+
+// Replaces the edges from From to Succ in the PHIs of Succ by a single edge
+// from To.
+static void redirectPhis(BasicBlock *Succ, BasicBlock *From, BasicBlock *To) {
+  for (PHINode &Phi : Succ->phis()) {
+    int Idx = Phi.getBasicBlockIndex(From);
+    if (Idx < 0)
+      continue;
+    Value *Val = Phi.getIncomingValue(Idx);
+    while (Phi.getBasicBlockIndex(From) >= 0)
+      Phi.removeIncomingValue(From, /*DeletePHIIfEmpty=*/false);
+    Phi.addIncoming(Val, To);
+  }
+}
+
+static bool lowerControlSwitch(SwitchInst *SI) {
+  BasicBlock *SwitchBB = SI->getParent();
+  BasicBlock *Default = SI->getDefaultDest();
+  Value *Cond = SI->getCondition();
+
+  // One predicate per distinct successor, in the order of the cases.
+  MapVector<BasicBlock *, Value *> Preds;
+  IRBuilder<> Builder(SI);
+  for (auto &Case : SI->cases()) {
+    BasicBlock *Succ = Case.getCaseSuccessor();
+    if (Succ == Default)
+      continue;
+    Value *Eq = Builder.CreateICmpEQ(Cond, Case.getCaseValue());
+    auto It = Preds.find(Succ);
+    if (It == Preds.end())
+      Preds.insert({Succ, Eq});
+    else
+      It->second = Builder.CreateOr(It->second, Eq);
+  }
+
+  // SwitchBB: br P1, S1, N2;  N2: br P2, S2, N3;  ...  Nm: br Pm, Sm, Default
+  BasicBlock *Cur = SwitchBB;
+  for (auto It = Preds.begin(), End = Preds.end(); It != End; ++It) {
+    BasicBlock *Next = Default;
+    if (std::next(It) != End)
+      Next = BasicBlock::Create(SwitchBB->getContext(),
+                                SwitchBB->getName() + ".case",
+                                SwitchBB->getParent(), Default);
+    BranchInst::Create(It->first, Next, It->second, Cur);
+    redirectPhis(It->first, SwitchBB, Cur);
+    if (Next != Default)
+      Cur = Next;
+  }
+  if (Preds.empty())
+    BranchInst::Create(Default, SwitchBB);
+  redirectPhis(Default, SwitchBB, Cur);
+
+  SI->eraseFromParent();
+  return true;
+}
+
+//------------------------------------------------------------------------------
+// Entry point
+//------------------------------------------------------------------------------
+bool lowerSwitches(ArrayRef<SwitchInst *> Switches) {
+  for (SwitchInst *SI : Switches) {
+    if (BasicBlock *Join = getValueSwitchJoin(SI))
+      lowerValueSwitch(SI, Join);
+    else
+      lowerControlSwitch(SI);
+  }
+  return !Switches.empty();
+}
@@ -0,0 +1,180 @@
+//==============================================================================
+// FILE:
+//    SecretVerify.cpp
+//
+// DESCRIPTION:
+//    The ct-verify pass, a check of the IR that can run in every build of the
+//    hardened modules. It takes the taint of the Secret analysis as it is and
+//    looks at each instruction once, so it runs in time linear in the size of
+//    the module. It reports:
+//      * the conditional branches, switches and indirect branches on a
+//        secret, and the indirect calls to a secret callee;
+//      * the loads, stores, atomics and memory intrinsics at an address
+//        derived from a secret (a table indexed by a secret), or of a secret
+//        length;
+//      * the instructions whose latency depends on their operands: integer
+//        divisions and remainders (x86-64 DIV and IDIV, Cortex-M UDIV and
+//        SDIV), floating-point divisions, remainders and square roots, and
+//        the multiplications wider than 32 bits on Cortex-M3 (UMULL, SMULL).
+//    and fails when it finds one. ct-llc checks the machine code the same
+//    way, once the backend is done.
+//
+// USAGE:
+//      $ opt -load-pass-plugin <BUILD_DIR>/lib/libSecret.so `\`
+//        -passes="require<secret-summary>,ct-masked-clones,function(ct-linearize,ct-opt<O2>),ct-verify" `\`
+//        -disable-output <input-llvm-file>
+//
+// License: MIT
+//==============================================================================
+#include "SecretVerify.h"
+#include "Secret.h"
+#include "SecretDivision.h"
+
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Support/ErrorHandling.h"
+
+using namespace llvm;
+
+//------------------------------------------------------------------------------
+// Helper functions
+//------------------------------------------------------------------------------
+static bool hasSecretOperand(const Instruction &I, const ResultSecret &Secrets) {
+  return any_of(I.operands(),
+                [&](const Use &Op) { return Secrets.isSecret(Op.get()); });
+}
+
+// The address a load, store or atomic instruction accesses.
+static const Value *getAddress(const Instruction &I) {
+  if (auto *RMW = dyn_cast<AtomicRMWInst>(&I))
+    return RMW->getPointerOperand();
+  if (auto *CmpXchg = dyn_cast<AtomicCmpXchgInst>(&I))
+    return CmpXchg->getPointerOperand();
+  return getLoadStorePointerOperand(&I);
+}
+
+// What makes the timing of I depend on a secret, NULL if nothing does.
+static const char *getLeak(const Instruction &I, const ResultSecret &Secrets) {
+  switch (I.getOpcode()) {
+  case Instruction::Br: {
+    auto &Br = cast<BranchInst>(I);
+    return Br.isConditional() && Secrets.isSecret(Br.getCondition())
+               ? "branch on a secret"
+               : nullptr;
+  }
+  case Instruction::Switch:
+    return Secrets.isSecret(cast<SwitchInst>(I).getCondition())
+               ? "switch on a secret"
+               : nullptr;
+  case Instruction::IndirectBr:
+    return Secrets.isSecret(cast<IndirectBrInst>(I).getAddress())
+               ? "indirect branch to a secret address"
+               : nullptr;
+
+  case Instruction::Load:
+  case Instruction::Store:
+  case Instruction::AtomicRMW:
+  case Instruction::AtomicCmpXchg:
+    return Secrets.isSecret(getAddress(I))
+               ? "memory access at an address derived from a secret"
+               : nullptr;
+
+  case Instruction::UDiv:
+  case Instruction::SDiv:
+  case Instruction::URem:
+  case Instruction::SRem:
+    return hasSecretOperand(I, Secrets) ? "integer division on a secret"
+                                        : nullptr;
+  // On Cortex-M3, as lowerSecretDivisions reports them.
+  case Instruction::Mul:
+    return I.getType()->getScalarSizeInBits() > 32 &&
+                   hasSecretOperand(I, Secrets) &&
+                   hasEarlyExitLongMultiply(*I.getFunction())
+               ? "long multiplication on a secret"
+               : nullptr;
+  case Instruction::FDiv:
+  case Instruction::FRem:
+    return hasSecretOperand(I, Secrets)
+               ? "floating-point division on a secret"
+               : nullptr;
+
+  case Instruction::Call:
+  case Instruction::Invoke:
+  case Instruction::CallBr:
+    break;
+  default:
+    return nullptr;
+  }
+
+  auto &Call = cast<CallBase>(I);
+  if (Call.isIndirectCall())
+    return Secrets.isSecret(Call.getCalledOperand())
+               ? "indirect call to a secret target"
+               : nullptr;
+
+  if (auto *Mem = dyn_cast<MemIntrinsic>(&I)) {
+    if (Secrets.isSecret(Mem->getRawDest()))
+      return "memory access at an address derived from a secret";
+    if (auto *Transfer = dyn_cast<MemTransferInst>(Mem))
+      if (Secrets.isSecret(Transfer->getRawSource()))
+        return "memory access at an address derived from a secret";
+    return Secrets.isSecret(Mem->getLength()) ? "memory access of a secret size"
+                                              : nullptr;
+  }
+
+  switch (Call.getIntrinsicID()) {
+  case Intrinsic::masked_load:
+  case Intrinsic::masked_gather:
+    return Secrets.isSecret(Call.getArgOperand(0))
+               ? "memory access at an address derived from a secret"
+               : nullptr;
+  case Intrinsic::masked_store:
+  case Intrinsic::masked_scatter:
+    return Secrets.isSecret(Call.getArgOperand(1))
+               ? "memory access at an address derived from a secret"
+               : nullptr;
+  case Intrinsic::sqrt:
+    return Secrets.isSecret(Call.getArgOperand(0))
+               ? "floating-point square root of a secret"
+               : nullptr;
+  default:
+    return nullptr;
+  }
+}
+
+//------------------------------------------------------------------------------
+// Main functions
+//------------------------------------------------------------------------------
+unsigned verifyConstantTime(Function &F, const ResultSecret &Secrets,
+                            raw_ostream &OS) {
+  unsigned NumFindings = 0;
+  if (Secrets.empty())
+    return NumFindings;
+
+  for (BasicBlock &BB : F)
+    for (Instruction &I : BB) {
+      const char *Leak = getLeak(I, Secrets);
+      if (!Leak)
+        continue;
+      OS << F.getName() << ": " << Leak << " in ";
+      BB.printAsOperand(OS, /*PrintType=*/false);
+      OS << ":\n " << I << "\n";
+      NumFindings++;
+    }
+  return NumFindings;
+}
+
+PreservedAnalyses CTVerify::run(Module &M, ModuleAnalysisManager &MAM) {
+  auto &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+
+  unsigned NumFindings = 0;
+  for (Function &F : M)
+    if (!F.isDeclaration())
+      NumFindings += verifyConstantTime(F, FAM.getResult<Secret>(F), OS);
+
+  if (NumFindings)
+    report_fatal_error(Twine("ct-verify: ") + Twine(NumFindings) +
+                       " instruction(s) of '" + M.getName() +
+                       "' depend on a secret");
+  return PreservedAnalyses::all();
+}
@@ -0,0 +1,27 @@
+; A hardened version of ct-diff.ll where @pick compares with 11 instead of
+; 10.
+
+@counter = global i32 0
+
+define i32 @pick(i32 %a, i32 %b) {
+entry:
+  %cmp = icmp sgt i32 %a, 11
+  %c = load i32, ptr @counter
+  %c.add = add i32 %c, %b
+  %c.new = select i1 %cmp, i32 %c.add, i32 %c
+  store i32 %c.new, ptr @counter
+  %mul = mul i32 %b, 3
+  %r = select i1 %cmp, i32 %mul, i32 %a
+  ret i32 %r
+}
+
+define void @fill(ptr dereferenceable(32) %p, i32 %s) {
+entry:
+  %bit = and i32 %s, 1
+  %cmp = icmp ne i32 %bit, 0
+  %q = getelementptr inbounds i32, ptr %p, i64 7
+  %old = load i32, ptr %q
+  %new = select i1 %cmp, i32 %s, i32 %old
+  store i32 %new, ptr %q
+  ret void
+}
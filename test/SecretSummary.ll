@@ -0,0 +1,69 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="print<secret-summary>" -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s
+
+; Test the interprocedural summaries of the Secret analysis: the secret state
+; of cipher reaches subBytes and getSBoxValue, the public argc does not
+; reach pub, and the mutually recursive SCC converges.
+
+; CHECK: getSBoxValue: secret args {0}, return <- {0}, memory <- {}
+; CHECK-NEXT: subBytes: secret args {0}, return <- {}, memory <- {0}
+; CHECK-NEXT: pub: secret args {}, return <- {0}, memory <- {}
+; CHECK-NEXT: even: secret args {0}, return <- {0}, memory <- {}
+; CHECK-NEXT: odd: secret args {0}, return <- {0}, memory <- {}
+; CHECK-NEXT: cipher: secret args {0}, return <- {}, memory <- {}, always secret
+; CHECK-NEXT: main: secret args {}, return <- {0}, memory <- {}, always secret
+
+@sbox = constant [4 x i8] c"\01\02\03\04"
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [6 x i8] c"aes.c\00", section "llvm.metadata"
+@.arg = private unnamed_addr constant [1 x i8] zeroinitializer, section "llvm.metadata"
+@llvm.global.annotations = appending global [1 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @cipher, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i8 @getSBoxValue(i8 %n) {
+  %i = zext i8 %n to i64
+  %p = getelementptr [4 x i8], ptr @sbox, i64 0, i64 %i
+  %v = load i8, ptr %p
+  ret i8 %v
+}
+
+define void @subBytes(ptr %state) {
+  %x = load i8, ptr %state
+  %y = call i8 @getSBoxValue(i8 %x)
+  store i8 %y, ptr %state
+  ret void
+}
+
+define i32 @pub(i32 %a) {
+  %r = add i32 %a, 1
+  ret i32 %r
+}
+
+define i8 @even(i8 %n) {
+  %c = icmp eq i8 %n, 0
+  %m = sub i8 %n, 1
+  %r = call i8 @odd(i8 %m)
+  %s = select i1 %c, i8 %n, i8 %r
+  ret i8 %s
+}
+
+define i8 @odd(i8 %n) {
+  %m = sub i8 %n, 1
+  %r = call i8 @even(i8 %m)
+  ret i8 %r
+}
+
+define void @cipher(ptr %state) {
+  call void @subBytes(ptr %state)
+  %x = load i8, ptr %state
+  %y = call i8 @even(i8 %x)
+  store i8 %y, ptr %state
+  ret void
+}
+
+define i32 @main(i32 %argc) {
+  %buf = alloca i8
+  store i8 0, ptr %buf
+  call void @cipher(ptr %buf)
+  %r = call i32 @pub(i32 %argc)
+  ret i32 %r
+}
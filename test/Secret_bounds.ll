@@ -0,0 +1,122 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+
+; Test the bounds ct-linearize gives to loops whose trip count is a secret,
+; when the arrays they index are not local arrays.
+
+; A global array: its type.
+
+; CHECK-LABEL: define void @glob
+; CHECK:         %cmp = icmp slt i64 %i.next, 31
+
+; A pointer parameter: its dereferenceable bytes, here 10 elements. The i32
+; induction variable is found through the extension of the index.
+
+; CHECK-LABEL: define void @deref
+; CHECK:         [[PRED:%.*]] = icmp slt i32 %i, %n
+; CHECK:         select i1 [[PRED]], i32 %i,
+; CHECK:         %cmp = icmp slt i32 %i.next, 9
+
+; A parameter annotated with ct_bound:16, spilled to an annotated slot.
+
+; CHECK-LABEL: define void @annot
+; CHECK:         %cmp = icmp slt i64 %i.next, 15
+
+; A row of a global matrix: the bound of the column index, not the rows.
+
+; CHECK-LABEL: define void @column
+; CHECK:         %cmp = icmp slt i64 %i.next, 3
+
+; An array parameter: the rows its dereferenceable bytes hold, here 6 of
+; 16 bytes, not the elements of a row.
+
+; CHECK-LABEL: define void @rows
+; CHECK:         %cmp = icmp slt i64 %i.next, 5
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.bound = private unnamed_addr constant [12 x i8] c"ct_bound:16\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@table = global [32 x i8] zeroinitializer
+@grid = global [8 x [4 x i32]] zeroinitializer
+@llvm.global.annotations = appending global [5 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @glob, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @deref, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @annot, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @column, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @rows, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+declare void @llvm.var.annotation(ptr, ptr, ptr, i32, ptr)
+
+define void @glob(i32 %n) {
+entry:
+  %ext = sext i32 %n to i64
+  br label %for.body
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %t = trunc i64 %i to i8
+  %p = getelementptr inbounds [32 x i8], ptr @table, i64 0, i64 %i
+  store i8 %t, ptr %p, align 1
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %ext
+  br i1 %cmp, label %for.body, label %exit
+exit:
+  ret void
+}
+
+define void @deref(ptr dereferenceable(40) %out, i32 %n) {
+entry:
+  br label %for.body
+for.body:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %for.body ]
+  %idx = zext i32 %i to i64
+  %p = getelementptr inbounds i32, ptr %out, i64 %idx
+  store i32 %i, ptr %p, align 4
+  %i.next = add nsw i32 %i, 1
+  %cmp = icmp slt i32 %i.next, %n
+  br i1 %cmp, label %for.body, label %exit
+exit:
+  ret void
+}
+
+define void @annot(ptr %out, i64 %n) {
+entry:
+  %out.addr = alloca ptr, align 8
+  store ptr %out, ptr %out.addr, align 8
+  call void @llvm.var.annotation(ptr %out.addr, ptr @.bound, ptr @.file, i32 3, ptr null)
+  br label %for.body
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %o = load ptr, ptr %out.addr, align 8
+  %p = getelementptr inbounds i16, ptr %o, i64 %i
+  %t = trunc i64 %i to i16
+  store i16 %t, ptr %p, align 2
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %n
+  br i1 %cmp, label %for.body, label %exit
+exit:
+  ret void
+}
+
+define void @column(i64 %n) {
+entry:
+  br label %for.body
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %t = trunc i64 %i to i32
+  %p = getelementptr inbounds [8 x [4 x i32]], ptr @grid, i64 0, i64 2, i64 %i
+  store i32 %t, ptr %p, align 4
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %n
+  br i1 %cmp, label %for.body, label %exit
+exit:
+  ret void
+}
+
+define void @rows(ptr dereferenceable(96) %m, i64 %n) {
+entry:
+  br label %for.body
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %t = trunc i64 %i to i32
+  %p = getelementptr inbounds [4 x i32], ptr %m, i64 %i, i64 1
+  store i32 %t, ptr %p, align 4
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %n
+  br i1 %cmp, label %for.body, label %exit
+exit:
+  ret void
+}
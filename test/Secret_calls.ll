@@ -0,0 +1,133 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-external-calls=guard -passes="ct-masked-clones,function(ct-linearize)" -S %s \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-external-calls=keep -passes="ct-masked-clones,function(ct-linearize)" -S %s \
+; RUN:   | FileCheck --check-prefix=KEEP %s
+; RUN:  not --crash opt -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -passes="ct-masked-clones,function(ct-linearize)" -disable-output %s 2>&1 \
+; RUN:   | FileCheck --check-prefix=ERR %s
+
+; Test the calls in serialized regions: a function of the module is called
+; through its masked clone, created by ct-masked-clones and shared by both
+; sides. An external function is an error by default; it is only called when
+; the side it is in would have run with -ct-external-calls=guard, and always
+; with -ct-external-calls=keep.
+
+; CHECK-LABEL: define i32 @foo
+; CHECK:       then:
+; CHECK-NEXT:    call void @record.ct_masked(ptr %out, i32 %a, i1 %c)
+; CHECK-NEXT:    br i1 %c, label %then.ct.call, label %then.ct.cont
+; CHECK:       then.ct.call:
+; CHECK-NEXT:    %p = call i32 @puts(ptr @msg)
+; CHECK:       then.ct.cont:
+; CHECK-NEXT:    %p.ct = phi i32 [ %p, %then.ct.call ], [ 0, %then ]
+; CHECK-NEXT:    %x = add i32 %p.ct, %a
+; CHECK:       else:
+; CHECK-NEXT:    [[NOT:%.*]] = xor i1 %c, true
+; CHECK:         call void @record.ct_masked(ptr %out, i32 %y, i1 [[NOT]])
+
+; A memcpy and a memset become loops that store either the new byte or the
+; old one, whatever the guard option.
+
+; CHECK-LABEL: define void @copy
+; CHECK:       then.ct.mem:
+; CHECK-NEXT:    %ct.i = phi i64 [ 0, %then ], [ %ct.i.next, %then.ct.mem.body ]
+; CHECK-NEXT:    %ct.more = icmp ult i64 %ct.i, %n
+; CHECK-NEXT:    br i1 %ct.more, label %then.ct.mem.body, label %then.ct.cont
+; CHECK:       then.ct.mem.body:
+; CHECK-NEXT:    %ct.dst = getelementptr i8, ptr %dst, i64 %ct.i
+; CHECK-NEXT:    %ct.src = getelementptr i8, ptr %src, i64 %ct.i
+; CHECK-NEXT:    %ct.new = load i8, ptr %ct.src, align 1
+; CHECK-NEXT:    %ct.old = load i8, ptr %ct.dst, align 1
+; CHECK-NEXT:    %ct.masked = select i1 %c, i8 %ct.new, i8 %ct.old
+; CHECK-NEXT:    store i8 %ct.masked, ptr %ct.dst, align 1
+; CHECK:       else:
+; CHECK-NEXT:    [[NOT:%.*]] = xor i1 %c, true
+; CHECK:       else.ct.mem.body:
+; CHECK:         [[OLD:%ct.old[0-9]*]] = load i8, ptr [[DST:%ct.dst[0-9]*]], align 1
+; CHECK-NEXT:    [[SEL:%ct.masked[0-9]*]] = select i1 [[NOT]], i8 0, i8 [[OLD]]
+; CHECK-NEXT:    store i8 [[SEL]], ptr [[DST]], align 1
+; CHECK-NOT:     call void @llvm.mem
+
+; The clone keeps the stores that its predicate is false for from changing
+; memory, and its arguments are secret: its branch is serialized too.
+
+; CHECK-LABEL: define internal void @record.ct_masked(ptr %out, i32 %v, i1 %ct.pred) #0
+; CHECK:         %ct.old = load i32, ptr %out, align 4
+; CHECK-NEXT:    %ct.masked = select i1 %ct.pred, i32 %sum, i32 %ct.old
+; CHECK-NEXT:    store i32 %ct.masked, ptr %out, align 4
+; CHECK:       log:
+; CHECK-NEXT:    [[PRED:%.*]] = and i1 %ct.pred, %big
+; CHECK-NEXT:    br i1 [[PRED]], label %log.ct.call, label %log.ct.cont
+; CHECK:       attributes #0 = { "ct-masked" }
+
+; KEEP-LABEL:  define i32 @foo
+; KEEP:        then:
+; KEEP-NEXT:     call void @record.ct_masked(ptr %out, i32 %a, i1 %c)
+; KEEP-NEXT:     %p = call i32 @puts(ptr @msg)
+
+; ERR: ct-linearize: cannot mask the call to 'puts' in 'foo' on a secret, the callee is external
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@msg = private constant [5 x i8] c"ciao\00"
+@llvm.global.annotations = appending global [2 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @foo, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @copy, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+declare i32 @puts(ptr)
+declare void @llvm.memcpy.p0.p0.i64(ptr, ptr, i64, i1)
+declare void @llvm.memset.p0.i64(ptr, i8, i64, i1)
+
+define void @record(ptr %out, i32 %v) {
+entry:
+  %old = load i32, ptr %out
+  %sum = add i32 %old, %v
+  store i32 %sum, ptr %out
+  %big = icmp sgt i32 %sum, 100
+  br i1 %big, label %log, label %done
+
+log:
+  %r = call i32 @puts(ptr @msg)
+  br label %done
+
+done:
+  ret void
+}
+
+define i32 @foo(i32 %a, ptr %out) {
+entry:
+  %c = icmp sgt i32 %a, 10
+  br i1 %c, label %then, label %else
+
+then:
+  call void @record(ptr %out, i32 %a)
+  %p = call i32 @puts(ptr @msg)
+  %x = add i32 %p, %a
+  br label %end
+
+else:
+  %y = mul i32 %a, 3
+  call void @record(ptr %out, i32 %y)
+  br label %end
+
+end:
+  %r = phi i32 [ %x, %then ], [ %y, %else ]
+  ret i32 %r
+}
+
+define void @copy(i32 %a, ptr %dst, ptr %src, i64 %n) {
+entry:
+  %c = icmp sgt i32 %a, 10
+  br i1 %c, label %then, label %else
+
+then:
+  call void @llvm.memcpy.p0.p0.i64(ptr %dst, ptr %src, i64 %n, i1 false)
+  br label %end
+
+else:
+  call void @llvm.memset.p0.i64(ptr %dst, i8 0, i64 %n, i1 false)
+  br label %end
+
+end:
+  ret void
+}
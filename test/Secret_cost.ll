@@ -0,0 +1,88 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" \
+; RUN:   -pass-remarks=ct-linearize -disable-output %s 2>&1 | FileCheck %s
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" \
+; RUN:   -pass-remarks-output=%t.yaml -disable-output %s
+; RUN:  FileCheck --check-prefix=YAML %s < %t.yaml
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-max-slowdown=1.5 -ct-over-budget=skip -passes="ct-linearize" -S %s 2>&1 \
+; RUN:   | FileCheck --check-prefix=SKIP %s
+; RUN:  not --crash opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-max-slowdown=1.5 -ct-over-budget=error -passes="ct-linearize" -disable-output %s 2>&1 \
+; RUN:   | FileCheck --check-prefix=ERROR %s
+
+; Test the cost model of ct-linearize: the estimate is reported as a remark,
+; and the functions above -ct-max-slowdown are reported, left as they are or
+; rejected.
+
+; Both sides of the branch run, the PHI becomes a select, and the division
+; on a secret by 3 a multiplication by its reciprocal (7 instead of 4).
+; CHECK: remark: <unknown>:0:0: estimated cost 8.00 before linearization, 16.00 after (slowdown 2.00x)
+
+; The loop runs the 64 iterations of the table instead of the 32 that BFI
+; expects.
+; CHECK: remark: <unknown>:0:0: estimated cost {{.*}} (slowdown 1.99x)
+
+; No branch, no slowdown.
+; CHECK: remark: <unknown>:0:0: estimated cost 2.00 before linearization, 2.00 after (slowdown 1.00x)
+
+; YAML:      --- !Passed
+; YAML-NEXT: Pass:            ct-linearize
+; YAML-NEXT: Name:            LinearizationCost
+; YAML-NEXT: Function:        branchy
+; YAML:        - CostBefore:      '8.00'
+; YAML:        - CostAfter:       '16.00'
+; YAML:        - Slowdown:        '2.00'
+
+; SKIP:      warning: <unknown>:0:0: ct-linearize: 'branchy' would be 2.00x slower, more than the budget of 1.50x, left as it is
+; SKIP:      define i32 @branchy
+; SKIP:        br i1 %cmp, label %if.then, label %if.else
+; SKIP:      define i32 @clean
+
+; ERROR: LLVM ERROR: ct-linearize: 'branchy' would be 2.00x slower, more than the budget of 1.50x (-ct-max-slowdown)
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@table = global [64 x i8] zeroinitializer
+@llvm.global.annotations = appending global [3 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @branchy, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @fill, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @clean, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @branchy(i32 %a, i32 %b) {
+entry:
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %if.then, label %if.else
+
+if.then:
+  %x = mul i32 %b, 7
+  %x2 = add i32 %x, %a
+  br label %if.end
+
+if.else:
+  %y = sdiv i32 %b, 3
+  br label %if.end
+
+if.end:
+  %r = phi i32 [ %x2, %if.then ], [ %y, %if.else ]
+  ret i32 %r
+}
+
+define void @fill(i32 %n) {
+entry:
+  %ext = sext i32 %n to i64
+  br label %for.body
+
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %t = trunc i64 %i to i8
+  %p = getelementptr inbounds [64 x i8], ptr @table, i64 0, i64 %i
+  store i8 %t, ptr %p, align 1
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp slt i64 %i.next, %ext
+  br i1 %cmp, label %for.body, label %exit
+
+exit:
+  ret void
+}
+
+define i32 @clean(i32 %a, i32 %b) {
+  %s = add i32 %a, %b
+  ret i32 %s
+}
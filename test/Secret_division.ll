@@ -0,0 +1,208 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=by_const:arg0,by_neg_const:arg0,rem_by_secret:arg1,sdiv8:arg0,srem8:arg1,udiv8:arg0,urem8:arg1 \
+; RUN:   -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=by_const:arg0,by_neg_const:arg0,rem_by_secret:arg1,sdiv8:arg0,srem8:arg1,udiv8:arg0,urem8:arg1 \
+; RUN:   -passes="ct-linearize" -S %s \
+; RUN:   | lli
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -mtriple=thumbv7m-none-eabi -secret-args=by_const:arg0 \
+; RUN:   -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck --check-prefix=M3 %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=vec_div:arg0 -passes="ct-linearize" -disable-output %s 2>&1 \
+; RUN:   | FileCheck --check-prefix=WARN %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -mtriple=thumbv7m-none-eabi -secret-args=wide_mul:arg0 -passes="ct-linearize" -disable-output %s 2>&1 \
+; RUN:   | FileCheck --check-prefix=M3WARN %s
+
+; Test the divisions with a secret operand: they take a fixed time once
+; ct-linearize has run, and still compute the same values (main checks every
+; pair of i8 operands and returns the number of mismatches).
+
+; A division by a constant is a multiplication by its reciprocal: the high
+; half of a 64-bit product, shifted.
+
+; CHECK-LABEL: define i32 @by_const
+; CHECK-NOT:     udiv
+; CHECK:         [[X:%.*]] = zext i32 %x to i64
+; CHECK-NEXT:    [[P:%.*]] = mul i64 [[X]], 3435973837
+; CHECK-NEXT:    [[H:%.*]] = lshr i64 [[P]], 32
+; CHECK-NEXT:    %div.mulh = trunc i64 [[H]] to i32
+; CHECK-NEXT:    %q = lshr i32 %div.mulh, 3
+; CHECK-NEXT:    ret i32 %q
+
+; A signed one rounds the quotient towards zero, a remainder subtracts the
+; quotient times the divisor.
+
+; CHECK-LABEL: define i32 @by_neg_const
+; CHECK-NOT:     srem
+; CHECK:         [[X:%.*]] = sext i32 %x to i64
+; CHECK-NEXT:    mul i64 [[X]], 1840700269
+; CHECK:         [[Q:%.*]] = ashr i32
+; CHECK-NEXT:    [[SIGN:%.*]] = lshr i32 [[Q]], 31
+; CHECK-NEXT:    %div.q = add i32 [[Q]], [[SIGN]]
+; CHECK-NEXT:    [[M:%.*]] = mul i32 %div.q, -7
+; CHECK-NEXT:    %r = sub i32 %x, [[M]]
+
+; A secret divisor gets a restoring division: one iteration per bit, the
+; divisor subtracted under a mask.
+
+; CHECK-LABEL: define i32 @rem_by_secret
+; CHECK-NOT:     urem
+; CHECK:       div:
+; CHECK-NEXT:    %div.i = phi i32 [ 0, %entry ], [ %div.i.next, %div ]
+; CHECK:         %div.fits = or i1
+; CHECK-NEXT:    %div.mask = sext i1 %div.fits to i32
+; CHECK-NEXT:    [[SUB:%.*]] = and i32 %d, %div.mask
+; CHECK-NEXT:    %r = sub i32 %div.r.shl, [[SUB]]
+; CHECK:         [[MORE:%.*]] = icmp ult i32 %div.i.next, 32
+; CHECK-NEXT:    br i1 [[MORE]], label %div, label %div.end
+; CHECK:       div.end:
+; CHECK-NEXT:    ret i32 %r
+
+; The signed division runs on the absolute values.
+
+; CHECK-LABEL: define i8 @sdiv8
+; CHECK:         %div.sx = ashr i8 %x, 7
+; CHECK-NEXT:    %div.sd = ashr i8 %d, 7
+; CHECK:       div.end:
+; CHECK-NEXT:    [[S:%.*]] = xor i8 %div.sx, %div.sd
+; CHECK-NEXT:    [[N:%.*]] = xor i8 %div.q.next, [[S]]
+; CHECK-NEXT:    %q = sub i8 [[N]], [[S]]
+
+; On Cortex-M3 the 64-bit product would be a UMULL, which stops early: the
+; division by a constant takes the loop too.
+
+; M3-LABEL: define i32 @by_const
+; M3-NOT:     mul i64
+; M3:       div:
+; M3:         %q = or i32
+; M3:         icmp ult i32 %div.i.next, 32
+
+; A division of vectors is left as it is, and reported.
+
+; WARN: ct-linearize: 1 vector division(s) with a secret operand in 'vec_div' left as they are
+
+; So is a 64-bit multiplication on Cortex-M3, a UMULL that stops early.
+
+; M3WARN: ct-linearize: 1 multiplication(s) wider than 32 bits with a secret operand in 'wide_mul' take a variable time on Cortex-M3
+
+; The divisions in main have no secret operand.
+
+; CHECK-LABEL: define i32 @main
+; CHECK:         udiv i8
+; CHECK:         urem i8
+; CHECK:         sdiv i8
+; CHECK:         srem i8
+
+define i32 @by_const(i32 %x) {
+entry:
+  %q = udiv i32 %x, 10
+  ret i32 %q
+}
+
+define i32 @by_neg_const(i32 %x) {
+entry:
+  %r = srem i32 %x, -7
+  ret i32 %r
+}
+
+define i32 @rem_by_secret(i32 %x, i32 %d) {
+entry:
+  %r = urem i32 %x, %d
+  ret i32 %r
+}
+
+define i8 @sdiv8(i8 %x, i8 %d) {
+entry:
+  %q = sdiv i8 %x, %d
+  ret i8 %q
+}
+
+define i8 @srem8(i8 %x, i8 %d) {
+entry:
+  %r = srem i8 %x, %d
+  ret i8 %r
+}
+
+define i8 @udiv8(i8 %x, i8 %d) {
+entry:
+  %q = udiv i8 %x, %d
+  ret i8 %q
+}
+
+define i8 @urem8(i8 %x, i8 %d) {
+entry:
+  %r = urem i8 %x, %d
+  ret i8 %r
+}
+
+define <4 x i32> @vec_div(<4 x i32> %x, <4 x i32> %d) {
+entry:
+  %q = udiv <4 x i32> %x, %d
+  ret <4 x i32> %q
+}
+
+define i64 @wide_mul(i32 %x, i32 %y) {
+entry:
+  %wx = zext i32 %x to i64
+  %wy = zext i32 %y to i64
+  %p = mul i64 %wx, %wy
+  ret i64 %p
+}
+
+; Counts the pairs x, d (d != 0, and not -128 / -1 for the signed ones) for
+; which the functions above differ from the division instructions.
+define i32 @main() {
+entry:
+  br label %outer
+
+outer:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %outer.latch ]
+  %err.outer = phi i32 [ 0, %entry ], [ %err.inner, %outer.latch ]
+  %x = trunc i32 %i to i8
+  br label %inner
+
+inner:
+  %j = phi i32 [ 1, %outer ], [ %j.next, %inner ]
+  %err = phi i32 [ %err.outer, %outer ], [ %err.inner, %inner ]
+  %d = trunc i32 %j to i8
+
+  %uq = call i8 @udiv8(i8 %x, i8 %d)
+  %uq.ref = udiv i8 %x, %d
+  %uq.bad = icmp ne i8 %uq, %uq.ref
+  %ur = call i8 @urem8(i8 %x, i8 %d)
+  %ur.ref = urem i8 %x, %d
+  %ur.bad = icmp ne i8 %ur, %ur.ref
+
+  ; -128 / -1 overflows: divide by 1 instead.
+  %x.min = icmp eq i8 %x, -128
+  %d.m1 = icmp eq i8 %d, -1
+  %ovf = and i1 %x.min, %d.m1
+  %sd = select i1 %ovf, i8 1, i8 %d
+  %sq = call i8 @sdiv8(i8 %x, i8 %sd)
+  %sq.ref = sdiv i8 %x, %sd
+  %sq.bad = icmp ne i8 %sq, %sq.ref
+  %sr = call i8 @srem8(i8 %x, i8 %sd)
+  %sr.ref = srem i8 %x, %sd
+  %sr.bad = icmp ne i8 %sr, %sr.ref
+
+  %bad.u = or i1 %uq.bad, %ur.bad
+  %bad.s = or i1 %sq.bad, %sr.bad
+  %bad = or i1 %bad.u, %bad.s
+  %bad.count = zext i1 %bad to i32
+  %err.inner = add i32 %err, %bad.count
+  %j.next = add nuw nsw i32 %j, 1
+  %inner.more = icmp ult i32 %j.next, 256
+  br i1 %inner.more, label %inner, label %outer.latch
+
+outer.latch:
+  %i.next = add nuw nsw i32 %i, 1
+  %outer.more = icmp ult i32 %i.next, 256
+  br i1 %outer.more, label %outer, label %exit
+
+exit:
+  ret i32 %err.inner
+}
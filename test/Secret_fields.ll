@@ -0,0 +1,48 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="print<inputsVector>" -disable-output %s 2>&1 \
+; RUN:   | FileCheck --check-prefix=PRINT %s
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+
+; Test a struct with a secret field, annotated through llvm.ptr.annotation,
+; next to a public one: only the bytes of the secret field are secret, so the
+; load of the other field is public and the branch on it is kept.
+
+; PRINT-LABEL: Secret values in function 'fields':
+; PRINT-DAG:     %k = load i8, ptr %key
+; PRINT-DAG:     %kx = xor i32 %kz, 7
+; PRINT-NOT:     %v = load
+; PRINT-NOT:     %c = icmp
+
+; CHECK-LABEL: define i32 @fields
+; CHECK:         %v = load i8, ptr %iv.f
+; CHECK:         br i1 %c, label %zero, label %nonzero
+
+%struct.ctx = type { [16 x i8], [16 x i8] }
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [6 x i8] c"aes.c\00", section "llvm.metadata"
+
+declare ptr @llvm.ptr.annotation.p0.p0(ptr, ptr, ptr, i32, ptr)
+
+define i32 @fields(ptr %ctx) {
+entry:
+  %key.f = getelementptr inbounds %struct.ctx, ptr %ctx, i32 0, i32 0
+  %key = call ptr @llvm.ptr.annotation.p0.p0(ptr %key.f, ptr @.str, ptr @.file, i32 3, ptr null)
+  %k = load i8, ptr %key
+  %kz = zext i8 %k to i32
+  %iv.f = getelementptr inbounds %struct.ctx, ptr %ctx, i32 0, i32 1
+  %v = load i8, ptr %iv.f
+  %c = icmp eq i8 %v, 0
+  br i1 %c, label %zero, label %nonzero
+
+zero:
+  br label %end
+
+nonzero:
+  %kx = xor i32 %kz, 7
+  br label %end
+
+end:
+  %r = phi i32 [ %kz, %zero ], [ %kx, %nonzero ]
+  ret i32 %r
+}
@@ -0,0 +1,132 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+
+; Test ct-linearize on an if/else on a secret: both sides are executed one
+; after the other and the PHI becomes a select on the secret condition.
+
+; CHECK-LABEL: define i32 @foo
+; CHECK:       entry:
+; CHECK-NEXT:    %cmp = icmp sgt i32 %a, 10
+; CHECK-NEXT:    br label %if.else
+; CHECK:       if.then:
+; CHECK:         br label %if.end
+; CHECK:       if.else:
+; CHECK:         br label %if.then
+; CHECK:       if.end:
+; CHECK-NEXT:    [[SEL:%.*]] = select i1 %cmp, i32 %add, i32 %add1
+; CHECK-NEXT:    ret i32 [[SEL]]
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [3 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @foo, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @nested, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @elseif, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @foo(i32 %a) {
+entry:
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %if.then, label %if.else
+
+if.then:
+  %add = add nsw i32 %a, 5
+  br label %if.end
+
+if.else:
+  %add1 = add nsw i32 %a, 3
+  br label %if.end
+
+if.end:
+  %res.0 = phi i32 [ %add, %if.then ], [ %add1, %if.else ]
+  ret i32 %res.0
+}
+
+; A PHI merging four values becomes one select per branch, each choosing
+; between the values reached through its true and false successors,
+; whatever the order of the incoming blocks.
+
+; CHECK-LABEL: define i32 @nested
+; CHECK-DAG:     [[HI:%.*]] = select i1 %c2, i32 %v2, i32 %v3
+; CHECK-DAG:     [[LO:%.*]] = select i1 %c1, i32 %v1, i32 42
+; CHECK:         [[SEL:%.*]] = select i1 %c0, i32 [[LO]], i32 [[HI]]
+; CHECK-NEXT:    ret i32 [[SEL]]
+
+define i32 @nested(i32 %a) {
+entry:
+  %c0 = icmp slt i32 %a, 10
+  br i1 %c0, label %lo, label %hi
+
+lo:
+  %c1 = icmp slt i32 %a, 5
+  br i1 %c1, label %lolo, label %end
+
+lolo:
+  %v1 = mul i32 %a, 3
+  br label %end
+
+hi:
+  %c2 = icmp slt i32 %a, 50
+  br i1 %c2, label %mid, label %top
+
+mid:
+  %v2 = add i32 %a, 100
+  br label %end
+
+top:
+  %v3 = sub i32 %a, 7
+  br label %end
+
+end:
+  %r = phi i32 [ %v3, %top ], [ %v1, %lolo ], [ 42, %lo ], [ %v2, %mid ]
+  ret i32 %r
+}
+
+; An else-if chain is a region nested in the else side of each branch: each
+; one becomes a single path before the one around it, and the whole function
+; runs its blocks one after the other.
+
+; CHECK-LABEL: define i32 @elseif
+; CHECK:       entry:
+; CHECK:         br label %elif1
+; CHECK:       first:
+; CHECK:         br label %end
+; CHECK:       elif1:
+; CHECK:         br label %elif2
+; CHECK:       second:
+; CHECK:         br label %first
+; CHECK:       elif2:
+; CHECK:         br label %third
+; CHECK:       third:
+; CHECK:         br label %second
+; CHECK:       end:
+; CHECK-NEXT:    [[S2:%.*]] = select i1 %c2, i32 %v2, i32 0
+; CHECK-NEXT:    [[S1:%.*]] = select i1 %c1, i32 %v1, i32 [[S2]]
+; CHECK-NEXT:    [[S0:%.*]] = select i1 %c0, i32 %v0, i32 [[S1]]
+; CHECK-NEXT:    ret i32 [[S0]]
+
+define i32 @elseif(i32 %a) {
+entry:
+  %c0 = icmp slt i32 %a, 10
+  br i1 %c0, label %first, label %elif1
+
+first:
+  %v0 = add i32 %a, 1
+  br label %end
+
+elif1:
+  %c1 = icmp slt i32 %a, 20
+  br i1 %c1, label %second, label %elif2
+
+second:
+  %v1 = mul i32 %a, 3
+  br label %end
+
+elif2:
+  %c2 = icmp slt i32 %a, 30
+  br i1 %c2, label %third, label %end
+
+third:
+  %v2 = sub i32 %a, 7
+  br label %end
+
+end:
+  %r = phi i32 [ %v0, %first ], [ %v1, %second ], [ %v2, %third ], [ 0, %elif2 ]
+  ret i32 %r
+}
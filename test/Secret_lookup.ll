@@ -0,0 +1,83 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-table-lookup=scalar -ct-align-tables -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck --check-prefix=SCALAR %s
+
+; Test the rewriting of the loads from a table at a secret index into scans
+; of the whole table.
+
+; SCALAR: @sbox = internal constant [64 x i8] {{.*}}, align 64
+
+; An S-box lookup: on x86-64, 16 bytes are compared and blended at a time.
+
+; CHECK-LABEL: define i8 @sub
+; CHECK:       scan:
+; CHECK:         %scan.j = phi i64 [ 0, %entry ], [ %scan.j.next, %scan ]
+; CHECK:         [[ELTS:%.*]] = load <16 x i8>, ptr %scan.ptr, align 16
+; CHECK:         [[HIT:%.*]] = icmp eq <16 x i8>
+; CHECK:         select <16 x i1> [[HIT]], <16 x i8> [[ELTS]], <16 x i8> %scan.acc
+; CHECK:         %scan.j.next = add nuw nsw i64 %scan.j, 16
+; CHECK:         icmp ult i64 %scan.j.next, 64
+; CHECK:       scan.end:
+; CHECK-NEXT:    %v = call i8 @llvm.vector.reduce.or.v16i8
+; CHECK-NOT:     load i8, ptr %p
+
+; SCALAR-LABEL: define i8 @sub
+; SCALAR:         %scan.elt = load i8, ptr %scan.ptr, align 1
+; SCALAR-NEXT:    [[HIT:%.*]] = icmp eq i64 %scan.j, %i
+; SCALAR-NEXT:    %scan.mask = sext i1 [[HIT]] to i8
+; SCALAR-NEXT:    [[ELT:%.*]] = and i8 %scan.elt, %scan.mask
+; SCALAR-NEXT:    %v = or i8 %scan.acc, [[ELT]]
+; SCALAR:         %scan.j.next = add nuw nsw i64 %scan.j, 1
+
+; A table in a struct field, as in blowfish: ctx->S[1][x & 15].
+
+; CHECK-LABEL: define i32 @field
+; CHECK:         %scan.base = getelementptr inbounds %struct.ctx, ptr %c, i64 0, i32 1, i64 1
+; CHECK:         [[ELTS:%.*]] = load <4 x i32>, ptr %scan.ptr, align 4
+; CHECK:         select <4 x i1> {{%.*}}, <4 x i32> [[ELTS]], <4 x i32> %scan.acc
+; CHECK:         %v = call i32 @llvm.vector.reduce.or.v4i32
+
+; The index of the other table is public: nothing changes.
+
+; CHECK-LABEL: define i32 @public
+; CHECK-NOT:     scan
+; CHECK:         %v = load i32, ptr %p, align 4
+
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+%struct.ctx = type { [18 x i32], [4 x [16 x i32]] }
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [2 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @sub, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @field, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+@sbox = internal constant [64 x i8] c"c|w{\F2ko\C50\01g+\FE\D7\ABv\CA\82\C9}\FAYG\F0\AD\D4\A2\AF\9C\A4r\C0\B7\FD\93&6?\F7\CC4\A5\E5\F1q\D81\15\04\C7#\C3\18\96\05\9A\07\12\80\E2\EB'\B2u", align 16
+
+define i8 @sub(i8 %x) {
+entry:
+  %m = and i8 %x, 63
+  %i = zext i8 %m to i64
+  %p = getelementptr inbounds [64 x i8], ptr @sbox, i64 0, i64 %i
+  %v = load i8, ptr %p, align 1
+  ret i8 %v
+}
+
+define i32 @field(ptr %c, i32 %x) {
+entry:
+  %m = and i32 %x, 15
+  %i = zext i32 %m to i64
+  %p = getelementptr inbounds %struct.ctx, ptr %c, i64 0, i32 1, i64 1, i64 %i
+  %v = load i32, ptr %p, align 4
+  ret i32 %v
+}
+
+define i32 @public(ptr %c, i32 %x) {
+entry:
+  %m = and i32 %x, 15
+  %i = zext i32 %m to i64
+  %p = getelementptr inbounds %struct.ctx, ptr %c, i64 0, i32 1, i64 1, i64 %i
+  %v = load i32, ptr %p, align 4
+  ret i32 %v
+}
@@ -0,0 +1,137 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=drain:arg0,find:arg1 -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=drain:arg0,find:arg1 -passes="function(ct-linearize),ct-verify" -disable-output %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=collatz:arg0 -passes="ct-linearize" -pass-remarks-missed=ct-linearize \
+; RUN:   -disable-output %s 2>&1 | FileCheck --check-prefix=REMARK %s
+
+; Test the loops whose exit depends on a secret: they always run their
+; maximum number of iterations, a live flag skipping the iterations after
+; the exit, and the latch only depends on the iteration count. The induction
+; variables keep advancing after the exit, so that ct-verify finds no access
+; at a secret address.
+
+; `while (res > 0)` with a secret res, bounded by the ct_trip:8 annotation
+; of the function. The store only takes effect in the live iterations, the
+; value returned is the one the loop had when it left.
+
+; CHECK-LABEL: define i32 @drain
+; CHECK:       while.cond:
+; CHECK-NEXT:    %ct.trip = phi i32 [ 0, %entry ], [ %ct.trip.next, %while.cond.ct.latch ]
+; CHECK-NEXT:    %ct.live = phi i1 [ true, %entry ], [ [[LIVE:%.*]], %while.cond.ct.latch ]
+; CHECK:         %acc.lcssa.ct = phi i32 [ 0, %entry ], [ [[ACC:%.*]], %while.cond.ct.latch ]
+; CHECK:       while.body:
+; CHECK-NEXT:    [[PRED:%.*]] = and i1 %ct.live, %cmp
+; CHECK:         %ct.masked = select i1 [[PRED]], i32 %acc.next, i32 %ct.old
+; CHECK-NEXT:    store i32 %ct.masked, ptr %out, align 4
+; CHECK:       while.cond.ct.latch:
+; CHECK:         [[ACC]] = select i1 %ct.live,
+; CHECK:         [[LIVE]] = select i1 %ct.live,
+; CHECK:         %res.ct.next = add i32 %res, -1
+; CHECK:         %ct.trip.next = add nuw i32 %ct.trip, 1
+; CHECK-NEXT:    %ct.trip.more = icmp ult i32 %ct.trip.next, 8
+; CHECK-NEXT:    br i1 %ct.trip.more, label %while.cond, label %while.cond.ct.done, !llvm.loop [[BOUNDED8:![0-9]+]]
+; CHECK:       while.end:
+; CHECK-NEXT:    ret i32 [[ACC]]
+
+; A search that breaks on a secret, bounded by ScalarEvolution: 16 elements,
+; 17 iterations. The exit taken is carried to the new exit, and decides
+; which value the function returns. The index loaded goes on after the key
+; is found.
+
+; CHECK-LABEL: define i32 @find
+; CHECK:         %ct.exit.id = phi i32 [ 0, %entry ], [ [[ID:%.*]], %for.cond.ct.latch ]
+; CHECK-NEXT:    %i = phi i32 [ 0, %entry ], [ %i.ct.next, %for.cond.ct.latch ]
+; CHECK:       for.body.ct.exit:
+; CHECK-NEXT:    %ct.live.exit = xor i1 %eq, true
+; CHECK-NEXT:    %ct.exit.sel = select i1 %eq, i32 1, i32 %ct.exit.id
+; CHECK:       for.cond.ct.latch:
+; CHECK:         %i.ct.next = add i32 %i, 1
+; CHECK:         %ct.trip.more = icmp ult i32 %ct.trip.next, 17
+; CHECK-NEXT:    br i1 %ct.trip.more, label %for.cond, label %for.cond.ct.done, !llvm.loop [[BOUNDED17:![0-9]+]]
+; CHECK:       for.cond.ct.done:
+; CHECK-NEXT:    %ct.exit.is = icmp eq i32 [[ID]], 0
+; CHECK:       exit:
+; CHECK-NEXT:    [[R:%.*]] = select i1 %ct.exit.is, i32 -1,
+; CHECK-NEXT:    ret i32 [[R]]
+
+; CHECK:       [[BOUNDED8]] = distinct !{[[BOUNDED8]], [[TRIP8:![0-9]+]]}
+; CHECK-NEXT:  [[TRIP8]] = !{!"llvm.loop.ct.bounded", i32 8}
+; CHECK-NEXT:  [[BOUNDED17]] = distinct !{[[BOUNDED17]], [[TRIP17:![0-9]+]]}
+; CHECK-NEXT:  [[TRIP17]] = !{!"llvm.loop.ct.bounded", i32 17}
+
+; A loop without a maximum trip count keeps its secret exit, and says so.
+
+; REMARK: remark: {{.*}} the loop at 'loop' keeps its secret exit: no maximum trip count is known, annotate 'collatz' with ct_trip:N or raise -ct-max-trip-count
+
+@.trip = private unnamed_addr constant [10 x i8] c"ct_trip:8\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [1 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @drain, ptr @.trip, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @drain(i32 %n, ptr %out) {
+entry:
+  br label %while.cond
+
+while.cond:
+  %res = phi i32 [ %n, %entry ], [ %dec, %while.body ]
+  %acc = phi i32 [ 0, %entry ], [ %acc.next, %while.body ]
+  %cmp = icmp sgt i32 %res, 0
+  br i1 %cmp, label %while.body, label %while.end
+
+while.body:
+  %dec = add nsw i32 %res, -1
+  %acc.next = add i32 %acc, %res
+  store i32 %acc.next, ptr %out, align 4
+  br label %while.cond
+
+while.end:
+  ret i32 %acc
+}
+
+define i32 @find(ptr %tab, i32 %key) {
+entry:
+  br label %for.cond
+
+for.cond:
+  %i = phi i32 [ 0, %entry ], [ %inc, %for.inc ]
+  %cmp = icmp slt i32 %i, 16
+  br i1 %cmp, label %for.body, label %for.end
+
+for.body:
+  %idx = sext i32 %i to i64
+  %p = getelementptr inbounds i32, ptr %tab, i64 %idx
+  %v = load i32, ptr %p, align 4
+  %eq = icmp eq i32 %v, %key
+  br i1 %eq, label %found, label %for.inc
+
+for.inc:
+  %inc = add nsw i32 %i, 1
+  br label %for.cond
+
+found:
+  br label %exit
+
+for.end:
+  br label %exit
+
+exit:
+  %r = phi i32 [ %i, %found ], [ -1, %for.end ]
+  ret i32 %r
+}
+
+define i32 @collatz(i32 %x) {
+entry:
+  br label %loop
+
+loop:
+  %v = phi i32 [ %x, %entry ], [ %next, %loop ]
+  %m = mul i32 %v, 3
+  %next = add i32 %m, 1
+  %done = icmp eq i32 %next, 1
+  br i1 %done, label %exit, label %loop
+
+exit:
+  ret i32 %next
+}
@@ -0,0 +1,36 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-select=native -passes="function(ct-linearize,ct-opt<O2>)" -S %s \
+; RUN:   | FileCheck %s
+
+; Test ct-opt<O2> after ct-linearize: the serialized blocks are cleaned up
+; but the selects on the secret stay selects.
+
+; CHECK-LABEL: define i32 @foo
+; CHECK-NOT:     br i1
+; CHECK:         %cmp = icmp sgt i32 %a, 10
+; CHECK:         select i1 %cmp
+; CHECK-NOT:     br i1
+; CHECK:         ret i32
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [1 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @foo, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @foo(i32 %a) {
+entry:
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %if.then, label %if.else
+
+if.then:
+  %add = add nsw i32 %a, 5
+  br label %if.end
+
+if.else:
+  %add1 = add nsw i32 %a, 3
+  br label %if.end
+
+if.end:
+  %r = phi i32 [ %add, %if.then ], [ %add1, %if.else ]
+  %s = mul i32 %r, %r
+  ret i32 %s
+}
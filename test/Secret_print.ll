@@ -0,0 +1,37 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="print<inputsVector>" -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s
+
+; Test the values reported as secret: the annotated parameter %a and the
+; annotated global @key, but neither %len nor the public global @pub.
+
+; CHECK-LABEL: Secret values in function 'foo':
+; CHECK-DAG:  i32 %a
+; CHECK-DAG:  %v = load i32, ptr %a.addr
+; CHECK-DAG:  %k = load i8, ptr @key
+; CHECK-DAG:  %sum = add i32 %v, %ext
+; CHECK-NOT: %len
+; CHECK-NOT: @pub
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [4 x i8] c"a.c\00", section "llvm.metadata"
+@key = global [16 x i8] zeroinitializer
+@pub = global [16 x i8] zeroinitializer
+@llvm.global.annotations = appending global [1 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @key, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+declare void @llvm.var.annotation(ptr, ptr, ptr, i32, ptr)
+
+define i32 @foo(i32 %a, i32 %len) {
+entry:
+  %a.addr = alloca i32
+  store i32 %a, ptr %a.addr
+  call void @llvm.var.annotation(ptr %a.addr, ptr @.str, ptr @.file, i32 3, ptr null)
+  %v = load i32, ptr %a.addr
+  %k = load i8, ptr @key
+  %ext = zext i8 %k to i32
+  %sum = add i32 %v, %ext
+  %p = load i8, ptr @pub
+  %pext = zext i8 %p to i32
+  %n = add i32 %len, %pext
+  store i32 %n, ptr @pub
+  ret i32 %sum
+}
@@ -0,0 +1,168 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=check:arg1,dispatch:arg1,sum:arg1,flag:arg1 -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=check:arg1,dispatch:arg1,sum:arg1,flag:arg1 -ct-linearize-public -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck --check-prefix=ALL %s
+
+; Test that ct-linearize only serializes the branches on a secret and the
+; branches in their regions: the other ones keep both their sides, unless
+; -ct-linearize-public is given.
+
+; A length check before an if/else on a secret: the check stays, and the PHI
+; after both merges its value with the select of the serialized region.
+
+; CHECK-LABEL: define i32 @check
+; CHECK:       entry:
+; CHECK:         br i1 %bad, label %err, label %body
+; CHECK:       body:
+; CHECK:         br label %else
+; CHECK:       then:
+; CHECK:         [[SEL:%.*]] = select i1 %c, i32 %x, i32 %y
+; CHECK-NEXT:    br label %end
+; CHECK:       else:
+; CHECK:         br label %then
+; CHECK:       end:
+; CHECK-NEXT:    %r = phi i32 [ -1, %err ], [ [[SEL]], %then ]
+
+; ALL-LABEL:   define i32 @check
+; ALL:         entry:
+; ALL:           br label %body
+; ALL:         end:
+; ALL-NEXT:      [[SEL:%.*]] = select i1 %c, i32 %x, i32 %y
+; ALL-NEXT:      select i1 %bad, i32 -1, i32 [[SEL]]
+
+; A public branch in the region of a secret one is serialized with it.
+
+; CHECK-LABEL: define i32 @dispatch
+; CHECK-NOT:     br i1
+; CHECK:         [[MODE:%.*]] = select i1 %p, i32 1, i32 %t
+; CHECK-NEXT:    select i1 %c, i32 [[MODE]], i32 %k
+
+; A public loop with a secret if in its body: the guard of the loop stays,
+; the if becomes a select.
+
+; CHECK-LABEL: define i32 @sum
+; CHECK:       entry:
+; CHECK:         br i1 %empty, label %exit, label %loop.ph
+; CHECK:       loop:
+; CHECK:         br label %even
+; CHECK:       latch:
+; CHECK-NEXT:    select i1 %c, i32 %a2, i32 %acc
+; CHECK:       {{^}}exit:
+; CHECK-NEXT:    %r = phi i32 [ 0, %entry ], [ %res, %loop.exit ]
+
+; A branch on a flag set on both sides of a secret if: the flag tells the
+; side that ran, so its branch is serialized too.
+
+; CHECK-LABEL: define i32 @flag
+; CHECK-NOT:     br i1
+; CHECK:         ret i32
+
+define i32 @check(i32 %len, i32 %k) {
+entry:
+  %bad = icmp ugt i32 %len, 16
+  br i1 %bad, label %err, label %body
+
+err:
+  br label %end
+
+body:
+  %c = icmp sgt i32 %k, 10
+  br i1 %c, label %then, label %else
+
+then:
+  %x = mul i32 %k, 3
+  br label %end
+
+else:
+  %y = add i32 %k, %len
+  br label %end
+
+end:
+  %r = phi i32 [ -1, %err ], [ %x, %then ], [ %y, %else ]
+  ret i32 %r
+}
+
+define i32 @dispatch(i32 %mode, i32 %k) {
+entry:
+  %c = icmp eq i32 %k, 0
+  br i1 %c, label %zero, label %join
+
+zero:
+  %p = icmp eq i32 %mode, 1
+  br i1 %p, label %one, label %two
+
+one:
+  br label %join
+
+two:
+  %t = add i32 %mode, 5
+  br label %join
+
+join:
+  %r = phi i32 [ %k, %entry ], [ 1, %one ], [ %t, %two ]
+  ret i32 %r
+}
+
+define i32 @sum(i32 %n, i32 %k) {
+entry:
+  %empty = icmp eq i32 %n, 0
+  br i1 %empty, label %exit, label %loop.ph
+
+loop.ph:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %loop.ph ], [ %i.next, %latch ]
+  %acc = phi i32 [ 0, %loop.ph ], [ %acc.next, %latch ]
+  %odd = and i32 %k, 1
+  %c = icmp eq i32 %odd, 0
+  br i1 %c, label %even, label %latch
+
+even:
+  %a2 = add i32 %acc, %i
+  br label %latch
+
+latch:
+  %acc.next = phi i32 [ %a2, %even ], [ %acc, %loop ]
+  %i.next = add i32 %i, 1
+  %more = icmp ult i32 %i.next, %n
+  br i1 %more, label %loop, label %loop.exit
+
+loop.exit:
+  %res = phi i32 [ %acc.next, %latch ]
+  br label %exit
+
+exit:
+  %r = phi i32 [ 0, %entry ], [ %res, %loop.exit ]
+  ret i32 %r
+}
+
+define i32 @flag(i32 %x, i32 %k) {
+entry:
+  %c = icmp sgt i32 %k, 10
+  br i1 %c, label %then, label %else
+
+then:
+  br label %join
+
+else:
+  br label %join
+
+join:
+  %f = phi i1 [ true, %then ], [ false, %else ]
+  br i1 %f, label %big, label %small
+
+big:
+  %b = mul i32 %x, 3
+  br label %end
+
+small:
+  %s = add i32 %x, 1
+  br label %end
+
+end:
+  %r = phi i32 [ %b, %big ], [ %s, %small ]
+  ret i32 %r
+}
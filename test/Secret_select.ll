@@ -0,0 +1,170 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=pick:arg0,pick_i8:arg0,pick_double:arg0,pick_vec:arg0,pick_lanes:arg0 \
+; RUN:   -ct-select=native -passes="ct-select" -S %s \
+; RUN:   | FileCheck %s --check-prefix=NATIVE
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=pick:arg0,pick_i8:arg0,pick_double:arg0,pick_vec:arg0,pick_lanes:arg0 \
+; RUN:   -ct-select=mask -passes="ct-opt<O2>" -S %s \
+; RUN:   | FileCheck %s --check-prefix=MASK
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=pick:arg0,pick_i8:arg0,pick_double:arg0,pick_vec:arg0,pick_lanes:arg0 \
+; RUN:   -ct-select=asm -mtriple=x86_64-unknown-linux-gnu -passes="ct-select" -S %s \
+; RUN:   | FileCheck %s --check-prefix=X86
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=pick:arg0,pick_i8:arg0,pick_double:arg0,pick_vec:arg0,pick_lanes:arg0 \
+; RUN:   -ct-select=asm -mtriple=thumbv7m-none-eabi -passes="ct-select" -S %s \
+; RUN:   | FileCheck %s --check-prefix=THUMB2
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=pick:arg0,pick_i8:arg0,pick_double:arg0,pick_vec:arg0,pick_lanes:arg0 \
+; RUN:   -mtriple=thumbv6m-none-eabi -passes="ct-select" -S %s \
+; RUN:   | FileCheck %s --check-prefix=THUMB1
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=pick:arg0,pick_i8:arg0,pick_double:arg0,pick_vec:arg0,pick_lanes:arg0 \
+; RUN:   -ct-select=mask -passes="ct-select" -S %s \
+; RUN:   | lli
+
+; Test the lowerings of the selects on a secret (-ct-select), and that the
+; masks compute the same values as the selects (main returns the number of
+; mismatches).
+
+; NATIVE-LABEL: define i32 @pick
+; NATIVE:         %r = select i1 %c, i32 %a, i32 %b
+
+; The mask survives the optimizations of ct-opt: the condition goes through an
+; empty inline asm.
+
+; MASK-LABEL: define i32 @pick
+; MASK:         %c = icmp sgt i32 %s, 10
+; MASK-NEXT:    [[BIT:%.*]] = zext i1 %c to i32
+; MASK-NEXT:    [[OPAQUE:%.*]] = call i32 asm "", "=r,0"(i32 [[BIT]])
+; MASK-NEXT:    %sel.mask = sub i32 0, [[OPAQUE]]
+; MASK-NEXT:    [[DIFF:%.*]] = xor i32 %a, %b
+; MASK-NEXT:    %sel.diff = and i32 [[DIFF]], %sel.mask
+; MASK-NEXT:    %r = xor i32 %b, %sel.diff
+; MASK-NEXT:    ret i32 %r
+
+; A double is selected as an i64, a vector with the mask in every lane.
+
+; MASK-LABEL: define double @pick_double
+; MASK:         bitcast double %a to i64
+; MASK:         %sel.mask = sext i32 {{.*}} to i64
+; MASK:         bitcast i64 {{.*}} to double
+; MASK-LABEL: define <4 x i32> @pick_vec
+; MASK:         %sel.mask = shufflevector <4 x i32>
+; MASK-LABEL: define <4 x i32> @pick_lanes
+; MASK:         %sel.mask = sext <4 x i1> %c to <4 x i32>
+; MASK-NOT:     select
+
+; MASK-LABEL: define i32 @main
+; MASK:         select
+
+; X86-LABEL: define i32 @pick
+; X86:         [[C:%.*]] = zext i1 %c to i32
+; X86-NEXT:    %r = call i32 asm "test $1, $1\0A\09cmovne $2, $0", "=r,r,r,0,~{flags}"(i32 [[C]], i32 %a, i32 %b)
+; X86-LABEL: define i8 @pick_i8
+; X86:         call i32 asm "test $1, $1
+; X86:         %r = trunc i32 %sel.move to i8
+; X86-LABEL: define double @pick_double
+; X86:         %sel.move = call i64 asm "test $1, $1\0A\09cmovne $2, $0"
+; X86-LABEL: define <4 x i32> @pick_vec
+; X86:         %sel.mask
+; X86-NOT:     select
+; X86-LABEL: define i32 @main
+
+; THUMB2-LABEL: define i32 @pick
+; THUMB2:         %r = call i32 asm "cmp $1, #0\0A\09it ne\0A\09movne $0, $2", "=r,r,r,0,~{cc}"
+; THUMB2-LABEL: define double @pick_double
+; THUMB2:         %sel.mask
+
+; Thumb-1 has no conditional move: auto takes the mask.
+
+; THUMB1-LABEL: define i32 @pick
+; THUMB1:         %sel.mask
+; THUMB1-NOT:     select
+; THUMB1-LABEL: define i8 @pick_i8
+
+define i32 @pick(i32 %s, i32 %a, i32 %b) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  %r = select i1 %c, i32 %a, i32 %b
+  ret i32 %r
+}
+
+define i8 @pick_i8(i32 %s, i8 %a, i8 %b) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  %r = select i1 %c, i8 %a, i8 %b
+  ret i8 %r
+}
+
+define double @pick_double(i32 %s, double %a, double %b) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  %r = select i1 %c, double %a, double %b
+  ret double %r
+}
+
+define <4 x i32> @pick_vec(i32 %s, <4 x i32> %a, <4 x i32> %b) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  %r = select i1 %c, <4 x i32> %a, <4 x i32> %b
+  ret <4 x i32> %r
+}
+
+define <4 x i32> @pick_lanes(<4 x i32> %s, <4 x i32> %a, <4 x i32> %b) {
+entry:
+  %c = icmp sgt <4 x i32> %s, <i32 10, i32 10, i32 10, i32 10>
+  %r = select <4 x i1> %c, <4 x i32> %a, <4 x i32> %b
+  ret <4 x i32> %r
+}
+
+; Counts the values of s in [0, 20] for which the functions above differ
+; from a select.
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %err = phi i32 [ 0, %entry ], [ %err.next, %loop ]
+  %c = icmp sgt i32 %s, 10
+
+  %i = call i32 @pick(i32 %s, i32 -7, i32 123456789)
+  %i.ref = select i1 %c, i32 -7, i32 123456789
+  %i.bad = icmp ne i32 %i, %i.ref
+
+  %b = call i8 @pick_i8(i32 %s, i8 -1, i8 42)
+  %b.ref = select i1 %c, i8 -1, i8 42
+  %b.bad = icmp ne i8 %b, %b.ref
+
+  %d = call double @pick_double(i32 %s, double -2.5, double 1.0e10)
+  %d.ref = select i1 %c, double -2.5, double 1.0e10
+  %d.bad = fcmp une double %d, %d.ref
+
+  %v = call <4 x i32> @pick_vec(i32 %s, <4 x i32> <i32 1, i32 2, i32 3, i32 4>, <4 x i32> <i32 -1, i32 -2, i32 -3, i32 -4>)
+  %v.ref = select i1 %c, <4 x i32> <i32 1, i32 2, i32 3, i32 4>, <4 x i32> <i32 -1, i32 -2, i32 -3, i32 -4>
+  %v.ne = icmp ne <4 x i32> %v, %v.ref
+  %v.bits = bitcast <4 x i1> %v.ne to i4
+  %v.bad = icmp ne i4 %v.bits, 0
+
+  %lanes = insertelement <4 x i32> <i32 0, i32 11, i32 5, i32 20>, i32 %s, i32 0
+  %l = call <4 x i32> @pick_lanes(<4 x i32> %lanes, <4 x i32> <i32 1, i32 2, i32 3, i32 4>, <4 x i32> <i32 -1, i32 -2, i32 -3, i32 -4>)
+  %l.c = icmp sgt <4 x i32> %lanes, <i32 10, i32 10, i32 10, i32 10>
+  %l.ref = select <4 x i1> %l.c, <4 x i32> <i32 1, i32 2, i32 3, i32 4>, <4 x i32> <i32 -1, i32 -2, i32 -3, i32 -4>
+  %l.ne = icmp ne <4 x i32> %l, %l.ref
+  %l.bits = bitcast <4 x i1> %l.ne to i4
+  %l.bad = icmp ne i4 %l.bits, 0
+
+  %bad.1 = or i1 %i.bad, %b.bad
+  %bad.2 = or i1 %d.bad, %v.bad
+  %bad.3 = or i1 %bad.1, %bad.2
+  %bad = or i1 %bad.3, %l.bad
+  %bad.count = zext i1 %bad to i32
+  %err.next = add i32 %err, %bad.count
+  %s.next = add nuw nsw i32 %s, 1
+  %more = icmp ule i32 %s.next, 20
+  br i1 %more, label %loop, label %exit
+
+exit:
+  ret i32 %err.next
+}
@@ -0,0 +1,116 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+
+; Test the lowering of the stores ct-linearize predicates in a loop whose
+; bound is a secret.
+
+; The store to array[i] is still a load, select and store.
+
+; CHECK-LABEL: define i32 @foo
+; CHECK:       for.body:
+; CHECK-NEXT:    [[RES:%.*]] = phi i32 [ %res.promoted, %entry ], [ %r2, %for.body ]
+; CHECK:         [[PRED:%.*]] = icmp sle i64 %i, %ext
+; CHECK:         [[ELT:%.*]] = load i32, ptr %arrayidx, align 4
+; CHECK-NEXT:    [[ELTSEL:%.*]] = select i1 [[PRED]], i32 %t, i32 [[ELT]]
+; CHECK-NEXT:    store i32 [[ELTSEL]], ptr %arrayidx, align 4
+
+; The accumulator does not move across the loop: it is kept in a register
+; and written back once at the exit, instead of a load and a store per
+; iteration. The sum adds zero in the iterations past the bound rather than
+; selecting the old sum: a reduction LoopVectorize recognizes.
+
+; CHECK-NOT:     load i32, ptr %res
+; CHECK:         [[T:%.*]] = select i1 [[PRED]], i32 %t, i32 0
+; CHECK-NEXT:    %r2 = add i32 [[RES]], [[T]]
+
+; The two stores to consecutive elements share the predicate: one wide load,
+; select and store.
+
+; CHECK:         [[V0:%.*]] = insertelement <2 x i16> poison, i16 %t16, i64 0
+; CHECK-NEXT:    [[V1:%.*]] = insertelement <2 x i16> [[V0]], i16 %u, i64 1
+; CHECK-NEXT:    [[OLD:%.*]] = load <2 x i16>, ptr %p0, align 4
+; CHECK-NEXT:    [[NEW:%.*]] = select i1 [[PRED]], <2 x i16> [[V1]], <2 x i16> [[OLD]]
+; CHECK-NEXT:    store <2 x i16> [[NEW]], ptr %p0, align 4
+; CHECK-NOT:     store i16
+; CHECK:       exit:
+; CHECK-NEXT:    store i32 %r2, ptr %res, align 4
+
+; The sum is only written back on a secret condition, and also stored to the
+; array in every iteration: the store to the array keeps the sum, not the
+; masked one.
+
+; CHECK-LABEL: define i32 @bar
+; CHECK:         %t = add i32 {{%.*}}, %ti
+; CHECK-NOT:     select i1 {{%.*}}, i32 %ti, i32 0
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [2 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @foo, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @bar, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @foo(i32 %a) {
+entry:
+  %array = alloca [8 x i32], align 16
+  %pair = alloca [16 x i16], align 16
+  %res = alloca i32, align 4
+  store i32 0, ptr %res, align 4
+  %m = and i32 %a, 7
+  %ext = sext i32 %m to i64
+  br label %for.body
+
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %for.body ]
+  %t = trunc i64 %i to i32
+  %arrayidx = getelementptr inbounds [8 x i32], ptr %array, i64 0, i64 %i
+  store i32 %t, ptr %arrayidx, align 4
+  %r = load i32, ptr %res, align 4
+  %r2 = add i32 %r, %t
+  store i32 %r2, ptr %res, align 4
+  %i2 = shl i64 %i, 1
+  %p0 = getelementptr inbounds [16 x i16], ptr %pair, i64 0, i64 %i2
+  %p1 = getelementptr inbounds i16, ptr %p0, i64 1
+  %t16 = trunc i64 %i to i16
+  store i16 %t16, ptr %p0, align 4
+  %u = add i16 %t16, 100
+  store i16 %u, ptr %p1, align 2
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp sgt i64 %i.next, %ext
+  br i1 %cmp, label %exit, label %for.body
+
+exit:
+  %rv = load i32, ptr %res, align 4
+  ret i32 %rv
+}
+
+define i32 @bar(i32 %a) {
+entry:
+  %array = alloca [8 x i32], align 16
+  %sum = alloca i32, align 4
+  store i32 0, ptr %sum, align 4
+  %m = and i32 %a, 7
+  %ext = sext i32 %m to i64
+  br label %for.body
+
+for.body:
+  %i = phi i64 [ 0, %entry ], [ %i.next, %if.end ]
+  %ti = trunc i64 %i to i32
+  %s = load i32, ptr %sum, align 4
+  %t = add i32 %s, %ti
+  %x = xor i32 %ti, %a
+  %c = icmp slt i32 %x, 5
+  br i1 %c, label %if.then, label %if.end
+
+if.then:
+  store i32 %t, ptr %sum, align 4
+  br label %if.end
+
+if.end:
+  %arrayidx = getelementptr inbounds [8 x i32], ptr %array, i64 0, i64 %i
+  store i32 %t, ptr %arrayidx, align 4
+  %i.next = add nsw i64 %i, 1
+  %cmp = icmp sgt i64 %i.next, %ext
+  br i1 %cmp, label %exit, label %for.body
+
+exit:
+  %rv = load i32, ptr %sum, align 4
+  ret i32 %rv
+}
@@ -0,0 +1,152 @@
+; RUN:  opt -load-pass-plugin %shlibdir/libSecret%shlibext -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+
+; Test the lowering of switches in ct-linearize, without lowerswitch.
+
+; A switch on i32 that only picks a value becomes a balanced tree of selects.
+
+; CHECK-LABEL: define i32 @tree
+; CHECK-NOT:     switch
+; CHECK:         [[EQ0:%.*]] = icmp eq i32 %a, 1
+; CHECK-NEXT:    [[S0:%.*]] = select i1 [[EQ0]], i32 10, i32 30
+; CHECK-NEXT:    [[EQ1:%.*]] = icmp eq i32 %a, 4
+; CHECK-NEXT:    [[S1:%.*]] = select i1 [[EQ1]], i32 20, i32 30
+; CHECK-NEXT:    [[LT:%.*]] = icmp ult i32 %a, 4
+; CHECK-NEXT:    [[S:%.*]] = select i1 [[LT]], i32 [[S0]], i32 [[S1]]
+; CHECK-NEXT:    br label %join
+; CHECK:       join:
+; CHECK-NEXT:    ret i32 [[S]]
+
+; On i8, where selects are expensive, the cost model picks the masked
+; selection over all the cases instead.
+
+; CHECK-LABEL: define i8 @table
+; CHECK-NOT:     switch
+; CHECK-NOT:     select
+; CHECK:         [[EQ0:%.*]] = icmp eq i8 %a, 1
+; CHECK:         [[EQ1:%.*]] = icmp eq i8 %a, 4
+; CHECK:         [[M0:%.*]] = sext i1 [[EQ0]] to i8
+; CHECK-NEXT:    [[V0:%.*]] = and i8 10, [[M0]]
+; CHECK:         [[M1:%.*]] = sext i1 [[EQ1]] to i8
+; CHECK-NEXT:    [[V1:%.*]] = and i8 20, [[M1]]
+; CHECK:         br label %join
+
+; Any other switch becomes a chain of two-way branches, which are then
+; linearized; cases sharing a successor share the predicate.
+
+; CHECK-LABEL: define i32 @control
+; CHECK-NOT:     switch
+; CHECK:         [[EQ1:%.*]] = icmp eq i32 %a, 1
+; CHECK-NEXT:    [[EQ2:%.*]] = icmp eq i32 %a, 2
+; CHECK-NEXT:    [[EQ5:%.*]] = icmp eq i32 %a, 5
+; CHECK-NEXT:    [[P1:%.*]] = or i1 [[EQ1]], [[EQ5]]
+; CHECK:       join:
+; CHECK:         [[SEL:%.*]] = select i1 [[EQ2]], i32 %x2, i32 %x3
+; CHECK-NEXT:    select i1 [[P1]], i32 %x1, i32 [[SEL]]
+
+; A switch on a public value, in a function without secrets, keeps its jump
+; table: neither a chain of branches nor a select per case.
+
+; CHECK-LABEL: define i32 @dispatch
+; CHECK:         switch i32 %mode, label %def [
+; CHECK-NOT:     select
+; CHECK:       join:
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [3 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @tree, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @table, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @control, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @tree(i32 %a) {
+entry:
+  switch i32 %a, label %def [
+    i32 4, label %c1
+    i32 1, label %c0
+  ]
+
+c0:
+  br label %join
+
+c1:
+  br label %join
+
+def:
+  br label %join
+
+join:
+  %r = phi i32 [ 10, %c0 ], [ 20, %c1 ], [ 30, %def ]
+  ret i32 %r
+}
+
+define i8 @table(i8 %a) {
+entry:
+  switch i8 %a, label %def [
+    i8 1, label %c0
+    i8 4, label %c1
+  ]
+
+c0:
+  br label %join
+
+c1:
+  br label %join
+
+def:
+  br label %join
+
+join:
+  %r = phi i8 [ 10, %c0 ], [ 20, %c1 ], [ 30, %def ]
+  ret i8 %r
+}
+
+define i32 @control(i32 %a) {
+entry:
+  switch i32 %a, label %def [
+    i32 1, label %c1
+    i32 2, label %c2
+    i32 5, label %c1
+  ]
+
+c1:
+  %x1 = mul i32 %a, 3
+  br label %join
+
+c2:
+  %x2 = add i32 %a, 100
+  br label %join
+
+def:
+  %x3 = sub i32 0, %a
+  br label %join
+
+join:
+  %r = phi i32 [ %x1, %c1 ], [ %x2, %c2 ], [ %x3, %def ]
+  ret i32 %r
+}
+
+define i32 @dispatch(i32 %mode, i32 %x) {
+entry:
+  switch i32 %mode, label %def [
+    i32 0, label %c0
+    i32 1, label %c1
+    i32 2, label %c2
+  ]
+
+c0:
+  %x0 = add i32 %x, 1
+  br label %join
+
+c1:
+  %x1 = mul i32 %x, 5
+  br label %join
+
+c2:
+  %x2 = xor i32 %x, 42
+  br label %join
+
+def:
+  br label %join
+
+join:
+  %r = phi i32 [ %x0, %c0 ], [ %x1, %c1 ], [ %x2, %c2 ], [ %x, %def ]
+  ret i32 %r
+}
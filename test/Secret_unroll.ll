@@ -0,0 +1,113 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=rounds:arg0 -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=rounds:arg0 -ct-unroll-threshold=20 -passes="ct-linearize" -S %s \
+; RUN:   | FileCheck %s --check-prefix=KEEP
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=rounds:arg0 -passes="ct-linearize" -S %s \
+; RUN:   | lli
+
+; Test the loops with a constant trip count in a secret region: they are
+; fully unrolled before the serialization when they stay under
+; -ct-unroll-threshold instructions, and compute the same values (main
+; returns the number of mismatches with a copy of the function left as it
+; is).
+
+; The seven iterations of `for (i = 0; i < 7; i++)` as straight-line code,
+; the value used after the loop is the one of the last one.
+
+; CHECK-LABEL: define i32 @rounds
+; CHECK-NOT:     br i1
+; CHECK:         %acc.next = mul i32 %k, 31
+; CHECK:         %acc.next.6 = mul i32 %t.6, 31
+; CHECK-NOT:     br i1
+; CHECK:         select i1 %c, i32 %acc.next.6, i32 %v
+; CHECK-NEXT:    ret i32
+
+; 7 iterations of 7 instructions are above a threshold of 20: the loop is
+; kept and serialized as a loop.
+
+; KEEP-LABEL: define i32 @rounds
+; KEEP:       loop:
+; KEEP:         br i1 %more, label %loop, label %loop.end
+
+define i32 @rounds(i32 %s, i32 %k) {
+entry:
+  %c = icmp slt i32 %s, 5
+  br i1 %c, label %then, label %else
+
+then:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %then ], [ %i.next, %loop ]
+  %acc = phi i32 [ %k, %then ], [ %acc.next, %loop ]
+  %t = xor i32 %acc, %i
+  %acc.next = mul i32 %t, 31
+  %i.next = add nuw nsw i32 %i, 1
+  %more = icmp ult i32 %i.next, 7
+  br i1 %more, label %loop, label %loop.end
+
+loop.end:
+  br label %end
+
+else:
+  %v = add i32 %k, 1
+  br label %end
+
+end:
+  %r = phi i32 [ %acc.next, %loop.end ], [ %v, %else ]
+  ret i32 %r
+}
+
+define i32 @rounds_ref(i32 %s, i32 %k) {
+entry:
+  %c = icmp slt i32 %s, 5
+  br i1 %c, label %then, label %else
+
+then:
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %then ], [ %i.next, %loop ]
+  %acc = phi i32 [ %k, %then ], [ %acc.next, %loop ]
+  %t = xor i32 %acc, %i
+  %acc.next = mul i32 %t, 31
+  %i.next = add nuw nsw i32 %i, 1
+  %more = icmp ult i32 %i.next, 7
+  br i1 %more, label %loop, label %loop.end
+
+loop.end:
+  br label %end
+
+else:
+  %v = add i32 %k, 1
+  br label %end
+
+end:
+  %r = phi i32 [ %acc.next, %loop.end ], [ %v, %else ]
+  ret i32 %r
+}
+
+; Counts the values of s in [0, 10] for which @rounds and @rounds_ref differ.
+define i32 @main() {
+entry:
+  br label %loop
+
+loop:
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %err = phi i32 [ 0, %entry ], [ %err.next, %loop ]
+  %k = mul i32 %s, 12345
+  %r = call i32 @rounds(i32 %s, i32 %k)
+  %r.ref = call i32 @rounds_ref(i32 %s, i32 %k)
+  %bad = icmp ne i32 %r, %r.ref
+  %bad.count = zext i1 %bad to i32
+  %err.next = add i32 %err, %bad.count
+  %s.next = add nuw nsw i32 %s, 1
+  %more = icmp ule i32 %s.next, 10
+  br i1 %more, label %loop, label %exit
+
+exit:
+  ret i32 %err.next
+}
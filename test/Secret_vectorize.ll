@@ -0,0 +1,138 @@
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -ct-external-calls=keep -passes="ct-linearize,loop-vectorize" -force-vector-width=4 -S %s \
+; RUN:   | FileCheck %s
+
+; Test that the loops ct-linearize rewrites stay in a form LoopVectorize
+; widens: the padded loops branch back to their header on the latch
+; condition, are in LCSSA form and update their sums with a select on the
+; added value instead of a select on the loop-carried sum.
+
+; The pattern of inputs/test_LoopArray.c: the loop filling the array up to
+; the secret a is padded to the size of the array, with a predicated store,
+; and so is the loop summing it back from a. Both are vectorized. The call to
+; printf runs unconditionally, as -ct-external-calls=keep asks.
+
+; CHECK-LABEL: define i32 @loop_array
+; CHECK:       vector.body:
+; CHECK:       fill.body:
+; CHECK:       vector.body{{[0-9]+}}:
+; CHECK:         call i32 @llvm.vector.reduce.add.v4i32
+; CHECK:       sum.body:
+; CHECK:         [[MASK:%.*]] = icmp sle i64 %j, %start
+; CHECK:         [[V:%.*]] = select i1 [[MASK]], i32 %v, i32 0
+; CHECK-NEXT:    %res.next = add nsw i32 %res, [[V]]
+
+; The pattern of inputs/test_ifarray.c, without the calls to printf: both
+; sides of the secret branch run, and so do their counted loops, each one a
+; reduction LoopVectorize widens.
+
+; CHECK-LABEL: define i32 @if_array
+; CHECK:       vector.body{{[0-9]+}}:
+; CHECK:         call i32 @llvm.vector.reduce.add.v4i32
+; CHECK:       vector.body:
+; CHECK:         call i32 @llvm.vector.reduce.mul.v4i32
+; CHECK:       if.end:
+; CHECK-NEXT:    select i1 %cmp,
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@.msg = private unnamed_addr constant [5 x i8] c"ciao\00"
+@llvm.global.annotations = appending global [2 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @loop_array, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @if_array, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+declare i32 @printf(ptr, ...)
+
+define i32 @loop_array(i32 %a) {
+entry:
+  %array = alloca [8 x i32], align 16
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %if.then, label %fill.ph
+
+if.then:
+  %add = add nsw i32 %a, 8
+  %call = call i32 (ptr, ...) @printf(ptr @.msg)
+  br label %if.end
+
+fill.ph:
+  %ext = sext i32 %a to i64
+  br label %fill.body
+
+fill.body:
+  %i = phi i64 [ 0, %fill.ph ], [ %i.next, %fill.body ]
+  %t = trunc i64 %i to i32
+  %mul = shl nsw i32 %t, 1
+  %arrayidx = getelementptr inbounds [8 x i32], ptr %array, i64 0, i64 %i
+  store i32 %mul, ptr %arrayidx, align 4
+  %i.next = add nsw i64 %i, 1
+  %fill.done = icmp sgt i64 %i.next, %ext
+  br i1 %fill.done, label %fill.end, label %fill.body
+
+fill.end:
+  br label %if.end
+
+if.end:
+  %res0 = phi i32 [ %add, %if.then ], [ 0, %fill.end ]
+  %start = sext i32 %a to i64
+  br label %sum.cond
+
+sum.cond:
+  %more0 = icmp sgt i64 %start, 2
+  br i1 %more0, label %sum.ph, label %exit
+
+sum.ph:
+  br label %sum.body
+
+sum.body:
+  %j = phi i64 [ %start, %sum.ph ], [ %j.next, %sum.body ]
+  %res = phi i32 [ %res0, %sum.ph ], [ %res.next, %sum.body ]
+  %p = getelementptr inbounds [8 x i32], ptr %array, i64 0, i64 %j
+  %v = load i32, ptr %p, align 4
+  %res.next = add nsw i32 %res, %v
+  %j.next = add nsw i64 %j, -1
+  %more = icmp sgt i64 %j.next, 2
+  br i1 %more, label %sum.body, label %sum.end
+
+sum.end:
+  br label %exit
+
+exit:
+  %r = phi i32 [ %res0, %sum.cond ], [ %res.next, %sum.end ]
+  ret i32 %r
+}
+
+define i32 @if_array(i32 %a) {
+entry:
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %then.ph, label %else.ph
+
+then.ph:
+  br label %then.body
+
+then.body:
+  %i = phi i32 [ 0, %then.ph ], [ %i.next, %then.body ]
+  %res1 = phi i32 [ 2, %then.ph ], [ %add, %then.body ]
+  %add = add nsw i32 %res1, %a
+  %i.next = add nuw nsw i32 %i, 1
+  %then.more = icmp ult i32 %i.next, 64
+  br i1 %then.more, label %then.body, label %then.end
+
+then.end:
+  br label %if.end
+
+else.ph:
+  br label %else.body
+
+else.body:
+  %k = phi i32 [ 0, %else.ph ], [ %k.next, %else.body ]
+  %res2 = phi i32 [ 2, %else.ph ], [ %mul, %else.body ]
+  %mul = mul nsw i32 %res2, %a
+  %k.next = add nuw nsw i32 %k, 1
+  %else.more = icmp ult i32 %k.next, 64
+  br i1 %else.more, label %else.body, label %else.end
+
+else.end:
+  br label %if.end
+
+if.end:
+  %res = phi i32 [ %add, %then.end ], [ %mul, %else.end ]
+  ret i32 %res
+}
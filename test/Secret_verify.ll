@@ -0,0 +1,127 @@
+; RUN:  not --crash opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-all-args -passes="ct-verify" -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s
+; RUN:  opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -secret-args=branch:arg0,divide:arg0 -passes="function(ct-linearize),ct-verify" -S %s \
+; RUN:   | FileCheck %s --check-prefix=LINEAR
+; RUN:  not --crash opt -load %shlibdir/libSecret%shlibext -load-pass-plugin %shlibdir/libSecret%shlibext \
+; RUN:   -mtriple=thumbv7m-none-eabi -secret-args=widen:arg0 -passes="ct-verify" -disable-output %s 2>&1 \
+; RUN:   | FileCheck %s --check-prefix=M3
+
+; Test the instructions ct-verify reports, every argument being a secret (a
+; pointer argument only points to secrets): each one is reported, then the
+; pass fails. @clean (a select, a store at a public address and a
+; multiplication) has nothing to report. Once ct-linearize has removed the
+; branch and the division on a secret, the same functions pass.
+
+; CHECK:      branch: branch on a secret in %entry:
+; CHECK-NEXT:   br i1 %c, label %then, label %end
+; CHECK-NEXT: switch: switch on a secret in %entry:
+; CHECK:      lookup: memory access at an address derived from a secret in %entry:
+; CHECK-NEXT:   %v = load i32, ptr %p, align 4
+; CHECK-NEXT: lookup: memory access at an address derived from a secret in %entry:
+; CHECK-NEXT:   store i32 %v, ptr %p, align 4
+; CHECK-NEXT: copy: memory access of a secret size in %entry:
+; CHECK:      divide: integer division on a secret in %entry:
+; CHECK-NEXT:   %q = udiv i32 %a, %b
+; CHECK-NEXT: scale: floating-point division on a secret in %entry:
+; CHECK-NEXT:   %q = fdiv double %a, %b
+; CHECK-NEXT: scale: floating-point square root of a secret in %entry:
+; CHECK:      dispatch: indirect call to a secret target in %entry:
+; CHECK-NEXT:   %r = call i32 %f(i32 0)
+; CHECK-NEXT: LLVM ERROR: ct-verify: 9 instruction(s) of '{{.*}}' depend on a secret
+
+; On Cortex-M3, whose UMULL stops early, a 64-bit multiplication of a
+; secret is reported too; it is not on x86-64.
+
+; M3:      widen: long multiplication on a secret in %entry:
+; M3-NEXT:   %p = mul i64 %w, 3
+; M3-NEXT: LLVM ERROR: ct-verify: 1 instruction(s) of '{{.*}}' depend on a secret
+
+; LINEAR-LABEL: define i32 @branch
+; LINEAR:         select i1 %c
+; LINEAR-LABEL: define i32 @divide
+; LINEAR-NOT:     udiv
+
+define i32 @branch(i32 %s) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  br i1 %c, label %then, label %end
+
+then:
+  %t = add i32 %s, 1
+  br label %end
+
+end:
+  %r = phi i32 [ %t, %then ], [ 0, %entry ]
+  ret i32 %r
+}
+
+define i32 @switch(i32 %s) {
+entry:
+  switch i32 %s, label %end [
+    i32 1, label %one
+  ]
+
+one:
+  br label %end
+
+end:
+  %r = phi i32 [ 1, %one ], [ 0, %entry ]
+  ret i32 %r
+}
+
+define void @lookup(ptr %tab, i32 %s) {
+entry:
+  %idx = zext i32 %s to i64
+  %p = getelementptr inbounds i32, ptr %tab, i64 %idx
+  %v = load i32, ptr %p, align 4
+  store i32 %v, ptr %p, align 4
+  ret void
+}
+
+define void @copy(ptr %dst, ptr %src, i64 %n) {
+entry:
+  call void @llvm.memcpy.p0.p0.i64(ptr %dst, ptr %src, i64 %n, i1 false)
+  ret void
+}
+
+define i32 @divide(i32 %a, i32 %b) {
+entry:
+  %q = udiv i32 %a, %b
+  ret i32 %q
+}
+
+define double @scale(double %a, double %b) {
+entry:
+  %q = fdiv double %a, %b
+  %r = call double @llvm.sqrt.f64(double %q)
+  ret double %r
+}
+
+define i32 @dispatch(i32 %s) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  %f = select i1 %c, ptr @branch, ptr @divide
+  %r = call i32 %f(i32 0)
+  ret i32 %r
+}
+
+define i32 @clean(i32 %s, i32 %t, ptr %out) {
+entry:
+  %c = icmp sgt i32 %s, 10
+  %m = mul i32 %s, %t
+  %r = select i1 %c, i32 %m, i32 %t
+  store i32 %r, ptr %out, align 4
+  ret i32 %r
+}
+
+declare void @llvm.memcpy.p0.p0.i64(ptr, ptr, i64, i1)
+declare double @llvm.sqrt.f64(double)
+
+define i64 @widen(i32 %s) {
+entry:
+  %w = zext i32 %s to i64
+  %p = mul i64 %w, 3
+  ret i64 %p
+}
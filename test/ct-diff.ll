@@ -0,0 +1,56 @@
+; RUN: ../bin/ct-diff -inputs=100000 %s | FileCheck %s
+; RUN: not ../bin/ct-diff -inputs=100000 -transformed=%S/Inputs/CtDiffWrong.ll \
+; RUN:   %s 2>&1 | FileCheck --check-prefix=WRONG %s
+
+; Test ct-diff: the functions linearized in-process compute the same values
+; and write the same memory as the original ones, a version computing
+; something else for a > 10 is caught.
+
+; CHECK:      function {{ +}}inputs {{ +}}skipped {{ +}}inputs/s
+; CHECK-NEXT: pick {{ +}}100000 {{ +}}0
+; CHECK-NEXT: fill {{ +}}100000 {{ +}}0
+; CHECK-NEXT: 0 of 2 function(s) differ
+
+; WRONG:      pick: the hardened version returns 11 instead of {{-?[0-9]+}} on input
+; WRONG:      fill {{ +}}100000 {{ +}}0
+; WRONG-NEXT: 1 of 2 function(s) differ
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [2 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @pick, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @fill, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+@counter = global i32 0
+
+; The global written on one side of the branch is compared after each call.
+define i32 @pick(i32 %a, i32 %b) {
+entry:
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %then, label %end
+
+then:
+  %c = load i32, ptr @counter
+  %c.add = add i32 %c, %b
+  store i32 %c.add, ptr @counter
+  %mul = mul i32 %b, 3
+  br label %end
+
+end:
+  %r = phi i32 [ %mul, %then ], [ %a, %entry ]
+  ret i32 %r
+}
+
+; The buffer passed to %p has its 32 dereferenceable bytes.
+define void @fill(ptr dereferenceable(32) %p, i32 %s) {
+entry:
+  %bit = and i32 %s, 1
+  %cmp = icmp ne i32 %bit, 0
+  br i1 %cmp, label %then, label %end
+
+then:
+  %q = getelementptr inbounds i32, ptr %p, i64 7
+  store i32 %s, ptr %q
+  br label %end
+
+end:
+  ret void
+}
@@ -0,0 +1,74 @@
+; RUN: not ../bin/ct-llc -mtriple=x86_64-- -O2 %s -o /dev/null 2>&1 \
+; RUN:   | FileCheck %s
+; RUN: not ../bin/ct-llc -mtriple=armv7m-none-eabi -O2 %s -o /dev/null 2>&1 \
+; RUN:   | FileCheck --check-prefix=ARM %s
+
+; Test ct-llc: the branch left on a secret and the load indexed by a secret
+; are reported in the machine code, the select is not. An i64 secret is
+; followed on ARMv7-M too, in two registers; a float secret is not followed,
+; with a warning.
+
+; CHECK:      warning: {{.*}}ct-llc: 1 secret value(s) that are not integers or pointers in 'fp' are not checked
+; CHECK:      branchy: branch on a secret in bb.0.entry:
+; CHECK-NEXT:   JCC_1
+; CHECK:      lookup: memory access at an address derived from a secret in bb.0:
+; CHECK-NEXT:   MOV8rm
+; CHECK-NOT:  clean:
+; CHECK:      lookup64: memory access at an address derived from a secret in bb.0:
+; CHECK-NOT:  fp:
+; CHECK:      3 constant-time violation(s)
+
+; ARM:        lookup: memory access at an address derived from a secret in bb.0:
+; ARM-NEXT:     tLDRBr
+; ARM-NOT:    clean:
+; ARM:        lookup64: memory access at an address derived from a secret in bb.0:
+; ARM-NOT:    fp:
+
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"test.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [5 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @branchy, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @lookup, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @clean, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @lookup64, ptr @.str, ptr @.file, i32 1, ptr null }, { ptr, ptr, ptr, i32, ptr } { ptr @fp, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+@tab = global [16 x i8] zeroinitializer
+
+define i32 @branchy(i32 %a, i32 %b) {
+entry:
+  %cmp = icmp sgt i32 %a, 10
+  br i1 %cmp, label %if.then, label %if.else
+
+if.then:
+  %x = mul i32 %b, 7
+  br label %if.end
+
+if.else:
+  %y = sdiv i32 %b, 3
+  br label %if.end
+
+if.end:
+  %r = phi i32 [ %x, %if.then ], [ %y, %if.else ]
+  ret i32 %r
+}
+
+define i8 @lookup(i32 %a) {
+  %i = and i32 %a, 15
+  %z = zext i32 %i to i64
+  %p = getelementptr [16 x i8], ptr @tab, i64 0, i64 %z
+  %v = load i8, ptr %p
+  ret i8 %v
+}
+
+define i32 @clean(i32 %a, i32 %b) {
+  %cmp = icmp sgt i32 %a, 10
+  %s = select i1 %cmp, i32 %a, i32 %b
+  ret i32 %s
+}
+
+define i8 @lookup64(i64 %a) {
+  %i = and i64 %a, 15
+  %p = getelementptr [16 x i8], ptr @tab, i64 0, i64 %i
+  %v = load i8, ptr %p
+  ret i8 %v
+}
+
+define float @fp(float %a) {
+  %m = fmul float %a, %a
+  ret float %m
+}
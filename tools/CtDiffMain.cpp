@@ -0,0 +1,883 @@
+//========================================================================
+// FILE:
+//    CtDiffMain.cpp
+//
+// DESCRIPTION:
+//    ct-diff: differential tester of the Secret transformations. The input
+//    module and its hardened version, transformed in-process with -passes
+//    or read from -transformed, are compiled by the same ORC LLJIT into two
+//    JITDylibs. Every function defined in the input is then called in both
+//    with the same random arguments, and must return the same value, leave
+//    the same bytes in the buffers passed to its pointer parameters and in
+//    the writable globals, and print the same text.
+//
+//    Each buffer ends at an inaccessible page, so that a write past its end
+//    crashes rather than corrupting the tool, and each call is stopped after
+//    -call-timeout milliseconds. The inputs on which the original crashes or
+//    times out are skipped; a crash or timeout of the hardened version alone
+//    is a mismatch. The tool exits with 1 if any function differs.
+//
+// USAGE:
+//    # Harden the loop-simplified module in-process, as compile.sh does:
+//      <BUILD/DIR>/bin/ct-diff [-inputs=N] [-function=foo,...] test2.ll
+//    # Or compare it with a module already transformed by opt:
+//      <BUILD/DIR>/bin/ct-diff -transformed=output.ll test2.ll
+//
+// License: MIT
+//========================================================================
+#include "Secret.h"
+#include "SecretAnnotations.h"
+
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/Mangling.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/CrashRecoveryContext.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Memory.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <optional>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+static cl::opt<std::string> InputModule{cl::Positional,
+                                        cl::desc{"<input LLVM file>"},
+                                        cl::Required};
+
+static cl::opt<std::string> TransformedModule{
+    "transformed",
+    cl::desc{"The hardened version of the input (default = the input "
+             "transformed with -passes)"},
+    cl::value_desc{"filename"}};
+
+static cl::opt<std::string> Passes{
+    "passes", cl::desc{"The pipeline hardening the input"},
+    cl::init("function(loop-simplify),require<secret-summary>,"
+             "ct-masked-clones,function(ct-linearize,ct-opt<O2>)")};
+
+static cl::list<std::string> Functions{
+    "function", cl::desc{"Only test these functions (default = all but main)"},
+    cl::CommaSeparated};
+
+static cl::opt<uint64_t> Inputs{"inputs",
+                                cl::desc{"Random inputs for each function"},
+                                cl::init(1000000)};
+
+static cl::opt<uint64_t> Seed{"seed", cl::desc{"Seed of the random inputs"},
+                              cl::init(1)};
+
+static cl::opt<uint64_t> BufferSize{
+    "buffer-size",
+    cl::desc{"Bytes of the buffer passed to a pointer parameter of unknown "
+             "size"},
+    cl::init(256)};
+
+static cl::opt<uint64_t> IntRange{
+    "int-range",
+    cl::desc{"Draw the integer arguments in [0, N) instead of over the whole "
+             "type, e.g. to keep loops bounded by an argument short"},
+    cl::init(0)};
+
+static cl::opt<unsigned> CallTimeout{
+    "call-timeout",
+    cl::desc{"Milliseconds a call may run before it is stopped, e.g. in a loop "
+             "bounded by a large argument (0 = no limit)"},
+    cl::init(1000)};
+
+static cl::opt<bool> KeepOutput{
+    "keep-output",
+    cl::desc{"Let the functions print to stdout instead of comparing what "
+             "they print"}};
+
+//===----------------------------------------------------------------------===//
+// The functions under test
+//===----------------------------------------------------------------------===//
+namespace {
+// How a value goes through a 64-bit slot of a wrapper.
+enum class SlotKind { Void, Int, Float, Double, Pointer };
+
+struct Slot {
+  SlotKind Kind;
+  // Bits of an Int, bytes of the buffer a Pointer parameter points to.
+  uint64_t Size = 0;
+};
+
+// A function defined in both modules, called through the wrapper added to
+// each: void(ptr Args, ptr Ret), which loads the arguments from an array of
+// 64-bit slots and stores the return value to another one.
+struct TestedFunction {
+  std::string Name;
+  SmallVector<Slot, 8> Params;
+  Slot Ret;
+};
+} // namespace
+
+static std::string getWrapperName(StringRef Name) {
+  return ("__ct_diff." + Name).str();
+}
+
+// The table of the addresses of the writable globals, in both modules.
+static const char *GlobalsTableName = "__ct_diff.globals";
+
+// Returns how a value of type Ty is passed, std::nullopt if it does not fit
+// in a slot.
+static std::optional<Slot> getSlot(Type *Ty) {
+  if (Ty->isVoidTy())
+    return Slot{SlotKind::Void};
+  if (Ty->isIntegerTy() && Ty->getIntegerBitWidth() <= 64)
+    return Slot{SlotKind::Int, Ty->getIntegerBitWidth()};
+  if (Ty->isFloatTy())
+    return Slot{SlotKind::Float};
+  if (Ty->isDoubleTy())
+    return Slot{SlotKind::Double};
+  if (Ty->isPointerTy() && Ty->getPointerAddressSpace() == 0)
+    return Slot{SlotKind::Pointer};
+  return std::nullopt;
+}
+
+// Returns N if parameter A, or the stack slot it is spilled to, is annotated
+// with ct_bound:N, 0 otherwise.
+static unsigned getBound(Argument &A) {
+  SmallVector<std::pair<Value *, StringRef>, 8> Pointers;
+  getAnnotatedPointers(*A.getParent(), Pointers);
+  for (auto &[Ptr, Str] : Pointers) {
+    unsigned Bound = getBoundAnnotation(Str);
+    if (!Bound || isa<IntrinsicInst>(Ptr))
+      continue;
+    if (Ptr == &A)
+      return Bound;
+    const Value *Obj = getUnderlyingObject(Ptr);
+    for (const User *U : Obj->users())
+      if (auto *SI = dyn_cast<StoreInst>(U))
+        if (SI->getValueOperand() == &A && SI->getPointerOperand() == Obj)
+          return Bound;
+  }
+  return 0;
+}
+
+// The size of the largest element A is read, written or indexed with.
+static uint64_t getElementSize(Argument &A, const DataLayout &DL) {
+  uint64_t Size = 0;
+  for (User *U : A.users()) {
+    Type *Ty = nullptr;
+    if (auto *LI = dyn_cast<LoadInst>(U))
+      Ty = LI->getType();
+    else if (auto *SI = dyn_cast<StoreInst>(U);
+             SI && SI->getPointerOperand() == &A)
+      Ty = SI->getValueOperand()->getType();
+    else if (auto *GEP = dyn_cast<GetElementPtrInst>(U))
+      Ty = GEP->getSourceElementType();
+    while (Ty && Ty->isArrayTy())
+      Ty = Ty->getArrayElementType();
+    if (Ty && Ty->isSized())
+      Size = std::max<uint64_t>(Size, DL.getTypeAllocSize(Ty));
+  }
+  return Size;
+}
+
+// The bytes of the buffer passed to pointer parameter A: its dereferenceable
+// bytes, its ct_bound:N annotation times the size of its elements, or
+// -buffer-size.
+static uint64_t getBufferSize(Argument &A) {
+  if (uint64_t Bytes = A.getDereferenceableBytes())
+    return Bytes;
+  if (uint64_t Bytes = A.getDereferenceableOrNullBytes())
+    return Bytes;
+  if (unsigned Bound = getBound(A)) {
+    uint64_t Size =
+        getElementSize(A, A.getParent()->getParent()->getDataLayout());
+    return Bound * (Size ? Size : 8);
+  }
+  return BufferSize;
+}
+
+// Describes how F is called, or returns why it cannot be.
+static Expected<TestedFunction> describeFunction(Function &F) {
+  if (F.isVarArg())
+    return createStringError(inconvertibleErrorCode(), "variadic");
+
+  TestedFunction TF;
+  TF.Name = F.getName().str();
+  for (Argument &A : F.args()) {
+    std::optional<Slot> S = getSlot(A.getType());
+    if (!S || S->Kind == SlotKind::Void || A.hasByValAttr() ||
+        A.hasInAllocaAttr() || A.hasPreallocatedAttr())
+      return createStringError(inconvertibleErrorCode(),
+                               "unsupported type of parameter %u",
+                               A.getArgNo());
+    if (S->Kind == SlotKind::Pointer)
+      S->Size = getBufferSize(A);
+    TF.Params.push_back(*S);
+  }
+
+  std::optional<Slot> Ret = getSlot(F.getReturnType());
+  if (!Ret)
+    return createStringError(inconvertibleErrorCode(),
+                             "unsupported return type");
+  TF.Ret = *Ret;
+  return TF;
+}
+
+// Adds the wrapper of F to its module.
+static void addWrapper(Function &F) {
+  Module &M = *F.getParent();
+  LLVMContext &Ctx = M.getContext();
+  Type *PtrTy = PointerType::getUnqual(Ctx);
+  Type *Int64Ty = Type::getInt64Ty(Ctx);
+  Function *Wrapper = Function::Create(
+      FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy}, false),
+      GlobalValue::ExternalLinkage, getWrapperName(F.getName()), M);
+
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", Wrapper));
+  SmallVector<Value *, 8> Args;
+  for (Argument &A : F.args()) {
+    Value *Ptr = B.CreateConstInBoundsGEP1_64(Int64Ty, Wrapper->getArg(0),
+                                              A.getArgNo());
+    if (A.getType()->isIntegerTy())
+      Args.push_back(B.CreateTrunc(B.CreateLoad(Int64Ty, Ptr), A.getType()));
+    else
+      Args.push_back(B.CreateLoad(A.getType(), Ptr));
+  }
+
+  // The attributes of the parameters and return value are part of the ABI.
+  CallInst *Call = B.CreateCall(&F, Args);
+  AttributeList Attrs = F.getAttributes();
+  SmallVector<AttributeSet, 8> ParamAttrs;
+  for (unsigned ArgNo = 0; ArgNo < F.arg_size(); ArgNo++)
+    ParamAttrs.push_back(Attrs.getParamAttrs(ArgNo));
+  Call->setAttributes(AttributeList::get(Ctx, AttributeSet(),
+                                         Attrs.getRetAttrs(), ParamAttrs));
+  Call->setCallingConv(F.getCallingConv());
+
+  Type *RetTy = F.getReturnType();
+  if (RetTy->isIntegerTy())
+    B.CreateStore(B.CreateZExt(Call, Int64Ty), Wrapper->getArg(1));
+  else if (RetTy->isPointerTy())
+    B.CreateStore(B.CreatePtrToInt(Call, Int64Ty), Wrapper->getArg(1));
+  else if (!RetTy->isVoidTy())
+    B.CreateStore(Call, Wrapper->getArg(1));
+  B.CreateRetVoid();
+}
+
+// The globals of Original written by the functions, and defined with the
+// same type in Hardened.
+static std::vector<GlobalVariable *> getWritableGlobals(Module &Original,
+                                                        Module &Hardened) {
+  std::vector<GlobalVariable *> Globals;
+  for (GlobalVariable &GV : Original.globals()) {
+    if (GV.isConstant() || GV.isDeclaration() || !GV.hasName() ||
+        GV.getName().startswith("llvm.") || GV.getSection() == "llvm.metadata")
+      continue;
+    GlobalVariable *Other = Hardened.getGlobalVariable(GV.getName(), true);
+    if (Other && !Other->isDeclaration() &&
+        Other->getValueType() == GV.getValueType())
+      Globals.push_back(&GV);
+  }
+  return Globals;
+}
+
+// Adds to M the table of the addresses of the globals named Names.
+static void addGlobalsTable(Module &M, ArrayRef<std::string> Names) {
+  SmallVector<Constant *, 16> Addresses;
+  for (const std::string &Name : Names)
+    Addresses.push_back(M.getGlobalVariable(Name, true));
+  auto *TableTy = ArrayType::get(PointerType::getUnqual(M.getContext()),
+                                 Addresses.size());
+  new GlobalVariable(M, TableTy, true, GlobalValue::ExternalLinkage,
+                     ConstantArray::get(TableTy, Addresses), GlobalsTableName);
+}
+
+//===----------------------------------------------------------------------===//
+// Loading and hardening the modules
+//===----------------------------------------------------------------------===//
+static Expected<std::unique_ptr<Module>>
+loadModule(StringRef File, LLVMContext &Ctx, const DataLayout &DL,
+           const Triple &TT) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIRFile(File, Err, Ctx);
+  if (!M) {
+    std::string Msg;
+    raw_string_ostream OS(Msg);
+    Err.print("ct-diff", OS);
+    return createStringError(inconvertibleErrorCode(), OS.str());
+  }
+  // Both versions run on the host, whatever they were compiled for.
+  M->setTargetTriple(TT.getTriple());
+  M->setDataLayout(DL);
+  return std::move(M);
+}
+
+// Runs -passes on M, with the passes of the Secret plugin.
+static Error hardenModule(Module &M, TargetMachine &TM) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+
+  PassBuilder PB(&TM);
+  getInputVectorPluginInfo().RegisterPassBuilderCallbacks(PB);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  ModulePassManager MPM;
+  if (Error Err = PB.parsePassPipeline(MPM, Passes))
+    return Err;
+  MPM.run(M, MAM);
+
+  std::string Msg;
+  raw_string_ostream OS(Msg);
+  if (verifyModule(M, &OS))
+    return createStringError(inconvertibleErrorCode(),
+                             "the hardened module is invalid: " + OS.str());
+  return Error::success();
+}
+
+//===----------------------------------------------------------------------===//
+// Output of the functions
+//===----------------------------------------------------------------------===//
+// What each version prints goes to a digest instead of stdout: 0 is the
+// original, 1 the hardened one.
+static uint64_t OutputDigest[2];
+
+static void addToDigest(unsigned Version, const char *Str, size_t Len) {
+  OutputDigest[Version] =
+      hash_combine(OutputDigest[Version], StringRef(Str, Len));
+}
+
+template <unsigned Version> static int stubPrintf(const char *Fmt, ...) {
+  char Buf[256];
+  va_list Args;
+  va_start(Args, Fmt);
+  int Len = vsnprintf(Buf, sizeof(Buf), Fmt, Args);
+  va_end(Args);
+  if (Len > 0)
+    addToDigest(Version, Buf, std::min<size_t>(Len, sizeof(Buf) - 1));
+  return Len;
+}
+
+template <unsigned Version> static int stubPuts(const char *Str) {
+  addToDigest(Version, Str, strlen(Str));
+  addToDigest(Version, "\n", 1);
+  return 1;
+}
+
+template <unsigned Version> static int stubPutchar(int C) {
+  char Ch = C;
+  addToDigest(Version, &Ch, 1);
+  return static_cast<unsigned char>(Ch);
+}
+
+template <unsigned Version>
+static Error defineOutputStubs(orc::LLJIT &J, orc::JITDylib &JD) {
+  orc::MangleAndInterner Mangle(J.getExecutionSession(), J.getDataLayout());
+  JITSymbolFlags Flags = JITSymbolFlags::Exported | JITSymbolFlags::Callable;
+  orc::SymbolMap Stubs;
+  Stubs[Mangle("printf")] = JITEvaluatedSymbol(
+      pointerToJITTargetAddress(&stubPrintf<Version>), Flags);
+  Stubs[Mangle("puts")] =
+      JITEvaluatedSymbol(pointerToJITTargetAddress(&stubPuts<Version>), Flags);
+  Stubs[Mangle("putchar")] = JITEvaluatedSymbol(
+      pointerToJITTargetAddress(&stubPutchar<Version>), Flags);
+  return JD.define(orc::absoluteSymbols(std::move(Stubs)));
+}
+
+//===----------------------------------------------------------------------===//
+// ct-diff - implementation
+//===----------------------------------------------------------------------===//
+namespace {
+using WrapperFn = void (*)(uint64_t *, uint64_t *);
+
+// splitmix64: fast, and the same sequence on every host.
+class Random {
+public:
+  explicit Random(uint64_t Seed) : State(Seed) {}
+
+  uint64_t next() {
+    uint64_t Z = (State += 0x9e3779b97f4a7c15);
+    Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9;
+    Z = (Z ^ (Z >> 27)) * 0x94d049bb133111eb;
+    return Z ^ (Z >> 31);
+  }
+
+  // Biased towards the values where a transformation is most likely to go
+  // wrong: small numbers, 0, -1 and the extremes of the type.
+  uint64_t nextInt(unsigned Bits) {
+    if (IntRange)
+      return next() % IntRange;
+    uint64_t R = next();
+    uint64_t SignBit = uint64_t(1) << (Bits - 1);
+    switch (R & 7) {
+    case 0:
+    case 1:
+      return (R >> 3) % 17;
+    case 2: {
+      const uint64_t Edges[] = {0, 1, ~uint64_t(0), SignBit, SignBit - 1};
+      return Edges[(R >> 3) % 5];
+    }
+    default:
+      return next();
+    }
+  }
+
+  uint64_t nextFloat(bool IsDouble) {
+    uint64_t R = next();
+    uint64_t Bits = 0;
+    if (R & 3) {
+      // Random bits, NaNs and infinities included.
+      Bits = next();
+    } else if (IsDouble) {
+      double D = static_cast<int64_t>(R >> 2) % 1000;
+      memcpy(&Bits, &D, sizeof(D));
+    } else {
+      float F = static_cast<int64_t>(R >> 2) % 1000;
+      memcpy(&Bits, &F, sizeof(F));
+    }
+    return Bits;
+  }
+
+private:
+  uint64_t State;
+};
+
+// A buffer passed to a pointer parameter, or a writable global, in one
+// version.
+struct MemoryRegion {
+  uint8_t *Begin;
+  uint64_t Size;
+  std::string Name;
+};
+
+// Calls the functions of the two versions, original (0) and hardened (1),
+// with the same inputs.
+class DiffTester {
+public:
+  DiffTester(orc::LLJIT &J, orc::JITDylib &Original, orc::JITDylib &Hardened,
+             std::vector<std::string> GlobalNames,
+             std::vector<uint64_t> GlobalSizes)
+      : J(J), Dylibs{&Original, &Hardened},
+        GlobalNames(std::move(GlobalNames)),
+        GlobalSizes(std::move(GlobalSizes)) {}
+
+  // Reads the addresses of the globals in both versions.
+  Error init() {
+    for (unsigned V = 0; V < 2; V++) {
+      auto Table = J.lookup(*Dylibs[V], GlobalsTableName);
+      if (!Table)
+        return Table.takeError();
+      auto *Addresses = Table->toPtr<uint8_t **>();
+      for (unsigned I = 0; I < GlobalNames.size(); I++)
+        Globals[V].push_back(
+            {Addresses[I], GlobalSizes[I], "@" + GlobalNames[I]});
+    }
+    return Error::success();
+  }
+
+  // Tests TF on -inputs inputs. Returns false if the versions differ.
+  Expected<bool> test(const TestedFunction &TF, raw_ostream &OS);
+
+private:
+  // Copies the state of the original version to the hardened one, so that
+  // the next calls start from the same globals and output.
+  void syncHardened() {
+    for (unsigned I = 0; I < Globals[0].size(); I++)
+      memcpy(Globals[1][I].Begin, Globals[0][I].Begin, Globals[0][I].Size);
+    OutputDigest[1] = OutputDigest[0];
+  }
+
+  bool compare(const TestedFunction &TF, uint64_t Input,
+               ArrayRef<uint64_t> Args, const uint64_t Ret[2],
+               ArrayRef<MemoryRegion> Buffers0, ArrayRef<MemoryRegion> Buffers1,
+               raw_ostream &OS);
+  std::string describeAddress(uint64_t Addr, unsigned V,
+                              ArrayRef<MemoryRegion> Buffers) const;
+
+  orc::LLJIT &J;
+  orc::JITDylib *Dylibs[2];
+  std::vector<std::string> GlobalNames;
+  std::vector<uint64_t> GlobalSizes;
+  std::vector<MemoryRegion> Globals[2];
+};
+} // namespace
+
+namespace {
+enum class CallResult { Returned, Crashed, TimedOut };
+} // namespace
+
+// The exit code of a call stopped by -call-timeout.
+static const int TimeoutRetCode = 128 + SIGALRM;
+
+// Leaves the call running when -call-timeout expires as if it had crashed.
+static void handleTimeout(int) {
+  // The handler does not return: unblock SIGALRM for the next calls.
+  sigset_t Mask;
+  sigemptyset(&Mask);
+  sigaddset(&Mask, SIGALRM);
+  sigprocmask(SIG_UNBLOCK, &Mask, nullptr);
+  if (CrashRecoveryContext *CRC = CrashRecoveryContext::GetCurrent())
+    CRC->HandleExit(TimeoutRetCode);
+}
+
+// Calls Fn, stopping it after -call-timeout milliseconds.
+static CallResult callSafely(WrapperFn Fn, uint64_t *Args, uint64_t *Ret) {
+  itimerval Timer = {};
+  Timer.it_value.tv_sec = CallTimeout / 1000;
+  Timer.it_value.tv_usec = CallTimeout % 1000 * 1000;
+  CrashRecoveryContext CRC;
+  bool Returned = CRC.RunSafely([&] {
+    setitimer(ITIMER_REAL, &Timer, nullptr);
+    Fn(Args, Ret);
+  });
+  itimerval Off = {};
+  setitimer(ITIMER_REAL, &Off, nullptr);
+  if (Returned)
+    return CallResult::Returned;
+  return CRC.RetCode == TimeoutRetCode ? CallResult::TimedOut
+                                       : CallResult::Crashed;
+}
+
+// Allocates a buffer of Size bytes that ends, up to its alignment, at an
+// inaccessible page: a function writing past the end of its buffer crashes
+// instead of corrupting the heap of the tool.
+static Expected<uint8_t *>
+allocateGuarded(uint64_t Size, std::vector<sys::OwningMemoryBlock> &Blocks) {
+  const uint64_t Align = 16;
+  uint64_t PageSize = sys::Process::getPageSizeEstimate();
+  uint64_t Bytes = alignTo(Size + Align - 1, PageSize);
+  std::error_code EC;
+  sys::MemoryBlock Block = sys::Memory::allocateMappedMemory(
+      Bytes + PageSize, nullptr, sys::Memory::MF_READ | sys::Memory::MF_WRITE,
+      EC);
+  if (EC)
+    return errorCodeToError(EC);
+  Blocks.emplace_back(Block);
+  uint8_t *Guard = static_cast<uint8_t *>(Block.base()) + Bytes;
+  if (mprotect(Guard, PageSize, PROT_NONE))
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  return reinterpret_cast<uint8_t *>(
+      alignDown(reinterpret_cast<uintptr_t>(Guard) - Size, Align));
+}
+
+// A pointer returned by one version is compared as the region it points
+// into and the offset in it, since the buffers and globals of the two
+// versions live at different addresses.
+std::string DiffTester::describeAddress(uint64_t Addr, unsigned V,
+                                        ArrayRef<MemoryRegion> Buffers) const {
+  for (ArrayRef<MemoryRegion> Regions :
+       {Buffers, ArrayRef<MemoryRegion>(Globals[V])})
+    for (const MemoryRegion &R : Regions) {
+      uint64_t Begin = reinterpret_cast<uintptr_t>(R.Begin);
+      if (Addr >= Begin && Addr <= Begin + R.Size)
+        return R.Name + "+" + utostr(Addr - Begin);
+    }
+  return "0x" + utohexstr(Addr);
+}
+
+static bool sameFloat(uint64_t A, uint64_t B, bool IsDouble) {
+  if (IsDouble) {
+    double X, Y;
+    memcpy(&X, &A, sizeof(X));
+    memcpy(&Y, &B, sizeof(Y));
+    return A == B || (X != X && Y != Y);
+  }
+  float X, Y;
+  memcpy(&X, &A, sizeof(X));
+  memcpy(&Y, &B, sizeof(Y));
+  return memcmp(&X, &Y, sizeof(X)) == 0 || (X != X && Y != Y);
+}
+
+// Reports the first difference between the two versions after an input.
+bool DiffTester::compare(const TestedFunction &TF, uint64_t Input,
+                         ArrayRef<uint64_t> Args, const uint64_t Ret[2],
+                         ArrayRef<MemoryRegion> Buffers0,
+                         ArrayRef<MemoryRegion> Buffers1,
+                         raw_ostream &OS) {
+  std::string Diff;
+  switch (TF.Ret.Kind) {
+  case SlotKind::Void:
+    break;
+  case SlotKind::Int:
+    if (Ret[0] != Ret[1])
+      Diff = "returns " + itostr(SignExtend64(Ret[0], TF.Ret.Size)) +
+             " instead of " + itostr(SignExtend64(Ret[1], TF.Ret.Size));
+    break;
+  case SlotKind::Float:
+  case SlotKind::Double:
+    if (!sameFloat(Ret[0], Ret[1], TF.Ret.Kind == SlotKind::Double))
+      Diff = "returns 0x" + utohexstr(Ret[1]) + " instead of 0x" +
+             utohexstr(Ret[0]);
+    break;
+  case SlotKind::Pointer: {
+    std::string P0 = describeAddress(Ret[0], 0, Buffers0);
+    std::string P1 = describeAddress(Ret[1], 1, Buffers1);
+    if (P0 != P1)
+      Diff = "returns " + P1 + " instead of " + P0;
+    break;
+  }
+  }
+
+  auto CompareRegions = [&](ArrayRef<MemoryRegion> R0,
+                            ArrayRef<MemoryRegion> R1) {
+    for (unsigned I = 0; I < R0.size() && Diff.empty(); I++) {
+      if (!memcmp(R0[I].Begin, R1[I].Begin, R0[I].Size))
+        continue;
+      uint64_t Off = 0;
+      while (R0[I].Begin[Off] == R1[I].Begin[Off])
+        Off++;
+      Diff = "writes 0x" + utohexstr(R1[I].Begin[Off]) + " instead of 0x" +
+             utohexstr(R0[I].Begin[Off]) + " to " + R0[I].Name + "+" +
+             utostr(Off);
+    }
+  };
+  CompareRegions(Buffers0, Buffers1);
+  CompareRegions(Globals[0], Globals[1]);
+  if (Diff.empty() && OutputDigest[0] != OutputDigest[1])
+    Diff = "prints something else";
+  if (Diff.empty())
+    return true;
+
+  OS << TF.Name << ": the hardened version " << Diff << " on input " << Input
+     << "\n  (";
+  for (unsigned I = 0; I < TF.Params.size(); I++) {
+    OS << (I ? ", " : "");
+    if (TF.Params[I].Kind == SlotKind::Pointer)
+      OS << "buffer of " << TF.Params[I].Size << " bytes";
+    else if (TF.Params[I].Kind == SlotKind::Int)
+      OS << SignExtend64(Args[I], TF.Params[I].Size);
+    else
+      OS << "0x" << utohexstr(Args[I]);
+  }
+  OS << ")\n";
+  return false;
+}
+
+Expected<bool> DiffTester::test(const TestedFunction &TF, raw_ostream &OS) {
+  WrapperFn Fns[2];
+  for (unsigned V = 0; V < 2; V++) {
+    auto Wrapper = J.lookup(*Dylibs[V], getWrapperName(TF.Name));
+    if (!Wrapper)
+      return Wrapper.takeError();
+    Fns[V] = Wrapper->toPtr<WrapperFn>();
+  }
+
+  // The buffers of the pointer parameters, each followed by a guard page.
+  std::vector<sys::OwningMemoryBlock> Storage;
+  std::vector<MemoryRegion> Buffers[2];
+  for (unsigned I = 0; I < TF.Params.size(); I++) {
+    if (TF.Params[I].Kind != SlotKind::Pointer)
+      continue;
+    for (unsigned V = 0; V < 2; V++) {
+      Expected<uint8_t *> Begin = allocateGuarded(TF.Params[I].Size, Storage);
+      if (!Begin)
+        return Begin.takeError();
+      Buffers[V].push_back({*Begin, TF.Params[I].Size, "arg" + utostr(I)});
+    }
+  }
+
+  Random Rand(hash_combine(Seed.getValue(), StringRef(TF.Name)));
+  SmallVector<uint64_t, 8> Args(TF.Params.size());
+  SmallVector<uint64_t, 8> VersionArgs[2] = {Args, Args};
+  uint64_t Skipped = 0;
+
+  auto Start = std::chrono::steady_clock::now();
+  for (uint64_t Input = 0; Input < Inputs; Input++) {
+    unsigned NextBuffer = 0;
+    for (unsigned I = 0; I < TF.Params.size(); I++) {
+      const Slot &S = TF.Params[I];
+      switch (S.Kind) {
+      case SlotKind::Int:
+        Args[I] = Rand.nextInt(S.Size);
+        break;
+      case SlotKind::Float:
+      case SlotKind::Double:
+        Args[I] = Rand.nextFloat(S.Kind == SlotKind::Double);
+        break;
+      case SlotKind::Pointer: {
+        MemoryRegion &B0 = Buffers[0][NextBuffer], &B1 = Buffers[1][NextBuffer];
+        for (uint64_t Off = 0; Off < S.Size; Off += 8) {
+          uint64_t R = Rand.next();
+          memcpy(B0.Begin + Off, &R, std::min<uint64_t>(8, S.Size - Off));
+        }
+        memcpy(B1.Begin, B0.Begin, S.Size);
+        VersionArgs[0][I] = reinterpret_cast<uintptr_t>(B0.Begin);
+        VersionArgs[1][I] = reinterpret_cast<uintptr_t>(B1.Begin);
+        NextBuffer++;
+        continue;
+      }
+      case SlotKind::Void:
+        llvm_unreachable("void parameter");
+      }
+      VersionArgs[0][I] = VersionArgs[1][I] = Args[I];
+    }
+
+    uint64_t Ret[2] = {0, 0};
+    if (callSafely(Fns[0], VersionArgs[0].data(), &Ret[0]) !=
+        CallResult::Returned) {
+      // Not an input of the function.
+      syncHardened();
+      Skipped++;
+      continue;
+    }
+    CallResult Hardened = callSafely(Fns[1], VersionArgs[1].data(), &Ret[1]);
+    if (Hardened != CallResult::Returned) {
+      OS << TF.Name << ": the hardened version "
+         << (Hardened == CallResult::Crashed
+                 ? "crashes"
+                 : "runs for more than " + utostr(CallTimeout) + " ms")
+         << " on input " << Input << "\n";
+      syncHardened();
+      return false;
+    }
+    if (!compare(TF, Input, Args, Ret, Buffers[0], Buffers[1], OS)) {
+      syncHardened();
+      return false;
+    }
+  }
+  std::chrono::duration<double> Time = std::chrono::steady_clock::now() - Start;
+
+  OS << format("%-24s %12llu %10llu %14.0f\n", TF.Name.c_str(),
+               static_cast<unsigned long long>(Inputs.getValue()),
+               static_cast<unsigned long long>(Skipped),
+               Time.count() > 0 ? Inputs / Time.count() : 0.0);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+int main(int Argc, char **Argv) {
+  InitLLVM X(Argc, Argv);
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  cl::ParseCommandLineOptions(Argc, Argv,
+                              "checks that the hardened functions compute "
+                              "what the original ones do\n");
+
+  ExitOnError ExitOnErr(std::string(Argv[0]) + ": ");
+
+  orc::JITTargetMachineBuilder JTMB =
+      ExitOnErr(orc::JITTargetMachineBuilder::detectHost());
+  std::unique_ptr<TargetMachine> TM = ExitOnErr(JTMB.createTargetMachine());
+  std::unique_ptr<orc::LLJIT> J =
+      ExitOnErr(orc::LLJITBuilder().setJITTargetMachineBuilder(JTMB).create());
+  const DataLayout &DL = J->getDataLayout();
+
+  auto OriginalCtx = std::make_unique<LLVMContext>();
+  auto HardenedCtx = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> Original = ExitOnErr(
+      loadModule(InputModule, *OriginalCtx, DL, TM->getTargetTriple()));
+  std::unique_ptr<Module> Hardened;
+  if (TransformedModule.empty()) {
+    Hardened = ExitOnErr(
+        loadModule(InputModule, *HardenedCtx, DL, TM->getTargetTriple()));
+    ExitOnErr(hardenModule(*Hardened, *TM));
+  } else {
+    Hardened = ExitOnErr(
+        loadModule(TransformedModule, *HardenedCtx, DL, TM->getTargetTriple()));
+  }
+
+  // The functions defined in both versions with the same type.
+  std::vector<TestedFunction> Tested;
+  for (Function &F : *Original) {
+    if (F.isDeclaration() || F.getName() == "main")
+      continue;
+    if (!Functions.empty() && !is_contained(Functions, F.getName()))
+      continue;
+    Function *Other = Hardened->getFunction(F.getName());
+    if (!Other || Other->isDeclaration() ||
+        Other->getFunctionType() != F.getFunctionType()) {
+      errs() << F.getName() << ": skipped, not in the hardened module\n";
+      continue;
+    }
+    Expected<TestedFunction> TF = describeFunction(F);
+    if (!TF) {
+      errs() << F.getName() << ": skipped, " << toString(TF.takeError())
+             << "\n";
+      continue;
+    }
+    addWrapper(F);
+    addWrapper(*Other);
+    Tested.push_back(std::move(*TF));
+  }
+  for (const std::string &Name : Functions)
+    if (!Original->getFunction(Name)) {
+      errs() << Argv[0] << ": no function '" << Name << "' in "
+             << InputModule << "\n";
+      return 1;
+    }
+
+  std::vector<std::string> GlobalNames;
+  std::vector<uint64_t> GlobalSizes;
+  for (GlobalVariable *GV : getWritableGlobals(*Original, *Hardened)) {
+    GlobalNames.push_back(GV->getName().str());
+    GlobalSizes.push_back(DL.getTypeAllocSize(GV->getValueType()));
+  }
+  addGlobalsTable(*Original, GlobalNames);
+  addGlobalsTable(*Hardened, GlobalNames);
+
+  orc::JITDylib *Dylibs[2] = {&ExitOnErr(J->createJITDylib("original")),
+                              &ExitOnErr(J->createJITDylib("hardened"))};
+  for (orc::JITDylib *JD : Dylibs)
+    JD->addGenerator(
+        ExitOnErr(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            DL.getGlobalPrefix())));
+  if (!KeepOutput) {
+    ExitOnErr(defineOutputStubs<0>(*J, *Dylibs[0]));
+    ExitOnErr(defineOutputStubs<1>(*J, *Dylibs[1]));
+  }
+  ExitOnErr(J->addIRModule(
+      *Dylibs[0],
+      orc::ThreadSafeModule(std::move(Original), std::move(OriginalCtx))));
+  ExitOnErr(J->addIRModule(
+      *Dylibs[1],
+      orc::ThreadSafeModule(std::move(Hardened), std::move(HardenedCtx))));
+
+  DiffTester Tester(*J, *Dylibs[0], *Dylibs[1], std::move(GlobalNames),
+                    std::move(GlobalSizes));
+  ExitOnErr(Tester.init());
+
+  // The functions may crash on some inputs, or not return.
+  CrashRecoveryContext::Enable();
+  signal(SIGALRM, handleTimeout);
+
+  outs() << left_justify("function", 24) << right_justify("inputs", 13)
+         << right_justify("skipped", 11) << right_justify("inputs/s", 15)
+         << "\n";
+  unsigned NumDiffer = 0;
+  for (const TestedFunction &TF : Tested)
+    if (!ExitOnErr(Tester.test(TF, outs())))
+      NumDiffer++;
+
+  outs() << NumDiffer << " of " << Tested.size() << " function(s) differ\n";
+  return NumDiffer ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+//========================================================================
+// FILE:
+//    CtLlcMain.cpp
+//
+// DESCRIPTION:
+//    ct-llc: llc with a constant-time check of the machine code it emits.
+//    The secrets are computed on the input IR with the Secret analysis, and
+//    every function is checked right before the asm printer, after the
+//    backend optimizations that may bring a branch or a secret-dependent
+//    memory access back (select to branch, cmov conversion, switch and
+//    division lowering). The tool exits with 1 if anything was found.
+//
+// USAGE:
+//    # First, linearize the LLVM file:
+//      opt -load-pass-plugin <BUILD/DIR>/lib/libSecret.so `\`
+//        -passes="function(ct-linearize,ct-opt<O2>)" <input> -S -o <output>
+//    # Now compile it as with llc:
+//      <BUILD/DIR>/bin/ct-llc -O2 -mtriple=armv7m-none-eabi <output>
+//
+// License: MIT
+//========================================================================
+#include "Secret.h"
+#include "SecretMachineCheck.h"
+#include "SecretSummary.h"
+
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/CodeGen/Passes.h"
+#include "llvm/CodeGen/TargetPassConfig.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Target/TargetMachine.h"
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+// -mcpu, -mattr, -filetype, -relocation-model and the other llc options.
+static codegen::RegisterCodeGenFlags CGF;
+
+static cl::opt<std::string> InputModule{cl::Positional,
+                                        cl::desc{"<input LLVM file>"},
+                                        cl::init("-")};
+
+static cl::opt<std::string> OutputFilename{
+    "o", cl::desc{"Output filename"}, cl::value_desc{"filename"},
+    cl::init("-")};
+
+static cl::opt<std::string> TargetTriple{
+    "mtriple", cl::desc{"Override the target triple of the module"}};
+
+static cl::opt<char> OptLevel{
+    "O", cl::desc{"Optimization level: -O0, -O1, -O2 or -O3 (default = -O2)"},
+    cl::Prefix, cl::init('2')};
+
+//===----------------------------------------------------------------------===//
+// ct-llc - implementation
+//===----------------------------------------------------------------------===//
+// Computes the secrets on the IR and marks them for SecretMachineCheck.
+static void markSecrets(Module &M, TargetMachine &TM) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  FAM.registerPass([&] { return Secret(); });
+  MAM.registerPass([&] { return SecretSummary(); });
+
+  PassBuilder PB(&TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  // The summaries of the callees are only used when already computed.
+  MAM.getResult<SecretSummary>(M);
+  markSecretRoots(M, FAM);
+}
+
+// Same pipeline as LLVMTargetMachine::addPassesToEmitFile, with the checker
+// between the last machine pass and the asm printer.
+static bool addPassesToEmitFile(LLVMTargetMachine &TM,
+                                legacy::PassManager &PM,
+                                raw_pwrite_stream &Out, CodeGenFileType Type,
+                                unsigned &NumFindings) {
+  auto *MMIWP = new MachineModuleInfoWrapperPass(&TM);
+  TargetPassConfig *PassConfig = TM.createPassConfig(PM);
+  PM.add(PassConfig);
+  PM.add(MMIWP);
+  if (PassConfig->addISelPasses())
+    return true;
+  PassConfig->addMachinePasses();
+  PassConfig->setInitialized();
+
+  PM.add(new SecretMachineCheck(errs(), NumFindings));
+  if (TM.addAsmPrinter(PM, Out, nullptr, Type, MMIWP->getMMI().getContext()))
+    return true;
+  PM.add(createFreeMachineFunctionPass());
+  return false;
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+int main(int Argc, char **Argv) {
+  InitLLVM X(Argc, Argv);
+
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+
+  // The passes of the codegen pipeline, as registered by llc.
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeCodeGen(Registry);
+  initializeLoopStrengthReducePass(Registry);
+  initializeLowerIntrinsicsPass(Registry);
+  initializeUnreachableBlockElimLegacyPassPass(Registry);
+  initializeConstantHoistingLegacyPassPass(Registry);
+  initializeScalarOpts(Registry);
+  initializeVectorization(Registry);
+  initializeScalarizeMaskedMemIntrinLegacyPassPass(Registry);
+  initializeExpandReductionsPass(Registry);
+  initializeExpandVectorPredicationPass(Registry);
+  initializeHardwareLoopsPass(Registry);
+  initializeTransformUtils(Registry);
+  initializeReplaceWithVeclibLegacyPass(Registry);
+
+  cl::ParseCommandLineOptions(Argc, Argv,
+                              "llc with a constant-time check of the "
+                              "generated machine code\n");
+
+  // Parse the IR file passed on the command line.
+  SMDiagnostic Err;
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M = parseIRFile(InputModule.getValue(), Err, Ctx);
+  if (!M) {
+    Err.print(Argv[0], errs());
+    return 1;
+  }
+
+  Triple TheTriple(TargetTriple.empty() ? M->getTargetTriple()
+                                        : TargetTriple.getValue());
+  if (TheTriple.getTriple().empty())
+    TheTriple.setTriple(sys::getDefaultTargetTriple());
+  M->setTargetTriple(TheTriple.getTriple());
+
+  std::string Error;
+  const Target *TheTarget =
+      TargetRegistry::lookupTarget(TheTriple.getTriple(), Error);
+  if (!TheTarget) {
+    errs() << Argv[0] << ": " << Error << "\n";
+    return 1;
+  }
+
+  CodeGenOpt::Level Level;
+  switch (OptLevel) {
+  case '0': Level = CodeGenOpt::None; break;
+  case '1': Level = CodeGenOpt::Less; break;
+  case '2': Level = CodeGenOpt::Default; break;
+  case '3': Level = CodeGenOpt::Aggressive; break;
+  default:
+    errs() << Argv[0] << ": invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+
+  TargetOptions Options = codegen::InitTargetOptionsFromCodeGenFlags(TheTriple);
+  std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+      TheTriple.getTriple(), codegen::getCPUStr(), codegen::getFeaturesStr(),
+      Options, codegen::getExplicitRelocModel(),
+      codegen::getExplicitCodeModel(), Level));
+  M->setDataLayout(TM->createDataLayout());
+
+  std::error_code EC;
+  CodeGenFileType Type = codegen::getFileType();
+  ToolOutputFile Out(OutputFilename, EC,
+                     Type == CGFT_AssemblyFile ? sys::fs::OF_Text
+                                               : sys::fs::OF_None);
+  if (EC) {
+    errs() << Argv[0] << ": " << EC.message() << "\n";
+    return 1;
+  }
+
+  markSecrets(*M, *TM);
+
+  legacy::PassManager PM;
+  TargetLibraryInfoImpl TLII(TheTriple);
+  PM.add(new TargetLibraryInfoWrapperPass(TLII));
+
+  unsigned NumFindings = 0;
+  if (addPassesToEmitFile(static_cast<LLVMTargetMachine &>(*TM), PM,
+                          Out.os(), Type, NumFindings)) {
+    errs() << Argv[0] << ": target does not support generation of this "
+           << "file type\n";
+    return 1;
+  }
+  PM.run(*M);
+  Out.keep();
+
+  if (NumFindings) {
+    errs() << Argv[0] << ": " << NumFindings
+           << " constant-time violation(s) in the generated code\n";
+    return 1;
+  }
+  return 0;
+}
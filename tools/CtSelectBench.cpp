@@ -0,0 +1,421 @@
+//========================================================================
+// FILE:
+//    CtSelectBench.cpp
+//
+// DESCRIPTION:
+//    ct-select-bench: picks the -ct-select lowering for a target. A small
+//    kernel, a loop of i32, i64 and double selects on a secret, is lowered
+//    with each of native, mask and asm, then compiled for the target with
+//    the SecretMachineCheck of ct-llc: a lowering is safe when the machine
+//    code has no branch on the secret. The safe ones are ranked by the time
+//    of an iteration when the target is the host (the kernel runs in the
+//    ORC JIT, and all of them must return the same value), by the latencies
+//    of the scheduling model of -mcpu otherwise. The tool prints the
+//    fastest one, and the one -ct-select=auto takes for the triple, which
+//    comes from running it on each target.
+//
+//    The backend options matter: pass the ones used to compile, e.g.
+//    -disable-cgp-select2branch and -x86-cmov-converter=false for compile.sh.
+//
+// USAGE:
+//      <BUILD/DIR>/bin/ct-select-bench -disable-cgp-select2branch `\`
+//        -x86-cmov-converter=false [-mtriple=thumbv7m-none-eabi -mcpu=...]
+//
+// License: MIT
+//========================================================================
+#include "Secret.h"
+#include "SecretMachineCheck.h"
+#include "SecretSelect.h"
+#include "SecretSummary.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/AsmParser/Parser.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineLoopInfo.h"
+#include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/CodeGen/Passes.h"
+#include "llvm/CodeGen/TargetPassConfig.h"
+#include "llvm/CodeGen/TargetSchedule.h"
+#include "llvm/CodeGen/TargetSubtargetInfo.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/InitLLVM.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Target/TargetMachine.h"
+
+#include <chrono>
+
+using namespace llvm;
+
+//===----------------------------------------------------------------------===//
+// Command line options
+//===----------------------------------------------------------------------===//
+// -mcpu, -mattr and the other llc options.
+static codegen::RegisterCodeGenFlags CGF;
+
+static cl::opt<std::string> TargetTriple{
+    "mtriple", cl::desc{"Target triple (default = the host)"}};
+
+static cl::opt<char> OptLevel{
+    "O", cl::desc{"Optimization level: -O0, -O1, -O2 or -O3 (default = -O2)"},
+    cl::Prefix, cl::init('2')};
+
+static cl::opt<unsigned> Iterations{
+    "iterations", cl::desc{"Iterations of the kernel on the host"},
+    cl::init(1u << 22)};
+
+//===----------------------------------------------------------------------===//
+// The kernel
+//===----------------------------------------------------------------------===//
+// Every iteration selects on the low bit of the secret, rotated by one: the
+// selects depend on the previous ones, so that their latency adds up, and a
+// branch on the condition would be mispredicted.
+static const char *KernelIR = R"(
+@ct_select_secret = global i32 -1640531527
+@.str = private unnamed_addr constant [7 x i8] c"secret\00", section "llvm.metadata"
+@.file = private unnamed_addr constant [7 x i8] c"bench\00\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [1 x { ptr, ptr, ptr, i32, ptr }] [{ ptr, ptr, ptr, i32, ptr } { ptr @ct_select_secret, ptr @.str, ptr @.file, i32 1, ptr null }], section "llvm.metadata"
+
+define i32 @ct_select_kernel(i32 %a, i32 %b, i32 %n) {
+entry:
+  %s0 = load i32, ptr @ct_select_secret
+  %a64 = zext i32 %a to i64
+  %b64 = zext i32 %b to i64
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi i32 [ %s0, %entry ], [ %s.next, %loop ]
+  %x = phi i32 [ %a, %entry ], [ %x.next, %loop ]
+  %y = phi i64 [ %b64, %entry ], [ %y.next, %loop ]
+  %z = phi double [ 1.0, %entry ], [ %z.next, %loop ]
+  %bit = and i32 %s, 1
+  %c = icmp ne i32 %bit, 0
+  %x.add = add i32 %x, %a
+  %x.xor = xor i32 %x, %b
+  %x.next = select i1 %c, i32 %x.add, i32 %x.xor
+  %y.add = add i64 %y, %a64
+  %y.xor = xor i64 %y, %b64
+  %y.next = select i1 %c, i64 %y.add, i64 %y.xor
+  %z.add = fadd double %z, 1.0
+  %z.half = fmul double %z, 0.5
+  %z.next = select i1 %c, double %z.add, double %z.half
+  %s.next = call i32 @llvm.fshr.i32(i32 %s, i32 %s, i32 1)
+  %i.next = add nuw i32 %i, 1
+  %more = icmp ult i32 %i.next, %n
+  br i1 %more, label %loop, label %exit
+
+exit:
+  %y.low = trunc i64 %y.next to i32
+  %z.int = fptoui double %z.next to i32
+  %xy = add i32 %x.next, %y.low
+  %r = add i32 %xy, %z.int
+  ret i32 %r
+}
+
+declare i32 @llvm.fshr.i32(i32, i32, i32)
+)";
+
+using KernelFn = uint32_t (*)(uint32_t, uint32_t, uint32_t);
+
+// The kernel for TM with its selects lowered with How. MarkSecrets adds the
+// markers of the machine code checker.
+static std::unique_ptr<Module> buildKernel(LLVMContext &Ctx, TargetMachine &TM,
+                                           SelectLowering How,
+                                           bool MarkSecrets) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseAssemblyString(KernelIR, Err, Ctx);
+  if (!M)
+    report_fatal_error(Twine("ct-select-bench: invalid kernel: ") +
+                       Err.getMessage());
+  M->setTargetTriple(TM.getTargetTriple().getTriple());
+  M->setDataLayout(TM.createDataLayout());
+
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  FAM.registerPass([&] { return Secret(); });
+  MAM.registerPass([&] { return SecretSummary(); });
+
+  PassBuilder PB(&TM);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+  MAM.getResult<SecretSummary>(*M);
+  for (Function &F : *M)
+    if (!F.isDeclaration() &&
+        lowerSecretSelects(F, FAM.getResult<Secret>(F), How))
+      FAM.invalidate(F, PreservedAnalyses::none());
+  if (MarkSecrets)
+    markSecretRoots(*M, FAM);
+  return M;
+}
+
+//===----------------------------------------------------------------------===//
+// Static estimate
+//===----------------------------------------------------------------------===//
+namespace {
+// Sums the latencies of the instructions in the loops, as given by the
+// scheduling model of the subtarget: both sides of a branch count. An inline
+// asm counts one cycle per instruction.
+class LoopLatency : public MachineFunctionPass {
+public:
+  static char ID;
+  explicit LoopLatency(unsigned &Cycles)
+      : MachineFunctionPass(ID), Cycles(Cycles) {}
+
+  bool runOnMachineFunction(MachineFunction &MF) override {
+    const MachineLoopInfo &MLI = getAnalysis<MachineLoopInfo>();
+    TargetSchedModel SchedModel;
+    SchedModel.init(&MF.getSubtarget());
+    for (MachineBasicBlock &MBB : MF) {
+      if (!MLI.getLoopFor(&MBB))
+        continue;
+      for (MachineInstr &MI : MBB) {
+        if (MI.isInlineAsm())
+          Cycles += countAsmInstructions(MI.getOperand(0).getSymbolName());
+        else if (!MI.isMetaInstruction())
+          Cycles += SchedModel.computeInstrLatency(&MI);
+      }
+    }
+    return false;
+  }
+
+  void getAnalysisUsage(AnalysisUsage &AU) const override {
+    AU.addRequired<MachineLoopInfo>();
+    AU.setPreservesAll();
+    MachineFunctionPass::getAnalysisUsage(AU);
+  }
+
+  StringRef getPassName() const override { return "Loop latency"; }
+
+private:
+  static unsigned countAsmInstructions(StringRef Asm) {
+    SmallVector<StringRef, 4> Lines;
+    Asm.split(Lines, '\n', -1, /*KeepEmpty=*/false);
+    return llvm::count_if(Lines,
+                          [](StringRef Line) { return !Line.trim().empty(); });
+  }
+
+  unsigned &Cycles;
+};
+} // namespace
+
+char LoopLatency::ID = 0;
+
+// Compiles M to an object file with the checker and LoopLatency before the
+// asm printer, as ct-llc does. Returns false if TM cannot emit one.
+static bool compileKernel(Module &M, LLVMTargetMachine &TM,
+                          unsigned &NumFindings, unsigned &Cycles) {
+  legacy::PassManager PM;
+  TargetLibraryInfoImpl TLII(TM.getTargetTriple());
+  PM.add(new TargetLibraryInfoWrapperPass(TLII));
+
+  auto *MMIWP = new MachineModuleInfoWrapperPass(&TM);
+  TargetPassConfig *PassConfig = TM.createPassConfig(PM);
+  PM.add(PassConfig);
+  PM.add(MMIWP);
+  if (PassConfig->addISelPasses())
+    return false;
+  PassConfig->addMachinePasses();
+  PassConfig->setInitialized();
+
+  PM.add(new SecretMachineCheck(errs(), NumFindings));
+  PM.add(new LoopLatency(Cycles));
+  SmallString<0> Object;
+  raw_svector_ostream OS(Object);
+  if (TM.addAsmPrinter(PM, OS, nullptr, CGFT_ObjectFile,
+                       MMIWP->getMMI().getContext()))
+    return false;
+  PM.add(createFreeMachineFunctionPass());
+  PM.run(M);
+  return true;
+}
+
+//===----------------------------------------------------------------------===//
+// Timing on the host
+//===----------------------------------------------------------------------===//
+// The best time of an iteration of the kernel lowered with How, in ns, over a
+// few runs. Result is set to the value it returns.
+static Expected<double> timeKernel(orc::JITTargetMachineBuilder JTMB,
+                                   TargetMachine &TM, SelectLowering How,
+                                   uint32_t &Result) {
+  auto J = orc::LLJITBuilder().setJITTargetMachineBuilder(JTMB).create();
+  if (!J)
+    return J.takeError();
+
+  auto Ctx = std::make_unique<LLVMContext>();
+  std::unique_ptr<Module> M =
+      buildKernel(*Ctx, TM, How, /*MarkSecrets=*/false);
+  if (Error Err = (*J)->addIRModule(
+          orc::ThreadSafeModule(std::move(M), std::move(Ctx))))
+    return std::move(Err);
+  auto Kernel = (*J)->lookup("ct_select_kernel");
+  if (!Kernel)
+    return Kernel.takeError();
+  KernelFn Fn = Kernel->toPtr<KernelFn>();
+
+  double Best = 0;
+  for (int Run = 0; Run < 5; Run++) {
+    auto Start = std::chrono::steady_clock::now();
+    Result = Fn(3, 5, Iterations);
+    std::chrono::duration<double, std::nano> Time =
+        std::chrono::steady_clock::now() - Start;
+    if (Run == 0 || Time.count() < Best)
+      Best = Time.count();
+  }
+  return Best / Iterations;
+}
+
+static const char *getLoweringName(SelectLowering How) {
+  switch (How) {
+  case SelectLowering::Auto: return "auto";
+  case SelectLowering::Native: return "native";
+  case SelectLowering::Mask: return "mask";
+  case SelectLowering::Asm: return "asm";
+  }
+  llvm_unreachable("unknown select lowering");
+}
+
+//===----------------------------------------------------------------------===//
+// Main driver code.
+//===----------------------------------------------------------------------===//
+int main(int Argc, char **Argv) {
+  InitLLVM X(Argc, Argv);
+
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+  InitializeAllAsmPrinters();
+  InitializeAllAsmParsers();
+
+  // The passes of the codegen pipeline, as registered by llc.
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeCodeGen(Registry);
+  initializeLoopStrengthReducePass(Registry);
+  initializeLowerIntrinsicsPass(Registry);
+  initializeUnreachableBlockElimLegacyPassPass(Registry);
+  initializeConstantHoistingLegacyPassPass(Registry);
+  initializeScalarOpts(Registry);
+  initializeVectorization(Registry);
+  initializeScalarizeMaskedMemIntrinLegacyPassPass(Registry);
+  initializeExpandReductionsPass(Registry);
+  initializeExpandVectorPredicationPass(Registry);
+  initializeHardwareLoopsPass(Registry);
+  initializeTransformUtils(Registry);
+  initializeReplaceWithVeclibLegacyPass(Registry);
+
+  cl::ParseCommandLineOptions(Argc, Argv,
+                              "picks the fastest branch-free lowering of the "
+                              "selects on a secret\n");
+
+  Triple TheTriple(TargetTriple.empty() ? sys::getProcessTriple()
+                                        : TargetTriple.getValue());
+  std::string Error;
+  const Target *TheTarget =
+      TargetRegistry::lookupTarget(TheTriple.getTriple(), Error);
+  if (!TheTarget) {
+    errs() << Argv[0] << ": " << Error << "\n";
+    return 1;
+  }
+
+  CodeGenOpt::Level Level;
+  switch (OptLevel) {
+  case '0': Level = CodeGenOpt::None; break;
+  case '1': Level = CodeGenOpt::Less; break;
+  case '2': Level = CodeGenOpt::Default; break;
+  case '3': Level = CodeGenOpt::Aggressive; break;
+  default:
+    errs() << Argv[0] << ": invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+
+  // Timed only when the code can run here.
+  std::string CPU = codegen::getCPUStr();
+  Triple Host(sys::getProcessTriple());
+  bool OnHost = Host.getArch() == TheTriple.getArch() &&
+                Host.getOS() == TheTriple.getOS() &&
+                (CPU.empty() || CPU == sys::getHostCPUName());
+
+  TargetOptions Options = codegen::InitTargetOptionsFromCodeGenFlags(TheTriple);
+  std::unique_ptr<TargetMachine> TM(TheTarget->createTargetMachine(
+      TheTriple.getTriple(), CPU, codegen::getFeaturesStr(), Options,
+      codegen::getExplicitRelocModel(), codegen::getExplicitCodeModel(),
+      Level));
+
+  orc::JITTargetMachineBuilder JTMB(TheTriple);
+  JTMB.setCPU(CPU);
+  JTMB.addFeatures(codegen::getFeatureList());
+  JTMB.setOptions(Options);
+  JTMB.setCodeGenOptLevel(Level);
+
+  outs() << "Target: " << TheTriple.getTriple() << " ("
+         << (CPU.empty() ? "generic" : CPU) << ")\n";
+  outs() << "         findings   cycles" << (OnHost ? "       ns" : "")
+         << "\n";
+
+  SelectLowering Best = SelectLowering::Auto;
+  double BestCost = 0;
+  uint32_t Reference = 0;
+  for (SelectLowering How :
+       {SelectLowering::Native, SelectLowering::Mask, SelectLowering::Asm}) {
+    LLVMContext Ctx;
+    std::unique_ptr<Module> M =
+        buildKernel(Ctx, *TM, How, /*MarkSecrets=*/true);
+
+    unsigned NumFindings = 0, Cycles = 0;
+    if (!compileKernel(*M, static_cast<LLVMTargetMachine &>(*TM), NumFindings,
+                       Cycles)) {
+      errs() << Argv[0] << ": target does not support object files\n";
+      return 1;
+    }
+    outs() << format("%-8s %8u %8u", getLoweringName(How), NumFindings, Cycles);
+
+    double Cost = Cycles;
+    if (OnHost) {
+      uint32_t Result = 0;
+      auto Time = timeKernel(JTMB, *TM, How, Result);
+      if (!Time) {
+        errs() << Argv[0] << ": " << toString(Time.takeError()) << "\n";
+        return 1;
+      }
+      if (How != SelectLowering::Native && Result != Reference) {
+        errs() << "\n" << Argv[0] << ": " << getLoweringName(How)
+               << " computes " << Result << " instead of " << Reference
+               << "\n";
+        return 1;
+      }
+      Reference = Result;
+      Cost = *Time;
+      outs() << format(" %8.2f", Cost);
+    }
+    outs() << "\n";
+
+    if (!NumFindings && (Best == SelectLowering::Auto || Cost < BestCost)) {
+      Best = How;
+      BestCost = Cost;
+    }
+  }
+
+  SelectLowering Auto = resolveSelectLowering(SelectLowering::Auto, TheTriple);
+  if (Best == SelectLowering::Auto) {
+    errs() << Argv[0] << ": no lowering is branch-free on this target\n";
+    return 1;
+  }
+  outs() << "Fastest branch-free: -ct-select=" << getLoweringName(Best)
+         << "\n-ct-select=auto takes: " << getLoweringName(Auto) << "\n";
+  return 0;
+}
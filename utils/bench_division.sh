@@ -0,0 +1,47 @@
+#! /bin/env bash
+# === bench_division.sh =======================================================
+#  Compare the latency of the -ct-division strategies of ct-linearize
+#
+#  DESCRIPTION:
+#   Builds inputs/test_division.c once per strategy (none keeps the division
+#   instructions) and runs it: each one prints the time of a division on
+#   small and on large operands. A constant-time strategy takes the same time
+#   on both, the fastest of them is the one to use on this machine.
+#
+#  USAGE:
+#    bash utils/bench_division.sh [strategy...]
+#   from the main folder, once build/ is configured as for compile.sh. The
+#   strategies default to none, reciprocal, loop and auto.
+#
+# =============================================================================
+set -euo pipefail
+
+LLVM_DIR=${LLVM_DIR:-/usr/lib/llvm-16}
+LLVM_TUTOR_DIR="$(cd "$(dirname "$0")/.." && pwd)"
+BUILD_DIR="$LLVM_TUTOR_DIR/build"
+OUT_DIR="$BUILD_DIR/bench_division"
+
+strategies=("$@")
+if [ "${#strategies[@]}" -eq 0 ]; then
+    strategies=(none reciprocal loop auto)
+fi
+
+make -C "$BUILD_DIR"
+mkdir -p "$OUT_DIR"
+cd "$OUT_DIR"
+
+"$LLVM_DIR/bin/clang" -O1 -emit-llvm -S "$LLVM_TUTOR_DIR/inputs/test_division.c" -o test.ll
+"$LLVM_DIR/bin/opt" --passes=loop-simplify test.ll -S -o test2.ll
+
+for strategy in "${strategies[@]}"; do
+    "$LLVM_DIR/bin/opt" -load-pass-plugin "$BUILD_DIR/lib/libSecret.so" \
+        -ct-division="$strategy" \
+        --passes="require<secret-summary>,ct-masked-clones,function(ct-linearize,ct-opt<O2>)" \
+        test2.ll -S -o "output_$strategy.ll"
+    "$LLVM_DIR/bin/llc" -O2 -disable-cgp-select2branch -filetype=obj \
+        -relocation-model=pic "output_$strategy.ll" -o "output_$strategy.o"
+    gcc -O0 -o "test_division_$strategy" "output_$strategy.o" -pie
+
+    echo "== -ct-division=$strategy"
+    "./test_division_$strategy"
+done